@@ -0,0 +1,432 @@
+#include "check.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "crypto/aes_gcm.h"
+#include "crypto/sha256.h"
+#include "crypto/x25519.h"
+#include "protocol/lz4.h"
+
+#define A_CHAT_CHECK_MAXIMUM_SIZE 4096
+
+// turns a hex string into bytes, returns how many
+static size_t a_chat_check_hex(const char* hex, uint8_t* output) {
+    size_t length = strlen(hex) / 2;
+    for (size_t i = 0; i < length; i++) {
+        unsigned int byte;
+        sscanf(hex + i * 2, "%2x", &byte);
+        output[i] = (uint8_t) byte;
+    }
+
+    return length;
+}
+
+static bool a_chat_check_equal_hex(const uint8_t* bytes, size_t length, const char* hex) {
+    uint8_t expected[A_CHAT_CHECK_MAXIMUM_SIZE];
+    return a_chat_check_hex(hex, expected) == length && memcmp(bytes, expected, length) == 0;
+}
+
+// xorshift64, the checks that use random data should fail the same way every run
+static uint64_t a_chat_check_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void a_chat_check_random_bytes(uint64_t* state, uint8_t* output, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        output[i] = (uint8_t) a_chat_check_random(state);
+    }
+}
+
+// crypto/aes_gcm: test cases 2, 3 and 4 from McGrew and Viega's GCM spec, the AES-128 ones
+
+typedef struct AChatCheckAesGcmVector {
+    const char* key;
+    const char* nonce;
+    const char* aad;
+    const char* plaintext;
+    const char* ciphertext;
+    const char* tag;
+} AChatCheckAesGcmVector;
+
+static const AChatCheckAesGcmVector a_chat_check_aes_gcm_vectors[] = {
+    {
+        "00000000000000000000000000000000",
+        "000000000000000000000000",
+        "",
+        "00000000000000000000000000000000",
+        "0388dace60b6a392f328c2b971b2fe78",
+        "ab6e47d42cec13bdf53a67b21257bddf",
+    },
+    {
+        "feffe9928665731c6d6a8f9467308308",
+        "cafebabefacedbaddecaf888",
+        "",
+        "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+        "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+        "4d5c2af327cd64a62cf35abd2ba6fab4",
+    },
+    {
+        "feffe9928665731c6d6a8f9467308308",
+        "cafebabefacedbaddecaf888",
+        "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+        "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+        "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+        "5bc94fbc3221a5db94fae95ae7121a47",
+    },
+};
+
+static bool a_chat_check_aes_gcm_vector(const AChatCheckAesGcmVector* vector, bool accelerated) {
+    uint8_t key[A_CHAT_AES_GCM_KEY_SIZE];
+    uint8_t nonce[A_CHAT_AES_GCM_NONCE_SIZE];
+    uint8_t aad[64];
+    uint8_t plaintext[128];
+    uint8_t ciphertext[128];
+    uint8_t decrypted[128];
+    uint8_t tag[A_CHAT_AES_GCM_TAG_SIZE];
+
+    a_chat_check_hex(vector->key, key);
+    a_chat_check_hex(vector->nonce, nonce);
+    size_t aad_length = a_chat_check_hex(vector->aad, aad);
+    size_t length = a_chat_check_hex(vector->plaintext, plaintext);
+
+    AChatAesGcm gcm;
+    a_chat_aes_gcm_init(&gcm, key);
+    gcm.accelerated = accelerated;
+
+    bool ok = true;
+    a_chat_aes_gcm_encrypt(&gcm, nonce, aad, aad_length, plaintext, length, ciphertext, tag);
+    ok = ok && a_chat_check_equal_hex(ciphertext, length, vector->ciphertext);
+    ok = ok && a_chat_check_equal_hex(tag, sizeof(tag), vector->tag);
+    ok = ok && a_chat_aes_gcm_decrypt(&gcm, nonce, aad, aad_length, ciphertext, length, tag, decrypted);
+    ok = ok && memcmp(decrypted, plaintext, length) == 0;
+
+    // and anything tampered with has to be refused
+    ciphertext[0] ^= 1;
+    ok = ok && !a_chat_aes_gcm_decrypt(&gcm, nonce, aad, aad_length, ciphertext, length, tag, decrypted);
+    ciphertext[0] ^= 1;
+    tag[A_CHAT_AES_GCM_TAG_SIZE - 1] ^= 0x80;
+    ok = ok && !a_chat_aes_gcm_decrypt(&gcm, nonce, aad, aad_length, ciphertext, length, tag, decrypted);
+
+    a_chat_aes_gcm_destroy(&gcm);
+    return ok;
+}
+
+static bool a_chat_check_aes_gcm_portable(void) {
+    for (size_t i = 0; i < sizeof(a_chat_check_aes_gcm_vectors) / sizeof(a_chat_check_aes_gcm_vectors[0]); i++) {
+        if (!a_chat_check_aes_gcm_vector(&a_chat_check_aes_gcm_vectors[i], false)) { return false; }
+    }
+
+    return true;
+}
+
+static bool a_chat_check_aes_gcm_accelerated(void) {
+    for (size_t i = 0; i < sizeof(a_chat_check_aes_gcm_vectors) / sizeof(a_chat_check_aes_gcm_vectors[0]); i++) {
+        if (!a_chat_check_aes_gcm_vector(&a_chat_check_aes_gcm_vectors[i], true)) { return false; }
+    }
+
+    return true;
+}
+
+// the two paths have to agree on every length, the vectors only cover a few, and the AES-NI path handles several
+// blocks at a time with its own tail handling
+static bool a_chat_check_aes_gcm_paths_agree(void) {
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    uint8_t key[A_CHAT_AES_GCM_KEY_SIZE];
+    uint8_t nonce[A_CHAT_AES_GCM_NONCE_SIZE];
+    uint8_t aad[64];
+    uint8_t plaintext[1024];
+    uint8_t portable_ciphertext[1024];
+    uint8_t accelerated_ciphertext[1024];
+    uint8_t decrypted[1024];
+    uint8_t portable_tag[A_CHAT_AES_GCM_TAG_SIZE];
+    uint8_t accelerated_tag[A_CHAT_AES_GCM_TAG_SIZE];
+
+    bool ok = true;
+    for (size_t length = 0; length <= sizeof(plaintext) && ok; length += 1 + length / 16) {
+        a_chat_check_random_bytes(&state, key, sizeof(key));
+        a_chat_check_random_bytes(&state, nonce, sizeof(nonce));
+        size_t aad_length = a_chat_check_random(&state) % (sizeof(aad) + 1);
+        a_chat_check_random_bytes(&state, aad, aad_length);
+        a_chat_check_random_bytes(&state, plaintext, length);
+
+        AChatAesGcm portable;
+        a_chat_aes_gcm_init(&portable, key);
+        portable.accelerated = false;
+        AChatAesGcm accelerated;
+        a_chat_aes_gcm_init(&accelerated, key);
+
+        a_chat_aes_gcm_encrypt(&portable, nonce, aad, aad_length, plaintext, length, portable_ciphertext, portable_tag);
+        a_chat_aes_gcm_encrypt(&accelerated, nonce, aad, aad_length, plaintext, length, accelerated_ciphertext, accelerated_tag);
+        ok = memcmp(portable_ciphertext, accelerated_ciphertext, length) == 0 && memcmp(portable_tag, accelerated_tag, sizeof(portable_tag)) == 0;
+
+        // each has to open what the other sealed
+        ok = ok && a_chat_aes_gcm_decrypt(&portable, nonce, aad, aad_length, accelerated_ciphertext, length, accelerated_tag, decrypted);
+        ok = ok && memcmp(decrypted, plaintext, length) == 0;
+        ok = ok && a_chat_aes_gcm_decrypt(&accelerated, nonce, aad, aad_length, portable_ciphertext, length, portable_tag, decrypted);
+        ok = ok && memcmp(decrypted, plaintext, length) == 0;
+
+        a_chat_aes_gcm_destroy(&portable);
+        a_chat_aes_gcm_destroy(&accelerated);
+    }
+
+    return ok;
+}
+
+// crypto/sha256: the FIPS 180-2 examples, and the same message fed in uneven pieces
+
+static bool a_chat_check_sha256_digest(const void* data, size_t length, const char* expected) {
+    AChatSha256 sha256;
+    uint8_t digest[A_CHAT_SHA256_SIZE];
+    a_chat_sha256_init(&sha256);
+    a_chat_sha256_update(&sha256, data, length);
+    a_chat_sha256_final(&sha256, digest);
+    return a_chat_check_equal_hex(digest, sizeof(digest), expected);
+}
+
+static bool a_chat_check_sha256(void) {
+    bool ok = true;
+    ok = ok && a_chat_check_sha256_digest("", 0, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    ok = ok && a_chat_check_sha256_digest("abc", 3, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    ok = ok && a_chat_check_sha256_digest("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+    // a million 'a's, in pieces that never line up with a block
+    uint8_t a[1000];
+    memset(a, 'a', sizeof(a));
+    AChatSha256 sha256;
+    uint8_t digest[A_CHAT_SHA256_SIZE];
+    a_chat_sha256_init(&sha256);
+    size_t hashed = 0;
+    for (size_t piece = 1; hashed < 1000000; piece = piece % 997 + 1) {
+        size_t length = 1000000 - hashed < piece ? 1000000 - hashed : piece;
+        a_chat_sha256_update(&sha256, a, length);
+        hashed += length;
+    }
+    a_chat_sha256_final(&sha256, digest);
+    ok = ok && a_chat_check_equal_hex(digest, sizeof(digest), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+    return ok;
+}
+
+// crypto/hmac_sha256 and crypto/hkdf_sha256: RFC 4231 test case 2, RFC 5869 test cases 1 and 3
+
+static bool a_chat_check_hmac_sha256(void) {
+    const char* data = "what do ya want for nothing?";
+    uint8_t mac[A_CHAT_SHA256_SIZE];
+    a_chat_hmac_sha256((const uint8_t*) "Jefe", 4, data, strlen(data), mac);
+    return a_chat_check_equal_hex(mac, sizeof(mac), "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+}
+
+static bool a_chat_check_hkdf_sha256(void) {
+    uint8_t input[22];
+    uint8_t salt[13];
+    uint8_t info[10];
+    uint8_t output[42];
+    memset(input, 0x0b, sizeof(input));
+    a_chat_check_hex("000102030405060708090a0b0c", salt);
+    a_chat_check_hex("f0f1f2f3f4f5f6f7f8f9", info);
+
+    bool ok = true;
+    a_chat_hkdf_sha256(salt, sizeof(salt), input, sizeof(input), info, sizeof(info), output, sizeof(output));
+    ok = ok && a_chat_check_equal_hex(output, sizeof(output), "3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf34007208d5b887185865");
+    a_chat_hkdf_sha256(NULL, 0, input, sizeof(input), NULL, 0, output, sizeof(output));
+    ok = ok && a_chat_check_equal_hex(output, sizeof(output), "8da4e775a563c18f715f802a063c5a31b8a11f5c5ee1879ec3454e5f3c738d2d9d201395faa4b61a96c8");
+
+    return ok;
+}
+
+// crypto/x25519: RFC 7748's vectors from section 5.2, its 1000 iterations, and the key exchange from section 6.1
+
+static bool a_chat_check_x25519(void) {
+    uint8_t scalar[A_CHAT_X25519_KEY_SIZE];
+    uint8_t point[A_CHAT_X25519_KEY_SIZE];
+    uint8_t output[A_CHAT_X25519_KEY_SIZE];
+
+    bool ok = true;
+    a_chat_check_hex("a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4", scalar);
+    a_chat_check_hex("e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c", point);
+    ok = ok && a_chat_x25519(output, scalar, point);
+    ok = ok && a_chat_check_equal_hex(output, sizeof(output), "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552");
+
+    a_chat_check_hex("4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d", scalar);
+    a_chat_check_hex("e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493", point);
+    ok = ok && a_chat_x25519(output, scalar, point);
+    ok = ok && a_chat_check_equal_hex(output, sizeof(output), "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957");
+
+    // k and u both start as 9, then each round's output becomes k and the old k becomes u
+    memset(scalar, 0, sizeof(scalar));
+    scalar[0] = 9;
+    memset(point, 0, sizeof(point));
+    point[0] = 9;
+    for (int i = 0; i < 1000 && ok; i++) {
+        ok = a_chat_x25519(output, scalar, point);
+        memcpy(point, scalar, sizeof(point));
+        memcpy(scalar, output, sizeof(scalar));
+        if (i == 0) {
+            ok = ok && a_chat_check_equal_hex(scalar, sizeof(scalar), "422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079");
+        }
+    }
+    ok = ok && a_chat_check_equal_hex(scalar, sizeof(scalar), "684cf59ba83309552800ef566f2f4d3c1c3887c49360e3875f2eb94d99532c51");
+
+    uint8_t alice_private_key[A_CHAT_X25519_KEY_SIZE];
+    uint8_t alice_public_key[A_CHAT_X25519_KEY_SIZE];
+    uint8_t bob_private_key[A_CHAT_X25519_KEY_SIZE];
+    uint8_t bob_public_key[A_CHAT_X25519_KEY_SIZE];
+    a_chat_check_hex("77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a", alice_private_key);
+    a_chat_check_hex("5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb", bob_private_key);
+    a_chat_x25519_public_key(alice_public_key, alice_private_key);
+    a_chat_x25519_public_key(bob_public_key, bob_private_key);
+    ok = ok && a_chat_check_equal_hex(alice_public_key, sizeof(alice_public_key), "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a");
+    ok = ok && a_chat_check_equal_hex(bob_public_key, sizeof(bob_public_key), "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f");
+    ok = ok && a_chat_x25519(output, alice_private_key, bob_public_key);
+    ok = ok && a_chat_check_equal_hex(output, sizeof(output), "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+    ok = ok && a_chat_x25519(output, bob_private_key, alice_public_key);
+    ok = ok && a_chat_check_equal_hex(output, sizeof(output), "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+
+    // a low order point has to be refused, not turned into an all zero secret
+    memset(point, 0, sizeof(point));
+    ok = ok && !a_chat_x25519(output, alice_private_key, point);
+
+    return ok;
+}
+
+// compression/lz4: round trips, then every truncation and a lot of corruptions of what came out, which have to be
+// refused or at least stay inside the output, the input comes from other clients
+
+static const char* a_chat_check_lz4_messages[] = {
+    "hey does anyone know if the release is still going out tomorrow or did it get pushed to next week?",
+    "sorry about that, my bad, I must have pushed to the wrong branch this morning, I'll fix it right now",
+    "lol ok, what time works for you tomorrow? I'm free after lunch but I have to leave at 5",
+};
+
+static bool a_chat_check_lz4_round_trip(const uint8_t* input, size_t length) {
+    uint8_t compressed[A_CHAT_CHECK_MAXIMUM_SIZE];
+    uint8_t output[A_CHAT_CHECK_MAXIMUM_SIZE];
+
+    size_t compressed_length = a_chat_lz4_compress(input, length, compressed, length);
+    // it didn't get smaller, so it would be sent as it is
+    if (compressed_length == 0) { return true; }
+    if (compressed_length >= length) { return false; }
+
+    if (!a_chat_lz4_decompress(compressed, compressed_length, output, length) || memcmp(output, input, length) != 0) { return false; }
+    // the length has to be the one in the header
+    if (a_chat_lz4_decompress(compressed, compressed_length, output, length - 1)) { return false; }
+    if (a_chat_lz4_decompress(compressed, compressed_length, output, length + 1)) { return false; }
+
+    for (size_t i = 0; i < compressed_length; i++) {
+        if (a_chat_lz4_decompress(compressed, i, output, length)) { return false; }
+    }
+
+    // whether a corrupted block decodes depends on where it was hit, it just can't write past the output, which a
+    // sanitizer build catches
+    for (size_t i = A_CHAT_LZ4_HEADER_SIZE; i < compressed_length; i++) {
+        for (int bit = 0; bit < 8; bit++) {
+            compressed[i] ^= (uint8_t) (1 << bit);
+            a_chat_lz4_decompress(compressed, compressed_length, output, length);
+            compressed[i] ^= (uint8_t) (1 << bit);
+        }
+    }
+
+    return true;
+}
+
+static bool a_chat_check_lz4(void) {
+    uint8_t input[A_CHAT_CHECK_MAXIMUM_SIZE];
+    uint64_t state = 0x2545f4914f6cdd1dull;
+
+    for (size_t i = 0; i < sizeof(a_chat_check_lz4_messages) / sizeof(a_chat_check_lz4_messages[0]); i++) {
+        if (!a_chat_check_lz4_round_trip((const uint8_t*) a_chat_check_lz4_messages[i], strlen(a_chat_check_lz4_messages[i]))) { return false; }
+    }
+
+    // long runs need the extra length bytes, and a short repeating pattern has matches that overlap what they copy
+    memset(input, 'a', 1000);
+    if (!a_chat_check_lz4_round_trip(input, 1000)) { return false; }
+    for (size_t i = 0; i < 700; i++) {
+        input[i] = "abc"[i % 3];
+    }
+    if (!a_chat_check_lz4_round_trip(input, 700)) { return false; }
+
+    // random pieces repeated a few times, the random parts are literals between the matches
+    for (int round = 0; round < 32; round++) {
+        size_t piece_length = 1 + a_chat_check_random(&state) % 40;
+        size_t length = 0;
+        uint8_t piece[40];
+        a_chat_check_random_bytes(&state, piece, piece_length);
+        while (length + piece_length + 8 < 600) {
+            memcpy(input + length, piece, piece_length);
+            length += piece_length;
+            size_t literals = a_chat_check_random(&state) % 8;
+            a_chat_check_random_bytes(&state, input + length, literals);
+            length += literals;
+        }
+        if (!a_chat_check_lz4_round_trip(input, length)) { return false; }
+    }
+
+    // blocks no compressor would make
+    uint8_t output[128];
+    uint8_t block[16];
+    // five literals and nothing else, which is fine
+    a_chat_check_hex("0000000550", block);
+    memcpy(block + 5, "hello", 5);
+    if (!a_chat_lz4_decompress(block, 10, output, 5) || memcmp(output, "hello", 5) != 0) { return false; }
+    // the header says more than the sequences make
+    a_chat_check_hex("0000006450", block);
+    if (a_chat_lz4_decompress(block, 10, output, 100)) { return false; }
+    // a match with an offset of zero
+    a_chat_check_hex("00000008040000", block);
+    if (a_chat_lz4_decompress(block, 7, output, 8)) { return false; }
+    // a match from further back than the dictionary goes
+    a_chat_check_hex("0000000804ffff", block);
+    if (a_chat_lz4_decompress(block, 7, output, 8)) { return false; }
+    // a literal length that says it goes on, then the input ends
+    a_chat_check_hex("00000014f0", block);
+    if (a_chat_lz4_decompress(block, 5, output, 20)) { return false; }
+    // not even a whole header
+    if (a_chat_lz4_decompress(block, 2, output, 20)) { return false; }
+
+    return true;
+}
+
+typedef struct AChatCheck {
+    const char* name;
+    bool (*run)(void);
+    bool needs_acceleration;
+} AChatCheck;
+
+static const AChatCheck a_chat_checks[] = {
+    { "crypto/aes_gcm_portable", a_chat_check_aes_gcm_portable, false },
+    { "crypto/aes_gcm_accelerated", a_chat_check_aes_gcm_accelerated, true },
+    { "crypto/aes_gcm_paths_agree", a_chat_check_aes_gcm_paths_agree, true },
+    { "crypto/sha256", a_chat_check_sha256, false },
+    { "crypto/hmac_sha256", a_chat_check_hmac_sha256, false },
+    { "crypto/hkdf_sha256", a_chat_check_hkdf_sha256, false },
+    { "crypto/x25519", a_chat_check_x25519, false },
+    { "compression/lz4", a_chat_check_lz4, false },
+};
+
+bool a_chat_check_run(void) {
+    printf("%-36s %12s\n", "check", "result");
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(a_chat_checks) / sizeof(a_chat_checks[0]); i++) {
+        const AChatCheck* check = &a_chat_checks[i];
+        if (check->needs_acceleration && !a_chat_aes_gcm_is_accelerated()) {
+            printf("%-36s %12s\n", check->name, "skipped");
+            continue;
+        }
+
+        if (check->run()) {
+            printf("%-36s %12s\n", check->name, "ok");
+        } else {
+            printf("%-36s %12s\n", check->name, "FAILED");
+            ok = false;
+        }
+    }
+    printf("\n");
+
+    return ok;
+}
@@ -0,0 +1,667 @@
+#include "load.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server/event_loop.h"
+#include "server/metrics.h"
+
+#define A_CHAT_LOAD_MAXIMUM_EVENTS 256
+
+// how long epoll_wait can block, which is also how precise the send rate is
+#define A_CHAT_LOAD_TICK_MS 1
+
+// how long the workers keep reading after the last counted message was sent
+#define A_CHAT_LOAD_DRAIN_MS 1000
+
+// how long to wait for every client's handshake before giving up
+#define A_CHAT_LOAD_CONNECT_TIMEOUT_MS 30000
+
+// the most messages a worker sends in one tick when it has fallen behind, so it still gets to read
+#define A_CHAT_LOAD_MAXIMUM_BATCH 256
+
+// every message starts with the time it was sent, so whoever receives it knows how long it took
+#define A_CHAT_LOAD_TIMESTAMP_SIZE 8
+
+typedef struct AChatLoadClient {
+    int socket;
+    int room;
+    AChatFrameDecoder decoder;
+    bool disconnected;
+
+    // the rest of a frame the socket only took part of, no new messages are sent until it has gone
+    uint8_t* pending;
+    size_t pending_length;
+    size_t pending_offset;
+} AChatLoadClient;
+
+typedef struct AChatLoad AChatLoad;
+
+typedef struct AChatLoadWorker {
+    AChatLoad* load;
+    pthread_t thread_id;
+    bool started;
+    int epoll_fd;
+
+    AChatLoadClient** clients;
+    int number_of_clients;
+    int next_sender;
+    uint64_t number_sent; // messages sent or skipped since the start, to keep to the rate
+    uint8_t* frame; // where each message is built
+
+    // only messages sent during the measurement are counted
+    uint64_t sent;
+    uint64_t skipped; // messages that weren't sent because the client's socket was full
+    uint64_t expected; // how many clients the messages sent should reach
+    uint64_t received;
+    uint64_t disconnects;
+    AChatHistogram latency;
+} AChatLoadWorker;
+
+struct AChatLoad {
+    AChatLoadConfig config;
+    atomic_bool running;
+    atomic_bool sending; // set once every client is connected, the timestamps below are only read after it
+
+    AChatLoadClient* clients;
+    int* room_sizes;
+
+    AChatLoadWorker* workers;
+    int number_of_workers;
+
+    uint64_t started_at_ns;
+    uint64_t measure_start_ns;
+    uint64_t measure_end_ns;
+};
+
+AChatLoadConfig a_chat_load_default_config(void) {
+    return (AChatLoadConfig) {
+        .address = NULL,
+        .port = A_CHAT_DEFAULT_PORT,
+        .engine = A_CHAT_SERVER_ENGINE_EPOLL,
+        .server_threads = 0,
+        .io_uring = false,
+        .message_store_path = NULL,
+        .clients = 1000,
+        .rooms = 10,
+        .workers = 0,
+        .rate = 1.0,
+        .message_size = 128,
+        .warmup_seconds = 2.0,
+        .duration_seconds = 10.0,
+    };
+}
+
+static void a_chat_load_room_name(int room, char* name, size_t size) {
+    snprintf(name, size, "bench-%d", room);
+}
+
+// sends what is left of a partly sent frame, returns false if the socket still can't take all of it
+static bool a_chat_load_client_flush(AChatLoadClient* client) {
+    while (client->pending_offset < client->pending_length) {
+        ssize_t bytes_sent = send(client->socket, client->pending + client->pending_offset, client->pending_length - client->pending_offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytes_sent == -1) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+        client->pending_offset += bytes_sent;
+    }
+
+    free(client->pending);
+    client->pending = NULL;
+    client->pending_length = 0;
+    client->pending_offset = 0;
+
+    return true;
+}
+
+// sent_at is when the message was sent, or when it would have been if it was skipped
+static bool a_chat_load_send(AChatLoadWorker* worker, AChatLoadClient* client, uint64_t* sent_at) {
+    *sent_at = a_chat_metrics_now_ns();
+    if (client->disconnected) { return false; }
+    if (client->pending && !a_chat_load_client_flush(client)) { return false; }
+
+    char room[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+    a_chat_load_room_name(client->room, room, sizeof(room));
+    size_t room_length = strlen(room);
+
+    // MESSAGE payload: room name length (2 bytes, big-endian), room name, message
+    // real clients only send encrypted messages, and the server takes the same path for them whatever is inside
+    uint32_t payload_length = (uint32_t) (2 + room_length + worker->load->config.message_size);
+    uint8_t* payload = worker->frame + A_CHAT_FRAME_HEADER_SIZE;
+    a_chat_frame_encode_header(worker->frame, A_CHAT_FRAME_MESSAGE, A_CHAT_FRAME_FLAG_ENCRYPTED, payload_length);
+    payload[0] = (uint8_t) (room_length >> 8);
+    payload[1] = (uint8_t) room_length;
+    memcpy(payload + 2, room, room_length);
+
+    // the timestamp is taken as late as possible, only this process reads it so it stays in host byte order
+    *sent_at = a_chat_metrics_now_ns();
+    memcpy(payload + 2 + room_length, sent_at, A_CHAT_LOAD_TIMESTAMP_SIZE);
+
+    size_t length = A_CHAT_FRAME_HEADER_SIZE + payload_length;
+    ssize_t bytes_sent;
+    do {
+        bytes_sent = send(client->socket, worker->frame, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (bytes_sent == -1 && errno == EINTR);
+
+    // nothing was sent, so the stream is still whole and the message is just skipped
+    if (bytes_sent == -1) { return false; }
+
+    if ((size_t) bytes_sent < length) {
+        client->pending_length = length - bytes_sent;
+        client->pending = malloc(client->pending_length);
+        if (!client->pending) {
+            // the stream is broken without the rest of the frame, so the client is given up on
+            fprintf(stderr, "ERROR: Failed to allocate memory for a partly sent message!\n");
+            shutdown(client->socket, SHUT_RDWR);
+            client->disconnected = true;
+            return false;
+        }
+        memcpy(client->pending, worker->frame + bytes_sent, client->pending_length);
+    }
+
+    return true;
+}
+
+static void a_chat_load_send_due(AChatLoadWorker* worker, uint64_t now) {
+    AChatLoad* load = worker->load;
+
+    // the number of messages the worker's clients should have sent by now
+    double rate = load->config.rate * worker->number_of_clients;
+    uint64_t due = (uint64_t) ((double) (now - load->started_at_ns) / 1e9 * rate);
+
+    for (int batch = 0; worker->number_sent < due && batch < A_CHAT_LOAD_MAXIMUM_BATCH; batch++) {
+        AChatLoadClient* client = worker->clients[worker->next_sender];
+        worker->next_sender = (worker->next_sender + 1) % worker->number_of_clients;
+        worker->number_sent++;
+
+        // counted the same way the receiving side counts, by the message's own timestamp
+        uint64_t sent_at;
+        bool sent = a_chat_load_send(worker, client, &sent_at);
+        if (sent_at < load->measure_start_ns || sent_at >= load->measure_end_ns) { continue; }
+
+        if (sent) {
+            worker->sent++;
+            worker->expected += load->room_sizes[client->room];
+        } else {
+            worker->skipped++;
+        }
+    }
+}
+
+static void a_chat_load_receive(AChatLoadWorker* worker, const AChatFrame* frame, uint64_t now) {
+    if (frame->type != A_CHAT_FRAME_MESSAGE) { return; }
+
+    // MESSAGE payload from the server: sequence with A_CHAT_FRAME_FLAG_SEQUENCE, room name length, room name,
+    // sender's username length, username, message
+    size_t offset = (frame->flags & A_CHAT_FRAME_FLAG_SEQUENCE) ? 8 : 0;
+    if (frame->length < offset + 2) { return; }
+    offset += 2 + (((size_t) frame->payload[offset] << 8) | frame->payload[offset + 1]);
+    if (frame->length < offset + 2) { return; }
+    offset += 2 + (((size_t) frame->payload[offset] << 8) | frame->payload[offset + 1]);
+    if (frame->length < offset + A_CHAT_LOAD_TIMESTAMP_SIZE) { return; }
+
+    uint64_t sent_at;
+    memcpy(&sent_at, frame->payload + offset, A_CHAT_LOAD_TIMESTAMP_SIZE);
+
+    AChatLoad* load = worker->load;
+    if (sent_at < load->measure_start_ns || sent_at >= load->measure_end_ns) { return; }
+
+    worker->received++;
+    a_chat_histogram_record(&worker->latency, now - sent_at);
+}
+
+static void a_chat_load_disconnect(AChatLoadWorker* worker, AChatLoadClient* client) {
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, client->socket, NULL) == -1) {
+        fprintf(stderr, "ERROR: Failed to remove a client from epoll: %s\n", strerror(errno));
+    }
+    client->disconnected = true;
+    worker->disconnects++;
+}
+
+static void a_chat_load_read(AChatLoadWorker* worker, AChatLoadClient* client) {
+    while (true) {
+        size_t available;
+        uint8_t* buffer = a_chat_frame_decoder_reserve(&client->decoder, &available);
+        if (!buffer) {
+            a_chat_load_disconnect(worker, client);
+            return;
+        }
+
+        ssize_t bytes_received = recv(client->socket, buffer, available, MSG_DONTWAIT);
+        if (bytes_received == 0) {
+            a_chat_load_disconnect(worker, client);
+            return;
+        } else if (bytes_received == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+
+            a_chat_load_disconnect(worker, client);
+            return;
+        }
+        a_chat_frame_decoder_commit(&client->decoder, bytes_received);
+
+        // every frame in this read arrived at the same time
+        uint64_t now = a_chat_metrics_now_ns();
+        AChatFrame frame;
+        AChatFrameResult result;
+        while ((result = a_chat_frame_decoder_next(&client->decoder, &frame)) == A_CHAT_FRAME_COMPLETE) {
+            a_chat_load_receive(worker, &frame, now);
+        }
+
+        if (result == A_CHAT_FRAME_ERROR) {
+            a_chat_load_disconnect(worker, client);
+            return;
+        }
+    }
+}
+
+static void* a_chat_load_worker_thread(void* arguments) {
+    AChatLoadWorker* worker = (AChatLoadWorker*) arguments;
+
+    struct epoll_event events[A_CHAT_LOAD_MAXIMUM_EVENTS];
+    while (atomic_load(&worker->load->running)) {
+        uint64_t now = a_chat_metrics_now_ns();
+        if (atomic_load(&worker->load->sending) && now < worker->load->measure_end_ns && worker->number_of_clients > 0) {
+            a_chat_load_send_due(worker, now);
+        }
+
+        int number_of_events = epoll_wait(worker->epoll_fd, events, A_CHAT_LOAD_MAXIMUM_EVENTS, A_CHAT_LOAD_TICK_MS);
+        if (number_of_events == -1) {
+            if (errno == EINTR) { continue; }
+
+            fprintf(stderr, "ERROR: Failed to wait for events: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < number_of_events; i++) {
+            a_chat_load_read(worker, events[i].data.ptr);
+        }
+    }
+
+    return NULL;
+}
+
+static int a_chat_load_connect(const struct addrinfo* address, int index, const char* room) {
+    int new_socket = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (new_socket == -1) {
+        fprintf(stderr, "ERROR: Failed to create client socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (connect(new_socket, address->ai_addr, address->ai_addrlen) == -1) {
+        fprintf(stderr, "ERROR: Failed to connect client %d: %s\n", index, strerror(errno));
+
+        close(new_socket);
+        return -1;
+    }
+
+    // messages are small and latency is what is being measured
+    int yes = 1;
+    setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    char handshake[64];
+    int handshake_length = snprintf(handshake, sizeof(handshake), "a-chat bench-%d", index);
+    if (!a_chat_frame_send(new_socket, A_CHAT_FRAME_HANDSHAKE, 0, handshake, handshake_length) || !a_chat_frame_send(new_socket, A_CHAT_FRAME_JOIN, 0, room, strlen(room))) {
+        fprintf(stderr, "ERROR: Failed to send client %d's handshake: %s\n", index, strerror(errno));
+
+        close(new_socket);
+        return -1;
+    }
+
+    if (fcntl(new_socket, F_SETFL, fcntl(new_socket, F_GETFL) | O_NONBLOCK) == -1) {
+        fprintf(stderr, "ERROR: Failed to make client %d's socket non-blocking: %s\n", index, strerror(errno));
+
+        close(new_socket);
+        return -1;
+    }
+
+    return new_socket;
+}
+
+// every client is two sockets when the server is in this process
+static void a_chat_load_raise_file_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static double a_chat_load_cpu_seconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (double) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + (double) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void a_chat_load_sleep_until(uint64_t deadline_ns) {
+    uint64_t now;
+    while ((now = a_chat_metrics_now_ns()) < deadline_ns) {
+        uint64_t remaining = deadline_ns - now;
+        struct timespec duration = { .tv_sec = remaining / 1000000000, .tv_nsec = remaining % 1000000000 };
+        nanosleep(&duration, NULL);
+    }
+}
+
+static void* a_chat_load_server_thread(void* arguments) {
+    a_chat_server_accept((AChatServer*) arguments);
+    return NULL;
+}
+
+static void a_chat_load_stop_server(AChatServer* server, pthread_t thread_id) {
+    // a_chat_server_accept returns once the server has drained its clients
+    a_chat_server_stop(server);
+    pthread_join(thread_id, NULL);
+    a_chat_server_close(server);
+}
+
+static void a_chat_load_print_latency(const char* name, const AChatLatencyStats* latency) {
+    printf("%-12s p50 %.1fus  p90 %.1fus  p99 %.1fus  p99.9 %.1fus  max %.1fus  (%llu samples)\n", name,
+        latency->p50_ns / 1e3, latency->p90_ns / 1e3, latency->p99_ns / 1e3, latency->p999_ns / 1e3, latency->maximum_ns / 1e3,
+        (unsigned long long) latency->count);
+}
+
+static void a_chat_load_report(AChatLoad* load, AChatServer* server, double cpu_seconds) {
+    const AChatLoadConfig* config = &load->config;
+
+    uint64_t sent = 0, skipped = 0, expected = 0, received = 0, disconnects = 0;
+    AChatHistogram** histograms = malloc(sizeof(AChatHistogram*) * load->number_of_workers);
+    if (!histograms) {
+        fprintf(stderr, "ERROR: Failed to allocate memory for the report!\n");
+        return;
+    }
+    for (int i = 0; i < load->number_of_workers; i++) {
+        AChatLoadWorker* worker = &load->workers[i];
+        sent += worker->sent;
+        skipped += worker->skipped;
+        expected += worker->expected;
+        received += worker->received;
+        disconnects += worker->disconnects;
+        histograms[i] = &worker->latency;
+    }
+
+    AChatLatencyStats latency;
+    a_chat_histogram_summarize(histograms, load->number_of_workers, &latency);
+    free(histograms);
+
+    printf("\n");
+    printf("%-12s %d clients in %d rooms, %.2f messages/s each, %zu byte messages, %.1fs measured\n", "load:", config->clients, config->rooms, config->rate, config->message_size, config->duration_seconds);
+    if (server) {
+        printf("%-12s %s engine", "server:", server->config.engine == A_CHAT_SERVER_ENGINE_EPOLL ? "epoll" : "threaded");
+        if (server->config.engine == A_CHAT_SERVER_ENGINE_EPOLL) {
+            // the server falls back to epoll when io_uring isn't available
+            printf(" with %d %s event loops", server->config.number_of_threads, server->event_loops && server->event_loops[0].uring ? "io_uring" : "epoll");
+        }
+        printf(", in this process\n");
+    } else {
+        printf("%-12s %s:%s\n", "server:", config->address, config->port);
+    }
+    printf("%-12s %llu messages, %llu skipped because a socket was full\n", "sent:", (unsigned long long) sent, (unsigned long long) skipped);
+    printf("%-12s %llu of %llu expected (%.2f%%), %llu clients disconnected\n", "delivered:", (unsigned long long) received, (unsigned long long) expected,
+        expected ? 100.0 * received / expected : 0.0, (unsigned long long) disconnects);
+
+    double throughput = received / config->duration_seconds;
+    double cores = cpu_seconds / config->duration_seconds;
+    printf("%-12s %.0f messages/s", "throughput:", throughput);
+    if (cores > 0.0) {
+        // the cpu time is the whole process, so with the server in this process it includes the load generator
+        printf(", %.0f messages/s per core (%.2f cores busy%s)", throughput / cores, cores, server ? ", server and clients" : ", clients only");
+    }
+    printf("\n");
+    a_chat_load_print_latency("latency:", &latency);
+
+    if (server) {
+        AChatServerStats stats;
+        a_chat_server_get_stats(server, &stats);
+        a_chat_load_print_latency("broadcast:", &stats.latencies[A_CHAT_HISTOGRAM_BROADCAST]);
+        printf("%-12s %llu slow consumer disconnects, %llu frames dropped\n", "overflow:",
+            (unsigned long long) stats.counters[A_CHAT_COUNTER_SLOW_CONSUMER_DISCONNECTS], (unsigned long long) stats.counters[A_CHAT_COUNTER_FRAMES_DROPPED]);
+        printf("%-12s %.1f KB reserved, %.1f KB in use, %.1f KB oversized\n", "pool:",
+            stats.pool.reserved_bytes / 1024.0, stats.pool.in_use_bytes / 1024.0, stats.pool.oversized_bytes / 1024.0);
+    }
+}
+
+static void a_chat_load_destroy(AChatLoad* load) {
+    if (load->workers) {
+        for (int i = 0; i < load->number_of_workers; i++) {
+            AChatLoadWorker* worker = &load->workers[i];
+            if (worker->epoll_fd != -1) { close(worker->epoll_fd); }
+            free(worker->clients);
+            free(worker->frame);
+        }
+        free(load->workers);
+    }
+
+    if (load->clients) {
+        for (int i = 0; i < load->config.clients; i++) {
+            AChatLoadClient* client = &load->clients[i];
+            if (client->socket != -1) { close(client->socket); }
+            a_chat_frame_decoder_destroy(&client->decoder);
+            free(client->pending);
+        }
+        free(load->clients);
+    }
+
+    free(load->room_sizes);
+}
+
+static bool a_chat_load_create(AChatLoad* load) {
+    const AChatLoadConfig* config = &load->config;
+
+    load->clients = calloc(config->clients, sizeof(AChatLoadClient));
+    load->room_sizes = calloc(config->rooms, sizeof(int));
+    load->workers = calloc(load->number_of_workers, sizeof(AChatLoadWorker));
+    if (!load->clients || !load->room_sizes || !load->workers) {
+        fprintf(stderr, "ERROR: Failed to allocate memory for the clients!\n");
+        return false;
+    }
+
+    for (int i = 0; i < load->number_of_workers; i++) {
+        load->workers[i].epoll_fd = -1;
+    }
+
+    for (int i = 0; i < config->clients; i++) {
+        AChatLoadClient* client = &load->clients[i];
+        client->socket = -1;
+        client->room = i % config->rooms;
+        load->room_sizes[client->room]++;
+        if (!a_chat_frame_decoder_init(&client->decoder)) { return false; }
+    }
+
+    // clients are dealt out to the workers like cards, so every worker gets a bit of every room
+    size_t frame_size = A_CHAT_FRAME_HEADER_SIZE + 2 + A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + config->message_size;
+    for (int i = 0; i < load->number_of_workers; i++) {
+        AChatLoadWorker* worker = &load->workers[i];
+        worker->load = load;
+        worker->clients = malloc(sizeof(AChatLoadClient*) * (config->clients / load->number_of_workers + 1));
+        worker->frame = calloc(1, frame_size);
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (!worker->clients || !worker->frame || worker->epoll_fd == -1) {
+            fprintf(stderr, "ERROR: Failed to set up a worker!\n");
+            return false;
+        }
+    }
+    for (int i = 0; i < config->clients; i++) {
+        AChatLoadWorker* worker = &load->workers[i % load->number_of_workers];
+        worker->clients[worker->number_of_clients++] = &load->clients[i];
+    }
+
+    return true;
+}
+
+bool a_chat_load_run(const AChatLoadConfig* config) {
+    if (config->clients <= 0 || config->rooms <= 0 || config->rate <= 0.0 || config->duration_seconds <= 0.0) {
+        fprintf(stderr, "ERROR: clients, rooms, rate and duration must all be positive!\n");
+        return false;
+    }
+    if (config->message_size < A_CHAT_LOAD_TIMESTAMP_SIZE || config->message_size > A_CHAT_FRAME_MAXIMUM_LENGTH - 2 - A_CHAT_ROOM_NAME_MAXIMUM_LENGTH) {
+        fprintf(stderr, "ERROR: The message size must be between %d and %d bytes!\n", A_CHAT_LOAD_TIMESTAMP_SIZE, A_CHAT_FRAME_MAXIMUM_LENGTH - 2 - A_CHAT_ROOM_NAME_MAXIMUM_LENGTH);
+        return false;
+    }
+
+    a_chat_load_raise_file_limit();
+
+    // the workers' histograms are big, so the load lives on the heap
+    AChatLoad* load = calloc(1, sizeof(AChatLoad));
+    if (!load) {
+        fprintf(stderr, "ERROR: Failed to allocate memory for the load!\n");
+        return false;
+    }
+    load->config = *config;
+    if (load->config.rooms > load->config.clients) {
+        load->config.rooms = load->config.clients;
+    }
+    long number_of_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    load->number_of_workers = config->workers > 0 ? config->workers : (number_of_cpus > 0 ? (int) number_of_cpus : 1);
+    if (load->number_of_workers > load->config.clients) {
+        load->number_of_workers = load->config.clients;
+    }
+    atomic_init(&load->running, true);
+    atomic_init(&load->sending, false);
+
+    if (!a_chat_load_create(load)) {
+        a_chat_load_destroy(load);
+        free(load);
+        return false;
+    }
+
+    AChatServer* server = NULL;
+    pthread_t server_thread_id;
+    if (!config->address) {
+        AChatServerConfig server_config = a_chat_server_default_config();
+        server_config.engine = config->engine;
+        server_config.io_uring = config->io_uring;
+        server_config.message_store_path = config->message_store_path;
+        if (config->server_threads > 0) {
+            server_config.number_of_threads = config->server_threads;
+        }
+        if (server_config.maximum_clients < config->clients) {
+            server_config.maximum_clients = config->clients;
+        }
+        // every simulated client connects from loopback and sends as fast as it is told to, the point is what the server can
+        // take, not how well it turns them away
+        server_config.client_messages_per_second = 0;
+        server_config.client_bytes_per_second = 0;
+        server_config.address_messages_per_second = 0;
+        server_config.address_bytes_per_second = 0;
+
+        server = a_chat_server_create_with_config(config->port, &server_config);
+        if (!server) {
+            fprintf(stderr, "ERROR: Failed to create server!\n");
+
+            a_chat_load_destroy(load);
+            free(load);
+            return false;
+        }
+        pthread_create(&server_thread_id, NULL, a_chat_load_server_thread, server);
+    }
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* address = NULL;
+    int status = getaddrinfo(config->address ? config->address : "127.0.0.1", config->port, &hints, &address);
+    bool ok = status == 0;
+    if (!ok) {
+        fprintf(stderr, "ERROR: Failed to look up the server's address: %s\n", gai_strerror(status));
+    }
+
+    // the workers read while the rest are connecting, otherwise every connect's notice would pile up on the earlier clients
+    for (int i = 0; ok && i < load->number_of_workers; i++) {
+        if (pthread_create(&load->workers[i].thread_id, NULL, a_chat_load_worker_thread, &load->workers[i]) != 0) {
+            fprintf(stderr, "ERROR: Failed to create worker thread!\n");
+            ok = false;
+            break;
+        }
+        load->workers[i].started = true;
+    }
+
+    printf("Connecting %d clients...\n", config->clients);
+    for (int i = 0; ok && i < load->config.clients; i++) {
+        AChatLoadClient* client = &load->clients[i];
+        char room[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+        a_chat_load_room_name(client->room, room, sizeof(room));
+
+        client->socket = a_chat_load_connect(address, i, room);
+        if (client->socket == -1) {
+            ok = false;
+            break;
+        }
+
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+        if (epoll_ctl(load->workers[i % load->number_of_workers].epoll_fd, EPOLL_CTL_ADD, client->socket, &event) == -1) {
+            fprintf(stderr, "ERROR: Failed to register client %d with epoll: %s\n", i, strerror(errno));
+            ok = false;
+        }
+    }
+
+    // with the server in this process its stats say when every handshake is done
+    if (ok && server) {
+        uint64_t deadline = a_chat_metrics_now_ns() + (uint64_t) A_CHAT_LOAD_CONNECT_TIMEOUT_MS * 1000000;
+        AChatServerStats stats;
+        a_chat_server_get_stats(server, &stats);
+        while (stats.connected_clients < load->config.clients) {
+            if (a_chat_metrics_now_ns() > deadline) {
+                fprintf(stderr, "ERROR: Only %d of %d clients finished their handshake!\n", stats.connected_clients, load->config.clients);
+                ok = false;
+                break;
+            }
+            a_chat_load_sleep_until(a_chat_metrics_now_ns() + 10000000);
+            a_chat_server_get_stats(server, &stats);
+        }
+    }
+
+    double cpu_seconds = 0.0;
+    if (ok) {
+        load->started_at_ns = a_chat_metrics_now_ns();
+        load->measure_start_ns = load->started_at_ns + (uint64_t) (config->warmup_seconds * 1e9);
+        load->measure_end_ns = load->measure_start_ns + (uint64_t) (config->duration_seconds * 1e9);
+        atomic_store(&load->sending, true);
+
+        printf("Warming up for %.1fs, then measuring for %.1fs...\n", config->warmup_seconds, config->duration_seconds);
+        a_chat_load_sleep_until(load->measure_start_ns);
+        double cpu_at_start = a_chat_load_cpu_seconds();
+        a_chat_load_sleep_until(load->measure_end_ns);
+        cpu_seconds = a_chat_load_cpu_seconds() - cpu_at_start;
+
+        // messages sent just before the end are still on their way
+        a_chat_load_sleep_until(load->measure_end_ns + (uint64_t) A_CHAT_LOAD_DRAIN_MS * 1000000);
+    }
+
+    atomic_store(&load->running, false);
+    for (int i = 0; i < load->number_of_workers; i++) {
+        if (load->workers[i].started) {
+            pthread_join(load->workers[i].thread_id, NULL);
+        }
+    }
+
+    if (ok) {
+        a_chat_load_report(load, server, cpu_seconds);
+    }
+
+    // the server goes first, so it isn't left sending to clients that have gone
+    if (server) {
+        a_chat_load_stop_server(server, server_thread_id);
+    }
+    a_chat_load_destroy(load);
+    if (address) { freeaddrinfo(address); }
+    free(load);
+
+    return ok;
+}
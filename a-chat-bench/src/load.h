@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <a-chat.h>
+
+// drives thousands of simulated clients over loopback and measures how long their messages take to come back
+// every client sends to one of a number of rooms, so the rooms' size sets how far each message fans out
+typedef struct AChatLoadConfig {
+    const char* address; // the server to load, NULL to run one in this process
+    const char* port;
+    AChatServerEngine engine; // only used by the server run in this process
+    int server_threads; // only used by the server run in this process, 0 for its default
+    bool io_uring; // only used by the server run in this process with the epoll engine
+    const char* message_store_path; // only used by the server run in this process, NULL to store nothing
+
+    int clients;
+    int rooms; // clients are spread evenly over this many rooms
+    int workers; // the threads driving the clients, 0 for one per online cpu
+    double rate; // messages per second sent by each client
+    size_t message_size; // at least the 8 byte timestamp every message carries
+    double warmup_seconds; // messages sent before the measurement starts aren't counted
+    double duration_seconds;
+} AChatLoadConfig;
+
+AChatLoadConfig a_chat_load_default_config(void);
+// runs the load and prints a report, returns false if the clients couldn't be set up
+bool a_chat_load_run(const AChatLoadConfig* config);
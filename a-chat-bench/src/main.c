@@ -0,0 +1,116 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <a-chat.h>
+
+#include "load.h"
+#include "micro.h"
+
+static void a_chat_bench_usage(void) {
+    printf("a-chat-bench usage: [type] [options]\n");
+    printf("\n");
+    printf("types:\n");
+    printf("\n");
+    printf("  load [options] - drive simulated clients through a server over loopback\n");
+    printf("  micro [filter] - check the crypto and compression against known answers, then time framing, broadcast, crypto and compression, only the benchmarks whose name contains filter\n");
+    printf("\n");
+    printf("load options:\n");
+    printf("\n");
+    printf("  --clients [n]   - number of simulated clients (1000)\n");
+    printf("  --rooms [n]     - clients are spread over this many rooms (10)\n");
+    printf("  --rate [n]      - messages per second sent by each client (1)\n");
+    printf("  --size [n]      - bytes in each message (128)\n");
+    printf("  --duration [s]  - seconds to measure for (10)\n");
+    printf("  --warmup [s]    - seconds to send for before measuring (2)\n");
+    printf("  --workers [n]   - threads driving the clients (online cpus)\n");
+    printf("  --engine [name] - epoll, io_uring or threaded, for the server run in this process (epoll)\n");
+    printf("  --threads [n]   - event loops of the server run in this process (online cpus)\n");
+    printf("  --store [dir]   - the server run in this process stores every message in this directory\n");
+    printf("  --address [ip]  - load the server at this address instead of running one\n");
+    printf("  --port [port]   - the server's port (" A_CHAT_DEFAULT_PORT ")\n");
+}
+
+static bool a_chat_bench_parse_load(int argc, char* argv[], AChatLoadConfig* config) {
+    for (int i = 2; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "ERROR: %s is missing its value!\n", argv[i]);
+            return false;
+        }
+
+        const char* option = argv[i];
+        const char* value = argv[i + 1];
+        if (strcmp(option, "--clients") == 0) {
+            config->clients = atoi(value);
+        } else if (strcmp(option, "--rooms") == 0) {
+            config->rooms = atoi(value);
+        } else if (strcmp(option, "--rate") == 0) {
+            config->rate = atof(value);
+        } else if (strcmp(option, "--size") == 0) {
+            config->message_size = (size_t) atol(value);
+        } else if (strcmp(option, "--duration") == 0) {
+            config->duration_seconds = atof(value);
+        } else if (strcmp(option, "--warmup") == 0) {
+            config->warmup_seconds = atof(value);
+        } else if (strcmp(option, "--workers") == 0) {
+            config->workers = atoi(value);
+        } else if (strcmp(option, "--engine") == 0) {
+            if (strcmp(value, "epoll") == 0) {
+                config->engine = A_CHAT_SERVER_ENGINE_EPOLL;
+            } else if (strcmp(value, "io_uring") == 0) {
+                // the epoll engine's event loops, driven by io_uring instead
+                config->engine = A_CHAT_SERVER_ENGINE_EPOLL;
+                config->io_uring = true;
+            } else if (strcmp(value, "threaded") == 0) {
+                config->engine = A_CHAT_SERVER_ENGINE_THREADED;
+            } else {
+                fprintf(stderr, "ERROR: Unknown engine %s!\n", value);
+                return false;
+            }
+        } else if (strcmp(option, "--threads") == 0) {
+            config->server_threads = atoi(value);
+        } else if (strcmp(option, "--store") == 0) {
+            config->message_store_path = value;
+        } else if (strcmp(option, "--address") == 0) {
+            config->address = value;
+        } else if (strcmp(option, "--port") == 0) {
+            config->port = value;
+        } else {
+            fprintf(stderr, "ERROR: Unknown option %s!\n", option);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        a_chat_bench_usage();
+        return 0;
+    }
+
+    // thousands of clients connecting would drown the results in info messages
+    AChatLogConfig log_config = a_chat_log_default_config();
+    log_config.level = A_CHAT_LOG_LEVEL_WARNING;
+    if (!a_chat_log_start(&log_config)) {
+        fprintf(stderr, "ERROR: Failed to start logging!\n");
+        return -1;
+    }
+
+    if (strcmp(argv[1], "load") == 0) {
+        AChatLoadConfig config = a_chat_load_default_config();
+        if (!a_chat_bench_parse_load(argc, argv, &config)) {
+            a_chat_bench_usage();
+            return -1;
+        }
+
+        return a_chat_load_run(&config) ? 0 : -1;
+    } else if (strcmp(argv[1], "micro") == 0) {
+        return a_chat_micro_run(argc > 2 ? argv[2] : NULL) ? 0 : -1;
+    }
+
+    a_chat_bench_usage();
+    return 0;
+}
@@ -0,0 +1,447 @@
+#include "micro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <a-chat.h>
+#include "pool.h"
+#include "server/metrics.h"
+#include "server/room.h"
+#include "crypto/aes_gcm.h"
+#include "crypto/sha256.h"
+#include "crypto/x25519.h"
+#include "protocol/lz4.h"
+#include "check.h"
+
+// every benchmark is timed for about this long, a few times over, and its fastest run is reported
+#define A_CHAT_MICRO_TARGET_NS 200000000ull
+#define A_CHAT_MICRO_RUNS 3
+
+#define A_CHAT_MICRO_MESSAGE_SIZE 128
+#define A_CHAT_MICRO_FRAMES_PER_CHUNK 512
+#define A_CHAT_MICRO_ROOM_MEMBERS 1000
+
+typedef struct AChatMicroBenchmark {
+    const char* name;
+    size_t bytes; // processed by each operation, 0 if throughput doesn't mean anything for it
+    size_t parameter; // a size or a count, depending on the benchmark
+    bool (*setup)(struct AChatMicroBenchmark* benchmark);
+    void (*run)(struct AChatMicroBenchmark* benchmark, uint64_t iterations);
+    void (*teardown)(struct AChatMicroBenchmark* benchmark);
+    void* context;
+} AChatMicroBenchmark;
+
+// the compiler can't throw away work whose result is written here
+static volatile uint8_t a_chat_micro_sink;
+
+// frame/create: what the server does for every relayed message, allocate a buffer and encode the frame into it
+
+static void a_chat_micro_frame_create(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    uint8_t payload[A_CHAT_MICRO_MESSAGE_SIZE] = {0};
+    for (uint64_t i = 0; i < iterations; i++) {
+        AChatBuffer* frame = a_chat_frame_create(A_CHAT_FRAME_MESSAGE, 0, payload, benchmark->parameter);
+        a_chat_micro_sink = frame->data[A_CHAT_FRAME_HEADER_SIZE - 1];
+        a_chat_buffer_release(frame);
+    }
+}
+
+// pool/alloc_free and pool/malloc_free: a burst of message sized blocks taken and given back, from the pool and from the heap
+
+#define A_CHAT_MICRO_BURST 64
+
+static void a_chat_micro_pool(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    void* blocks[A_CHAT_MICRO_BURST];
+    for (uint64_t i = 0; i < iterations; i += A_CHAT_MICRO_BURST) {
+        for (int j = 0; j < A_CHAT_MICRO_BURST; j++) {
+            blocks[j] = a_chat_pool_alloc(benchmark->parameter);
+        }
+        for (int j = 0; j < A_CHAT_MICRO_BURST; j++) {
+            a_chat_pool_free(blocks[j]);
+        }
+    }
+}
+
+static void a_chat_micro_malloc(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    void* blocks[A_CHAT_MICRO_BURST];
+    for (uint64_t i = 0; i < iterations; i += A_CHAT_MICRO_BURST) {
+        for (int j = 0; j < A_CHAT_MICRO_BURST; j++) {
+            blocks[j] = malloc(benchmark->parameter);
+        }
+        for (int j = 0; j < A_CHAT_MICRO_BURST; j++) {
+            free(blocks[j]);
+        }
+    }
+}
+
+// frame/decode: a chunk of back to back frames is fed through a decoder, like a recv() full of messages
+
+typedef struct AChatMicroDecode {
+    AChatFrameDecoder decoder;
+    uint8_t* chunk;
+    size_t chunk_length;
+} AChatMicroDecode;
+
+static bool a_chat_micro_decode_setup(AChatMicroBenchmark* benchmark) {
+    AChatMicroDecode* decode = calloc(1, sizeof(AChatMicroDecode));
+    if (!decode) { return false; }
+    benchmark->context = decode;
+
+    size_t frame_length = A_CHAT_FRAME_HEADER_SIZE + benchmark->parameter;
+    decode->chunk_length = frame_length * A_CHAT_MICRO_FRAMES_PER_CHUNK;
+    decode->chunk = calloc(1, decode->chunk_length);
+    if (!decode->chunk || !a_chat_frame_decoder_init(&decode->decoder)) { return false; }
+
+    for (int i = 0; i < A_CHAT_MICRO_FRAMES_PER_CHUNK; i++) {
+        a_chat_frame_encode_header(decode->chunk + i * frame_length, A_CHAT_FRAME_MESSAGE, 0, benchmark->parameter);
+    }
+
+    return true;
+}
+
+static void a_chat_micro_decode_run(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    AChatMicroDecode* decode = benchmark->context;
+
+    uint64_t decoded = 0;
+    while (decoded < iterations) {
+        size_t copied = 0;
+        while (copied < decode->chunk_length) {
+            size_t available;
+            uint8_t* buffer = a_chat_frame_decoder_reserve(&decode->decoder, &available);
+            if (!buffer) { return; }
+
+            size_t length = decode->chunk_length - copied < available ? decode->chunk_length - copied : available;
+            memcpy(buffer, decode->chunk + copied, length);
+            a_chat_frame_decoder_commit(&decode->decoder, length);
+            copied += length;
+
+            AChatFrame frame;
+            while (a_chat_frame_decoder_next(&decode->decoder, &frame) == A_CHAT_FRAME_COMPLETE) {
+                a_chat_micro_sink = frame.type;
+                decoded++;
+            }
+        }
+    }
+}
+
+static void a_chat_micro_decode_teardown(AChatMicroBenchmark* benchmark) {
+    AChatMicroDecode* decode = benchmark->context;
+    if (!decode) { return; }
+
+    a_chat_frame_decoder_destroy(&decode->decoder);
+    free(decode->chunk);
+    free(decode);
+}
+
+// broadcast/room_fanout: the heart of a broadcast, a room is looked up and the frame is queued to each of its members
+// the queues are emptied again without a socket, so only the server's own work is timed
+
+typedef struct AChatMicroFanout {
+    AChatRoomTable rooms;
+    AChatClientHandler* client_handlers;
+    AChatBuffer* frame;
+} AChatMicroFanout;
+
+static bool a_chat_micro_fanout_setup(AChatMicroBenchmark* benchmark) {
+    AChatMicroFanout* fanout = calloc(1, sizeof(AChatMicroFanout));
+    if (!fanout) { return false; }
+    benchmark->context = fanout;
+
+    if (!a_chat_room_table_init(&fanout->rooms)) { return false; }
+
+    uint8_t payload[A_CHAT_MICRO_MESSAGE_SIZE] = {0};
+    fanout->frame = a_chat_frame_create(A_CHAT_FRAME_MESSAGE, 0, payload, sizeof(payload));
+    fanout->client_handlers = calloc(benchmark->parameter, sizeof(AChatClientHandler));
+    if (!fanout->frame || !fanout->client_handlers) { return false; }
+
+    AChatServerConfig config = a_chat_server_default_config();
+    for (size_t i = 0; i < benchmark->parameter; i++) {
+        AChatClientHandler* client_handler = &fanout->client_handlers[i];
+        client_handler->handshake_complete = true;
+        a_chat_outbound_queue_init(&client_handler->outbound, config.outbound_queue_maximum_frames, config.outbound_queue_maximum_bytes, config.overflow_policy, NULL);
+        if (!a_chat_room_join(&fanout->rooms, client_handler, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM))) { return false; }
+    }
+
+    return true;
+}
+
+static void a_chat_micro_fanout_run(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    AChatMicroFanout* fanout = benchmark->context;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        AChatRoom* room = a_chat_room_table_find(&fanout->rooms, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM));
+        for (uint32_t j = 0; j < room->members.count; j++) {
+            a_chat_outbound_queue_push(&room->members.client_handlers[j]->outbound, fanout->frame);
+        }
+        for (uint32_t j = 0; j < room->members.count; j++) {
+            a_chat_outbound_queue_clear(&room->members.client_handlers[j]->outbound);
+        }
+    }
+}
+
+static void a_chat_micro_fanout_teardown(AChatMicroBenchmark* benchmark) {
+    AChatMicroFanout* fanout = benchmark->context;
+    if (!fanout) { return; }
+
+    if (fanout->client_handlers) {
+        for (size_t i = 0; i < benchmark->parameter; i++) {
+            a_chat_outbound_queue_destroy(&fanout->client_handlers[i].outbound);
+        }
+        free(fanout->client_handlers);
+    }
+    if (fanout->frame) { a_chat_buffer_release(fanout->frame); }
+    a_chat_room_table_destroy(&fanout->rooms);
+    free(fanout);
+}
+
+// crypto/aes_gcm: sealing and opening a message, through whichever path the cpu supports or the portable one
+
+typedef struct AChatMicroAesGcm {
+    AChatAesGcm gcm;
+    uint8_t* plaintext;
+    uint8_t* ciphertext;
+    uint8_t tag[A_CHAT_AES_GCM_TAG_SIZE];
+} AChatMicroAesGcm;
+
+static bool a_chat_micro_aes_gcm_setup(AChatMicroBenchmark* benchmark) {
+    AChatMicroAesGcm* aes_gcm = calloc(1, sizeof(AChatMicroAesGcm));
+    if (!aes_gcm) { return false; }
+    benchmark->context = aes_gcm;
+
+    uint8_t key[A_CHAT_AES_GCM_KEY_SIZE] = {0};
+    a_chat_aes_gcm_init(&aes_gcm->gcm, key);
+
+    aes_gcm->plaintext = calloc(1, benchmark->bytes);
+    aes_gcm->ciphertext = calloc(1, benchmark->bytes);
+    return aes_gcm->plaintext && aes_gcm->ciphertext;
+}
+
+static bool a_chat_micro_aes_gcm_portable_setup(AChatMicroBenchmark* benchmark) {
+    if (!a_chat_micro_aes_gcm_setup(benchmark)) { return false; }
+
+    ((AChatMicroAesGcm*) benchmark->context)->gcm.accelerated = false;
+    return true;
+}
+
+static void a_chat_micro_aes_gcm_encrypt(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    AChatMicroAesGcm* aes_gcm = benchmark->context;
+
+    uint8_t nonce[A_CHAT_AES_GCM_NONCE_SIZE] = {0};
+    for (uint64_t i = 0; i < iterations; i++) {
+        memcpy(nonce, &i, sizeof(i));
+        a_chat_aes_gcm_encrypt(&aes_gcm->gcm, nonce, NULL, 0, aes_gcm->plaintext, benchmark->bytes, aes_gcm->ciphertext, aes_gcm->tag);
+    }
+    a_chat_micro_sink = aes_gcm->tag[0];
+}
+
+static void a_chat_micro_aes_gcm_decrypt(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    AChatMicroAesGcm* aes_gcm = benchmark->context;
+
+    // decrypting the same message over and over still checks its tag every time
+    uint8_t nonce[A_CHAT_AES_GCM_NONCE_SIZE] = {0};
+    a_chat_aes_gcm_encrypt(&aes_gcm->gcm, nonce, NULL, 0, aes_gcm->plaintext, benchmark->bytes, aes_gcm->ciphertext, aes_gcm->tag);
+    for (uint64_t i = 0; i < iterations; i++) {
+        a_chat_micro_sink = a_chat_aes_gcm_decrypt(&aes_gcm->gcm, nonce, NULL, 0, aes_gcm->ciphertext, benchmark->bytes, aes_gcm->tag, aes_gcm->plaintext);
+    }
+}
+
+static void a_chat_micro_aes_gcm_teardown(AChatMicroBenchmark* benchmark) {
+    AChatMicroAesGcm* aes_gcm = benchmark->context;
+    if (!aes_gcm) { return; }
+
+    a_chat_aes_gcm_destroy(&aes_gcm->gcm);
+    free(aes_gcm->plaintext);
+    free(aes_gcm->ciphertext);
+    free(aes_gcm);
+}
+
+// crypto/sha256 and crypto/x25519: what every rekey costs each member
+
+static void a_chat_micro_sha256(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    uint8_t data[1024] = {0};
+    uint8_t digest[A_CHAT_SHA256_SIZE] = {0};
+    for (uint64_t i = 0; i < iterations; i++) {
+        AChatSha256 sha256;
+        a_chat_sha256_init(&sha256);
+        a_chat_sha256_update(&sha256, data, benchmark->bytes);
+        a_chat_sha256_final(&sha256, digest);
+        data[0] = digest[0];
+    }
+    a_chat_micro_sink = digest[0];
+}
+
+static void a_chat_micro_x25519(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    (void) benchmark;
+
+    uint8_t private_key[A_CHAT_X25519_KEY_SIZE] = {1};
+    uint8_t public_key[A_CHAT_X25519_KEY_SIZE] = {9};
+    uint8_t shared_secret[A_CHAT_X25519_KEY_SIZE];
+    for (uint64_t i = 0; i < iterations; i++) {
+        a_chat_x25519(shared_secret, private_key, public_key);
+        private_key[1] = shared_secret[1];
+    }
+    a_chat_micro_sink = shared_secret[0];
+}
+
+// compression/lz4: what a client does to every message before encrypting it, and every other client after decrypting it
+// messages shorter than the client's default threshold are left out, they are sent as they are
+
+#define A_CHAT_MICRO_COMPRESSION_THRESHOLD 64
+
+static const char* a_chat_micro_chat_messages[] = {
+    "hey does anyone know if the release is still going out tomorrow or did it get pushed to next week?",
+    "I think we should merge the fix for the reconnect bug first, then do the release, let me know what you think",
+    "sounds good to me, I'm going to review the branch this afternoon and I'll let you know if I find anything",
+    "thanks a lot! I was going to ask you to take a look at the test that keeps failing on the build server",
+    "no problem, I'm not sure what's going on with it but I'll check the logs in a few minutes",
+    "good morning everyone, just a reminder that the meeting is moved to Thursday at 3, see you there",
+    "haha yeah that makes sense, I didn't know the server was doing that, good idea to add a check for it",
+    "can you send me the link to the issue? https://github.com/snufflyyy/a-chat/issues is what I have open right now",
+    "sorry about that, my bad, I must have pushed to the wrong branch this morning, I'll fix it right now",
+    "lol ok, what time works for you tomorrow? I'm free after lunch but I have to leave at 5",
+    "does anyone want to get food tonight? I was thinking about that place we went to last week",
+    "I agree with you about the schedule, it's too tight, we should talk to them about moving the deadline",
+};
+
+typedef struct AChatMicroCompression {
+    const uint8_t* messages[sizeof(a_chat_micro_chat_messages) / sizeof(a_chat_micro_chat_messages[0])];
+    size_t lengths[sizeof(a_chat_micro_chat_messages) / sizeof(a_chat_micro_chat_messages[0])];
+    uint8_t compressed[sizeof(a_chat_micro_chat_messages) / sizeof(a_chat_micro_chat_messages[0])][A_CHAT_MICRO_MESSAGE_SIZE];
+    size_t compressed_lengths[sizeof(a_chat_micro_chat_messages) / sizeof(a_chat_micro_chat_messages[0])];
+    int number_of_messages;
+    uint8_t output[A_CHAT_MICRO_MESSAGE_SIZE];
+} AChatMicroCompression;
+
+static bool a_chat_micro_compression_setup(AChatMicroBenchmark* benchmark) {
+    AChatMicroCompression* compression = calloc(1, sizeof(AChatMicroCompression));
+    if (!compression) { return false; }
+    benchmark->context = compression;
+
+    size_t number_of_messages = sizeof(a_chat_micro_chat_messages) / sizeof(a_chat_micro_chat_messages[0]);
+    size_t total_length = 0;
+    size_t total_compressed_length = 0;
+    for (size_t i = 0; i < number_of_messages; i++) {
+        size_t length = strlen(a_chat_micro_chat_messages[i]);
+        if (length < A_CHAT_MICRO_COMPRESSION_THRESHOLD || length > A_CHAT_MICRO_MESSAGE_SIZE) { continue; }
+
+        int index = compression->number_of_messages++;
+        compression->messages[index] = (const uint8_t*) a_chat_micro_chat_messages[i];
+        compression->lengths[index] = length;
+        compression->compressed_lengths[index] = a_chat_lz4_compress(compression->messages[index], length, compression->compressed[index], length);
+        // the ones that wouldn't get smaller are sent as they are, so they count as their own length
+        total_length += length;
+        total_compressed_length += compression->compressed_lengths[index] ? compression->compressed_lengths[index] : length;
+    }
+    benchmark->bytes = total_length;
+
+    printf("%-36s %zu messages, %zu bytes -> %zu bytes (%.2fx)\n", benchmark->name, (size_t) compression->number_of_messages, total_length, total_compressed_length, (double) total_length / (double) total_compressed_length);
+    return compression->number_of_messages > 0;
+}
+
+static void a_chat_micro_compression_compress(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    AChatMicroCompression* compression = benchmark->context;
+
+    // one operation is the whole corpus
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (int j = 0; j < compression->number_of_messages; j++) {
+            a_chat_micro_sink = (uint8_t) a_chat_lz4_compress(compression->messages[j], compression->lengths[j], compression->output, compression->lengths[j]);
+        }
+    }
+}
+
+static void a_chat_micro_compression_decompress(AChatMicroBenchmark* benchmark, uint64_t iterations) {
+    AChatMicroCompression* compression = benchmark->context;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (int j = 0; j < compression->number_of_messages; j++) {
+            if (compression->compressed_lengths[j] == 0) { continue; }
+            a_chat_micro_sink = a_chat_lz4_decompress(compression->compressed[j], compression->compressed_lengths[j], compression->output, compression->lengths[j]);
+        }
+    }
+}
+
+static void a_chat_micro_compression_teardown(AChatMicroBenchmark* benchmark) {
+    free(benchmark->context);
+}
+
+static AChatMicroBenchmark a_chat_micro_benchmarks[] = {
+    { "frame/create_128", 0, A_CHAT_MICRO_MESSAGE_SIZE, NULL, a_chat_micro_frame_create, NULL, NULL },
+    { "pool/alloc_free_1k", 0, 1024, NULL, a_chat_micro_pool, NULL, NULL },
+    { "pool/malloc_free_1k", 0, 1024, NULL, a_chat_micro_malloc, NULL, NULL },
+    { "frame/decode_128", A_CHAT_FRAME_HEADER_SIZE + A_CHAT_MICRO_MESSAGE_SIZE, A_CHAT_MICRO_MESSAGE_SIZE, a_chat_micro_decode_setup, a_chat_micro_decode_run, a_chat_micro_decode_teardown, NULL },
+    { "frame/decode_16k", A_CHAT_FRAME_HEADER_SIZE + 16384, 16384, a_chat_micro_decode_setup, a_chat_micro_decode_run, a_chat_micro_decode_teardown, NULL },
+    { "broadcast/room_fanout_1000", 0, A_CHAT_MICRO_ROOM_MEMBERS, a_chat_micro_fanout_setup, a_chat_micro_fanout_run, a_chat_micro_fanout_teardown, NULL },
+    { "crypto/aes_gcm_encrypt_64", 64, 0, a_chat_micro_aes_gcm_setup, a_chat_micro_aes_gcm_encrypt, a_chat_micro_aes_gcm_teardown, NULL },
+    { "crypto/aes_gcm_encrypt_1k", 1024, 0, a_chat_micro_aes_gcm_setup, a_chat_micro_aes_gcm_encrypt, a_chat_micro_aes_gcm_teardown, NULL },
+    { "crypto/aes_gcm_encrypt_16k", 16384, 0, a_chat_micro_aes_gcm_setup, a_chat_micro_aes_gcm_encrypt, a_chat_micro_aes_gcm_teardown, NULL },
+    { "crypto/aes_gcm_encrypt_1k_portable", 1024, 0, a_chat_micro_aes_gcm_portable_setup, a_chat_micro_aes_gcm_encrypt, a_chat_micro_aes_gcm_teardown, NULL },
+    { "crypto/aes_gcm_decrypt_1k", 1024, 0, a_chat_micro_aes_gcm_setup, a_chat_micro_aes_gcm_decrypt, a_chat_micro_aes_gcm_teardown, NULL },
+    { "crypto/sha256_1k", 1024, 0, NULL, a_chat_micro_sha256, NULL, NULL },
+    { "crypto/x25519", 0, 0, NULL, a_chat_micro_x25519, NULL, NULL },
+    { "compression/lz4_compress_chat", 0, 0, a_chat_micro_compression_setup, a_chat_micro_compression_compress, a_chat_micro_compression_teardown, NULL },
+    { "compression/lz4_decompress_chat", 0, 0, a_chat_micro_compression_setup, a_chat_micro_compression_decompress, a_chat_micro_compression_teardown, NULL },
+};
+
+// times the benchmark for about A_CHAT_MICRO_TARGET_NS and returns how long one operation took
+static double a_chat_micro_time(AChatMicroBenchmark* benchmark) {
+    // find how many iterations fill the target time, starting small so slow benchmarks don't take forever
+    uint64_t iterations = 1;
+    uint64_t elapsed;
+    while (true) {
+        uint64_t start = a_chat_metrics_now_ns();
+        benchmark->run(benchmark, iterations);
+        elapsed = a_chat_metrics_now_ns() - start;
+        if (elapsed >= A_CHAT_MICRO_TARGET_NS / 10) { break; }
+        iterations *= 2;
+    }
+    iterations = (uint64_t) ((double) iterations * A_CHAT_MICRO_TARGET_NS / (double) elapsed) + 1;
+
+    double best = 0.0;
+    for (int i = 0; i < A_CHAT_MICRO_RUNS; i++) {
+        uint64_t start = a_chat_metrics_now_ns();
+        benchmark->run(benchmark, iterations);
+        double per_operation = (double) (a_chat_metrics_now_ns() - start) / (double) iterations;
+        if (i == 0 || per_operation < best) {
+            best = per_operation;
+        }
+    }
+
+    return best;
+}
+
+bool a_chat_micro_run(const char* filter) {
+    // timing code that gives the wrong answers would only be misleading
+    if (!a_chat_check_run()) {
+        fprintf(stderr, "ERROR: Failed the known-answer checks, not running the benchmarks!\n");
+        return false;
+    }
+
+    printf("%-36s %12s %14s %12s\n", "benchmark", "ns/op", "ops/s", "MB/s");
+
+    bool ok = true;
+    size_t number_of_benchmarks = sizeof(a_chat_micro_benchmarks) / sizeof(a_chat_micro_benchmarks[0]);
+    for (size_t i = 0; i < number_of_benchmarks; i++) {
+        AChatMicroBenchmark* benchmark = &a_chat_micro_benchmarks[i];
+        if (filter && !strstr(benchmark->name, filter)) { continue; }
+
+        if (benchmark->setup && !benchmark->setup(benchmark)) {
+            fprintf(stderr, "ERROR: Failed to set up %s!\n", benchmark->name);
+            ok = false;
+        } else {
+            double nanoseconds = a_chat_micro_time(benchmark);
+            printf("%-36s %12.1f %14.0f", benchmark->name, nanoseconds, 1e9 / nanoseconds);
+            if (benchmark->bytes > 0) {
+                printf(" %12.1f", (double) benchmark->bytes / nanoseconds * 1e3);
+            }
+            printf("\n");
+        }
+
+        if (benchmark->teardown) {
+            benchmark->teardown(benchmark);
+        }
+        benchmark->context = NULL;
+    }
+
+    return ok;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdbool.h>
+
+// micro-benchmarks of the paths every message goes through: framing, broadcast fan-out, crypto and compression
+// the crypto and compression are checked against known answers first, nothing is timed if they fail
+// only benchmarks whose name contains filter are run, NULL runs all of them
+bool a_chat_micro_run(const char* filter);
@@ -1,11 +1,56 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 
 #include <a-chat.h>
-#include <sys/socket.h>
+
+static AChatServer* running_server = NULL;
+
+static void stop_server(int signal_number) {
+    (void) signal_number;
+    a_chat_server_stop(running_server);
+}
+
+// serves clients until ctrl+c or a SIGTERM, which drains them so a restart doesn't just cut everyone off
+static void run_server(AChatServer* server) {
+    running_server = server;
+    struct sigaction action = {0};
+    action.sa_handler = stop_server;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    a_chat_server_accept(server);
+    a_chat_server_close(server);
+}
+
+// usernames are unique on a server, so every client asks for its own instead of them all being the same
+static bool read_username(char* username, size_t size) {
+    while (true) {
+        printf("username: ");
+        fflush(stdout);
+        if (!fgets(username, (int) size, stdin)) { return false; }
+
+        // "/msg [username],[username] [message]" splits the usernames off at the first space and at every comma, so
+        // nobody could send a direct message to a username with either in it
+        username[strcspn(username, "\n")] = '\0';
+        if (username[0] != '\0' && !strpbrk(username, " ,")) { return true; }
+
+        printf("a username can't be empty or have spaces or commas in it, /msg couldn't reach it\n");
+    }
+}
 
 int main(int argc, char* argv[]) {
+    // logs are written by a background thread, to stderr and to A_CHAT_LOG_FILE if it is set
+    AChatLogConfig log_config = a_chat_log_default_config();
+    log_config.file_path = getenv("A_CHAT_LOG_FILE");
+    if (!a_chat_log_start(&log_config)) {
+        fprintf(stderr, "ERROR: Failed to start logging!\n");
+        return -1;
+    }
+
     switch (argc) {
         case 2: // use the localhost as the ip and the default port (1126)
             if (strcmp(argv[1], "server") == 0) {
@@ -15,11 +60,14 @@ int main(int argc, char* argv[]) {
                     return -1;
                 }
 
-                a_chat_server_accept(server);
-
-                a_chat_server_close(server);
+                run_server(server);
             } else if (strcmp(argv[1], "client") == 0) {
-                AChatClient* client = a_chat_client_create("127.0.0.1", A_CHAT_DEFAULT_PORT, "braden");
+                char username[256];
+                if (!read_username(username, sizeof(username))) {
+                    return -1;
+                }
+
+                AChatClient* client = a_chat_client_create("127.0.0.1", A_CHAT_DEFAULT_PORT, username);
                 if (!client) {
                     fprintf(stderr, "ERROR: Failed to create client!\n");
                     return -1;
@@ -30,11 +78,35 @@ int main(int argc, char* argv[]) {
                     fgets(message, sizeof(message), stdin);
 
                     if (strcmp(message, "exit\n") == 0) {
-                        client->running = false;
                         break;
                     }
 
-                    send(client->socket, message, strlen(message), 0);
+                    // the message is framed, so the new line isn't needed to mark where it ends
+                    message[strcspn(message, "\n")] = '\0';
+
+                    // "/join [room]" and "/leave [room]" move between rooms, "/msg [username] [message]" only goes to that user,
+                    // or to each of them with "/msg [username],[username] [message]", "/who" or "/who [username]" asks who
+                    // is online, anything else goes to the current room
+                    char* space;
+                    if (strncmp(message, "/join ", 6) == 0) {
+                        a_chat_client_join(client, message + 6);
+                    } else if (strncmp(message, "/leave ", 7) == 0) {
+                        a_chat_client_leave(client, message + 7);
+                    } else if (strncmp(message, "/msg ", 5) == 0 && (space = strchr(message + 5, ' '))) {
+                        *space = '\0';
+                        const char* usernames[A_CHAT_DIRECT_MAXIMUM_RECIPIENTS];
+                        int number_of_usernames = 0;
+                        for (char* username = strtok(message + 5, ","); username && number_of_usernames < A_CHAT_DIRECT_MAXIMUM_RECIPIENTS; username = strtok(NULL, ",")) {
+                            usernames[number_of_usernames++] = username;
+                        }
+                        a_chat_client_send_multicast(client, usernames, number_of_usernames, space + 1);
+                    } else if (strcmp(message, "/who") == 0) {
+                        a_chat_client_query_presence(client, NULL);
+                    } else if (strncmp(message, "/who ", 5) == 0) {
+                        a_chat_client_query_presence(client, message + 5);
+                    } else {
+                        a_chat_client_send(client, message);
+                    }
                 }
 
                 a_chat_client_close(client);
@@ -48,8 +120,7 @@ int main(int argc, char* argv[]) {
                     return -1;
                 }
 
-                a_chat_server_accept(server);
-                a_chat_server_close(server);
+                run_server(server);
             } else if (strcmp(argv[1], "client") == 0) {
 
             }
@@ -62,8 +133,7 @@ int main(int argc, char* argv[]) {
                     return -1;
                 }
 
-                a_chat_server_accept(server);
-                a_chat_server_close(server);
+                run_server(server);
             } else if (strcmp(argv[1], "client") == 0) {
 
             }
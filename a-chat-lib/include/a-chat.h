@@ -2,5 +2,6 @@
 
 #define A_CHAT_DEFAULT_PORT "1126"
 
+#include "log.h"
 #include "server/server.h"
 #include "client/client.h"
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// a reference counted, immutable once shared, block of bytes
+// a frame is encoded into a buffer once, then the same buffer is queued to every client it is sent to
+// buffers come from the pool, so building and releasing frames doesn't touch the general heap once it has warmed up
+// a buffer can also lend out memory it doesn't own, like a mapped file, whose owner is told when the last reference goes
+typedef struct AChatBuffer {
+    atomic_int references;
+    size_t length;
+    uint8_t* data; // the buffer's own storage, or the lent memory
+    void (*release)(void* owner); // NULL unless the memory is lent
+    void* owner;
+    uint8_t storage[];
+} AChatBuffer;
+
+// the new buffer starts with one reference, owned by the caller
+AChatBuffer* a_chat_buffer_create(size_t length);
+// the memory has to stay valid until release(owner) is called
+AChatBuffer* a_chat_buffer_wrap(uint8_t* data, size_t length, void (*release)(void* owner), void* owner);
+AChatBuffer* a_chat_buffer_acquire(AChatBuffer* buffer);
+void a_chat_buffer_release(AChatBuffer* buffer);
@@ -1,17 +1,133 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
+#include "buffer.h"
+#include "client/group_key.h"
+#include "protocol/frame.h"
+
+// the most rooms the client remembers the last message of, the same as the server's limit on rooms per client
+#define A_CHAT_CLIENT_MAXIMUM_ROOMS 32
+// the most messages kept while the client is reconnecting, anything sent past this is dropped
+#define A_CHAT_CLIENT_MAXIMUM_PENDING 256
+// the wait between reconnect attempts doubles from the minimum up to the maximum, with some jitter so a restarted
+// server isn't hit by every client at once
+#define A_CHAT_CLIENT_RECONNECT_MINIMUM_MS 100
+#define A_CHAT_CLIENT_RECONNECT_MAXIMUM_MS 5000
+// how long closing waits for what is still queued to be written, a server that stopped reading can't hold it up forever
+#define A_CHAT_CLIENT_CLOSE_TIMEOUT_MS 2000
+// the most frames the sender thread writes with one sendmsg()
+#define A_CHAT_CLIENT_SEND_BATCH 64
+// the most questions waiting on the server's answers, like direct messages waiting on who their recipients are,
+// anything sent past this is dropped
+#define A_CHAT_CLIENT_MAXIMUM_QUERIES 16
+// what a direct message carries for each of its recipients: a nonce, its key wrapped for them, and a tag
+#define A_CHAT_CLIENT_DIRECT_ENTRY_SIZE (A_CHAT_AES_GCM_NONCE_SIZE + A_CHAT_AES_GCM_KEY_SIZE + A_CHAT_AES_GCM_TAG_SIZE)
+
+typedef struct AChatClientConfig {
+    // the sender thread waits this long after a frame is queued for more to write with it, 0 writes straight away
+    // (frames queued while a write is in flight are still written together)
+    int coalesce_window_us;
+    // the most messages waiting for the sender thread, a_chat_client_send fails instead of blocking once there are this many
+    int send_queue_maximum_messages;
+
+    // compresses messages before encrypting them if the server lets it, only messages this long or longer are worth it
+    bool compression;
+    int compression_threshold;
+} AChatClientConfig;
+
+// the sequence of the last message seen in a room the client is in
+typedef struct AChatClientRoomSequence {
+    char name[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+    size_t name_length;
+    uint64_t last_sequence;
+} AChatClientRoomSequence;
+
+// a PRESENCE frame the server hasn't answered yet, and the direct message waiting on it if there is one
+typedef struct AChatClientQuery {
+    uint8_t* recipients; // the users asked about, as a routing header, see A_CHAT_FRAME_DIRECT
+    size_t recipients_length;
+    char* message; // NULL if the answer is just shown
+} AChatClientQuery;
+
 typedef struct AChatClient {
     bool running;
+    AChatClientConfig config;
 
-    int socket;
+    int socket; // -1 while reconnecting
+    char* address;
+    char* port;
+    bool connected;
     const char* username;
+    char room[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1]; // messages are sent to this room, the last room joined
+
+    // messages are end-to-end encrypted with each room's group key
+    AChatGroupKeys keys;
+    // a nonce is a random prefix picked by this client followed by a counter, so it is never reused with the same key
+    uint8_t nonce_prefix[A_CHAT_AES_GCM_NONCE_SIZE - 4];
+    uint32_t nonce_counter;
 
+    // a message seen twice, like one both relayed and replayed while catching up, is only shown once
+    AChatClientRoomSequence sequences[A_CHAT_CLIENT_MAXIMUM_ROOMS];
+    int number_of_sequences;
+
+    // the session the server gave this client, a reconnect resumes it instead of doing the handshake again
+    uint8_t session_token[A_CHAT_SESSION_TOKEN_SIZE];
+    bool has_session;
+    bool resuming; // a resume has been sent and the server hasn't answered it yet
+    bool compressing; // the server has answered the handshake or resume letting the client compress
+
+    // messages sent while the client is reconnecting, or before its resume was answered, oldest first
+    // they are sent again once the client is back, so the server may see one twice if a resume fails
+    AChatBuffer* pending[A_CHAT_CLIENT_MAXIMUM_PENDING];
+    int number_of_pending;
+
+    // PRESENCE frames waiting on their answers, oldest first, which is the order the server answers them in
+    // direct messages are only encrypted once an answer brings their recipients' public keys, the keys are asked for
+    // every time, as someone who comes back as a new client has a new one
+    AChatClientQuery queries[A_CHAT_CLIENT_MAXIMUM_QUERIES];
+    int number_of_queries;
+
+    // every frame goes out through the sender thread, which writes whatever has been queued in as few syscalls as it can
+    // a ring of encoded frames, oldest first, that grows as needed, only MESSAGE frames count towards the config's limit
+    AChatBuffer** send_queue;
+    size_t send_queue_capacity;
+    size_t send_queue_head;
+    size_t send_queue_count;
+    int queued_messages;
+    uint64_t connection; // counts connections, so the sender thread doesn't retry one that already failed
+    bool sending; // the sender thread is writing to the socket, so it can't be closed yet
+    pthread_cond_t sendable; // wakes the sender thread
+    pthread_cond_t sent; // wakes whoever waits on sending
+    pthread_t send_thread_id;
+
+    // guards the keys, the send queue and the connection, as the receive thread rekeys rooms and reconnects while
+    // messages are being sent
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // cuts the wait between reconnect attempts short when closing
     pthread_t receive_thread_id;
 } AChatClient;
 
+AChatClientConfig a_chat_client_default_config(void);
+
+// a dropped connection is reconnected by the receive thread, messages sent meanwhile are kept until it is back
 AChatClient* a_chat_client_create(const char* ip_address, const char* port, const char* username);
-void a_chat_client_send(AChatClient* client, const char* message);
+AChatClient* a_chat_client_create_with_config(const char* ip_address, const char* port, const char* username, const AChatClientConfig* config);
+// encrypts a message with the room's group key and queues it for the client's current room, never blocks on the socket
+// returns false if the message was dropped, like when the send queue is full
+bool a_chat_client_send(AChatClient* client, const char* message);
+// encrypts a message for the user alone, once the server has said what their public key is, never blocks on the socket
+// returns false if the message was dropped, the client is told later if the user isn't online
+bool a_chat_client_send_direct(AChatClient* client, const char* username, const char* message);
+// like a_chat_client_send_direct but for every one of the users, the message is only encrypted and sent once
+// the client is told later about any of them who aren't online, the rest are still sent it
+bool a_chat_client_send_multicast(AChatClient* client, const char* const* usernames, int number_of_usernames, const char* message);
+// asks the server how many users are online, and about the user too unless username is NULL, the answer is printed
+void a_chat_client_query_presence(AChatClient* client, const char* username);
+// joins a room and makes it the client's current room
+void a_chat_client_join(AChatClient* client, const char* room);
+void a_chat_client_leave(AChatClient* client, const char* room);
+// ends the client's session, so the server tells its rooms it has gone straight away
 void a_chat_client_close(AChatClient* client);
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crypto/aes_gcm.h"
+#include "crypto/x25519.h"
+#include "protocol/frame.h"
+
+// every room has a group key that its messages are encrypted with, made by the room's leader (the member with the
+// smallest public key) and wrapped for each member with a key from X25519 between the leader and that member
+// the server only ever relays public keys and wrapped keys, so it never learns a group key
+
+// a membership change waits this long before the leader rekeys, so a burst of joins or leaves costs a single rekey
+#define A_CHAT_GROUP_REKEY_DELAY_MS 100
+// how long a client that has just joined waits for the leader's key before deciding the room is empty and making its own
+#define A_CHAT_GROUP_FIRST_KEY_DELAY_MS 500
+
+// a wrapped key for one member: their public key, nonce, the encrypted group key and its tag
+#define A_CHAT_GROUP_KEY_ENTRY_SIZE (A_CHAT_PUBLIC_KEY_SIZE + A_CHAT_AES_GCM_NONCE_SIZE + A_CHAT_AES_GCM_KEY_SIZE + A_CHAT_AES_GCM_TAG_SIZE)
+
+typedef struct AChatGroupMember {
+    uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE];
+    bool present; // false once they have left, so an older key frame that still lists them can't bring them back
+} AChatGroupMember;
+
+typedef struct AChatGroupEpoch {
+    bool valid;
+    uint32_t epoch;
+    AChatAesGcm cipher;
+} AChatGroupEpoch;
+
+typedef struct AChatGroupRoom {
+    char name[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+    size_t name_length;
+
+    // every member this client has heard of, sorted by public key so the leader is the first present one
+    AChatGroupMember* members;
+    size_t number_of_members;
+    size_t members_capacity;
+    size_t number_present;
+
+    // the previous key is kept so messages sent just before a rekey can still be read
+    AChatGroupEpoch current;
+    AChatGroupEpoch previous;
+    uint8_t current_sender[A_CHAT_PUBLIC_KEY_SIZE];
+    uint32_t highest_epoch;
+
+    bool stale; // the members have changed since the current key was made
+    uint64_t rekey_at; // 0 unless this client is the leader and owes the room a new key
+
+    struct AChatGroupRoom* next;
+} AChatGroupRoom;
+
+// the keys worked out with a peer, kept for the whole session so each peer costs a single X25519
+typedef struct AChatPeerKey {
+    bool used;
+    uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE];
+    uint8_t wrap_key[A_CHAT_AES_GCM_KEY_SIZE];
+    uint8_t direct_key[A_CHAT_AES_GCM_KEY_SIZE]; // direct messages between the two of them are encrypted with it
+} AChatPeerKey;
+
+typedef enum AChatGroupKeyResult {
+    A_CHAT_GROUP_KEY_IGNORED, // out of date, or from someone who has left
+    A_CHAT_GROUP_KEY_ACCEPTED, // this client has a new key
+    A_CHAT_GROUP_KEY_EXCLUDED, // the leader hasn't heard of this client (it joined first), so it should announce itself again
+} AChatGroupKeyResult;
+
+// none of this is thread safe, the client keeps it under its lock
+typedef struct AChatGroupKeys {
+    uint8_t private_key[A_CHAT_X25519_KEY_SIZE];
+    uint8_t public_key[A_CHAT_X25519_KEY_SIZE];
+
+    AChatGroupRoom* rooms;
+
+    // open addressing by the start of the peer's public key
+    AChatPeerKey* peers;
+    size_t peers_capacity;
+    size_t number_of_peers;
+} AChatGroupKeys;
+
+bool a_chat_group_keys_init(AChatGroupKeys* keys);
+// wipes every key
+void a_chat_group_keys_destroy(AChatGroupKeys* keys);
+
+AChatGroupRoom* a_chat_group_keys_find(const AChatGroupKeys* keys, const char* name, size_t length);
+// the key to decrypt a message from the given epoch with, or NULL if it isn't known
+const AChatAesGcm* a_chat_group_keys_cipher(const AChatGroupKeys* keys, const char* name, size_t length, uint32_t epoch);
+
+bool a_chat_group_keys_join(AChatGroupKeys* keys, const char* name, size_t length, uint64_t now);
+void a_chat_group_keys_leave(AChatGroupKeys* keys, const char* name, size_t length);
+// handles a MEMBER frame
+void a_chat_group_keys_member(AChatGroupKeys* keys, const char* name, size_t length, bool joined, const uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE], uint64_t now);
+// handles a GROUP_KEY frame
+AChatGroupKeyResult a_chat_group_keys_receive(AChatGroupKeys* keys, const char* name, size_t length, const uint8_t sender[A_CHAT_PUBLIC_KEY_SIZE], const uint8_t* body, size_t body_length, uint64_t now);
+
+// the key for direct messages to and from the peer, or NULL if their public key is invalid
+const uint8_t* a_chat_group_keys_direct_key(AChatGroupKeys* keys, const uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE]);
+
+// when the next rekey is due, or 0 if there isn't one
+uint64_t a_chat_group_keys_next_rekey(const AChatGroupKeys* keys);
+// makes a new key for a room whose rekey is due and returns the GROUP_KEY payload to send, which the caller frees
+// returns NULL once no rekey is due
+uint8_t* a_chat_group_keys_rekey(AChatGroupKeys* keys, uint64_t now, size_t* length);
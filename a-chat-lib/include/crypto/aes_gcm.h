@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// AES-128-GCM authenticated encryption, with an AES-NI and PCLMULQDQ path picked at runtime through cpuid
+// and a portable fallback for every other cpu
+
+#define A_CHAT_AES_GCM_KEY_SIZE 16
+#define A_CHAT_AES_GCM_NONCE_SIZE 12
+#define A_CHAT_AES_GCM_TAG_SIZE 16
+
+#define A_CHAT_AES_BLOCK_SIZE 16
+#define A_CHAT_AES_ROUNDS 10
+
+typedef struct AChatAesGcm {
+    _Alignas(16) uint8_t round_keys[(A_CHAT_AES_ROUNDS + 1) * A_CHAT_AES_BLOCK_SIZE];
+    _Alignas(16) uint8_t hash_key[A_CHAT_AES_BLOCK_SIZE]; // H, the encryption of the zero block
+    bool accelerated;
+} AChatAesGcm;
+
+// true if this cpu has AES-NI and PCLMULQDQ
+bool a_chat_aes_gcm_is_accelerated(void);
+
+void a_chat_aes_gcm_init(AChatAesGcm* gcm, const uint8_t key[A_CHAT_AES_GCM_KEY_SIZE]);
+// wipes the key schedule
+void a_chat_aes_gcm_destroy(AChatAesGcm* gcm);
+
+// the ciphertext is the same length as the plaintext, and can be written over it
+void a_chat_aes_gcm_encrypt(const AChatAesGcm* gcm, const uint8_t nonce[A_CHAT_AES_GCM_NONCE_SIZE], const uint8_t* aad, size_t aad_length, const uint8_t* plaintext, size_t length, uint8_t* ciphertext, uint8_t tag[A_CHAT_AES_GCM_TAG_SIZE]);
+// returns false without writing any plaintext if the ciphertext, aad or tag have been tampered with
+bool a_chat_aes_gcm_decrypt(const AChatAesGcm* gcm, const uint8_t nonce[A_CHAT_AES_GCM_NONCE_SIZE], const uint8_t* aad, size_t aad_length, const uint8_t* ciphertext, size_t length, const uint8_t tag[A_CHAT_AES_GCM_TAG_SIZE], uint8_t* plaintext);
+
+// the kernels behind each path
+// ctr encrypts length bytes starting from the counter block, ghash folds data (zero padded to a whole block) into state
+void a_chat_aes_gcm_ctr_portable(const AChatAesGcm* gcm, const uint8_t counter[A_CHAT_AES_BLOCK_SIZE], const uint8_t* input, uint8_t* output, size_t length);
+void a_chat_aes_gcm_ghash_portable(const AChatAesGcm* gcm, uint8_t state[A_CHAT_AES_BLOCK_SIZE], const uint8_t* data, size_t length);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define A_CHAT_AES_GCM_X86
+void a_chat_aes_gcm_ctr_x86(const AChatAesGcm* gcm, const uint8_t counter[A_CHAT_AES_BLOCK_SIZE], const uint8_t* input, uint8_t* output, size_t length);
+void a_chat_aes_gcm_ghash_x86(const AChatAesGcm* gcm, uint8_t state[A_CHAT_AES_BLOCK_SIZE], const uint8_t* data, size_t length);
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256, and the HMAC and HKDF built on it that turn X25519 shared secrets into keys
+
+#define A_CHAT_SHA256_SIZE 32
+#define A_CHAT_SHA256_BLOCK_SIZE 64
+#define A_CHAT_HKDF_MAXIMUM_INFO 256
+
+typedef struct AChatSha256 {
+    uint32_t state[8];
+    uint64_t length; // the number of bytes hashed so far
+    uint8_t block[A_CHAT_SHA256_BLOCK_SIZE];
+    size_t block_length;
+} AChatSha256;
+
+void a_chat_sha256_init(AChatSha256* sha256);
+void a_chat_sha256_update(AChatSha256* sha256, const void* data, size_t length);
+void a_chat_sha256_final(AChatSha256* sha256, uint8_t digest[A_CHAT_SHA256_SIZE]);
+
+void a_chat_hmac_sha256(const uint8_t* key, size_t key_length, const void* data, size_t length, uint8_t mac[A_CHAT_SHA256_SIZE]);
+// extract and expand in one go, output_length can be at most 255 * A_CHAT_SHA256_SIZE and info is cut off after A_CHAT_HKDF_MAXIMUM_INFO bytes
+void a_chat_hkdf_sha256(const uint8_t* salt, size_t salt_length, const uint8_t* input, size_t input_length, const uint8_t* info, size_t info_length, uint8_t* output, size_t output_length);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// X25519 Diffie-Hellman (RFC 7748), clients use it to agree on the keys that wrap each room's group key
+
+#define A_CHAT_X25519_KEY_SIZE 32
+
+// fills the private key from getrandom() and derives its public key
+bool a_chat_x25519_generate(uint8_t private_key[A_CHAT_X25519_KEY_SIZE], uint8_t public_key[A_CHAT_X25519_KEY_SIZE]);
+void a_chat_x25519_public_key(uint8_t public_key[A_CHAT_X25519_KEY_SIZE], const uint8_t private_key[A_CHAT_X25519_KEY_SIZE]);
+// returns false if the peer's public key is a low order point, which would make the shared secret all zeros
+bool a_chat_x25519(uint8_t shared_secret[A_CHAT_X25519_KEY_SIZE], const uint8_t private_key[A_CHAT_X25519_KEY_SIZE], const uint8_t peer_public_key[A_CHAT_X25519_KEY_SIZE]);
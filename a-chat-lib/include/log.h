@@ -1,7 +1,43 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// logging never blocks the thread doing it, each thread formats its messages into its own lock-free ring buffer
+// and a background thread drains every ring to stderr and/or a log file
+// until a_chat_log_start is called messages are written straight to stderr instead
+
+typedef enum AChatLogLevel {
+    A_CHAT_LOG_LEVEL_INFO,
+    A_CHAT_LOG_LEVEL_WARNING,
+    A_CHAT_LOG_LEVEL_ERROR,
+    A_CHAT_LOG_LEVEL_NONE, // nothing is logged
+} AChatLogLevel;
+
+typedef struct AChatLogConfig {
+    AChatLogLevel level; // messages below this level are dropped before they are formatted
+    bool to_stderr;
+    const char* file_path; // NULL for no log file
+    size_t file_maximum_bytes; // once the file gets this big it is rotated to "file_path.1", 0 never rotates it
+    int number_of_files; // how many rotated files are kept around
+    int flush_interval_ms; // how long the background thread sleeps when there is nothing to drain
+} AChatLogConfig;
+
+AChatLogConfig a_chat_log_default_config(void);
+// starts the background thread, which is stopped (and the rings drained) when the program exits
+bool a_chat_log_start(const AChatLogConfig* config);
+// drains whatever is left in the rings and stops the background thread
+void a_chat_log_stop(void);
+
+void a_chat_log_set_level(AChatLogLevel level);
+AChatLogLevel a_chat_log_get_level(void);
+// how many messages have been dropped because their thread's ring was full
+uint64_t a_chat_log_dropped(void);
+
 void a_chat_log_error(const char* message);
 void a_chat_log_error_gai_strerror(const char* message, int status);
 void a_chat_log_error_errno(const char* message);
+void a_chat_log_warning(const char* message);
 void a_chat_log_warning_errno(const char* message);
 void a_chat_log_info(const char* message);
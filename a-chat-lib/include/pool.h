@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// a slab allocator for message sized blocks, so frames and broadcasts don't go to the general heap once it has warmed up
+// blocks come in a few size classes, each thread keeps a cache of free blocks per class and only takes the class' lock
+// to move a batch of them at a time, anything bigger than the largest class comes straight from the heap
+//
+// slabs are never given back to the heap, the pool only grows to what the busiest moment needed
+
+#define A_CHAT_POOL_SIZE_CLASSES 6
+
+typedef struct AChatPoolClassStats {
+    size_t block_size;
+    uint64_t reserved_blocks; // carved out of slabs
+    uint64_t in_use_blocks; // handed out right now, the rest are free in a cache or the class' list
+} AChatPoolClassStats;
+
+// a snapshot of the pool, taken while other threads keep allocating, so the numbers are approximate
+typedef struct AChatPoolStats {
+    AChatPoolClassStats classes[A_CHAT_POOL_SIZE_CLASSES];
+    uint64_t reserved_bytes;
+    uint64_t in_use_bytes;
+    uint64_t oversized_blocks; // in use blocks too big for any class
+    uint64_t oversized_bytes;
+} AChatPoolStats;
+
+// the block is aligned like malloc's, NULL if the heap is out of memory
+void* a_chat_pool_alloc(size_t size);
+// safe to call from a different thread than the one that allocated the block, NULL does nothing
+void a_chat_pool_free(void* block);
+
+void a_chat_pool_get_stats(AChatPoolStats* stats);
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer.h"
+
+// every message sent over a connection is a frame, which is an 8 byte header followed by the payload
+//
+//   offset 0: version (1 byte)
+//   offset 1: type    (1 byte)
+//   offset 2: flags   (2 bytes, big-endian)
+//   offset 4: length  (4 bytes, big-endian), the length of the payload
+//   offset 8: payload
+
+#define A_CHAT_FRAME_VERSION 1
+#define A_CHAT_FRAME_HEADER_SIZE 8
+#define A_CHAT_FRAME_MAXIMUM_LENGTH (1024 * 1024)
+
+// every client is put in this room once its handshake is done
+#define A_CHAT_DEFAULT_ROOM "general"
+#define A_CHAT_ROOM_NAME_MAXIMUM_LENGTH 64
+
+// the message payload after the room name is the group key's epoch (4 bytes, big-endian), nonce (12 bytes),
+// AES-128-GCM ciphertext, tag (16 bytes)
+// the server never looks inside it, it only passes the flag on with the relayed message
+#define A_CHAT_FRAME_FLAG_ENCRYPTED 0x0001
+// set on a handshake whose payload ends with the client's X25519 public key
+#define A_CHAT_FRAME_FLAG_PUBLIC_KEY 0x0002
+// set on a relayed message whose payload starts with its sequence number in the room's history (8 bytes, big-endian),
+// sequence numbers start at 1 and go up by one with every message relayed to the room
+// set on a join whose payload starts with the first sequence number the client wants (8 bytes, big-endian), the server
+// resends the room's kept messages from that sequence on before any new ones
+#define A_CHAT_FRAME_FLAG_SEQUENCE 0x0004
+// set on a handshake from a client that wants to compress its messages, the server answers with an empty HANDSHAKE frame
+// with the flag set if it lets it, a client only compresses once it has that answer
+// set on a message whose plaintext was compressed with protocol/lz4.h before it was encrypted, the flag is part of the
+// message's additional authenticated data, every client can decompress whether or not it compresses its own messages
+#define A_CHAT_FRAME_FLAG_COMPRESSED 0x0008
+
+#define A_CHAT_PUBLIC_KEY_SIZE 32
+#define A_CHAT_SESSION_TOKEN_SIZE 16
+
+// the events in a MEMBER frame
+#define A_CHAT_MEMBER_LEFT 0
+#define A_CHAT_MEMBER_JOINED 1
+
+// a user's presence in a PRESENCE frame, away is disconnected but still able to resume their session
+#define A_CHAT_PRESENCE_OFFLINE 0
+#define A_CHAT_PRESENCE_ONLINE 1
+#define A_CHAT_PRESENCE_AWAY 2
+// how many users one PRESENCE frame can ask about
+#define A_CHAT_PRESENCE_MAXIMUM_USERS 64
+// how many users one DIRECT frame can be sent to, the same so the recipients' keys can be asked for with one PRESENCE frame
+#define A_CHAT_DIRECT_MAXIMUM_RECIPIENTS A_CHAT_PRESENCE_MAXIMUM_USERS
+// PINGs with anything longer are ignored, so a peer can't have much echoed back at it
+#define A_CHAT_PING_MAXIMUM_LENGTH 64
+
+typedef enum AChatFrameType {
+    A_CHAT_FRAME_HANDSHAKE = 1, // client -> server, payload: "a-chat [username]", then the public key with A_CHAT_FRAME_FLAG_PUBLIC_KEY
+                                // server -> client, payload: nothing, only sent with A_CHAT_FRAME_FLAG_COMPRESSED
+                                //                  or why the handshake was refused, like the username being taken
+    A_CHAT_FRAME_MESSAGE = 2, // client -> server, payload: room name length (2 bytes, big-endian), room name, message
+                              // server -> client, payload: room name length (2 bytes, big-endian), room name,
+                              //                            sender's username length (2 bytes, big-endian), username, message
+    A_CHAT_FRAME_SERVER = 3, // server -> client, payload: a notice from the server, like a client connecting
+    A_CHAT_FRAME_JOIN = 4, // client -> server, payload: the name of the room to join, after the sequence with A_CHAT_FRAME_FLAG_SEQUENCE
+    A_CHAT_FRAME_LEAVE = 5, // client -> server, payload: the name of the room to leave
+    A_CHAT_FRAME_MEMBER = 6, // server -> client, payload: room name length (2 bytes, big-endian), room name,
+                             //                            event (1 byte), the member's public key (32 bytes)
+    A_CHAT_FRAME_GROUP_KEY = 7, // client -> server, payload: room name length (2 bytes, big-endian), room name, group key
+                                // server -> client, payload: room name length (2 bytes, big-endian), room name,
+                                //                            sender's public key (32 bytes), group key
+                                // the group key is opaque to the server, see client/group_key.h
+    A_CHAT_FRAME_SESSION = 8, // server -> client, payload: the client's session token, sent once its handshake or resume is done,
+                              //                   or nothing if the resume was refused, then the server disconnects the client
+                              // client -> server, payload: nothing, ends the client's session so it can't be resumed
+    A_CHAT_FRAME_RESUME = 9, // client -> server, sent instead of the handshake to resume a session after a reconnect
+                             // payload: session token, then for each room the client has seen a message in:
+                             //          the last sequence seen (8 bytes, big-endian), room name length (2 bytes, big-endian), room name
+    A_CHAT_FRAME_PRESENCE = 10, // client -> server, payload: for each user asked about: username length (2 bytes, big-endian), username
+                                // server -> client, payload: the number of users online (4 bytes, big-endian), then for each user asked about:
+                                //                            presence (1 byte), username length (2 bytes, big-endian), username,
+                                //                            their public key (32 bytes, all zeros if they don't have one)
+    A_CHAT_FRAME_DIRECT = 11, // client -> server, payload: routing header, message
+                              // server -> client, payload: sender's username length (2 bytes, big-endian), username,
+                              //                            sender's public key (32 bytes), routing header, message
+                              // routing header: the number of recipients (1 byte), then for each one:
+                              //                 username length (2 bytes, big-endian), username
+                              // only the recipients' connections are sent it, the server routes it by the header alone,
+                              // the message is opaque to it like a room's
+    A_CHAT_FRAME_PING = 12, // either way, payload: anything up to A_CHAT_PING_MAXIMUM_LENGTH bytes, answered with a PONG
+    A_CHAT_FRAME_PONG = 13, // either way, payload: the PING's payload
+} AChatFrameType;
+
+typedef struct AChatFrame {
+    uint8_t type;
+    uint16_t flags;
+    uint32_t length;
+    const uint8_t* payload; // points into the decoder's buffer, only valid until the decoder is read into again
+} AChatFrame;
+
+typedef enum AChatFrameResult {
+    A_CHAT_FRAME_INCOMPLETE, // more bytes are needed before the next frame can be decoded
+    A_CHAT_FRAME_COMPLETE, // a frame was decoded
+    A_CHAT_FRAME_ERROR, // the stream is invalid and the connection should be dropped
+} AChatFrameResult;
+
+// an incremental decoder, bytes are received straight into its buffer and frames are decoded in place
+typedef struct AChatFrameDecoder {
+    uint8_t* buffer;
+    size_t capacity;
+    size_t start; // the first byte that hasn't been decoded
+    size_t end; // one past the last byte received
+} AChatFrameDecoder;
+
+bool a_chat_frame_decoder_init(AChatFrameDecoder* decoder);
+void a_chat_frame_decoder_destroy(AChatFrameDecoder* decoder);
+// makes room for the next read and returns where it should go, this invalidates every frame decoded so far
+uint8_t* a_chat_frame_decoder_reserve(AChatFrameDecoder* decoder, size_t* available);
+void a_chat_frame_decoder_commit(AChatFrameDecoder* decoder, size_t bytes_received);
+AChatFrameResult a_chat_frame_decoder_next(AChatFrameDecoder* decoder, AChatFrame* frame);
+
+void a_chat_frame_encode_header(uint8_t* header, uint8_t type, uint16_t flags, uint32_t length);
+// returns a buffer containing the header and payload, the caller owns its only reference
+AChatBuffer* a_chat_frame_create(uint8_t type, uint16_t flags, const void* payload, uint32_t length);
+// blocks until the whole frame has been sent
+bool a_chat_frame_send(int socket, uint8_t type, uint16_t flags, const void* payload, uint32_t length);
+bool a_chat_send_all(int socket, const void* data, size_t length);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// lz4's block format with a shared dictionary, used by clients to compress messages before encrypting them
+//
+// every client has the same dictionary of common chat text built in, and compressing acts as if it came right before the
+// message, so even a short message finds matches in it
+// compressed data starts with the uncompressed length (4 bytes, big-endian), then the lz4 sequences
+
+#define A_CHAT_LZ4_HEADER_SIZE 4
+
+// returns the compressed length, or 0 if it wouldn't be smaller than the input or doesn't fit in output
+size_t a_chat_lz4_compress(const uint8_t* input, size_t length, uint8_t* output, size_t capacity);
+// reads the uncompressed length from the header, so the caller can make room for it
+bool a_chat_lz4_decompressed_length(const uint8_t* input, size_t length, size_t* decompressed_length);
+// output has to have room for the length the header says, returns false if the input is invalid
+bool a_chat_lz4_decompress(const uint8_t* input, size_t length, uint8_t* output, size_t decompressed_length);
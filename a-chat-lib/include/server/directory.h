@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "protocol/frame.h"
+#include "server/hash_table.h"
+#include "server/registry.h"
+
+// every username in use on the server, shared by every thread, so a user can be found by name in O(1) from anywhere
+// a username is interned here once its handshake claims it, and client handlers and sessions only point at their entry
+//
+// an entry belongs to its client handler while it is connected and to its session while it is away, so the name stays
+// taken until the session expires, it is only freed once neither has it
+
+typedef struct AChatUser {
+    AChatHashEntry entry; // must be first so an entry can be cast back to the user
+
+    // where the user's connection is, only valid while they are online, the handle stops resolving once it disconnects
+    uint8_t presence;
+    int event_loop; // the index of the event loop that owns the client handler, -1 with the threaded engine
+    AChatRegistryHandle handle;
+    uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE];
+    bool has_public_key;
+
+    size_t name_length;
+    char name[]; // nul terminated
+} AChatUser;
+
+// what a lookup copies out of a user's entry, so it can be used after the directory's lock is let go
+typedef struct AChatUserStatus {
+    uint8_t presence;
+    int event_loop;
+    AChatRegistryHandle handle;
+    uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE];
+    bool has_public_key;
+} AChatUserStatus;
+
+// lookups vastly outnumber handshakes and disconnects, so they share a read lock and only changes take the write lock
+typedef struct AChatDirectory {
+    pthread_rwlock_t lock;
+    AChatHashTable users;
+
+    // kept as users come and go, so counting who is online never walks the directory
+    atomic_int number_online;
+    atomic_int number_away;
+} AChatDirectory;
+
+bool a_chat_directory_init(AChatDirectory* directory);
+void a_chat_directory_destroy(AChatDirectory* directory);
+
+// interns the name for a client that is doing its handshake, returns NULL if someone already has it
+AChatUser* a_chat_directory_claim(AChatDirectory* directory, const char* name, size_t length);
+// the user's client handler has finished its handshake or resume, so it can be found at the handle now
+void a_chat_directory_attach(AChatDirectory* directory, AChatUser* user, int event_loop, AChatRegistryHandle handle, const uint8_t* public_key);
+// the user's connection dropped but its session is kept, the name stays taken
+void a_chat_directory_detach(AChatDirectory* directory, AChatUser* user);
+// frees the name for anyone to take
+void a_chat_directory_release(AChatDirectory* directory, AChatUser* user);
+
+// returns false if nobody has the name, which is the same as them being offline
+bool a_chat_directory_find(AChatDirectory* directory, const char* name, size_t length, AChatUserStatus* status);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "server/server.h"
+#include "server/mpsc_queue.h"
+#include "server/registry.h"
+#include "server/room.h"
+#include "server/timer_wheel.h"
+#include "server/uring.h"
+
+// one event loop runs per thread, each with its own SO_REUSEPORT listening socket and its own shard of client handlers
+// client handlers are only ever touched by the event loop that owns them, so a shard needs no locking
+typedef struct AChatEventLoop {
+    AChatServer* server;
+    int index;
+
+    pthread_t thread_id;
+    int epoll_fd; // -1 when the event loop uses io_uring
+    int listening_socket;
+
+    // other threads hand this event loop work through the inbox, then wake it with the eventfd
+    int wake_fd;
+    atomic_bool wake_pending;
+    AChatMpscQueue inbox;
+
+    AChatRegistry registry;
+    AChatRoomTable rooms; // only holds the shard's own members of each room
+    bool draining; // the event loop has stopped accepting, and disconnects its clients once they have been sent everything
+    AChatTimerWheel timers; // handshake deadlines
+
+    // client handlers with queued frames, flushed once per pass through the event loop
+    // so every frame queued during the pass goes out in as few syscalls as possible
+    AChatClientHandler** pending_flushes;
+    int number_of_pending_flushes;
+    int pending_flushes_capacity;
+
+    // NULL unless the event loop uses io_uring instead of epoll
+    // then accepts and receives are multishot requests, and every flush in a pass is one sendmsg request, all submitted together
+    AChatUring* uring;
+    int uring_operations; // requests that haven't posted their last completion yet
+    bool uring_stopping; // everything on the ring is being cancelled, so no multishot request is submitted again
+    AChatRegistry closing; // disconnected client handlers waiting on their requests to complete before they are freed
+} AChatEventLoop;
+
+bool a_chat_event_loops_create(AChatServer* server, const char* port);
+// runs every event loop until the server is stopped, then drains them
+void a_chat_event_loops_run(AChatServer* server);
+void a_chat_event_loops_broadcast(AChatServer* server, AChatBuffer* frame);
+void a_chat_event_loops_broadcast_room(AChatServer* server, const char* room, size_t room_length, AChatBuffer* frame);
+// sends the frame to the client handler at the handle in the event loop's shard, if it is still there
+void a_chat_event_loops_send(AChatServer* server, int index, AChatRegistryHandle handle, AChatBuffer* frame);
+void a_chat_event_loops_destroy(AChatServer* server);
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "server/server.h"
+#include "server/mpsc_queue.h"
+#include "server/registry.h"
+#include "server/timer_wheel.h"
+
+// the threaded engine's handshake stage, a single thread that waits on every new connection's handshake at once
+// the accept loop hands it new client handlers and carries on accepting straight away,
+// so a slow or silent client only ever holds up itself until its handshake deadline passes
+typedef struct AChatHandshakeStage {
+    AChatServer* server;
+
+    pthread_t thread_id;
+    int epoll_fd;
+
+    // the accept loop hands over new client handlers through the inbox, then wakes the stage with the eventfd
+    int wake_fd;
+    atomic_bool wake_pending;
+    AChatMpscQueue inbox;
+
+    AChatRegistry registry; // client handlers still waiting on their handshake
+    AChatTimerWheel timers; // handshake deadlines
+} AChatHandshakeStage;
+
+AChatHandshakeStage* a_chat_handshake_stage_create(AChatServer* server);
+bool a_chat_handshake_stage_start(AChatHandshakeStage* stage);
+// hands a newly accepted, non-blocking client handler over to the stage, which takes ownership of it
+void a_chat_handshake_stage_submit(AChatHandshakeStage* stage, AChatClientHandler* client_handler);
+// the stage's thread stops once the server stops running, this waits for it
+void a_chat_handshake_stage_join(AChatHandshakeStage* stage);
+void a_chat_handshake_stage_destroy(AChatHandshakeStage* stage);
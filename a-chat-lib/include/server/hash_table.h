@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// an intrusive chained hash table, what the room, history, session and user tables are all built on
+// an entry is embedded in whatever it indexes, so adding one allocates nothing, and the table only links entries and
+// never frees them, that is left to its owner
+// the number of buckets is always a power of two, so an entry's bucket is just the low bits of its hash, and the table
+// grows to keep the load factor under 3/4 so lookups stay close to one comparison
+// it has no lock of its own, its owner decides how it is shared
+
+typedef struct AChatHashEntry {
+    uint32_t hash;
+    struct AChatHashEntry* next; // the next entry in the same bucket
+} AChatHashEntry;
+
+typedef struct AChatHashTable {
+    AChatHashEntry** buckets;
+    uint32_t number_of_buckets;
+    uint32_t number_of_entries;
+} AChatHashTable;
+
+// fnv-1a
+uint32_t a_chat_hash(const void* data, size_t length);
+
+// number_of_buckets must be a power of two, returns false if the buckets couldn't be allocated
+bool a_chat_hash_table_init(AChatHashTable* table, uint32_t number_of_buckets);
+// only frees the buckets, the entries still belong to whatever they are embedded in
+void a_chat_hash_table_destroy(AChatHashTable* table);
+
+// the first entry in the bucket the hash falls in, the rest follow its next, the caller compares its own keys
+AChatHashEntry* a_chat_hash_table_bucket(const AChatHashTable* table, uint32_t hash);
+// if growing the table fails the entry is still added, the table is just more loaded than it should be
+void a_chat_hash_table_insert(AChatHashTable* table, AChatHashEntry* entry, uint32_t hash);
+// the entry must be in the table
+void a_chat_hash_table_remove(AChatHashTable* table, AChatHashEntry* entry);
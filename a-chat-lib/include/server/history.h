@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "protocol/frame.h"
+#include "server/hash_table.h"
+#include "server/outbound_queue.h"
+
+// every room's most recent messages, so a client that (re)joins a room can catch up on what it missed
+// the ring keeps references to the same encrypted frames that were relayed, so keeping and replaying them copies nothing
+// and the server still never sees a message in the clear
+//
+// unlike rooms, which every epoll event loop keeps for its own shard, a room has one history for the whole server,
+// it is made by the room's first message and kept until the server closes
+
+typedef struct AChatHistory {
+    AChatHashEntry entry; // must be first so an entry can be cast back to the history
+
+    char name[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+    size_t name_length;
+
+    // relaying a message to the room holds the lock until the message is handed to every shard,
+    // so every client gets the room's messages in sequence order
+    pthread_mutex_t lock;
+
+    AChatBuffer** frames; // a ring of relayed MESSAGE frames, oldest first
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t bytes;
+    uint64_t next_sequence; // the sequence the next relayed message gets, the oldest kept one is next_sequence - count
+    struct AChatStoredRoom* stored; // where catch ups older than the ring come from, NULL without a message store
+} AChatHistory;
+
+typedef struct AChatHistoryTable {
+    pthread_rwlock_t lock; // only guards the table, each history has its own lock
+    AChatHashTable histories;
+
+    // a room's history is trimmed to whichever limit it hits first, 0 frames keeps no history
+    size_t maximum_frames;
+    size_t maximum_bytes;
+} AChatHistoryTable;
+
+bool a_chat_history_table_init(AChatHistoryTable* table, size_t maximum_frames, size_t maximum_bytes);
+void a_chat_history_table_destroy(AChatHistoryTable* table);
+AChatHistory* a_chat_history_table_find(AChatHistoryTable* table, const char* name, size_t length);
+// finds the room's history or makes it, NULL if the table keeps no history
+AChatHistory* a_chat_history_table_get(AChatHistoryTable* table, const char* name, size_t length);
+
+// keeps a reference to the frame, dropping the oldest ones past the table's limits, and returns its sequence
+// the history's lock must be held while calling this
+uint64_t a_chat_history_append(AChatHistoryTable* table, AChatHistory* history, AChatBuffer* frame);
+// queues every kept frame from sequence onwards, from the message store first if the ring doesn't go back that far,
+// stopping early if the queue fills up, and returns how many were queued
+// the history's lock must be held while calling this
+size_t a_chat_history_replay(AChatHistory* history, uint64_t sequence, AChatOutboundQueue* queue);
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "server/history.h"
+#include "server/metrics.h"
+#include "server/mpsc_queue.h"
+#include "server/outbound_queue.h"
+
+// keeps every room's relayed messages on disk, so the rooms' histories and sequence numbers survive a restart
+//
+// each room has a directory of segment files, named after the first sequence in them, that are preallocated and mapped
+// a segment is a small header followed by the relayed frames exactly as they were sent, back to back, so a catch up
+// older than the in-memory history is queued as buffers lent straight from the mapped segment
+//
+// relaying only pushes the frame onto a lock-free queue, a background thread copies everything queued into the segments
+// and commits it all at once every commit interval (group commit), so fanning out never waits on the disk
+//
+// every segment has a sparse index next to it, a sequence and its offset every A_CHAT_MESSAGE_STORE_INDEX_INTERVAL bytes,
+// written once the frames it points at are committed, so opening the store only reads the headers and the indexes,
+// plus the tail of each room's last segment after its last index entry
+
+#define A_CHAT_MESSAGE_STORE_INDEX_INTERVAL (64 * 1024)
+// the header at the start of every segment, the frames start right after it
+#define A_CHAT_MESSAGE_STORE_HEADER_SIZE 64
+
+typedef struct AChatSegmentIndexEntry {
+    uint64_t sequence;
+    uint64_t offset;
+} AChatSegmentIndexEntry;
+
+typedef struct AChatSegment {
+    atomic_int references; // the room's own, plus one for every buffer lent from the segment
+    uint64_t first_sequence;
+    uint64_t next_sequence; // the sequence after the last frame written to the segment
+
+    int fd;
+    int index_fd;
+    uint8_t* map;
+    size_t size;
+    size_t written; // the end of the frames copied in, only read under the room's lock
+    size_t committed; // the end of the frames synced to disk, only used by the background thread
+
+    // the sparse index, entries past index_committed haven't been written to the index file yet
+    AChatSegmentIndexEntry* index;
+    size_t index_count;
+    size_t index_capacity;
+    size_t index_committed;
+} AChatSegment;
+
+typedef struct AChatStoredRoom {
+    char name[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+    size_t name_length;
+    int directory_fd;
+
+    // guards the segments and their written ends, between the background thread and catch ups
+    pthread_mutex_t lock;
+    AChatSegment** segments; // oldest first
+    size_t number_of_segments;
+    size_t segments_capacity;
+
+    bool dirty; // has frames that aren't committed, only used by the background thread
+    struct AChatStoredRoom* next; // every room in the store
+} AChatStoredRoom;
+
+typedef struct AChatMessageStore {
+    int directory_fd;
+    size_t segment_bytes;
+    int segments_per_room; // the oldest segment is deleted once a room has more
+    int commit_interval_ms;
+    AChatMetrics* metrics;
+
+    // relayed frames waiting for the background thread
+    AChatMpscQueue queue;
+
+    pthread_mutex_t rooms_lock; // only guards the list of rooms
+    AChatStoredRoom* rooms;
+
+    pthread_t thread_id;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stopping;
+} AChatMessageStore;
+
+// opens or creates the store in the directory, giving every room found in it a history that carries on its sequence
+AChatMessageStore* a_chat_message_store_open(const char* path, size_t segment_bytes, int segments_per_room, int commit_interval_ms, AChatHistoryTable* history, AChatMetrics* metrics);
+// commits everything still queued before closing, NULL does nothing
+void a_chat_message_store_close(AChatMessageStore* store);
+
+// finds the room or makes its directory, NULL if that failed
+AChatStoredRoom* a_chat_message_store_room(AChatMessageStore* store, const char* name, size_t length);
+// hands a relayed frame to the background thread, never blocks
+void a_chat_message_store_append(AChatMessageStore* store, AChatStoredRoom* room, AChatBuffer* frame, uint64_t sequence);
+// queues what the room has written from *sequence on, moving *sequence past it and adding to *replayed
+// returns false if the queue filled up before the end
+bool a_chat_message_store_replay(AChatStoredRoom* room, uint64_t* sequence, AChatOutboundQueue* queue, size_t* replayed);
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+
+// the server's counters, gauges and latency histograms
+// every thread records into its own shard so hot paths never fight over a cache line, reading them adds the shards up
+
+// threads are spread over the shards round robin, with more threads than shards some of them share
+#define A_CHAT_METRICS_SHARDS 32
+
+// histograms are log-linear like HDR histograms: every power of two is split into this many linear sub-buckets,
+// so a recorded value is never off by more than 1/16th
+#define A_CHAT_HISTOGRAM_SUB_BUCKETS 16
+// values up to 2^40 ns (about 18 minutes) are tracked, anything bigger lands in the last bucket
+#define A_CHAT_HISTOGRAM_MAXIMUM_EXPONENT 40
+#define A_CHAT_HISTOGRAM_BUCKETS ((A_CHAT_HISTOGRAM_MAXIMUM_EXPONENT - 2) * A_CHAT_HISTOGRAM_SUB_BUCKETS)
+
+typedef enum AChatCounter {
+    A_CHAT_COUNTER_CONNECTIONS_ACCEPTED,
+    A_CHAT_COUNTER_HANDSHAKES_COMPLETED,
+    A_CHAT_COUNTER_HANDSHAKES_FAILED, // invalid handshakes, or the server was full
+    A_CHAT_COUNTER_HANDSHAKES_TIMED_OUT,
+    A_CHAT_COUNTER_DISCONNECTS,
+    A_CHAT_COUNTER_SLOW_CONSUMER_DISCONNECTS,
+    A_CHAT_COUNTER_FRAMES_RECEIVED,
+    A_CHAT_COUNTER_BYTES_RECEIVED,
+    A_CHAT_COUNTER_MESSAGES_RELAYED,
+    A_CHAT_COUNTER_BROADCASTS,
+    A_CHAT_COUNTER_FRAMES_QUEUED, // a broadcast to a room of n clients queues n frames
+    A_CHAT_COUNTER_FRAMES_SENT,
+    A_CHAT_COUNTER_BYTES_SENT,
+    A_CHAT_COUNTER_FRAMES_DROPPED,
+    A_CHAT_COUNTER_BYTES_DROPPED,
+    A_CHAT_COUNTER_FRAMES_COALESCED,
+    A_CHAT_COUNTER_FRAMES_REPLAYED, // queued from a room's history to a client catching up
+    A_CHAT_COUNTER_MESSAGES_STORED,
+    A_CHAT_COUNTER_MESSAGE_STORE_COMMITS, // one commit syncs every message stored since the last
+    A_CHAT_COUNTER_SESSIONS_RESUMED,
+    A_CHAT_COUNTER_SESSIONS_EXPIRED, // kept after a disconnect, but never resumed
+    A_CHAT_COUNTER_DIRECT_MESSAGES_RELAYED,
+    A_CHAT_COUNTER_DIRECT_MESSAGES_UNDELIVERED, // their recipient wasn't online
+    A_CHAT_COUNTER_PINGS_SENT, // to clients that had gone quiet
+    A_CHAT_COUNTER_CONNECTIONS_REAPED, // disconnected for sending nothing, not even a PONG, for the idle timeout
+    A_CHAT_COUNTER_FRAMES_RATE_LIMITED, // dropped for being over their client's rate limits
+    A_CHAT_COUNTER_FRAMES_ADDRESS_RATE_LIMITED, // dropped for being over their address' rate limits
+    A_CHAT_COUNTER_BYTES_RATE_LIMITED, // in frames dropped for either
+    A_CHAT_NUMBER_OF_COUNTERS,
+} AChatCounter;
+
+typedef enum AChatGauge {
+    A_CHAT_GAUGE_QUEUED_FRAMES, // waiting in every client's outbound queue
+    A_CHAT_GAUGE_QUEUED_BYTES,
+    A_CHAT_NUMBER_OF_GAUGES,
+} AChatGauge;
+
+typedef enum AChatHistogramType {
+    A_CHAT_HISTOGRAM_BROADCAST, // from a broadcast starting to a shard having queued it to all its members
+    A_CHAT_HISTOGRAM_HANDSHAKE, // from a connection being accepted to its handshake being done
+    A_CHAT_NUMBER_OF_HISTOGRAMS,
+} AChatHistogramType;
+
+typedef struct AChatHistogram {
+    _Atomic uint64_t buckets[A_CHAT_HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t maximum;
+} AChatHistogram;
+
+typedef struct AChatMetricsShard {
+    _Alignas(64) _Atomic uint64_t counters[A_CHAT_NUMBER_OF_COUNTERS];
+    _Atomic int64_t gauges[A_CHAT_NUMBER_OF_GAUGES]; // a shard's gauge can go negative, only the sum means anything
+    AChatHistogram histograms[A_CHAT_NUMBER_OF_HISTOGRAMS];
+} AChatMetricsShard;
+
+typedef struct AChatMetrics {
+    AChatMetricsShard* shards;
+} AChatMetrics;
+
+typedef struct AChatLatencyStats {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t maximum_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+} AChatLatencyStats;
+
+// a snapshot of the metrics, each value is read atomically but they aren't all read at the same instant
+typedef struct AChatServerStats {
+    int connected_clients;
+    int away_clients; // disconnected, but their session can still be resumed
+    uint64_t counters[A_CHAT_NUMBER_OF_COUNTERS];
+    int64_t gauges[A_CHAT_NUMBER_OF_GAUGES];
+    AChatLatencyStats latencies[A_CHAT_NUMBER_OF_HISTOGRAMS];
+    AChatPoolStats pool;
+} AChatServerStats;
+
+bool a_chat_metrics_init(AChatMetrics* metrics);
+void a_chat_metrics_destroy(AChatMetrics* metrics);
+
+uint64_t a_chat_metrics_now_ns(void);
+
+// metrics can be NULL for all of these, which records nothing
+void a_chat_metrics_add(AChatMetrics* metrics, AChatCounter counter, uint64_t value);
+void a_chat_metrics_gauge_add(AChatMetrics* metrics, AChatGauge gauge, int64_t value);
+void a_chat_metrics_record(AChatMetrics* metrics, AChatHistogramType histogram, uint64_t value_ns);
+
+// for histograms kept outside of the metrics, like a benchmark's, these work on them directly
+void a_chat_histogram_record(AChatHistogram* histogram, uint64_t value_ns);
+// adds the histograms together and works out their percentiles
+void a_chat_histogram_summarize(AChatHistogram* const* histograms, size_t number_of_histograms, AChatLatencyStats* latency);
+
+// fills in everything but connected_clients and away_clients, which the server keeps itself, and the pool, which belongs to the process
+void a_chat_metrics_snapshot(const AChatMetrics* metrics, AChatServerStats* stats);
+// writes the stats in prometheus' text format, returns the length it needed (like snprintf)
+size_t a_chat_metrics_format_prometheus(const AChatServerStats* stats, char* output, size_t size);
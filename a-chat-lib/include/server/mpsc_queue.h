@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdatomic.h>
+
+// an intrusive, lock-free, multi-producer single-consumer queue
+// any number of threads can push, but only the owning thread can pop
+
+typedef struct AChatMpscNode {
+    _Atomic(struct AChatMpscNode*) next;
+} AChatMpscNode;
+
+typedef struct AChatMpscQueue {
+    _Atomic(AChatMpscNode*) head; // producers push here
+    AChatMpscNode* tail; // the consumer pops here
+    AChatMpscNode stub;
+} AChatMpscQueue;
+
+void a_chat_mpsc_queue_init(AChatMpscQueue* queue);
+void a_chat_mpsc_queue_push(AChatMpscQueue* queue, AChatMpscNode* node);
+// returns NULL when the queue is empty, or when a producer is half way through a push
+AChatMpscNode* a_chat_mpsc_queue_pop(AChatMpscQueue* queue);
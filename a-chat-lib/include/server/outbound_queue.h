@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "buffer.h"
+#include "server/metrics.h"
+
+// the most frames gathered into a single sendmsg()
+#define A_CHAT_OUTBOUND_QUEUE_MAXIMUM_IOV 64
+
+// what happens when a client can't keep up and its outbound queue is full
+typedef enum AChatOverflowPolicy {
+    A_CHAT_OVERFLOW_DISCONNECT, // disconnect the slow client
+    A_CHAT_OVERFLOW_DROP_OLDEST, // drop the oldest frames that haven't started sending
+    A_CHAT_OVERFLOW_COALESCE, // merge the unsent frames into one buffer, dropping the oldest once the byte limit is hit
+} AChatOverflowPolicy;
+
+typedef enum AChatOutboundQueueResult {
+    A_CHAT_OUTBOUND_QUEUED,
+    A_CHAT_OUTBOUND_DROPPED, // the frame didn't fit even after dropping older frames
+    A_CHAT_OUTBOUND_OVERFLOW, // only with A_CHAT_OVERFLOW_DISCONNECT, the frame wasn't queued
+} AChatOutboundQueueResult;
+
+typedef enum AChatFlushResult {
+    A_CHAT_FLUSH_COMPLETE, // the queue is empty
+    A_CHAT_FLUSH_BLOCKED, // the socket is full, try again once it is writable
+    A_CHAT_FLUSH_FAILED, // the socket failed, errno is set
+} AChatFlushResult;
+
+// the frames waiting to be sent to a single client, in order
+// every queued buffer holds a reference, so a broadcast queues pointers rather than copies
+typedef struct AChatOutboundQueue {
+    AChatBuffer** buffers; // a ring that grows up to maximum_frames
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t head_offset; // how much of the buffer at the head has already been sent
+    size_t in_flight_frames; // frames at the head an asynchronous send is reading from, they stay put until it ends
+
+    size_t maximum_frames;
+    size_t maximum_bytes;
+    AChatOverflowPolicy policy;
+
+    // counters
+    size_t queued_bytes; // bytes waiting to be sent right now
+    uint64_t dropped_frames;
+    uint64_t dropped_bytes;
+    uint64_t coalesced_frames;
+
+    AChatMetrics* metrics; // where the queue reports what it sends and drops, can be NULL
+} AChatOutboundQueue;
+
+void a_chat_outbound_queue_init(AChatOutboundQueue* queue, size_t maximum_frames, size_t maximum_bytes, AChatOverflowPolicy policy, AChatMetrics* metrics);
+void a_chat_outbound_queue_destroy(AChatOutboundQueue* queue);
+// drops everything that is queued, keeping the limits and counters
+void a_chat_outbound_queue_clear(AChatOutboundQueue* queue);
+AChatOutboundQueueResult a_chat_outbound_queue_push(AChatOutboundQueue* queue, AChatBuffer* buffer);
+// sends as much of the queue as the socket takes without blocking, many frames per syscall
+AChatFlushResult a_chat_outbound_queue_flush(AChatOutboundQueue* queue, int socket);
+// for sends that complete later, like io_uring's, fills iov with the frames to send and pins them until a_chat_outbound_queue_end_send
+size_t a_chat_outbound_queue_begin_send(AChatOutboundQueue* queue, struct iovec* iov, size_t maximum);
+// releases what the send got through and unpins the rest
+void a_chat_outbound_queue_end_send(AChatOutboundQueue* queue, size_t bytes_sent);
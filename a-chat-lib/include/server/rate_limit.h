@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// token buckets kept in their virtual scheduling form (like GCRA): instead of a count of tokens and when they were last
+// topped up, a bucket is only the time it will be full again, so taking from one is a single compare and swap on one
+// value, which any number of threads can share without a lock
+//
+// each client has its own buckets, which only its own thread takes from, and the address it connects from has shared
+// ones in a fixed table every address hashes into, so a flood of addresses can't make the table grow, and the odd pair
+// of addresses that land in the same slot share a limit
+
+#define A_CHAT_RATE_LIMIT_ADDRESS_SLOTS 4096
+
+typedef struct AChatRate {
+    uint64_t interval_ns; // the time one token takes to come back, 0 for no limit
+    uint64_t burst_ns; // how far ahead of the rate a bucket can get, which is how many tokens it holds
+} AChatRate;
+
+typedef struct AChatTokenBucket {
+    _Atomic uint64_t full_at_ns; // the bucket is full from then on
+} AChatTokenBucket;
+
+typedef struct AChatAddressBuckets {
+    AChatTokenBucket messages;
+    AChatTokenBucket bytes;
+} AChatAddressBuckets;
+
+typedef struct AChatRateLimiter {
+    AChatRate client_messages;
+    AChatRate client_bytes;
+    AChatRate address_messages;
+    AChatRate address_bytes;
+    AChatAddressBuckets* addresses; // A_CHAT_RATE_LIMIT_ADDRESS_SLOTS of them, NULL unless addresses are limited
+} AChatRateLimiter;
+
+// per_second of 0 doesn't limit anything, a bucket holds burst_ms worth of tokens
+AChatRate a_chat_rate(int per_second, int burst_ms);
+
+void a_chat_token_bucket_init(AChatTokenBucket* bucket);
+// returns false if the bucket doesn't have the tokens, taking none of them
+// taking more than a whole burst only works on a full bucket, which leaves it that far behind
+bool a_chat_token_bucket_take(AChatTokenBucket* bucket, const AChatRate* rate, uint64_t tokens, uint64_t now_ns);
+// puts tokens that were taken back, for when whatever they were taken for didn't go ahead after all
+void a_chat_token_bucket_give_back(AChatTokenBucket* bucket, const AChatRate* rate, uint64_t tokens);
+
+bool a_chat_rate_limiter_init(AChatRateLimiter* limiter, AChatRate client_messages, AChatRate client_bytes, AChatRate address_messages, AChatRate address_bytes);
+void a_chat_rate_limiter_destroy(AChatRateLimiter* limiter);
+// the slot in the address table for whoever is on the other end of the socket
+uint32_t a_chat_rate_limiter_address_slot(int socket);
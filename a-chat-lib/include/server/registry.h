@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct AChatClientHandler;
+
+// a stable reference to a client handler, it stops resolving once the client handler is removed
+// even if its slot is reused, because the slot's generation changes
+typedef struct AChatRegistryHandle {
+    uint32_t slot;
+    uint32_t generation;
+} AChatRegistryHandle;
+
+typedef struct AChatRegistrySlot {
+    uint32_t generation;
+    uint32_t dense_index; // where the client handler is in the dense array
+    uint32_t next_free; // the next slot in the free list, only used while the slot is free
+    struct AChatClientHandler* client_handler; // NULL while the slot is free
+} AChatRegistrySlot;
+
+// a generational slot map of client handlers
+// inserting and removing are O(1), and the live client handlers are kept packed in a dense array to iterate over
+typedef struct AChatRegistry {
+    AChatRegistrySlot* slots;
+    uint32_t number_of_slots;
+    uint32_t free_list; // A_CHAT_REGISTRY_NONE when every slot is in use
+
+    struct AChatClientHandler** client_handlers; // dense, iterate from 0 to count
+    uint32_t* dense_slots; // the slot of each client handler in the dense array
+    uint32_t count;
+
+    uint32_t capacity; // how many slots are allocated, grows as needed
+} AChatRegistry;
+
+#define A_CHAT_REGISTRY_NONE UINT32_MAX
+
+void a_chat_registry_init(AChatRegistry* registry);
+void a_chat_registry_destroy(AChatRegistry* registry);
+bool a_chat_registry_insert(AChatRegistry* registry, struct AChatClientHandler* client_handler, AChatRegistryHandle* handle);
+bool a_chat_registry_remove(AChatRegistry* registry, AChatRegistryHandle handle);
+// returns NULL if the handle's client handler has been removed
+struct AChatClientHandler* a_chat_registry_get(const AChatRegistry* registry, AChatRegistryHandle handle);
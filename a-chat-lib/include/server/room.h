@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server/hash_table.h"
+#include "server/registry.h"
+#include "protocol/frame.h"
+
+#define A_CHAT_ROOM_MAXIMUM_PER_CLIENT 32
+
+struct AChatClientHandler;
+
+typedef struct AChatRoom {
+    AChatHashEntry entry; // must be first so an entry can be cast back to the room
+
+    char name[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+    size_t name_length;
+
+    AChatRegistry members; // the subscriber index, a broadcast to the room only walks this
+} AChatRoom;
+
+// a hash index of rooms by name, rooms are created by their first join and freed by their last leave
+// a room table is only ever used by its owner (an event loop, or the threaded engine under the server's mutex)
+typedef struct AChatRoomTable {
+    AChatHashTable rooms;
+} AChatRoomTable;
+
+// a room a client handler is in, and where the client handler is in the room's members
+typedef struct AChatRoomMembership {
+    AChatRoom* room;
+    AChatRegistryHandle handle;
+} AChatRoomMembership;
+
+bool a_chat_room_name_validate(const uint8_t* name, size_t length);
+// splits a MESSAGE or GROUP_KEY frame from a client into the room it is for and the rest of the payload
+bool a_chat_room_message_parse(const AChatFrame* frame, const char** room, size_t* room_length, const uint8_t** message, uint32_t* message_length);
+
+// splits a JOIN frame into the room and, with A_CHAT_FRAME_FLAG_SEQUENCE, the sequence to catch up from
+bool a_chat_room_join_parse(const AChatFrame* frame, const char** room, size_t* room_length, bool* catch_up, uint64_t* sequence);
+
+bool a_chat_room_table_init(AChatRoomTable* table);
+void a_chat_room_table_destroy(AChatRoomTable* table);
+AChatRoom* a_chat_room_table_find(const AChatRoomTable* table, const char* name, size_t length);
+
+// returns false if the client handler couldn't join, or was already in the room
+bool a_chat_room_join(AChatRoomTable* table, struct AChatClientHandler* client_handler, const char* name, size_t length);
+// returns false if the client handler wasn't in the room
+bool a_chat_room_leave(AChatRoomTable* table, struct AChatClientHandler* client_handler, const char* name, size_t length);
+// only reads the client handler's own memberships, so its owner can check it without touching the room table
+bool a_chat_room_is_member(const struct AChatClientHandler* client_handler, const char* name, size_t length);
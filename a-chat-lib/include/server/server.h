@@ -1,34 +1,242 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sys/socket.h>
 
-#define MAXIMUM_CLIENTS 100
+#include "buffer.h"
+#include "protocol/frame.h"
+#include "server/directory.h"
+#include "server/metrics.h"
+#include "server/outbound_queue.h"
+#include "server/history.h"
+#include "server/rate_limit.h"
+#include "server/registry.h"
+#include "server/room.h"
+#include "server/timer_wheel.h"
+
+typedef enum AChatServerEngine {
+    A_CHAT_SERVER_ENGINE_THREADED, // one blocking thread per connected client
+    A_CHAT_SERVER_ENGINE_EPOLL, // one epoll event loop per thread, each with its own shard of clients
+} AChatServerEngine;
+
+typedef struct AChatServerConfig {
+    AChatServerEngine engine;
+    int number_of_threads; // only used by the epoll engine, defaults to the number of online cpus
+    bool io_uring; // only used by the epoll engine, its event loops use io_uring instead, falling back to epoll when the kernel can't
+    int maximum_clients;
+    int listen_backlog;
+    int handshake_timeout_ms; // clients that haven't finished their handshake by then are disconnected
+
+    // a client the server hasn't heard anything from for the ping interval is sent a PING, which it answers with a PONG,
+    // so a dead connection, like one a NAT forgot or a laptop that vanished, is disconnected once it has been quiet for
+    // the idle timeout instead of holding on to its place forever, 0 turns either off
+    int ping_interval_ms;
+    int idle_timeout_ms;
+
+    // what each client, and every client from the same address together, can send before the rest is dropped, so one
+    // flooding client can't have the server send its messages on to everyone as fast as it can make them
+    // a burst of rate_limit_burst_ms worth is let through at once, 0 doesn't limit that rate at all
+    int client_messages_per_second;
+    int client_bytes_per_second;
+    int address_messages_per_second;
+    int address_bytes_per_second;
+    int rate_limit_burst_ms;
+
+    // once the server is stopped its clients are told and have this long to be sent what they still have queued, the
+    // ones that haven't been by then are disconnected anyway, 0 doesn't wait on them
+    int drain_timeout_ms;
+
+    // every client has its own bounded outbound queue, so one slow client can't hold up the others
+    int outbound_queue_maximum_frames;
+    int outbound_queue_maximum_bytes;
+    AChatOverflowPolicy overflow_policy;
+
+    // every room keeps its most recent messages for clients catching up, 0 frames keeps none
+    // a catch up is queued like any other frames, so it is cut short by the outbound queue's limits
+    int history_maximum_frames;
+    int history_maximum_bytes;
+
+    // keeps every room's messages on disk in this directory too, so catching up works across restarts, NULL to keep none
+    // needs a history, older segments than segments_per_room are deleted, and messages are synced to disk every commit interval
+    const char* message_store_path;
+    int message_store_segment_bytes;
+    int message_store_segments_per_room;
+    int message_store_commit_interval_ms;
+
+    // a client that disconnects keeps its session this long, so it can resume it without leaving its rooms, 0 keeps none
+    int session_timeout_ms;
+
+    // lets clients that ask in their handshake compress their messages, which saves bandwidth on every member of a room
+    bool compression;
+
+    const char* stats_port; // serves the stats in prometheus' text format on localhost, NULL to not serve them
+} AChatServerConfig;
+
+struct AChatEventLoop;
+struct AChatHandshakeStage;
+struct AChatStatsEndpoint;
+struct AChatMessageStore;
+struct AChatSession;
+struct AChatSessionTable;
 
 typedef struct AChatClientHandler {
     pthread_t thread_id;
-    int index;
+    AChatRegistryHandle handle; // where the client handler is in its registry
     int socket;
-    char username[512];
+    AChatUser* user; // the client's username in the server's directory, NULL until its handshake claims one
+    // sent with the handshake and passed on to the rooms the client is in, so the clients can agree on group keys
+    uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE];
+    bool has_public_key;
+    bool compression; // the client may send compressed messages
+
+    AChatOutboundQueue outbound;
+    bool overflowed; // the outbound queue overflowed with A_CHAT_OVERFLOW_DISCONNECT
+
+    bool handshake_complete;
+    uint64_t accepted_at_ns; // for timing the handshake
+    AChatFrameDecoder decoder;
+    AChatTimer timer; // the handshake deadline, then when to check if the client has gone quiet
+    uint64_t last_received_ms; // when anything was last received from the client
+    uint64_t last_ping_ms; // when the client was last sent a PING
+
+    // the client's own rate limits, and its address' slot in the server's table of shared ones
+    AChatTokenBucket messages_bucket;
+    AChatTokenBucket bytes_bucket;
+    uint32_t address_slot;
+    bool rate_limited; // the last frame from the client was dropped, so it has been told already
+
+    struct AChatSession* session; // NULL unless the server keeps sessions
+    bool resuming; // the client resumed its session, and the session's rooms haven't been rejoined yet
+
+    // the rooms the client is in, which belong to the client handler's event loop, or to the server with the threaded engine
+    AChatRoomMembership rooms[A_CHAT_ROOM_MAXIMUM_PER_CLIENT];
+    int number_of_rooms;
+
+    // only used by the threaded engine, wakes the client handler's thread to wait for its socket to be writable
+    int wake_fd;
+
+    // only used by the epoll engine
+    struct AChatEventLoop* event_loop;
+    int pending_flush_index; // -1 unless the client handler is waiting on its event loop to flush it
+
+    // only used by the epoll engine's io_uring event loops
+    int pending_operations; // requests the ring still has for the client handler, it can't be freed until they complete
+    bool closing; // disconnected, waiting on its pending operations
+    bool sending; // a sendmsg is in flight
+    struct iovec* send_iov;
+    struct msghdr send_message;
 } AChatClientHandler;
 
 typedef struct AChatServer {
-    bool running;
+    atomic_bool running;
+
+    // a_chat_server_stop wakes whichever thread is in a_chat_server_accept through the eventfd, which then drains the
+    // clients and sets draining, after which no frame from a client is handled and no new client gets in
+    int stop_fd;
+    atomic_bool draining;
+    uint64_t drain_deadline_ms; // set before draining is
+    pthread_cond_t drained; // only used by the threaded engine, signalled whenever the last client handler goes
+
+    AChatServerConfig config;
 
     int listening_socket;
 
-    AChatClientHandler clientHandlers[MAXIMUM_CLIENTS];
-    int number_of_clients;
+    // only used by the threaded engine, the epoll engine keeps its client handlers in its event loops
+    AChatRegistry registry;
+    AChatRoomTable rooms;
+    atomic_int number_of_clients;
 
     pthread_mutex_t lock;
+
+    // shared by both engines, a room's history lock is always taken before the server's mutex
+    AChatHistoryTable history;
+    struct AChatMessageStore* message_store; // NULL unless the config has a message store path
+    AChatDirectory directory; // every username in use, and where to find each user's connection
+    AChatRateLimiter rate_limiter;
+
+    AChatMetrics metrics;
+    struct AChatStatsEndpoint* stats_endpoint; // NULL unless the config has a stats port
+    struct AChatSessionTable* sessions; // NULL unless the config has a session timeout
+
+    // only used by the threaded engine, new clients wait here for their handshake so the accept loop never blocks on them
+    struct AChatHandshakeStage* handshake_stage;
+
+    // only used by the epoll engine
+    struct AChatEventLoop* event_loops;
 } AChatServer;
 
+// what to do about a client handler that may have gone quiet
+typedef enum AChatIdleResult {
+    A_CHAT_IDLE_WAIT, // nothing yet
+    A_CHAT_IDLE_PING, // send it a PING
+    A_CHAT_IDLE_REAP, // it has been quiet for the idle timeout, disconnect it
+} AChatIdleResult;
+
+typedef enum AChatAdmitResult {
+    A_CHAT_ADMIT_HANDLE, // within the rate limits
+    A_CHAT_ADMIT_DROP, // a message over the limits, drop it
+    A_CHAT_ADMIT_DISCONNECT, // any other frame over the limits, the client can't be left not knowing it was dropped
+} AChatAdmitResult;
+
 typedef struct AChatClientHandlerThreadArguments {
     AChatServer* server;
-    int client_handler_index;
+    AChatClientHandler* client_handler; // stays put until the client handler's thread destroys it
 } AChatClientHandlerThreadArguments;
 
+AChatServerConfig a_chat_server_default_config(void);
+
 AChatServer* a_chat_server_create(const char* port);
+AChatServer* a_chat_server_create_with_config(const char* port, const AChatServerConfig* config);
+// serves clients until a_chat_server_stop is called, and only returns once every client has been drained
 void a_chat_server_accept(AChatServer* server);
+// stops the server, safe to call from any thread or a signal handler
+void a_chat_server_stop(AChatServer* server);
+// sends a notice from the server to every client
 void a_chat_server_broadcast(AChatServer* server, const char* message);
+// sends a notice from the server to every client in a room
+void a_chat_server_broadcast_room(AChatServer* server, const char* room, size_t room_length, const char* message);
+// a_chat_server_accept has to have returned first, if it was called
 void a_chat_server_close(AChatServer* server);
+// safe to call from any thread while the server is running
+void a_chat_server_get_stats(AChatServer* server, AChatServerStats* stats);
+
+// shared between the server engines
+// address is NULL to listen on every address
+int a_chat_server_listen(const char* address, const char* port, bool reuse_port, int backlog);
+// fills in the client handler's username and public key, from its session if the frame resumes one
+// a username someone else has, even one whose session is only away, is refused
+bool a_chat_handshake_validate(AChatServer* server, const AChatFrame* frame, AChatClientHandler* client_handler);
+// queues the answer to a finished handshake or resume, the session's token and whether the client may compress
+// returns true if anything was queued, so the caller flushes it
+bool a_chat_client_handler_queue_answer(AChatClientHandler* client_handler);
+// tells every client the server is going and starts the drain, both engines then disconnect each client once its
+// outbound queue is empty or the drain's deadline has passed
+void a_chat_server_begin_drain(AChatServer* server);
+// checks whether the client handler has gone quiet, a PING it is told to send counts as sent
+// delay_ms is how long until it has to be checked again, or -1 if it never does
+AChatIdleResult a_chat_client_handler_check_idle(const AChatServer* server, AChatClientHandler* client_handler, uint64_t now_ms, int* delay_ms);
+// checks the frame against its client's and its address' rate limits before it is handled
+// only the frames that fan out (messages, direct messages and presence queries) are dropped when they are over them,
+// the client is told the first time in a row that happens, dropping anything else would leave it out of step with the
+// server without knowing, so it is disconnected instead
+AChatAdmitResult a_chat_client_handler_admit(AChatServer* server, AChatClientHandler* client_handler, const AChatFrame* frame);
+// the PONG answering a PING, NULL if the PING is too long to answer, the caller owns its only reference
+AChatBuffer* a_chat_server_pong_frame(const AChatFrame* frame);
+// starts a threaded client handler once its handshake is done, taking ownership of it
+void a_chat_client_handler_start(AChatServer* server, AChatClientHandler* client_handler);
+void a_chat_server_broadcast_buffer(AChatServer* server, AChatBuffer* frame);
+void a_chat_server_broadcast_frame(AChatServer* server, uint8_t type, const void* payload, uint32_t length);
+void a_chat_server_broadcast_room_buffer(AChatServer* server, const char* room, size_t room_length, AChatBuffer* frame);
+void a_chat_server_relay_message(AChatServer* server, const char* room, size_t room_length, const char* username, uint16_t flags, const uint8_t* message, uint32_t length);
+// tells a room that a client with a public key has joined or left it
+void a_chat_server_announce_member(AChatServer* server, const char* room, size_t room_length, const uint8_t* public_key, uint8_t event);
+void a_chat_server_relay_group_key(AChatServer* server, const char* room, size_t room_length, const uint8_t* public_key, const uint8_t* group_key, uint32_t length);
+// the answer to a PRESENCE frame, which only looks up the users it asks about, NULL if the frame is invalid
+// the caller owns its only reference
+AChatBuffer* a_chat_server_presence_frame(AChatServer* server, const AChatFrame* frame);
+// sends a DIRECT frame from the client handler on to each of its recipients' connections alone, wherever they are
+// the sender is told about any of them who aren't online
+void a_chat_server_relay_direct(AChatServer* server, const AChatClientHandler* client_handler, const AChatFrame* frame);
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "server/hash_table.h"
+#include "server/server.h"
+
+// every client that finishes its handshake gets a session, named by a random token the server sends it
+// when the client's connection drops its session is kept for a while instead of it leaving its rooms, nobody is told
+// it has gone, so a client that reconnects in time resumes with a single frame: no handshake, no joins, and since its
+// rooms never saw it leave, no rekeys either, it only catches up on what it missed
+//
+// a session nobody resumes expires, and its rooms are told the client has left then
+
+typedef struct AChatSession {
+    AChatHashEntry entry; // must be first so an entry can be cast back to the session
+
+    uint8_t token[A_CHAT_SESSION_TOKEN_SIZE];
+    AChatUser* user; // the session keeps the client's username taken while it is away
+    uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE];
+    bool has_public_key;
+    bool compression;
+
+    // only kept while the client is away, the rooms it was in and the sequence to catch each one up from
+    bool detached;
+    uint64_t expires_at_ms;
+    char rooms[A_CHAT_ROOM_MAXIMUM_PER_CLIENT][A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+    size_t room_lengths[A_CHAT_ROOM_MAXIMUM_PER_CLIENT];
+    uint64_t sequences[A_CHAT_ROOM_MAXIMUM_PER_CLIENT];
+    int number_of_rooms;
+} AChatSession;
+
+// shared by both engines, an attached session belongs to its client handler, only detached ones are expired
+typedef struct AChatSessionTable {
+    AChatServer* server;
+
+    pthread_mutex_t lock;
+    AChatHashTable sessions;
+
+    // expires detached sessions, the same way the log's background thread flushes
+    pthread_t thread_id;
+    pthread_cond_t wake;
+    bool stopping;
+} AChatSessionTable;
+
+AChatSessionTable* a_chat_session_table_create(AChatServer* server);
+void a_chat_session_table_destroy(AChatSessionTable* table);
+
+// gives a client handler that just finished its handshake a new session, returns false if it couldn't
+bool a_chat_session_table_open(AChatSessionTable* table, AChatClientHandler* client_handler);
+// reattaches the detached session named in a RESUME frame to the client handler, handing it the session's username back
+// and filling in its public key
+// the rooms to rejoin are left in the session, returns false if there is no such session to resume
+bool a_chat_session_table_resume(AChatSessionTable* table, const AChatFrame* frame, AChatClientHandler* client_handler);
+// keeps the rooms the disconnecting client handler is in, and where to catch each one up from, in its session
+void a_chat_session_table_save_rooms(AChatSessionTable* table, AChatClientHandler* client_handler);
+// keeps the disconnecting client handler's session for it to resume, once its rooms are saved
+// the session takes the client handler's username over, so nothing can use it through the client handler after this
+void a_chat_session_table_detach(AChatSessionTable* table, AChatClientHandler* client_handler);
+// ends the client handler's session for good, like when the client closes on purpose
+void a_chat_session_table_end(AChatSessionTable* table, AChatClientHandler* client_handler);
+
+// a SESSION frame with the client handler's token, the caller owns its only reference
+AChatBuffer* a_chat_session_frame(const AChatClientHandler* client_handler);
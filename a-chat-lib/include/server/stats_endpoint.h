@@ -0,0 +1,18 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "server/server.h"
+
+// serves the server's stats in prometheus' text format over http, only on localhost
+// it answers one request at a time on its own thread, so a scrape never touches the server's hot paths
+typedef struct AChatStatsEndpoint {
+    AChatServer* server;
+
+    pthread_t thread_id;
+    int listening_socket;
+} AChatStatsEndpoint;
+
+AChatStatsEndpoint* a_chat_stats_endpoint_create(AChatServer* server, const char* port);
+// the endpoint's thread stops once the server stops running, this waits for it
+void a_chat_stats_endpoint_destroy(AChatStatsEndpoint* endpoint);
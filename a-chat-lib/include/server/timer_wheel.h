@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// a hierarchical timer wheel, timers are bucketed by the tick they expire on so scheduling, cancelling and expiring are O(1)
+// each level's slots cover a whole turn of the level below, a timer starts in the lowest level its delay fits in and is
+// moved down a level each time the wheel reaches its slot, so it is only ever looked at once per level on its way to
+// expiring, however many turns away it is, rather than on every turn like a single wheel would
+// timers further away than the top level reaches wait in its last slot, and are put back where they belong from there
+// a timer wheel is only ever used by one thread, so it needs no locking
+
+#define A_CHAT_TIMER_WHEEL_LEVELS 4
+#define A_CHAT_TIMER_WHEEL_SLOT_BITS 6
+#define A_CHAT_TIMER_WHEEL_SLOTS (1 << A_CHAT_TIMER_WHEEL_SLOT_BITS) // in each level
+
+typedef struct AChatTimer {
+    struct AChatTimer* next;
+    struct AChatTimer* previous; // NULL while the timer isn't scheduled
+    uint64_t expires; // the tick the timer expires on
+    void* data; // whatever owns the timer
+} AChatTimer;
+
+typedef struct AChatTimerWheel {
+    AChatTimer slots[A_CHAT_TIMER_WHEEL_LEVELS][A_CHAT_TIMER_WHEEL_SLOTS]; // the head of each slot's circular list
+    AChatTimer expired; // the head of the timers that have expired but haven't been handed out yet
+
+    uint64_t tick_ms;
+    uint64_t current_tick; // the next tick to expire, every tick before it has been expired already
+    size_t number_of_timers;
+} AChatTimerWheel;
+
+uint64_t a_chat_timer_now_ms(void);
+
+void a_chat_timer_init(AChatTimer* timer, void* data);
+bool a_chat_timer_is_scheduled(const AChatTimer* timer);
+
+void a_chat_timer_wheel_init(AChatTimerWheel* wheel, uint64_t tick_ms, uint64_t now_ms);
+// scheduling a timer that is already scheduled moves it
+void a_chat_timer_wheel_schedule(AChatTimerWheel* wheel, AChatTimer* timer, uint64_t now_ms, uint64_t delay_ms);
+void a_chat_timer_wheel_cancel(AChatTimerWheel* wheel, AChatTimer* timer);
+// hands out the expired timers one at a time, returns NULL once there are none left
+AChatTimer* a_chat_timer_wheel_expire(AChatTimerWheel* wheel, uint64_t now_ms);
+// how long the owner can wait before the next tick has to be expired, capped at maximum_ms
+int a_chat_timer_wheel_timeout(const AChatTimerWheel* wheel, uint64_t now_ms, int maximum_ms);
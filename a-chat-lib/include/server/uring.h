@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+// a thin wrapper around the raw io_uring system calls, only what the event loops need
+// a ring is only ever used by the thread that enabled it, so it needs no locking
+//
+// received data goes into a ring of provided buffers, so a multishot recv picks a buffer only once data arrives
+// instead of every client holding one while it is idle
+
+typedef struct AChatUring {
+    int fd;
+
+    // the submission queue, sqes are filled in up to sq_local_tail and handed to the kernel on the next submit
+    void* sq_ring;
+    size_t sq_ring_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    // the completion queue
+    void* cq_ring;
+    size_t cq_ring_size;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    // the provided buffer ring, buffer group 0
+    struct io_uring_buf_ring* buffer_ring;
+    size_t buffer_ring_size;
+    uint8_t* buffers;
+    unsigned number_of_buffers;
+    size_t buffer_size;
+    uint16_t buffer_ring_tail;
+} AChatUring;
+
+// true if the kernel has everything the event loops use, checked once by setting up a small ring
+bool a_chat_uring_is_supported(void);
+
+// the ring starts disabled, so a_chat_uring_enable must be called by the thread that will use it
+bool a_chat_uring_init(AChatUring* uring, unsigned entries, unsigned number_of_buffers, size_t buffer_size);
+bool a_chat_uring_enable(AChatUring* uring);
+void a_chat_uring_destroy(AChatUring* uring);
+
+// returns a cleared sqe, submitting whatever is queued first if the submission queue is full
+struct io_uring_sqe* a_chat_uring_get_sqe(AChatUring* uring);
+// submits every queued sqe and waits up to timeout_ms for at least one completion, -1 waits forever
+bool a_chat_uring_submit_and_wait(AChatUring* uring, int timeout_ms);
+// returns the next completion, or NULL once there are none left, each one has to be marked as seen
+struct io_uring_cqe* a_chat_uring_peek(AChatUring* uring);
+void a_chat_uring_seen(AChatUring* uring);
+
+uint8_t* a_chat_uring_buffer(AChatUring* uring, uint16_t id);
+// gives a buffer a completion picked back to the kernel
+void a_chat_uring_recycle_buffer(AChatUring* uring, uint16_t id);
+
+void a_chat_uring_prepare_accept_multishot(struct io_uring_sqe* sqe, int socket, uint64_t user_data);
+// every completion carries one of the provided buffers
+void a_chat_uring_prepare_receive_multishot(struct io_uring_sqe* sqe, int socket, uint64_t user_data);
+void a_chat_uring_prepare_send_message(struct io_uring_sqe* sqe, int socket, const struct msghdr* message, uint64_t user_data);
+void a_chat_uring_prepare_poll_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data);
+// cancels every request submitted with target_user_data, only failures post a completion
+void a_chat_uring_prepare_cancel(struct io_uring_sqe* sqe, uint64_t target_user_data, uint64_t user_data);
+// cancels every request on the ring
+void a_chat_uring_prepare_cancel_all(struct io_uring_sqe* sqe, uint64_t user_data);
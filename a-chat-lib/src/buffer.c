@@ -0,0 +1,51 @@
+#include "buffer.h"
+
+#include <stdatomic.h>
+
+#include "pool.h"
+
+AChatBuffer* a_chat_buffer_create(size_t length) {
+    // a_chat_pool_alloc logs the correct error already
+    AChatBuffer* buffer = a_chat_pool_alloc(sizeof(AChatBuffer) + length);
+    if (!buffer) { return NULL; }
+
+    atomic_init(&buffer->references, 1);
+    buffer->length = length;
+    buffer->data = buffer->storage;
+    buffer->release = NULL;
+    buffer->owner = NULL;
+
+    return buffer;
+}
+
+AChatBuffer* a_chat_buffer_wrap(uint8_t* data, size_t length, void (*release)(void* owner), void* owner) {
+    // a_chat_pool_alloc logs the correct error already
+    AChatBuffer* buffer = a_chat_pool_alloc(sizeof(AChatBuffer));
+    if (!buffer) { return NULL; }
+
+    atomic_init(&buffer->references, 1);
+    buffer->length = length;
+    buffer->data = data;
+    buffer->release = release;
+    buffer->owner = owner;
+
+    return buffer;
+}
+
+AChatBuffer* a_chat_buffer_acquire(AChatBuffer* buffer) {
+    // taking a new reference needs no ordering, the caller already has one
+    atomic_fetch_add_explicit(&buffer->references, 1, memory_order_relaxed);
+    return buffer;
+}
+
+void a_chat_buffer_release(AChatBuffer* buffer) {
+    if (!buffer) { return; }
+
+    // the last reference frees the buffer, so every other release has to happen before it
+    if (atomic_fetch_sub_explicit(&buffer->references, 1, memory_order_acq_rel) == 1) {
+        if (buffer->release) {
+            buffer->release(buffer->owner);
+        }
+        a_chat_pool_free(buffer);
+    }
+}
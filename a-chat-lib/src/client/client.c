@@ -1,23 +1,158 @@
 #include "client/client.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/random.h>
 
+#include "client/group_key.h"
+#include "crypto/aes_gcm.h"
 #include "log.h"
+#include "pool.h"
+#include "protocol/frame.h"
+#include "protocol/lz4.h"
+
+static uint64_t a_chat_client_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+static bool a_chat_client_reset_nonce(AChatClient* client) {
+    if (getrandom(client->nonce_prefix, sizeof(client->nonce_prefix), 0) != sizeof(client->nonce_prefix)) {
+        a_chat_log_error_errno("Failed to generate nonce");
+        return false;
+    }
+    client->nonce_counter = 0;
+
+    return true;
+}
+
+// connects a new socket to the server, returns -1 if that failed
+static int a_chat_client_connect(const char* ip_address, const char* port) {
+    // get all the ip address related infomation for us
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC; // allows for either IPv4 or IPv6, it doesnt matter to us
+    hints.ai_socktype = SOCK_STREAM; // use TCP
+
+    struct addrinfo* address_info;
+    int status; // used for error checking
+    if ((status = getaddrinfo(ip_address, port, &hints, &address_info)) != 0) {
+        a_chat_log_error_gai_strerror("Failed to get address infomation", status);
+        return -1;
+    }
+
+    // create the client socket with the correct ip infomation
+    int client_socket = socket(address_info->ai_family, address_info->ai_socktype, address_info->ai_protocol);
+    if (client_socket == -1) {
+        a_chat_log_error_errno("Failed to create client socket");
+
+        freeaddrinfo(address_info);
+        return -1;
+    }
+
+    // connect to the server using the client socket
+    if (connect(client_socket, address_info->ai_addr, address_info->ai_addrlen) == -1) {
+        a_chat_log_error_errno("Failed to connect to server");
+
+        close(client_socket);
+        freeaddrinfo(address_info);
+        return -1;
+    }
+
+    // free the address infomation as it is no longer needed
+    freeaddrinfo(address_info);
+
+    // the sender thread already batches frames, so nagle would only add a delay to each batch
+    int yes = 1;
+    if (setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1) {
+        a_chat_log_warning("Failed to disable nagle's algorithm on client socket");
+    }
+
+    return client_socket;
+}
+
+// makes room for one more frame in the send queue, the client's lock must be held while calling this
+static bool a_chat_client_reserve_frame(AChatClient* client) {
+    if (client->send_queue_count == client->send_queue_capacity) {
+        size_t new_capacity = client->send_queue_capacity * 2;
+        AChatBuffer** new_queue = malloc(sizeof(AChatBuffer*) * new_capacity);
+        if (!new_queue) {
+            a_chat_log_error("Failed to allocate memory for send queue");
+            return false;
+        }
+
+        for (size_t i = 0; i < client->send_queue_count; i++) {
+            new_queue[i] = client->send_queue[(client->send_queue_head + i) % client->send_queue_capacity];
+        }
+        free(client->send_queue);
+        client->send_queue = new_queue;
+        client->send_queue_capacity = new_capacity;
+        client->send_queue_head = 0;
+    }
+
+    return true;
+}
+
+// takes over the caller's reference to the frame, the client's lock must be held while calling this
+static bool a_chat_client_push_frame(AChatClient* client, AChatBuffer* frame) {
+    if (!a_chat_client_reserve_frame(client)) { return false; }
+
+    client->send_queue[(client->send_queue_head + client->send_queue_count) % client->send_queue_capacity] = frame;
+    client->send_queue_count++;
+    if (frame->data[1] == A_CHAT_FRAME_MESSAGE) {
+        client->queued_messages++;
+    }
+    pthread_cond_signal(&client->sendable);
+
+    return true;
+}
+
+// the client's lock must be held while calling this
+static bool a_chat_client_queue_frame(AChatClient* client, uint8_t type, uint16_t flags, const void* payload, uint32_t length) {
+    // a_chat_frame_create logs the correct error already
+    AChatBuffer* frame = a_chat_frame_create(type, flags, payload, length);
+    if (!frame) { return false; }
+
+    if (!a_chat_client_push_frame(client, frame)) {
+        a_chat_buffer_release(frame);
+        return false;
+    }
+
+    return true;
+}
+
+// the client's lock must be held while calling this
+static void a_chat_client_clear_queue(AChatClient* client) {
+    for (size_t i = 0; i < client->send_queue_count; i++) {
+        a_chat_buffer_release(client->send_queue[(client->send_queue_head + i) % client->send_queue_capacity]);
+    }
+    client->send_queue_head = 0;
+    client->send_queue_count = 0;
+    client->queued_messages = 0;
+}
 
 static bool a_chat_client_send_handshake(AChatClient* client) {
-    char handshake_message[1024] = "a-chat ";
+    // the public key goes after the username, so the rooms the client joins can wrap their group keys for it
+    char handshake_message[1024 + A_CHAT_PUBLIC_KEY_SIZE] = "a-chat ";
     strcat(handshake_message, client->username);
+    size_t handshake_length = strlen(handshake_message);
+    memcpy(handshake_message + handshake_length, client->keys.public_key, A_CHAT_PUBLIC_KEY_SIZE);
+    handshake_length += A_CHAT_PUBLIC_KEY_SIZE;
 
-    int bytes_sent = send(client->socket, handshake_message, strlen(handshake_message), 0);
-    if (bytes_sent == -1) {
-        a_chat_log_error_errno("Failed to send handshake to server");
+    uint16_t flags = A_CHAT_FRAME_FLAG_PUBLIC_KEY | (client->config.compression ? A_CHAT_FRAME_FLAG_COMPRESSED : 0);
+    if (!a_chat_client_queue_frame(client, A_CHAT_FRAME_HANDSHAKE, flags, handshake_message, handshake_length)) {
+        a_chat_log_error("Failed to send handshake to server");
 
         return false;
     }
@@ -25,112 +160,1384 @@ static bool a_chat_client_send_handshake(AChatClient* client) {
     return true;
 }
 
+// the additional authenticated data binds a message to its room and sender, so the server can't move it to another room
+// or pass it off as someone else's, and to whether it is compressed, so the server can't flip the flag either
+static size_t a_chat_client_build_aad(uint8_t* aad, const char* room, size_t room_length, const char* username, size_t username_length, bool compressed) {
+    aad[0] = (uint8_t) (room_length >> 8);
+    aad[1] = (uint8_t) room_length;
+    memcpy(aad + 2, room, room_length);
+    aad += 2 + room_length;
+    aad[0] = (uint8_t) (username_length >> 8);
+    aad[1] = (uint8_t) username_length;
+    memcpy(aad + 2, username, username_length);
+    if (!compressed) {
+        return 2 + room_length + 2 + username_length;
+    }
+
+    // uncompressed messages don't have it, so they stay the same as they always were
+    aad[2 + username_length] = 1;
+    return 2 + room_length + 2 + username_length + 1;
+}
+
+// binds a direct message's key, wrapped for one of its recipients, to its sender and that recipient, so the server can't
+// pass it off as someone else's
+static void a_chat_client_build_wrap_aad(uint8_t* aad, const uint8_t* sender, const uint8_t* recipient) {
+    memcpy(aad, sender, A_CHAT_PUBLIC_KEY_SIZE);
+    memcpy(aad + A_CHAT_PUBLIC_KEY_SIZE, recipient, A_CHAT_PUBLIC_KEY_SIZE);
+}
+
+// binds a direct message to its sender and its routing header, so the server can't pass it off as someone else's or
+// change who else it says it was sent to, and to whether it is compressed
+static size_t a_chat_client_build_direct_aad(uint8_t* aad, const uint8_t* sender, const uint8_t* recipients, size_t recipients_length, bool compressed) {
+    memcpy(aad, sender, A_CHAT_PUBLIC_KEY_SIZE);
+    memcpy(aad + A_CHAT_PUBLIC_KEY_SIZE, recipients, recipients_length);
+    if (!compressed) {
+        return A_CHAT_PUBLIC_KEY_SIZE + recipients_length;
+    }
+
+    aad[A_CHAT_PUBLIC_KEY_SIZE + recipients_length] = 1;
+    return A_CHAT_PUBLIC_KEY_SIZE + recipients_length + 1;
+}
+
+// the client's prefix then the next count, the client's lock must be held while calling this
+static void a_chat_client_write_nonce(AChatClient* client, uint8_t nonce[A_CHAT_AES_GCM_NONCE_SIZE]) {
+    memcpy(nonce, client->nonce_prefix, sizeof(client->nonce_prefix));
+    uint32_t counter = client->nonce_counter++;
+    nonce[8] = (uint8_t) (counter >> 24);
+    nonce[9] = (uint8_t) (counter >> 16);
+    nonce[10] = (uint8_t) (counter >> 8);
+    nonce[11] = (uint8_t) counter;
+}
+
+// compressed before it is encrypted, ciphertext wouldn't compress at all, and only if it actually comes out smaller
+// returns NULL if the message should be sent as it is, otherwise the caller frees what is returned
+// the client's lock must be held while calling this
+static uint8_t* a_chat_client_compress(AChatClient* client, const uint8_t* message, size_t length, size_t* compressed_length) {
+    if (!client->compressing || length < (size_t) client->config.compression_threshold || length == 0) { return NULL; }
+
+    // a_chat_pool_alloc logs the correct error already, the message is just sent as it is then
+    uint8_t* compressed = a_chat_pool_alloc(length);
+    *compressed_length = compressed ? a_chat_lz4_compress(message, length, compressed, length) : 0;
+    if (*compressed_length == 0) {
+        a_chat_pool_free(compressed);
+        return NULL;
+    }
+
+    return compressed;
+}
+
+// takes over the decrypted message, returns what it decompresses to or NULL if it doesn't
+static uint8_t* a_chat_client_decompress(uint8_t* plaintext, size_t* length) {
+    // no message can be longer than a frame, whatever the header claims
+    size_t decompressed_length = 0;
+    uint8_t* decompressed = NULL;
+    if (a_chat_lz4_decompressed_length(plaintext, *length, &decompressed_length) && decompressed_length <= A_CHAT_FRAME_MAXIMUM_LENGTH) {
+        // a_chat_pool_alloc logs the correct error already
+        decompressed = a_chat_pool_alloc(decompressed_length ? decompressed_length : 1);
+    }
+    if (decompressed && !a_chat_lz4_decompress(plaintext, *length, decompressed, decompressed_length)) {
+        a_chat_pool_free(decompressed);
+        decompressed = NULL;
+    }
+
+    a_chat_pool_free(plaintext);
+    *length = decompressed_length;
+    return decompressed;
+}
+
+static void a_chat_client_print_message(AChatClient* client, uint16_t flags, const char* room, size_t room_length, const char* username, size_t username_length, const uint8_t* message, size_t message_length) {
+    if (!(flags & A_CHAT_FRAME_FLAG_ENCRYPTED)) {
+        printf("#%.*s [%.*s] (unencrypted) %.*s\n", (int) room_length, room, (int) username_length, username, (int) message_length, (const char*) message);
+        return;
+    }
+
+    if (message_length < 4 + A_CHAT_AES_GCM_NONCE_SIZE + A_CHAT_AES_GCM_TAG_SIZE) {
+        printf("#%.*s [%.*s] (message could not be decrypted)\n", (int) room_length, room, (int) username_length, username);
+        return;
+    }
+
+    // the epoch says which of the room's group keys the message was encrypted with
+    uint32_t epoch = ((uint32_t) message[0] << 24) | ((uint32_t) message[1] << 16) | ((uint32_t) message[2] << 8) | message[3];
+    message += 4;
+    message_length -= 4;
+
+    pthread_mutex_lock(&client->lock);
+    const AChatAesGcm* cipher = a_chat_group_keys_cipher(&client->keys, room, room_length, epoch);
+    if (!cipher) {
+        pthread_mutex_unlock(&client->lock);
+        printf("#%.*s [%.*s] (message could not be decrypted)\n", (int) room_length, room, (int) username_length, username);
+        return;
+    }
+
+    const uint8_t* nonce = message;
+    const uint8_t* ciphertext = message + A_CHAT_AES_GCM_NONCE_SIZE;
+    size_t length = message_length - A_CHAT_AES_GCM_NONCE_SIZE - A_CHAT_AES_GCM_TAG_SIZE;
+    const uint8_t* tag = ciphertext + length;
+
+    uint8_t aad[2 + A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 2 + 512 + 1];
+    if (room_length > A_CHAT_ROOM_NAME_MAXIMUM_LENGTH || username_length > 512) {
+        pthread_mutex_unlock(&client->lock);
+        return;
+    }
+    bool compressed = (flags & A_CHAT_FRAME_FLAG_COMPRESSED) != 0;
+    size_t aad_length = a_chat_client_build_aad(aad, room, room_length, username, username_length, compressed);
+
+    // a_chat_pool_alloc logs the correct error already
+    uint8_t* plaintext = a_chat_pool_alloc(length ? length : 1);
+    if (!plaintext) {
+        pthread_mutex_unlock(&client->lock);
+        return;
+    }
+
+    bool decrypted = a_chat_aes_gcm_decrypt(cipher, nonce, aad, aad_length, ciphertext, length, tag, plaintext);
+    pthread_mutex_unlock(&client->lock);
+
+    // the message was compressed before it was encrypted, so it is decompressed after
+    if (decrypted && compressed) {
+        plaintext = a_chat_client_decompress(plaintext, &length);
+        decrypted = plaintext != NULL;
+    }
+
+    if (decrypted) {
+        printf("#%.*s [%.*s] %.*s\n", (int) room_length, room, (int) username_length, username, (int) length, (const char*) plaintext);
+    } else {
+        printf("#%.*s [%.*s] (message could not be decrypted)\n", (int) room_length, room, (int) username_length, username);
+    }
+
+    a_chat_pool_free(plaintext);
+}
+
+static void a_chat_client_print_direct(AChatClient* client, uint16_t flags, const char* username, size_t username_length, const uint8_t* sender, const uint8_t* recipients, size_t recipients_length, const uint8_t* message, size_t message_length) {
+    // who else it was sent to, in the order the sender listed them, with this client as "you"
+    char label[1024];
+    int label_length = snprintf(label, sizeof(label), "%.*s -> ", (int) username_length, username);
+    int number_of_recipients = recipients[0];
+    int own_index = -1;
+    const uint8_t* recipient = recipients + 1;
+    for (int i = 0; i < number_of_recipients; i++) {
+        size_t recipient_length = ((size_t) recipient[0] << 8) | recipient[1];
+        bool own = recipient_length == strlen(client->username) && memcmp(recipient + 2, client->username, recipient_length) == 0;
+        if (own && own_index == -1) {
+            own_index = i;
+        }
+        if (label_length < (int) sizeof(label)) {
+            label_length += snprintf(label + label_length, sizeof(label) - label_length, i > 0 ? ", %.*s" : "%.*s", own ? 3 : (int) recipient_length, own ? "you" : (const char*) recipient + 2);
+        }
+        recipient += 2 + recipient_length;
+    }
+
+    if (!(flags & A_CHAT_FRAME_FLAG_ENCRYPTED)) {
+        printf("[%s] (unencrypted) %.*s\n", label, (int) message_length, (const char*) message);
+        return;
+    }
+
+    // the message key wrapped for each recipient comes first, in the same order as the recipients
+    size_t wrapped_length = (size_t) number_of_recipients * A_CHAT_CLIENT_DIRECT_ENTRY_SIZE;
+    if (own_index == -1 || message_length < wrapped_length + A_CHAT_AES_GCM_NONCE_SIZE + A_CHAT_AES_GCM_TAG_SIZE) {
+        printf("[%s] (message could not be decrypted)\n", label);
+        return;
+    }
+
+    // the key is copied into the cipher, as the peer keys can move once the lock is let go
+    pthread_mutex_lock(&client->lock);
+    const uint8_t* direct_key = a_chat_group_keys_direct_key(&client->keys, sender);
+    if (!direct_key) {
+        pthread_mutex_unlock(&client->lock);
+        printf("[%s] (message could not be decrypted)\n", label);
+        return;
+    }
+    AChatAesGcm wrap;
+    a_chat_aes_gcm_init(&wrap, direct_key);
+    pthread_mutex_unlock(&client->lock);
+
+    const uint8_t* entry = message + (size_t) own_index * A_CHAT_CLIENT_DIRECT_ENTRY_SIZE;
+    uint8_t wrap_aad[A_CHAT_PUBLIC_KEY_SIZE * 2];
+    a_chat_client_build_wrap_aad(wrap_aad, sender, client->keys.public_key);
+    uint8_t message_key[A_CHAT_AES_GCM_KEY_SIZE];
+    bool unwrapped = a_chat_aes_gcm_decrypt(&wrap, entry, wrap_aad, sizeof(wrap_aad), entry + A_CHAT_AES_GCM_NONCE_SIZE, A_CHAT_AES_GCM_KEY_SIZE, entry + A_CHAT_AES_GCM_NONCE_SIZE + A_CHAT_AES_GCM_KEY_SIZE, message_key);
+    a_chat_aes_gcm_destroy(&wrap);
+    if (!unwrapped) {
+        printf("[%s] (message could not be decrypted)\n", label);
+        return;
+    }
+
+    const uint8_t* nonce = message + wrapped_length;
+    const uint8_t* ciphertext = nonce + A_CHAT_AES_GCM_NONCE_SIZE;
+    size_t length = message_length - wrapped_length - A_CHAT_AES_GCM_NONCE_SIZE - A_CHAT_AES_GCM_TAG_SIZE;
+    const uint8_t* tag = ciphertext + length;
+    bool compressed = (flags & A_CHAT_FRAME_FLAG_COMPRESSED) != 0;
+
+    // a_chat_pool_alloc logs the correct error already
+    uint8_t* aad = a_chat_pool_alloc(A_CHAT_PUBLIC_KEY_SIZE + recipients_length + 1);
+    uint8_t* plaintext = a_chat_pool_alloc(length ? length : 1);
+    bool decrypted = false;
+    if (aad && plaintext) {
+        AChatAesGcm cipher;
+        a_chat_aes_gcm_init(&cipher, message_key);
+        size_t aad_length = a_chat_client_build_direct_aad(aad, sender, recipients, recipients_length, compressed);
+        decrypted = a_chat_aes_gcm_decrypt(&cipher, nonce, aad, aad_length, ciphertext, length, tag, plaintext);
+        a_chat_aes_gcm_destroy(&cipher);
+    }
+    explicit_bzero(message_key, sizeof(message_key));
+    a_chat_pool_free(aad);
+
+    if (decrypted && compressed) {
+        plaintext = a_chat_client_decompress(plaintext, &length);
+        decrypted = plaintext != NULL;
+    }
+
+    if (decrypted) {
+        printf("[%s] %.*s\n", label, (int) length, (const char*) plaintext);
+    } else {
+        printf("[%s] (message could not be decrypted)\n", label);
+    }
+
+    a_chat_pool_free(plaintext);
+}
+
+// asks the server about the query's users, the client's lock must be held while calling this
+static bool a_chat_client_send_query(AChatClient* client, const AChatClientQuery* query) {
+    // a PRESENCE frame is the users without their count in front
+    if (!a_chat_client_queue_frame(client, A_CHAT_FRAME_PRESENCE, 0, query->recipients + 1, query->recipients_length - 1)) {
+        a_chat_log_error("Failed to send presence query to server");
+        return false;
+    }
+
+    return true;
+}
+
+// asks the server about the users now, or once the client is back while reconnecting
+// the query takes over the recipients and the message, even if it fails
+// the client's lock must be held while calling this
+static bool a_chat_client_add_query(AChatClient* client, uint8_t* recipients, size_t recipients_length, char* message) {
+    if (client->number_of_queries >= A_CHAT_CLIENT_MAXIMUM_QUERIES) {
+        a_chat_log_error("Failed to ask the server, too many questions are waiting on its answers");
+
+        free(recipients);
+        free(message);
+        return false;
+    }
+
+    AChatClientQuery* query = &client->queries[client->number_of_queries];
+    query->recipients = recipients;
+    query->recipients_length = recipients_length;
+    query->message = message;
+    // a_chat_client_send_query logs the correct error already
+    if (client->connected && !a_chat_client_send_query(client, query)) {
+        free(recipients);
+        free(message);
+        return false;
+    }
+    client->number_of_queries++;
+
+    return true;
+}
+
+// encodes the usernames as a routing header, returns NULL if any of them are invalid, otherwise the caller frees it
+static uint8_t* a_chat_client_encode_recipients(const char* const* usernames, int number_of_usernames, size_t* length) {
+    if (number_of_usernames > A_CHAT_DIRECT_MAXIMUM_RECIPIENTS) {
+        a_chat_log_error("Too many recipients!");
+        return NULL;
+    }
+
+    size_t recipients_length = 1;
+    for (int i = 0; i < number_of_usernames; i++) {
+        size_t username_length = strlen(usernames[i]);
+        if (username_length == 0 || username_length >= 512) {
+            a_chat_log_error("Username is invalid!");
+            return NULL;
+        }
+        recipients_length += 2 + username_length;
+    }
+
+    uint8_t* recipients = malloc(recipients_length);
+    if (!recipients) {
+        a_chat_log_error("Failed to allocate memory for recipients");
+        return NULL;
+    }
+
+    recipients[0] = (uint8_t) number_of_usernames;
+    uint8_t* recipient = recipients + 1;
+    for (int i = 0; i < number_of_usernames; i++) {
+        size_t username_length = strlen(usernames[i]);
+        recipient[0] = (uint8_t) (username_length >> 8);
+        recipient[1] = (uint8_t) username_length;
+        memcpy(recipient + 2, usernames[i], username_length);
+        recipient += 2 + username_length;
+    }
+    *length = recipients_length;
+
+    return recipients;
+}
+
+// encrypts a direct message once with a new key, which is wrapped for each recipient with the key shared with them,
+// then queues it, so one frame is enough however many recipients there are
+// the client's lock must be held while calling this
+static bool a_chat_client_queue_direct(AChatClient* client, const uint8_t* recipients, size_t recipients_length, const uint8_t (*public_keys)[A_CHAT_PUBLIC_KEY_SIZE], const char* message) {
+    int number_of_recipients = recipients[0];
+
+    // a_chat_group_keys_direct_key logs the correct error already
+    for (int i = 0; i < number_of_recipients; i++) {
+        if (!a_chat_group_keys_direct_key(&client->keys, public_keys[i])) { return false; }
+    }
+
+    // every wrap and the message itself take a nonce each, a fresh prefix keeps them unique once the counter runs out
+    if (client->nonce_counter > UINT32_MAX - (uint32_t) number_of_recipients - 1 && !a_chat_client_reset_nonce(client)) { return false; }
+
+    uint8_t message_key[A_CHAT_AES_GCM_KEY_SIZE];
+    if (getrandom(message_key, sizeof(message_key), 0) != sizeof(message_key)) {
+        a_chat_log_error_errno("Failed to generate message key");
+        return false;
+    }
+
+    size_t message_length = strlen(message);
+    const uint8_t* plaintext = (const uint8_t*) message;
+    size_t plaintext_length = message_length;
+
+    size_t compressed_length = 0;
+    uint8_t* compressed = a_chat_client_compress(client, plaintext, message_length, &compressed_length);
+    if (compressed) {
+        plaintext = compressed;
+        plaintext_length = compressed_length;
+    }
+
+    size_t wrapped_length = (size_t) number_of_recipients * A_CHAT_CLIENT_DIRECT_ENTRY_SIZE;
+    size_t payload_length = recipients_length + wrapped_length + A_CHAT_AES_GCM_NONCE_SIZE + plaintext_length + A_CHAT_AES_GCM_TAG_SIZE;
+    if (payload_length > A_CHAT_FRAME_MAXIMUM_LENGTH) {
+        a_chat_log_error("Failed to send direct message, it is too long");
+
+        explicit_bzero(message_key, sizeof(message_key));
+        a_chat_pool_free(compressed);
+        return false;
+    }
+    // a_chat_buffer_create and a_chat_pool_alloc log the correct error already
+    AChatBuffer* frame = a_chat_buffer_create(A_CHAT_FRAME_HEADER_SIZE + payload_length);
+    uint8_t* aad = a_chat_pool_alloc(A_CHAT_PUBLIC_KEY_SIZE + recipients_length + 1);
+    if (!frame || !aad) {
+        explicit_bzero(message_key, sizeof(message_key));
+        if (frame) {
+            a_chat_buffer_release(frame);
+        }
+        a_chat_pool_free(aad);
+        a_chat_pool_free(compressed);
+        return false;
+    }
+    a_chat_frame_encode_header(frame->data, A_CHAT_FRAME_DIRECT, A_CHAT_FRAME_FLAG_ENCRYPTED | (compressed ? A_CHAT_FRAME_FLAG_COMPRESSED : 0), payload_length);
+
+    // the routing header is all the server reads
+    uint8_t* payload = frame->data + A_CHAT_FRAME_HEADER_SIZE;
+    memcpy(payload, recipients, recipients_length);
+
+    uint8_t* entry = payload + recipients_length;
+    for (int i = 0; i < number_of_recipients; i++) {
+        AChatAesGcm wrap;
+        a_chat_aes_gcm_init(&wrap, a_chat_group_keys_direct_key(&client->keys, public_keys[i]));
+        uint8_t wrap_aad[A_CHAT_PUBLIC_KEY_SIZE * 2];
+        a_chat_client_build_wrap_aad(wrap_aad, client->keys.public_key, public_keys[i]);
+
+        a_chat_client_write_nonce(client, entry);
+        uint8_t* wrapped = entry + A_CHAT_AES_GCM_NONCE_SIZE;
+        a_chat_aes_gcm_encrypt(&wrap, entry, wrap_aad, sizeof(wrap_aad), message_key, sizeof(message_key), wrapped, wrapped + A_CHAT_AES_GCM_KEY_SIZE);
+        a_chat_aes_gcm_destroy(&wrap);
+        entry += A_CHAT_CLIENT_DIRECT_ENTRY_SIZE;
+    }
+
+    uint8_t* nonce = entry;
+    a_chat_client_write_nonce(client, nonce);
+    size_t aad_length = a_chat_client_build_direct_aad(aad, client->keys.public_key, recipients, recipients_length, compressed != NULL);
+
+    AChatAesGcm cipher;
+    a_chat_aes_gcm_init(&cipher, message_key);
+    uint8_t* ciphertext = nonce + A_CHAT_AES_GCM_NONCE_SIZE;
+    a_chat_aes_gcm_encrypt(&cipher, nonce, aad, aad_length, plaintext, plaintext_length, ciphertext, ciphertext + plaintext_length);
+    a_chat_aes_gcm_destroy(&cipher);
+    explicit_bzero(message_key, sizeof(message_key));
+    a_chat_pool_free(aad);
+    a_chat_pool_free(compressed);
+
+    if (!a_chat_client_push_frame(client, frame)) {
+        a_chat_buffer_release(frame);
+        return false;
+    }
+
+    return true;
+}
+
+// answers come back in the order their queries were asked, so this is the answer to the oldest one
+// a direct message waiting on it is sent to whichever of its recipients are online, the rest of the answer is printed
+static void a_chat_client_handle_presence(AChatClient* client, const AChatFrame* frame) {
+    if (frame->length < 4) { return; }
+    uint32_t number_online = ((uint32_t) frame->payload[0] << 24) | ((uint32_t) frame->payload[1] << 16) | ((uint32_t) frame->payload[2] << 8) | frame->payload[3];
+
+    pthread_mutex_lock(&client->lock);
+    if (client->number_of_queries == 0) {
+        pthread_mutex_unlock(&client->lock);
+        return;
+    }
+    AChatClientQuery query = client->queries[0];
+    client->number_of_queries--;
+    memmove(client->queries, client->queries + 1, sizeof(AChatClientQuery) * client->number_of_queries);
+
+    if (!query.message && frame->length == 4) {
+        printf("[SERVER] %u users online\n", number_online);
+    }
+
+    // the recipients who can get the message, which are never more than the answer has
+    static const uint8_t no_public_key[A_CHAT_PUBLIC_KEY_SIZE] = { 0 };
+    uint8_t* recipients = query.message ? malloc(1 + frame->length) : NULL;
+    size_t recipients_length = 1;
+    uint8_t public_keys[A_CHAT_DIRECT_MAXIMUM_RECIPIENTS][A_CHAT_PUBLIC_KEY_SIZE];
+    int number_of_recipients = 0;
+    if (query.message && !recipients) {
+        a_chat_log_error("Failed to allocate memory for recipients");
+    }
+
+    const uint8_t* entry = frame->payload + 4;
+    const uint8_t* end = frame->payload + frame->length;
+    while (end - entry >= 3) {
+        uint8_t presence = entry[0];
+        size_t username_length = ((size_t) entry[1] << 8) | entry[2];
+        if ((size_t) (end - entry - 3) < username_length + A_CHAT_PUBLIC_KEY_SIZE) { break; }
+        const char* username = (const char*) entry + 3;
+        const uint8_t* public_key = entry + 3 + username_length;
+
+        if (!query.message) {
+            const char* status = presence == A_CHAT_PRESENCE_ONLINE ? "online" : presence == A_CHAT_PRESENCE_AWAY ? "away" : "offline";
+            printf("[SERVER] %.*s is %s, %u users online\n", (int) username_length, username, status, number_online);
+        } else if (presence != A_CHAT_PRESENCE_ONLINE || memcmp(public_key, no_public_key, A_CHAT_PUBLIC_KEY_SIZE) == 0) {
+            // a message can only be sent to someone who is there to decrypt it
+            printf("[SERVER] %.*s isn't online, the message wasn't sent to them\n", (int) username_length, username);
+        } else if (recipients && number_of_recipients < A_CHAT_DIRECT_MAXIMUM_RECIPIENTS) {
+            memcpy(recipients + recipients_length, entry + 1, 2 + username_length);
+            recipients_length += 2 + username_length;
+            memcpy(public_keys[number_of_recipients++], public_key, A_CHAT_PUBLIC_KEY_SIZE);
+        }
+        entry += 3 + username_length + A_CHAT_PUBLIC_KEY_SIZE;
+    }
+
+    if (number_of_recipients > 0) {
+        recipients[0] = (uint8_t) number_of_recipients;
+        // a_chat_client_queue_direct logs the correct error already
+        a_chat_client_queue_direct(client, recipients, recipients_length, (const uint8_t (*)[A_CHAT_PUBLIC_KEY_SIZE]) public_keys, query.message);
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    free(recipients);
+    free(query.recipients);
+    free(query.message);
+}
+
+// the client's lock must be held while calling this
+static AChatClientRoomSequence* a_chat_client_find_sequence(AChatClient* client, const char* room, size_t room_length) {
+    for (int i = 0; i < client->number_of_sequences; i++) {
+        if (client->sequences[i].name_length == room_length && memcmp(client->sequences[i].name, room, room_length) == 0) {
+            return &client->sequences[i];
+        }
+    }
+
+    return NULL;
+}
+
+// the client's lock must be held while calling this
+static void a_chat_client_free_pending(AChatClient* client) {
+    for (int i = 0; i < client->number_of_pending; i++) {
+        a_chat_buffer_release(client->pending[i]);
+    }
+    client->number_of_pending = 0;
+}
+
+// the client's lock must be held while calling this
+static void a_chat_client_free_queries(AChatClient* client) {
+    for (int i = 0; i < client->number_of_queries; i++) {
+        free(client->queries[i].recipients);
+        free(client->queries[i].message);
+    }
+    client->number_of_queries = 0;
+}
+
+// keeps a reference to a MESSAGE frame for when the client is back, the client's lock must be held while calling this
+static bool a_chat_client_keep_pending(AChatClient* client, AChatBuffer* frame) {
+    if (client->number_of_pending >= A_CHAT_CLIENT_MAXIMUM_PENDING) {
+        a_chat_log_error("Failed to keep message, too many are waiting on the connection to the server");
+        return false;
+    }
+    client->pending[client->number_of_pending++] = a_chat_buffer_acquire(frame);
+
+    return true;
+}
+
+// returns false if the message has been seen already
+static bool a_chat_client_see_sequence(AChatClient* client, const char* room, size_t room_length, uint64_t sequence) {
+    if (room_length > A_CHAT_ROOM_NAME_MAXIMUM_LENGTH) { return false; }
+
+    pthread_mutex_lock(&client->lock);
+    AChatClientRoomSequence* room_sequence = a_chat_client_find_sequence(client, room, room_length);
+    if (!room_sequence && client->number_of_sequences < A_CHAT_CLIENT_MAXIMUM_ROOMS) {
+        room_sequence = &client->sequences[client->number_of_sequences++];
+        memcpy(room_sequence->name, room, room_length);
+        room_sequence->name[room_length] = '\0';
+        room_sequence->name_length = room_length;
+        room_sequence->last_sequence = 0;
+    }
+
+    // a room's messages always arrive in sequence order, so anything not newer than the last one is a repeat
+    bool seen = room_sequence && sequence <= room_sequence->last_sequence;
+    if (room_sequence && !seen) {
+        room_sequence->last_sequence = sequence;
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    return !seen;
+}
+
+static void a_chat_client_handle_frame(AChatClient* client, const AChatFrame* frame) {
+    switch (frame->type) {
+        case A_CHAT_FRAME_MESSAGE: {
+            // messages from the server's history start with their sequence in the room
+            const uint8_t* payload = frame->payload;
+            uint32_t length = frame->length;
+            uint64_t sequence = 0;
+            if (frame->flags & A_CHAT_FRAME_FLAG_SEQUENCE) {
+                if (length < 8) { break; }
+                for (int i = 0; i < 8; i++) {
+                    sequence = (sequence << 8) | payload[i];
+                }
+                payload += 8;
+                length -= 8;
+            }
+
+            // relayed messages start with the room they were sent to, then the sender's username
+            if (length < 2) { break; }
+            uint32_t room_length = ((uint32_t) payload[0] << 8) | payload[1];
+            if (length < 2 + room_length + 2) { break; }
+
+            const uint8_t* sender = payload + 2 + room_length;
+            uint32_t username_length = ((uint32_t) sender[0] << 8) | sender[1];
+            if (length < 2 + room_length + 2 + username_length) { break; }
+
+            if ((frame->flags & A_CHAT_FRAME_FLAG_SEQUENCE) && !a_chat_client_see_sequence(client, (const char*) payload + 2, room_length, sequence)) { break; }
+
+            uint32_t message_length = length - 2 - room_length - 2 - username_length;
+            a_chat_client_print_message(client, frame->flags, (const char*) payload + 2, room_length, (const char*) sender + 2, username_length, sender + 2 + username_length, message_length);
+            break;
+        }
+        case A_CHAT_FRAME_SERVER:
+            printf("[SERVER] %.*s\n", (int) frame->length, (const char*) frame->payload);
+            break;
+        case A_CHAT_FRAME_DIRECT: {
+            // direct messages start with the sender's username and public key, then the routing header they were sent with
+            if (frame->length < 2) { break; }
+            uint32_t username_length = ((uint32_t) frame->payload[0] << 8) | frame->payload[1];
+            if (frame->length < 2 + username_length + A_CHAT_PUBLIC_KEY_SIZE + 1) { break; }
+
+            const uint8_t* sender = frame->payload + 2 + username_length;
+            const uint8_t* recipients = sender + A_CHAT_PUBLIC_KEY_SIZE;
+            const uint8_t* end = frame->payload + frame->length;
+            const uint8_t* recipient = recipients + 1;
+            int i = 0;
+            for (; i < recipients[0] && end - recipient >= 2; i++) {
+                size_t recipient_length = ((size_t) recipient[0] << 8) | recipient[1];
+                if ((size_t) (end - recipient - 2) < recipient_length) { break; }
+                recipient += 2 + recipient_length;
+            }
+            if (i < recipients[0]) { break; }
+
+            a_chat_client_print_direct(client, frame->flags, (const char*) frame->payload + 2, username_length, sender, recipients, recipient - recipients, recipient, end - recipient);
+            break;
+        }
+        case A_CHAT_FRAME_PRESENCE:
+            a_chat_client_handle_presence(client, frame);
+            break;
+        case A_CHAT_FRAME_PING:
+            // the server checking the connection is still alive, which a full send queue doesn't stop it answering
+            if (frame->length > A_CHAT_PING_MAXIMUM_LENGTH) { break; }
+
+            pthread_mutex_lock(&client->lock);
+            if (client->connected && !a_chat_client_queue_frame(client, A_CHAT_FRAME_PONG, 0, frame->payload, frame->length)) {
+                a_chat_log_error("Failed to send pong to server");
+            }
+            pthread_mutex_unlock(&client->lock);
+            break;
+        case A_CHAT_FRAME_MEMBER: {
+            if (frame->length < 2) { break; }
+            uint32_t room_length = ((uint32_t) frame->payload[0] << 8) | frame->payload[1];
+            if (frame->length != 2 + room_length + 1 + A_CHAT_PUBLIC_KEY_SIZE) { break; }
+
+            const uint8_t* member = frame->payload + 2 + room_length;
+            pthread_mutex_lock(&client->lock);
+            a_chat_group_keys_member(&client->keys, (const char*) frame->payload + 2, room_length, member[0] == A_CHAT_MEMBER_JOINED, member + 1, a_chat_client_now_ms());
+            pthread_mutex_unlock(&client->lock);
+            break;
+        }
+        case A_CHAT_FRAME_GROUP_KEY: {
+            if (frame->length < 2) { break; }
+            uint32_t room_length = ((uint32_t) frame->payload[0] << 8) | frame->payload[1];
+            if (frame->length < 2 + room_length + A_CHAT_PUBLIC_KEY_SIZE) { break; }
+
+            const uint8_t* sender = frame->payload + 2 + room_length;
+            pthread_mutex_lock(&client->lock);
+            AChatGroupKeyResult result = a_chat_group_keys_receive(&client->keys, (const char*) frame->payload + 2, room_length, sender, sender + A_CHAT_PUBLIC_KEY_SIZE, frame->length - 2 - room_length - A_CHAT_PUBLIC_KEY_SIZE, a_chat_client_now_ms());
+
+            // joining a room again gets the server to announce this client to it again
+            if (result == A_CHAT_GROUP_KEY_EXCLUDED && client->connected && !a_chat_client_queue_frame(client, A_CHAT_FRAME_JOIN, 0, frame->payload + 2, room_length)) {
+                a_chat_log_error("Failed to send join to server");
+            }
+            pthread_mutex_unlock(&client->lock);
+            break;
+        }
+        case A_CHAT_FRAME_HANDSHAKE:
+            // a refused handshake would only be refused again, so the client stops instead of reconnecting
+            if (frame->length > 0) {
+                a_chat_log_error("Server refused the handshake");
+                printf("[SERVER] %.*s\n", (int) frame->length, (const char*) frame->payload);
+
+                pthread_mutex_lock(&client->lock);
+                client->running = false;
+                pthread_cond_signal(&client->sendable);
+                pthread_mutex_unlock(&client->lock);
+                break;
+            }
+
+            // the server's answer to the handshake or resume, which only says whether the client may compress
+            pthread_mutex_lock(&client->lock);
+            client->compressing = client->config.compression && (frame->flags & A_CHAT_FRAME_FLAG_COMPRESSED);
+            pthread_mutex_unlock(&client->lock);
+            break;
+        case A_CHAT_FRAME_SESSION:
+            pthread_mutex_lock(&client->lock);
+            if (frame->length == A_CHAT_SESSION_TOKEN_SIZE) {
+                // the resumed session is the same one, so the server has everything that was sent after the resume
+                if (client->resuming && memcmp(client->session_token, frame->payload, A_CHAT_SESSION_TOKEN_SIZE) == 0) {
+                    a_chat_client_free_pending(client);
+                }
+                memcpy(client->session_token, frame->payload, A_CHAT_SESSION_TOKEN_SIZE);
+                client->has_session = true;
+            } else {
+                // the session has expired, the server disconnects and the next connection does the handshake again
+                a_chat_log_warning("Server couldn't resume the session");
+                client->has_session = false;
+                client->connected = false; // so messages wait for the next connection instead
+            }
+            client->resuming = false;
+            pthread_mutex_unlock(&client->lock);
+            break;
+        default:
+            break;
+    }
+}
+
+// sends every rekey that is due, returns how long until the next one for poll(), or -1 if there isn't one
+static int a_chat_client_rekey(AChatClient* client) {
+    pthread_mutex_lock(&client->lock);
+
+    uint64_t now = a_chat_client_now_ms();
+    size_t length;
+    uint8_t* payload;
+    while ((payload = a_chat_group_keys_rekey(&client->keys, now, &length))) {
+        // a rekey missed while reconnecting is made up for by the members' next change
+        if (client->connected && !a_chat_client_queue_frame(client, A_CHAT_FRAME_GROUP_KEY, 0, payload, length)) {
+            a_chat_log_error("Failed to send group key to server");
+        }
+        free(payload);
+    }
+
+    uint64_t next = a_chat_group_keys_next_rekey(&client->keys);
+    pthread_mutex_unlock(&client->lock);
+
+    if (next == 0) { return -1; }
+    return next > now ? (int) (next - now) : 0;
+}
+
+// queues what a new connection needs to carry on where the last one stopped, without waiting on the server's answer
+// the client's lock must be held while calling this
+static bool a_chat_client_restore(AChatClient* client) {
+    if (client->has_session) {
+        // the server kept the client's rooms, it only needs the last message seen in each to catch up
+        uint8_t payload[A_CHAT_SESSION_TOKEN_SIZE + A_CHAT_CLIENT_MAXIMUM_ROOMS * (8 + 2 + A_CHAT_ROOM_NAME_MAXIMUM_LENGTH)];
+        memcpy(payload, client->session_token, A_CHAT_SESSION_TOKEN_SIZE);
+        size_t length = A_CHAT_SESSION_TOKEN_SIZE;
+        for (int i = 0; i < client->number_of_sequences; i++) {
+            const AChatClientRoomSequence* room_sequence = &client->sequences[i];
+            for (int j = 0; j < 8; j++) {
+                payload[length + j] = (uint8_t) (room_sequence->last_sequence >> (56 - j * 8));
+            }
+            payload[length + 8] = (uint8_t) (room_sequence->name_length >> 8);
+            payload[length + 9] = (uint8_t) room_sequence->name_length;
+            memcpy(payload + length + 10, room_sequence->name, room_sequence->name_length);
+            length += 10 + room_sequence->name_length;
+        }
+
+        if (!a_chat_client_queue_frame(client, A_CHAT_FRAME_RESUME, 0, payload, length)) {
+            a_chat_log_error("Failed to send resume to server");
+            return false;
+        }
+        client->resuming = true;
+    } else {
+        // a_chat_client_send_handshake logs the correct error already
+        if (!a_chat_client_send_handshake(client)) { return false; }
+
+        // the server only put the client back in the default room, so it joins the rest again, catching up on each
+        bool in_default_room = false;
+        for (AChatGroupRoom* room = client->keys.rooms; room; room = room->next) {
+            if (room->name_length == strlen(A_CHAT_DEFAULT_ROOM) && memcmp(room->name, A_CHAT_DEFAULT_ROOM, room->name_length) == 0) {
+                in_default_room = true;
+                continue;
+            }
+
+            uint8_t payload[8 + A_CHAT_ROOM_NAME_MAXIMUM_LENGTH];
+            AChatClientRoomSequence* room_sequence = a_chat_client_find_sequence(client, room->name, room->name_length);
+            size_t length = 0;
+            uint16_t flags = 0;
+            if (room_sequence) {
+                for (int j = 0; j < 8; j++) {
+                    payload[j] = (uint8_t) ((room_sequence->last_sequence + 1) >> (56 - j * 8));
+                }
+                length = 8;
+                flags = A_CHAT_FRAME_FLAG_SEQUENCE;
+            }
+            memcpy(payload + length, room->name, room->name_length);
+            length += room->name_length;
+
+            if (!a_chat_client_queue_frame(client, A_CHAT_FRAME_JOIN, flags, payload, length)) {
+                a_chat_log_error("Failed to send join to server");
+                return false;
+            }
+        }
+
+        if (!in_default_room && !a_chat_client_queue_frame(client, A_CHAT_FRAME_LEAVE, 0, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM))) {
+            a_chat_log_error("Failed to send leave to server");
+            return false;
+        }
+
+        // a server that lost the session may have restarted and be numbering its rooms from 1 again, the catch ups
+        // above only replay what is newer anyway
+        for (int i = 0; i < client->number_of_sequences; i++) {
+            client->sequences[i].last_sequence = 0;
+        }
+    }
+
+    // messages go after the resume or the joins, so the server handles them once the client is back in its rooms
+    for (int i = 0; i < client->number_of_pending; i++) {
+        if (!a_chat_client_push_frame(client, a_chat_buffer_acquire(client->pending[i]))) {
+            a_chat_buffer_release(client->pending[i]);
+            return false;
+        }
+    }
+
+    // a resume can still be refused, so they are only dropped once the server has answered it
+    if (!client->resuming) {
+        a_chat_client_free_pending(client);
+    }
+
+    // the last connection's answers never came, so the questions are asked again, in the same order
+    for (int i = 0; i < client->number_of_queries; i++) {
+        // a_chat_client_send_query logs the correct error already
+        if (!a_chat_client_send_query(client, &client->queries[i])) { return false; }
+    }
+
+    return true;
+}
+
+// reconnects to the server, backing off between attempts, returns false once the client is closing
+static bool a_chat_client_reconnect(AChatClient* client, AChatFrameDecoder* decoder) {
+    pthread_mutex_lock(&client->lock);
+    client->connected = false;
+
+    // the socket can only be closed once the sender thread is done with it, which a shut down socket doesn't take long
+    shutdown(client->socket, SHUT_RDWR);
+    while (client->sending) {
+        pthread_cond_wait(&client->sent, &client->lock);
+    }
+    close(client->socket);
+    client->socket = -1;
+
+    // messages the server might not have got are sent again on the next connection, the rest of the queue is rebuilt
+    // while a resume is unanswered every queued message is pending already
+    for (size_t i = 0; i < client->send_queue_count && client->number_of_pending == 0 && !client->resuming; i++) {
+        AChatBuffer* frame = client->send_queue[(client->send_queue_head + i) % client->send_queue_capacity];
+        if (frame->data[1] == A_CHAT_FRAME_MESSAGE) {
+            a_chat_client_keep_pending(client, frame);
+        }
+    }
+    a_chat_client_clear_queue(client);
+    client->resuming = false;
+
+    // closing the client shuts its connection down too
+    if (!client->running) {
+        pthread_mutex_unlock(&client->lock);
+        return false;
+    }
+    a_chat_log_warning("Lost connection to server, reconnecting");
+
+    // the first attempt is straight away, most drops aren't the server going down
+    uint64_t delay_ms = 0;
+    while (client->running) {
+        if (delay_ms > 0) {
+            uint16_t jitter = 0;
+            getrandom(&jitter, sizeof(jitter), 0);
+            uint64_t wait_ms = delay_ms / 2 + jitter % (delay_ms / 2 + 1);
+
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += wait_ms / 1000;
+            deadline.tv_nsec += (long) (wait_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&client->wake, &client->lock, &deadline);
+            if (!client->running) { break; }
+        }
+        delay_ms = delay_ms == 0 ? A_CHAT_CLIENT_RECONNECT_MINIMUM_MS : delay_ms * 2;
+        if (delay_ms > A_CHAT_CLIENT_RECONNECT_MAXIMUM_MS) {
+            delay_ms = A_CHAT_CLIENT_RECONNECT_MAXIMUM_MS;
+        }
+
+        // connecting can take a while, so it is done without the lock
+        pthread_mutex_unlock(&client->lock);
+        int client_socket = a_chat_client_connect(client->address, client->port);
+        pthread_mutex_lock(&client->lock);
+        if (client_socket == -1) { continue; }
+
+        client->socket = client_socket;
+        client->connection++;
+        // the new connection's server answers again before the client may compress
+        client->compressing = false;
+        if (client->running && a_chat_client_restore(client)) {
+            client->connected = true;
+            pthread_cond_signal(&client->sendable);
+            pthread_mutex_unlock(&client->lock);
+            a_chat_log_info("Reconnected to server");
+
+            // whatever was left of the last connection's frames is useless now
+            a_chat_frame_decoder_destroy(decoder);
+            return a_chat_frame_decoder_init(decoder);
+        }
+
+        // whatever was pending is still there to try again with
+        a_chat_client_clear_queue(client);
+        close(client->socket);
+        client->socket = -1;
+        client->resuming = false;
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    return false;
+}
+
+// writes the send queue to the socket, several frames at a time
+static void* a_chat_client_send_thread(void* arguments) {
+    AChatClient* client = (AChatClient*) arguments;
+    uint64_t failed_connection = 0;
+
+    pthread_mutex_lock(&client->lock);
+    while (true) {
+        while (client->running && (client->send_queue_count == 0 || !client->connected || client->connection == failed_connection)) {
+            pthread_cond_wait(&client->sendable, &client->lock);
+        }
+        // once closing, whatever the connection can still take is written before stopping
+        if (client->send_queue_count == 0 || !client->connected || client->connection == failed_connection) { break; }
+
+        // a burst is written together instead of one frame at a time
+        if (client->running && client->config.coalesce_window_us > 0 && client->send_queue_count < A_CHAT_CLIENT_SEND_BATCH) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long) client->config.coalesce_window_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (client->running && client->connected && client->send_queue_count < A_CHAT_CLIENT_SEND_BATCH) {
+                if (pthread_cond_timedwait(&client->sendable, &client->lock, &deadline) == ETIMEDOUT) { break; }
+            }
+            if (!client->connected) { continue; }
+        }
+
+        AChatBuffer* batch[A_CHAT_CLIENT_SEND_BATCH];
+        struct iovec iov[A_CHAT_CLIENT_SEND_BATCH];
+        size_t number_of_frames = 0;
+        while (client->send_queue_count > 0 && number_of_frames < A_CHAT_CLIENT_SEND_BATCH) {
+            AChatBuffer* frame = client->send_queue[client->send_queue_head];
+            client->send_queue_head = (client->send_queue_head + 1) % client->send_queue_capacity;
+            client->send_queue_count--;
+            if (frame->data[1] == A_CHAT_FRAME_MESSAGE) {
+                client->queued_messages--;
+            }
+
+            batch[number_of_frames] = frame;
+            iov[number_of_frames] = (struct iovec) { .iov_base = frame->data, .iov_len = frame->length };
+            number_of_frames++;
+        }
+        int client_socket = client->socket;
+        client->sending = true;
+        pthread_mutex_unlock(&client->lock);
+
+        // a blocking socket can still send less than asked for
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = number_of_frames };
+        size_t number_of_sent = 0;
+        bool failed = false;
+        while (message.msg_iovlen > 0) {
+            ssize_t bytes_sent = sendmsg(client_socket, &message, MSG_NOSIGNAL);
+            if (bytes_sent == -1) {
+                if (errno == EINTR) { continue; }
+                failed = true;
+                break;
+            }
+
+            while (message.msg_iovlen > 0 && (size_t) bytes_sent >= message.msg_iov->iov_len) {
+                bytes_sent -= message.msg_iov->iov_len;
+                message.msg_iov++;
+                message.msg_iovlen--;
+                number_of_sent++;
+            }
+            if (message.msg_iovlen > 0) {
+                message.msg_iov->iov_base = (uint8_t*) message.msg_iov->iov_base + bytes_sent;
+                message.msg_iov->iov_len -= bytes_sent;
+            }
+        }
+        if (failed) {
+            a_chat_log_error_errno("Failed to send to server");
+        }
+
+        pthread_mutex_lock(&client->lock);
+        for (size_t i = 0; i < number_of_sent; i++) {
+            a_chat_buffer_release(batch[i]);
+        }
+
+        // what wasn't written goes back on the front of the queue, for the receive thread to sort out when it reconnects
+        if (failed) {
+            for (size_t i = number_of_frames; i > number_of_sent; i--) {
+                if (!a_chat_client_reserve_frame(client)) {
+                    a_chat_buffer_release(batch[i - 1]);
+                    continue;
+                }
+                client->send_queue_head = (client->send_queue_head + client->send_queue_capacity - 1) % client->send_queue_capacity;
+                client->send_queue[client->send_queue_head] = batch[i - 1];
+                client->send_queue_count++;
+                if (batch[i - 1]->data[1] == A_CHAT_FRAME_MESSAGE) {
+                    client->queued_messages++;
+                }
+            }
+
+            // the receive thread only notices once the socket is shut down
+            shutdown(client_socket, SHUT_RDWR);
+            failed_connection = client->connection;
+        }
+        client->sending = false;
+        pthread_cond_broadcast(&client->sent);
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    return NULL;
+}
+
 static void* a_chat_client_receive_thread(void* arguments) {
     AChatClient* client = (AChatClient*) arguments;
 
+    AChatFrameDecoder decoder;
+    if (!a_chat_frame_decoder_init(&decoder)) {
+        client->running = false;
+        return NULL;
+    }
+
     // this is just temporary
     while (client->running) {
-        char buffer[1024];
-        int bytes_received = recv(client->socket, &buffer, sizeof(buffer), 0);
-        if (bytes_received == 0 || bytes_received == -1) {
+        // receive straight into the frame decoder, a single recv() can contain any number of frames
+        size_t available;
+        uint8_t* buffer = a_chat_frame_decoder_reserve(&decoder, &available);
+        if (!buffer) {
             client->running = false;
+            break;
         }
 
-        buffer[bytes_received] = '\0';
-        printf("%s\n", buffer);
+        // wake up for the next rekey even if nothing arrives
+        struct pollfd poll_fd = { .fd = client->socket, .events = POLLIN };
+        int ready = poll(&poll_fd, 1, a_chat_client_rekey(client));
+        if (ready == 0 || (ready == -1 && errno == EINTR)) { continue; }
+
+        // the connection is only lost once nothing more can be read from it, so the server's last frames are still handled
+        int bytes_received = recv(client->socket, buffer, available, 0);
+        if (bytes_received == 0 || bytes_received == -1) {
+            if (!a_chat_client_reconnect(client, &decoder)) {
+                client->running = false;
+                break;
+            }
+            continue;
+        }
+        a_chat_frame_decoder_commit(&decoder, bytes_received);
+
+        AChatFrame frame;
+        AChatFrameResult result;
+        while ((result = a_chat_frame_decoder_next(&decoder, &frame)) == A_CHAT_FRAME_COMPLETE) {
+            a_chat_client_handle_frame(client, &frame);
+        }
+        if (result == A_CHAT_FRAME_ERROR && !a_chat_client_reconnect(client, &decoder)) {
+            client->running = false;
+            break;
+        }
     }
 
+    a_chat_frame_decoder_destroy(&decoder);
+
     return NULL;
 }
 
+AChatClientConfig a_chat_client_default_config(void) {
+    return (AChatClientConfig) {
+        .coalesce_window_us = 200,
+        .send_queue_maximum_messages = 1024,
+        .compression = true,
+        .compression_threshold = 64,
+    };
+}
+
 AChatClient* a_chat_client_create(const char* ip_address, const char* port, const char* username) {
+    return a_chat_client_create_with_config(ip_address, port, username, NULL);
+}
+
+AChatClient* a_chat_client_create_with_config(const char* ip_address, const char* port, const char* username, const AChatClientConfig* config) {
+    // make sure the username is the correct length
+    int username_length = strlen(username);
+    if (username_length < 0 || username_length > 512) {
+        a_chat_log_error("Username is invalid!");
+        return NULL;
+    }
+
     AChatClient* client = malloc(sizeof(AChatClient));
     if (!client) {
         a_chat_log_error("Failed to allocate memory for client");
         return NULL;
     }
 
-    // get all the ip address related infomation for us
-    struct addrinfo hints = {0};
-    hints.ai_family = AF_UNSPEC; // allows for either IPv4 or IPv6, it doesnt matter to us
-    hints.ai_socktype = SOCK_STREAM; // use TCP
-
-    struct addrinfo* address_info;
-    int status; // used for error checking
-    if ((status = getaddrinfo(ip_address, port, &hints, &address_info)) != 0) {
-        a_chat_log_error_gai_strerror("Failed to get address infomation", status);
-
-        free(client);
-        return NULL;
+    client->config = config ? *config : a_chat_client_default_config();
+    if (client->config.coalesce_window_us < 0 || client->config.coalesce_window_us >= 1000000) {
+        client->config.coalesce_window_us = a_chat_client_default_config().coalesce_window_us;
+    }
+    if (client->config.send_queue_maximum_messages < 1) {
+        client->config.send_queue_maximum_messages = a_chat_client_default_config().send_queue_maximum_messages;
+    }
+    if (client->config.compression_threshold < 0) {
+        client->config.compression_threshold = a_chat_client_default_config().compression_threshold;
     }
 
-    // create the client socket with the correct ip infomation
-    client->socket = socket(address_info->ai_family, address_info->ai_socktype, address_info->ai_protocol);
-    if (client->socket == -1) {
-        a_chat_log_error_errno("Failed to create client socket");
+    client->send_queue_capacity = A_CHAT_CLIENT_SEND_BATCH;
+    client->send_queue = malloc(sizeof(AChatBuffer*) * client->send_queue_capacity);
+    // kept to reconnect with
+    client->address = strdup(ip_address);
+    client->port = strdup(port);
+    if (!client->send_queue || !client->address || !client->port) {
+        a_chat_log_error("Failed to allocate memory for client");
 
+        free(client->send_queue);
+        free(client->address);
+        free(client->port);
         free(client);
         return NULL;
     }
+    client->send_queue_head = 0;
+    client->send_queue_count = 0;
+    client->queued_messages = 0;
+    client->sending = false;
 
-    // connect to the server using the client socket
-    if (connect(client->socket, address_info->ai_addr, address_info->ai_addrlen) == -1) {
-        a_chat_log_error_errno("Failed to connect to server");
+    client->username = username;
+    client->number_of_sequences = 0;
+    client->has_session = false;
+    client->resuming = false;
+    client->compressing = false;
+    client->number_of_pending = 0;
+    client->number_of_queries = 0;
+    snprintf(client->room, sizeof(client->room), "%s", A_CHAT_DEFAULT_ROOM);
 
-        close(client->socket);
+    if (!a_chat_group_keys_init(&client->keys) || !a_chat_client_reset_nonce(client)) {
+        free(client->send_queue);
+        free(client->address);
+        free(client->port);
         free(client);
         return NULL;
     }
 
-    // free the address infomation as it is no longer needed
-    freeaddrinfo(address_info);
-
-    // make sure the username is the correct length
-    int username_length = strlen(username);
-    if (username_length < 0 || username_length > 512) {
-        a_chat_log_error("Username is invalid!");
+    client->socket = a_chat_client_connect(ip_address, port);
+    if (client->socket == -1) {
+        // a_chat_client_connect logs the correct error already
 
-        close(client->socket);
+        a_chat_group_keys_destroy(&client->keys);
+        free(client->send_queue);
+        free(client->address);
+        free(client->port);
         free(client);
         return NULL;
     }
+    client->connection = 1;
+    client->connected = true;
 
-    client->username = username;
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->wake, NULL);
+    pthread_cond_init(&client->sendable, NULL);
+    pthread_cond_init(&client->sent, NULL);
 
+    // the handshake is the first thing the sender thread writes
     if (!a_chat_client_send_handshake(client)) {
         // a_chat_client_send_handshake logs the correct error already
 
+        pthread_cond_destroy(&client->sent);
+        pthread_cond_destroy(&client->sendable);
+        pthread_cond_destroy(&client->wake);
+        pthread_mutex_destroy(&client->lock);
+        a_chat_group_keys_destroy(&client->keys);
         close(client->socket);
+        free(client->send_queue);
+        free(client->address);
+        free(client->port);
         free(client);
         return NULL;
     }
 
+    // the server puts every client in the default room
+    a_chat_group_keys_join(&client->keys, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM), a_chat_client_now_ms());
+
     client->running = true;
 
-    // create the receiving thread
+    // create the sending and receiving threads
+    pthread_create(&client->send_thread_id, NULL, a_chat_client_send_thread, client);
     pthread_create(&client->receive_thread_id, NULL, a_chat_client_receive_thread, client);
 
     return client;
 }
 
-void a_chat_client_send(AChatClient* client, const char* message) {
-    // this needs encryption!
+bool a_chat_client_send(AChatClient* client, const char* message) {
+    pthread_mutex_lock(&client->lock);
 
-    if (send(client->socket, message, strlen(message), 0) == -1) {
-        a_chat_log_error_errno("Failed to send message to server");
+    size_t room_length = strlen(client->room);
+    AChatGroupRoom* room = a_chat_group_keys_find(&client->keys, client->room, room_length);
+    if (!room || !room->current.valid) {
+        pthread_mutex_unlock(&client->lock);
+        a_chat_log_error("Failed to send message, the room doesn't have a key yet");
+        return false;
+    }
 
-        close(client->socket);
-        free(client);
+    // the sender thread can't keep up, so the caller finds out instead of waiting on it
+    if (client->connected && client->queued_messages >= client->config.send_queue_maximum_messages) {
+        pthread_mutex_unlock(&client->lock);
+        a_chat_log_error("Failed to send message, the send queue is full");
+        return false;
+    }
+
+    // once the counter has been used up, a fresh prefix keeps the nonces unique
+    if (client->nonce_counter == UINT32_MAX) {
+        if (!a_chat_client_reset_nonce(client)) {
+            pthread_mutex_unlock(&client->lock);
+            return false;
+        }
+    }
+
+    // the message is prefixed with the room it is for and the key's epoch, then encrypted in place after its nonce,
+    // straight into the frame that is queued
+    size_t username_length = strlen(client->username);
+    size_t message_length = strlen(message);
+    const uint8_t* plaintext = (const uint8_t*) message;
+    size_t plaintext_length = message_length;
+
+    size_t compressed_length = 0;
+    uint8_t* compressed = a_chat_client_compress(client, plaintext, message_length, &compressed_length);
+    if (compressed) {
+        plaintext = compressed;
+        plaintext_length = compressed_length;
+    }
+
+    size_t payload_length = 2 + room_length + 4 + A_CHAT_AES_GCM_NONCE_SIZE + plaintext_length + A_CHAT_AES_GCM_TAG_SIZE;
+    if (payload_length > A_CHAT_FRAME_MAXIMUM_LENGTH) {
+        pthread_mutex_unlock(&client->lock);
+        a_chat_log_error("Failed to send message, it is too long");
+
+        a_chat_pool_free(compressed);
+        return false;
+    }
+    // a_chat_buffer_create logs the correct error already
+    AChatBuffer* frame = a_chat_buffer_create(A_CHAT_FRAME_HEADER_SIZE + payload_length);
+    if (!frame) {
+        pthread_mutex_unlock(&client->lock);
+
+        a_chat_pool_free(compressed);
+        return false;
+    }
+    a_chat_frame_encode_header(frame->data, A_CHAT_FRAME_MESSAGE, A_CHAT_FRAME_FLAG_ENCRYPTED | (compressed ? A_CHAT_FRAME_FLAG_COMPRESSED : 0), payload_length);
+
+    uint8_t* payload = frame->data + A_CHAT_FRAME_HEADER_SIZE;
+    payload[0] = (uint8_t) (room_length >> 8);
+    payload[1] = (uint8_t) room_length;
+    memcpy(payload + 2, client->room, room_length);
+
+    uint8_t* epoch = payload + 2 + room_length;
+    epoch[0] = (uint8_t) (room->current.epoch >> 24);
+    epoch[1] = (uint8_t) (room->current.epoch >> 16);
+    epoch[2] = (uint8_t) (room->current.epoch >> 8);
+    epoch[3] = (uint8_t) room->current.epoch;
+
+    uint8_t* nonce = epoch + 4;
+    a_chat_client_write_nonce(client, nonce);
+
+    uint8_t aad[2 + A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 2 + 512 + 1];
+    size_t aad_length = a_chat_client_build_aad(aad, client->room, room_length, client->username, username_length, compressed != NULL);
+
+    uint8_t* ciphertext = nonce + A_CHAT_AES_GCM_NONCE_SIZE;
+    a_chat_aes_gcm_encrypt(&room->current.cipher, nonce, aad, aad_length, plaintext, plaintext_length, ciphertext, ciphertext + plaintext_length);
+    a_chat_pool_free(compressed);
+
+    // while reconnecting the message waits for the connection, and until a resume is answered it is kept in case the
+    // server refuses it
+    bool queued;
+    if (!client->connected) {
+        queued = a_chat_client_keep_pending(client, frame);
+    } else {
+        queued = a_chat_client_push_frame(client, a_chat_buffer_acquire(frame));
+        if (!queued) {
+            a_chat_buffer_release(frame);
+        } else if (client->resuming) {
+            a_chat_client_keep_pending(client, frame);
+        }
     }
+
+    pthread_mutex_unlock(&client->lock);
+    a_chat_buffer_release(frame);
+
+    return queued;
+}
+
+bool a_chat_client_send_direct(AChatClient* client, const char* username, const char* message) {
+    return a_chat_client_send_multicast(client, &username, 1, message);
+}
+
+bool a_chat_client_send_multicast(AChatClient* client, const char* const* usernames, int number_of_usernames, const char* message) {
+    if (number_of_usernames < 1) {
+        a_chat_log_error("A direct message needs at least one recipient!");
+        return false;
+    }
+
+    // a_chat_client_encode_recipients logs the correct error already
+    size_t recipients_length;
+    uint8_t* recipients = a_chat_client_encode_recipients(usernames, number_of_usernames, &recipients_length);
+    if (!recipients) { return false; }
+
+    char* copy = strdup(message);
+    if (!copy) {
+        a_chat_log_error("Failed to allocate memory for direct message");
+
+        free(recipients);
+        return false;
+    }
+
+    // the message waits on its recipients' public keys, which the answer to the query brings
+    // a_chat_client_add_query logs the correct error already
+    pthread_mutex_lock(&client->lock);
+    bool queued = a_chat_client_add_query(client, recipients, recipients_length, copy);
+    pthread_mutex_unlock(&client->lock);
+
+    return queued;
+}
+
+void a_chat_client_query_presence(AChatClient* client, const char* username) {
+    // a_chat_client_encode_recipients logs the correct error already
+    size_t recipients_length;
+    uint8_t* recipients = a_chat_client_encode_recipients(&username, username ? 1 : 0, &recipients_length);
+    if (!recipients) { return; }
+
+    // a_chat_client_add_query logs the correct error already
+    pthread_mutex_lock(&client->lock);
+    a_chat_client_add_query(client, recipients, recipients_length, NULL);
+    pthread_mutex_unlock(&client->lock);
+}
+
+void a_chat_client_join(AChatClient* client, const char* room) {
+    size_t room_length = strlen(room);
+    if (room_length == 0 || room_length >= sizeof(client->room)) {
+        a_chat_log_error("Room name is invalid!");
+        return;
+    }
+
+    pthread_mutex_lock(&client->lock);
+    if (!client->connected) {
+        pthread_mutex_unlock(&client->lock);
+        a_chat_log_error("Failed to join room, the client is reconnecting");
+        return;
+    }
+    if (!a_chat_client_queue_frame(client, A_CHAT_FRAME_JOIN, 0, room, room_length)) {
+        pthread_mutex_unlock(&client->lock);
+        a_chat_log_error("Failed to send join to server");
+        return;
+    }
+
+    // the room's leader will send a key once it hears about the join
+    a_chat_group_keys_join(&client->keys, room, room_length, a_chat_client_now_ms());
+    memcpy(client->room, room, room_length + 1);
+    pthread_mutex_unlock(&client->lock);
+}
+
+void a_chat_client_leave(AChatClient* client, const char* room) {
+    pthread_mutex_lock(&client->lock);
+    if (!client->connected) {
+        pthread_mutex_unlock(&client->lock);
+        a_chat_log_error("Failed to leave room, the client is reconnecting");
+        return;
+    }
+    if (!a_chat_client_queue_frame(client, A_CHAT_FRAME_LEAVE, 0, room, strlen(room))) {
+        a_chat_log_error("Failed to send leave to server");
+    }
+
+    // the room's keys aren't needed anymore, whoever is left rekeys without this client
+    a_chat_group_keys_leave(&client->keys, room, strlen(room));
+
+    // what is sent while the client is away can't be read anyway, so a later join doesn't catch up on it
+    AChatClientRoomSequence* room_sequence = a_chat_client_find_sequence(client, room, strlen(room));
+    if (room_sequence) {
+        *room_sequence = client->sequences[--client->number_of_sequences];
+    }
+    pthread_mutex_unlock(&client->lock);
 }
 
 void a_chat_client_close(AChatClient* client) {
-    shutdown(client->socket, SHUT_RDWR);
+    pthread_mutex_lock(&client->lock);
+    // an empty SESSION frame tells the server not to keep the session around for a reconnect
+    if (client->connected && client->has_session && !a_chat_client_queue_frame(client, A_CHAT_FRAME_SESSION, 0, NULL, 0)) {
+        a_chat_log_error("Failed to send session end to server");
+    }
 
     client->running = false;
+    pthread_cond_signal(&client->sendable);
+    pthread_cond_signal(&client->wake);
 
+    // the sender thread writes whatever is still queued before it stops, but its sendmsg() blocks for as long as the
+    // server isn't reading, so once the timeout is up the socket is shut down from under it
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += A_CHAT_CLIENT_CLOSE_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (long) (A_CHAT_CLIENT_CLOSE_TIMEOUT_MS % 1000) * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (client->connected && (client->send_queue_count > 0 || client->sending)) {
+        if (pthread_cond_timedwait(&client->sent, &client->lock, &deadline) == ETIMEDOUT) {
+            a_chat_log_warning("Server didn't take everything still queued in time, closing anyway");
+            break;
+        }
+    }
+    if (client->socket != -1) {
+        shutdown(client->socket, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    pthread_join(client->send_thread_id, NULL);
     pthread_join(client->receive_thread_id, NULL);
 
-    close(client->socket);
+    a_chat_client_clear_queue(client);
+    a_chat_client_free_pending(client);
+    a_chat_client_free_queries(client);
+    a_chat_group_keys_destroy(&client->keys);
+    pthread_cond_destroy(&client->sent);
+    pthread_cond_destroy(&client->sendable);
+    pthread_cond_destroy(&client->wake);
+    pthread_mutex_destroy(&client->lock);
+    if (client->socket != -1) {
+        close(client->socket);
+    }
+    free(client->send_queue);
+    free(client->address);
+    free(client->port);
     free(client);
 }
@@ -0,0 +1,522 @@
+#include "client/group_key.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "crypto/sha256.h"
+#include "log.h"
+
+#define A_CHAT_GROUP_PEERS_INITIAL_CAPACITY 64
+#define A_CHAT_GROUP_MEMBERS_INITIAL_CAPACITY 8
+
+// the epoch, then one entry per member
+#define A_CHAT_GROUP_KEY_HEADER_SIZE 4
+
+static const char a_chat_group_wrap_salt[] = "a-chat group key wrap";
+static const char a_chat_group_direct_salt[] = "a-chat direct message";
+
+static void a_chat_group_wipe(void* data, size_t length) {
+    // volatile so the wipe isn't optimised away
+    volatile uint8_t* bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        bytes[i] = 0;
+    }
+}
+
+static size_t a_chat_group_peer_index(const uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE], size_t capacity) {
+    uint64_t hash;
+    memcpy(&hash, public_key, sizeof(hash));
+    return hash & (capacity - 1);
+}
+
+static bool a_chat_group_peers_grow(AChatGroupKeys* keys) {
+    size_t new_capacity = keys->peers_capacity ? keys->peers_capacity * 2 : A_CHAT_GROUP_PEERS_INITIAL_CAPACITY;
+    AChatPeerKey* new_peers = calloc(new_capacity, sizeof(AChatPeerKey));
+    if (!new_peers) {
+        a_chat_log_error("Failed to allocate memory for peer keys");
+        return false;
+    }
+
+    for (size_t i = 0; i < keys->peers_capacity; i++) {
+        if (!keys->peers[i].used) { continue; }
+
+        size_t index = a_chat_group_peer_index(keys->peers[i].public_key, new_capacity);
+        while (new_peers[index].used) {
+            index = (index + 1) & (new_capacity - 1);
+        }
+        new_peers[index] = keys->peers[i];
+    }
+
+    if (keys->peers) {
+        a_chat_group_wipe(keys->peers, keys->peers_capacity * sizeof(AChatPeerKey));
+        free(keys->peers);
+    }
+    keys->peers = new_peers;
+    keys->peers_capacity = new_capacity;
+
+    return true;
+}
+
+// the keys shared with a peer, working them out and caching them the first time
+static const AChatPeerKey* a_chat_group_peer(AChatGroupKeys* keys, const uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE]) {
+    if (keys->peers_capacity > 0) {
+        size_t index = a_chat_group_peer_index(public_key, keys->peers_capacity);
+        while (keys->peers[index].used) {
+            if (memcmp(keys->peers[index].public_key, public_key, A_CHAT_PUBLIC_KEY_SIZE) == 0) {
+                return &keys->peers[index];
+            }
+            index = (index + 1) & (keys->peers_capacity - 1);
+        }
+    }
+
+    // keep the table under three quarters full
+    if ((keys->number_of_peers + 1) * 4 > keys->peers_capacity * 3 && !a_chat_group_peers_grow(keys)) { return NULL; }
+
+    uint8_t shared_secret[A_CHAT_X25519_KEY_SIZE];
+    if (!a_chat_x25519(shared_secret, keys->private_key, public_key)) {
+        a_chat_log_error("Peer's public key is invalid");
+        return NULL;
+    }
+
+    // both sides must derive the same key, so the public keys go into it in sorted order
+    uint8_t info[A_CHAT_PUBLIC_KEY_SIZE * 2];
+    bool ours_first = memcmp(keys->public_key, public_key, A_CHAT_PUBLIC_KEY_SIZE) < 0;
+    memcpy(info, ours_first ? keys->public_key : public_key, A_CHAT_PUBLIC_KEY_SIZE);
+    memcpy(info + A_CHAT_PUBLIC_KEY_SIZE, ours_first ? public_key : keys->public_key, A_CHAT_PUBLIC_KEY_SIZE);
+
+    size_t index = a_chat_group_peer_index(public_key, keys->peers_capacity);
+    while (keys->peers[index].used) {
+        index = (index + 1) & (keys->peers_capacity - 1);
+    }
+    AChatPeerKey* peer = &keys->peers[index];
+    peer->used = true;
+    memcpy(peer->public_key, public_key, A_CHAT_PUBLIC_KEY_SIZE);
+    // the same secret, but a different salt, so a direct message key can't unwrap a group key or the other way around
+    a_chat_hkdf_sha256((const uint8_t*) a_chat_group_wrap_salt, sizeof(a_chat_group_wrap_salt) - 1, shared_secret, sizeof(shared_secret), info, sizeof(info), peer->wrap_key, sizeof(peer->wrap_key));
+    a_chat_hkdf_sha256((const uint8_t*) a_chat_group_direct_salt, sizeof(a_chat_group_direct_salt) - 1, shared_secret, sizeof(shared_secret), info, sizeof(info), peer->direct_key, sizeof(peer->direct_key));
+    keys->number_of_peers++;
+
+    a_chat_group_wipe(shared_secret, sizeof(shared_secret));
+
+    return peer;
+}
+
+static const uint8_t* a_chat_group_wrap_key(AChatGroupKeys* keys, const uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE]) {
+    const AChatPeerKey* peer = a_chat_group_peer(keys, public_key);
+    return peer ? peer->wrap_key : NULL;
+}
+
+const uint8_t* a_chat_group_keys_direct_key(AChatGroupKeys* keys, const uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE]) {
+    const AChatPeerKey* peer = a_chat_group_peer(keys, public_key);
+    return peer ? peer->direct_key : NULL;
+}
+
+// binds a wrapped key to its room, epoch, sender and recipient
+static size_t a_chat_group_wrap_aad(uint8_t* aad, const AChatGroupRoom* room, uint32_t epoch, const uint8_t* sender, const uint8_t* recipient) {
+    size_t length = 0;
+    aad[length++] = (uint8_t) (room->name_length >> 8);
+    aad[length++] = (uint8_t) room->name_length;
+    memcpy(aad + length, room->name, room->name_length);
+    length += room->name_length;
+    aad[length++] = (uint8_t) (epoch >> 24);
+    aad[length++] = (uint8_t) (epoch >> 16);
+    aad[length++] = (uint8_t) (epoch >> 8);
+    aad[length++] = (uint8_t) epoch;
+    memcpy(aad + length, sender, A_CHAT_PUBLIC_KEY_SIZE);
+    length += A_CHAT_PUBLIC_KEY_SIZE;
+    memcpy(aad + length, recipient, A_CHAT_PUBLIC_KEY_SIZE);
+    length += A_CHAT_PUBLIC_KEY_SIZE;
+
+    return length;
+}
+
+// binary search, returns where the member is or where it would go
+static size_t a_chat_group_member_search(const AChatGroupRoom* room, const uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE], bool* found) {
+    size_t low = 0, high = room->number_of_members;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int order = memcmp(room->members[middle].public_key, public_key, A_CHAT_PUBLIC_KEY_SIZE);
+        if (order == 0) {
+            *found = true;
+            return middle;
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    *found = false;
+    return low;
+}
+
+static AChatGroupMember* a_chat_group_member_find(const AChatGroupRoom* room, const uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE]) {
+    bool found;
+    size_t index = a_chat_group_member_search(room, public_key, &found);
+    return found ? &room->members[index] : NULL;
+}
+
+// adds a member that hasn't been heard of before, returns the existing one otherwise
+static AChatGroupMember* a_chat_group_member_add(AChatGroupRoom* room, const uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE], bool present) {
+    bool found;
+    size_t index = a_chat_group_member_search(room, public_key, &found);
+    if (found) { return &room->members[index]; }
+
+    if (room->number_of_members == room->members_capacity) {
+        size_t new_capacity = room->members_capacity ? room->members_capacity * 2 : A_CHAT_GROUP_MEMBERS_INITIAL_CAPACITY;
+        AChatGroupMember* new_members = realloc(room->members, sizeof(AChatGroupMember) * new_capacity);
+        if (!new_members) {
+            a_chat_log_error("Failed to allocate memory for room members");
+            return NULL;
+        }
+        room->members = new_members;
+        room->members_capacity = new_capacity;
+    }
+
+    memmove(&room->members[index + 1], &room->members[index], sizeof(AChatGroupMember) * (room->number_of_members - index));
+    memcpy(room->members[index].public_key, public_key, A_CHAT_PUBLIC_KEY_SIZE);
+    room->members[index].present = present;
+    room->number_of_members++;
+    if (present) {
+        room->number_present++;
+    }
+
+    return &room->members[index];
+}
+
+static const uint8_t* a_chat_group_leader(const AChatGroupRoom* room) {
+    for (size_t i = 0; i < room->number_of_members; i++) {
+        if (room->members[i].present) {
+            return room->members[i].public_key;
+        }
+    }
+    return NULL;
+}
+
+static bool a_chat_group_is_leader(const AChatGroupKeys* keys, const AChatGroupRoom* room) {
+    const uint8_t* leader = a_chat_group_leader(room);
+    return leader && memcmp(leader, keys->public_key, A_CHAT_PUBLIC_KEY_SIZE) == 0;
+}
+
+// only the leader rekeys, and the first change starts the clock so later changes ride along with it
+static void a_chat_group_schedule(const AChatGroupKeys* keys, AChatGroupRoom* room, uint64_t now) {
+    if (!a_chat_group_is_leader(keys, room) || (room->current.valid && !room->stale)) {
+        room->rekey_at = 0;
+        return;
+    }
+
+    if (room->rekey_at == 0) {
+        room->rekey_at = now + (room->current.valid ? A_CHAT_GROUP_REKEY_DELAY_MS : A_CHAT_GROUP_FIRST_KEY_DELAY_MS);
+    }
+}
+
+static void a_chat_group_install(AChatGroupRoom* room, uint32_t epoch, const uint8_t key[A_CHAT_AES_GCM_KEY_SIZE], const uint8_t sender[A_CHAT_PUBLIC_KEY_SIZE]) {
+    if (room->current.valid && room->current.epoch != epoch) {
+        room->previous = room->current;
+    }
+
+    room->current.valid = true;
+    room->current.epoch = epoch;
+    a_chat_aes_gcm_init(&room->current.cipher, key);
+    memcpy(room->current_sender, sender, A_CHAT_PUBLIC_KEY_SIZE);
+    if (epoch > room->highest_epoch) {
+        room->highest_epoch = epoch;
+    }
+}
+
+static void a_chat_group_room_free(AChatGroupRoom* room) {
+    free(room->members);
+    a_chat_group_wipe(room, sizeof(AChatGroupRoom));
+    free(room);
+}
+
+bool a_chat_group_keys_init(AChatGroupKeys* keys) {
+    // a fresh key pair every session, so nothing long lived is ever at risk
+    if (!a_chat_x25519_generate(keys->private_key, keys->public_key)) { return false; }
+
+    keys->rooms = NULL;
+    keys->peers = NULL;
+    keys->peers_capacity = 0;
+    keys->number_of_peers = 0;
+
+    return true;
+}
+
+void a_chat_group_keys_destroy(AChatGroupKeys* keys) {
+    while (keys->rooms) {
+        AChatGroupRoom* next = keys->rooms->next;
+        a_chat_group_room_free(keys->rooms);
+        keys->rooms = next;
+    }
+
+    if (keys->peers) {
+        a_chat_group_wipe(keys->peers, keys->peers_capacity * sizeof(AChatPeerKey));
+        free(keys->peers);
+    }
+    a_chat_group_wipe(keys, sizeof(AChatGroupKeys));
+}
+
+AChatGroupRoom* a_chat_group_keys_find(const AChatGroupKeys* keys, const char* name, size_t length) {
+    for (AChatGroupRoom* room = keys->rooms; room; room = room->next) {
+        if (room->name_length == length && memcmp(room->name, name, length) == 0) {
+            return room;
+        }
+    }
+    return NULL;
+}
+
+const AChatAesGcm* a_chat_group_keys_cipher(const AChatGroupKeys* keys, const char* name, size_t length, uint32_t epoch) {
+    AChatGroupRoom* room = a_chat_group_keys_find(keys, name, length);
+    if (!room) { return NULL; }
+
+    if (room->current.valid && room->current.epoch == epoch) { return &room->current.cipher; }
+    if (room->previous.valid && room->previous.epoch == epoch) { return &room->previous.cipher; }
+    return NULL;
+}
+
+bool a_chat_group_keys_join(AChatGroupKeys* keys, const char* name, size_t length, uint64_t now) {
+    if (length == 0 || length > A_CHAT_ROOM_NAME_MAXIMUM_LENGTH) { return false; }
+    if (a_chat_group_keys_find(keys, name, length)) { return true; }
+
+    AChatGroupRoom* room = calloc(1, sizeof(AChatGroupRoom));
+    if (!room) {
+        a_chat_log_error("Failed to allocate memory for room keys");
+        return false;
+    }
+    memcpy(room->name, name, length);
+    room->name_length = length;
+
+    // until the leader's key arrives this client only knows about itself
+    if (!a_chat_group_member_add(room, keys->public_key, true)) {
+        free(room);
+        return false;
+    }
+    a_chat_group_schedule(keys, room, now);
+
+    room->next = keys->rooms;
+    keys->rooms = room;
+
+    return true;
+}
+
+void a_chat_group_keys_leave(AChatGroupKeys* keys, const char* name, size_t length) {
+    for (AChatGroupRoom** link = &keys->rooms; *link; link = &(*link)->next) {
+        AChatGroupRoom* room = *link;
+        if (room->name_length == length && memcmp(room->name, name, length) == 0) {
+            *link = room->next;
+            a_chat_group_room_free(room);
+            return;
+        }
+    }
+}
+
+void a_chat_group_keys_member(AChatGroupKeys* keys, const char* name, size_t length, bool joined, const uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE], uint64_t now) {
+    AChatGroupRoom* room = a_chat_group_keys_find(keys, name, length);
+    if (!room || memcmp(public_key, keys->public_key, A_CHAT_PUBLIC_KEY_SIZE) == 0) { return; }
+
+    size_t number_of_members = room->number_of_members;
+    AChatGroupMember* member = a_chat_group_member_add(room, public_key, joined);
+    if (!member) { return; }
+
+    if (room->number_of_members != number_of_members) {
+        // someone who has left before this client heard of them is only remembered so they can't come back
+        if (joined) {
+            room->stale = true;
+        }
+    } else if (member->present != joined) {
+        member->present = joined;
+        if (joined) {
+            room->number_present++;
+        } else {
+            room->number_present--;
+        }
+        room->stale = true;
+    }
+
+    a_chat_group_schedule(keys, room, now);
+}
+
+AChatGroupKeyResult a_chat_group_keys_receive(AChatGroupKeys* keys, const char* name, size_t length, const uint8_t sender[A_CHAT_PUBLIC_KEY_SIZE], const uint8_t* body, size_t body_length, uint64_t now) {
+    AChatGroupRoom* room = a_chat_group_keys_find(keys, name, length);
+    if (!room || memcmp(sender, keys->public_key, A_CHAT_PUBLIC_KEY_SIZE) == 0) { return A_CHAT_GROUP_KEY_IGNORED; }
+
+    if (body_length < A_CHAT_GROUP_KEY_HEADER_SIZE || (body_length - A_CHAT_GROUP_KEY_HEADER_SIZE) % A_CHAT_GROUP_KEY_ENTRY_SIZE != 0) {
+        a_chat_log_error("Received invalid group key");
+        return A_CHAT_GROUP_KEY_IGNORED;
+    }
+    uint32_t epoch = ((uint32_t) body[0] << 24) | ((uint32_t) body[1] << 16) | ((uint32_t) body[2] << 8) | body[3];
+    const uint8_t* entries = body + A_CHAT_GROUP_KEY_HEADER_SIZE;
+    size_t number_of_entries = (body_length - A_CHAT_GROUP_KEY_HEADER_SIZE) / A_CHAT_GROUP_KEY_ENTRY_SIZE;
+
+    // a key from someone who has left is out of date
+    AChatGroupMember* sender_member = a_chat_group_member_find(room, sender);
+    if (sender_member && !sender_member->present) { return A_CHAT_GROUP_KEY_IGNORED; }
+
+    // everyone the key was made for is in the room, which is how a client that has just joined learns who else is
+    size_t number_of_members = room->number_of_members;
+    if (!sender_member) {
+        a_chat_group_member_add(room, sender, true);
+    }
+    const uint8_t* own_entry = NULL;
+    for (size_t i = 0; i < number_of_entries; i++) {
+        const uint8_t* entry = entries + i * A_CHAT_GROUP_KEY_ENTRY_SIZE;
+        if (memcmp(entry, keys->public_key, A_CHAT_PUBLIC_KEY_SIZE) == 0) {
+            own_entry = entry;
+        } else {
+            a_chat_group_member_add(room, entry, true);
+        }
+    }
+    if (epoch > room->highest_epoch) {
+        room->highest_epoch = epoch;
+    }
+
+    // the newest key wins, and two leaders racing on the same epoch are settled by the smaller public key
+    bool newer = !room->current.valid || epoch > room->current.epoch || (epoch == room->current.epoch && memcmp(sender, room->current_sender, A_CHAT_PUBLIC_KEY_SIZE) < 0);
+    bool accepted = false;
+    if (own_entry && newer) {
+        const uint8_t* wrap_key = a_chat_group_wrap_key(keys, sender);
+        if (wrap_key) {
+            AChatAesGcm wrap;
+            a_chat_aes_gcm_init(&wrap, wrap_key);
+
+            uint8_t aad[2 + A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 4 + A_CHAT_PUBLIC_KEY_SIZE * 2];
+            size_t aad_length = a_chat_group_wrap_aad(aad, room, epoch, sender, keys->public_key);
+
+            const uint8_t* nonce = own_entry + A_CHAT_PUBLIC_KEY_SIZE;
+            const uint8_t* wrapped = nonce + A_CHAT_AES_GCM_NONCE_SIZE;
+            const uint8_t* tag = wrapped + A_CHAT_AES_GCM_KEY_SIZE;
+            uint8_t group_key[A_CHAT_AES_GCM_KEY_SIZE];
+            if (a_chat_aes_gcm_decrypt(&wrap, nonce, aad, aad_length, wrapped, A_CHAT_AES_GCM_KEY_SIZE, tag, group_key)) {
+                a_chat_group_install(room, epoch, group_key, sender);
+                accepted = true;
+            } else {
+                a_chat_log_error("Failed to unwrap group key");
+            }
+
+            a_chat_group_wipe(group_key, sizeof(group_key));
+            a_chat_aes_gcm_destroy(&wrap);
+        }
+    }
+
+    // the key is up to date if it was made for every member still here, counting the sender and this client
+    if (accepted) {
+        size_t covered = 2;
+        for (size_t i = 0; i < number_of_entries; i++) {
+            const uint8_t* entry = entries + i * A_CHAT_GROUP_KEY_ENTRY_SIZE;
+            if (entry == own_entry) { continue; }
+
+            AChatGroupMember* member = a_chat_group_member_find(room, entry);
+            if (member && member->present) {
+                covered++;
+            }
+        }
+        room->stale = covered < room->number_present;
+    } else if (room->number_of_members != number_of_members) {
+        room->stale = true;
+    }
+
+    a_chat_group_schedule(keys, room, now);
+
+    // clients only hear about members that join after them, so a leader that joined later doesn't know this client is here
+    if (!own_entry && memcmp(a_chat_group_leader(room), sender, A_CHAT_PUBLIC_KEY_SIZE) == 0) {
+        return A_CHAT_GROUP_KEY_EXCLUDED;
+    }
+
+    return accepted ? A_CHAT_GROUP_KEY_ACCEPTED : A_CHAT_GROUP_KEY_IGNORED;
+}
+
+uint64_t a_chat_group_keys_next_rekey(const AChatGroupKeys* keys) {
+    uint64_t next = 0;
+    for (AChatGroupRoom* room = keys->rooms; room; room = room->next) {
+        if (room->rekey_at != 0 && (next == 0 || room->rekey_at < next)) {
+            next = room->rekey_at;
+        }
+    }
+    return next;
+}
+
+uint8_t* a_chat_group_keys_rekey(AChatGroupKeys* keys, uint64_t now, size_t* length) {
+    AChatGroupRoom* room = keys->rooms;
+    while (room && (room->rekey_at == 0 || room->rekey_at > now)) {
+        room = room->next;
+    }
+    if (!room) { return NULL; }
+    room->rekey_at = 0;
+
+    uint32_t epoch = (room->highest_epoch > room->current.epoch ? room->highest_epoch : room->current.epoch) + 1;
+
+    // the group key and a nonce base, every entry's nonce is the base with its index in the last 4 bytes
+    uint8_t random[A_CHAT_AES_GCM_KEY_SIZE + A_CHAT_AES_GCM_NONCE_SIZE];
+    if (getrandom(random, sizeof(random), 0) != sizeof(random)) {
+        a_chat_log_error_errno("Failed to generate group key");
+        return NULL;
+    }
+    const uint8_t* group_key = random;
+    uint8_t nonce[A_CHAT_AES_GCM_NONCE_SIZE];
+    memcpy(nonce, random + A_CHAT_AES_GCM_KEY_SIZE, sizeof(nonce));
+
+    // payload: room name length, room name, epoch, then one entry for every other member
+    size_t header_length = 2 + room->name_length + A_CHAT_GROUP_KEY_HEADER_SIZE;
+    size_t maximum_length = header_length + (room->number_present - 1) * A_CHAT_GROUP_KEY_ENTRY_SIZE;
+    if (maximum_length > A_CHAT_FRAME_MAXIMUM_LENGTH) {
+        a_chat_log_error("Room has too many members to rekey");
+        a_chat_group_wipe(random, sizeof(random));
+        return NULL;
+    }
+    uint8_t* payload = malloc(maximum_length);
+    if (!payload) {
+        a_chat_log_error("Failed to allocate memory for group key");
+        a_chat_group_wipe(random, sizeof(random));
+        return NULL;
+    }
+
+    payload[0] = (uint8_t) (room->name_length >> 8);
+    payload[1] = (uint8_t) room->name_length;
+    memcpy(payload + 2, room->name, room->name_length);
+    uint8_t* body = payload + 2 + room->name_length;
+    body[0] = (uint8_t) (epoch >> 24);
+    body[1] = (uint8_t) (epoch >> 16);
+    body[2] = (uint8_t) (epoch >> 8);
+    body[3] = (uint8_t) epoch;
+
+    size_t offset = header_length;
+    uint32_t index = 0;
+    for (size_t i = 0; i < room->number_of_members; i++) {
+        AChatGroupMember* member = &room->members[i];
+        if (!member->present || memcmp(member->public_key, keys->public_key, A_CHAT_PUBLIC_KEY_SIZE) == 0) { continue; }
+
+        // a member whose key can't be used just doesn't get the group key
+        const uint8_t* wrap_key = a_chat_group_wrap_key(keys, member->public_key);
+        if (!wrap_key) { continue; }
+
+        AChatAesGcm wrap;
+        a_chat_aes_gcm_init(&wrap, wrap_key);
+
+        uint8_t* entry = payload + offset;
+        memcpy(entry, member->public_key, A_CHAT_PUBLIC_KEY_SIZE);
+        nonce[8] = (uint8_t) (index >> 24);
+        nonce[9] = (uint8_t) (index >> 16);
+        nonce[10] = (uint8_t) (index >> 8);
+        nonce[11] = (uint8_t) index;
+        index++;
+        memcpy(entry + A_CHAT_PUBLIC_KEY_SIZE, nonce, sizeof(nonce));
+
+        uint8_t aad[2 + A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 4 + A_CHAT_PUBLIC_KEY_SIZE * 2];
+        size_t aad_length = a_chat_group_wrap_aad(aad, room, epoch, keys->public_key, member->public_key);
+        uint8_t* wrapped = entry + A_CHAT_PUBLIC_KEY_SIZE + A_CHAT_AES_GCM_NONCE_SIZE;
+        a_chat_aes_gcm_encrypt(&wrap, nonce, aad, aad_length, group_key, A_CHAT_AES_GCM_KEY_SIZE, wrapped, wrapped + A_CHAT_AES_GCM_KEY_SIZE);
+        a_chat_aes_gcm_destroy(&wrap);
+
+        offset += A_CHAT_GROUP_KEY_ENTRY_SIZE;
+    }
+
+    // the leader uses the new key straight away, the relayed copy that comes back to it is ignored
+    a_chat_group_install(room, epoch, group_key, keys->public_key);
+    room->stale = false;
+    a_chat_group_wipe(random, sizeof(random));
+
+    *length = offset;
+    return payload;
+}
@@ -0,0 +1,276 @@
+#include "crypto/aes_gcm.h"
+
+#include <string.h>
+
+#ifdef A_CHAT_AES_GCM_X86
+#include <cpuid.h>
+#endif
+
+static const uint8_t a_chat_aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static const uint8_t a_chat_aes_round_constants[A_CHAT_AES_ROUNDS] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+
+static void a_chat_aes_expand_key(const uint8_t key[A_CHAT_AES_GCM_KEY_SIZE], uint8_t* round_keys) {
+    memcpy(round_keys, key, A_CHAT_AES_GCM_KEY_SIZE);
+
+    // every word is the word before it, mixed with the word a whole round key back
+    for (int i = 4; i < (A_CHAT_AES_ROUNDS + 1) * 4; i++) {
+        uint8_t word[4];
+        memcpy(word, round_keys + (i - 1) * 4, 4);
+
+        if (i % 4 == 0) {
+            uint8_t first = word[0];
+            word[0] = a_chat_aes_sbox[word[1]] ^ a_chat_aes_round_constants[i / 4 - 1];
+            word[1] = a_chat_aes_sbox[word[2]];
+            word[2] = a_chat_aes_sbox[word[3]];
+            word[3] = a_chat_aes_sbox[first];
+        }
+
+        for (int j = 0; j < 4; j++) {
+            round_keys[i * 4 + j] = round_keys[(i - 4) * 4 + j] ^ word[j];
+        }
+    }
+}
+
+static uint8_t a_chat_aes_double(uint8_t value) {
+    return (uint8_t) ((value << 1) ^ ((value >> 7) * 0x1b));
+}
+
+static void a_chat_aes_encrypt_block(const uint8_t* round_keys, const uint8_t input[A_CHAT_AES_BLOCK_SIZE], uint8_t output[A_CHAT_AES_BLOCK_SIZE]) {
+    // the state is stored column by column, so byte (row, column) is at column * 4 + row
+    uint8_t state[A_CHAT_AES_BLOCK_SIZE];
+    for (int i = 0; i < A_CHAT_AES_BLOCK_SIZE; i++) {
+        state[i] = input[i] ^ round_keys[i];
+    }
+
+    for (int round = 1; round <= A_CHAT_AES_ROUNDS; round++) {
+        // SubBytes and ShiftRows together, row r is rotated left by r columns
+        uint8_t shifted[A_CHAT_AES_BLOCK_SIZE];
+        for (int column = 0; column < 4; column++) {
+            for (int row = 0; row < 4; row++) {
+                shifted[column * 4 + row] = a_chat_aes_sbox[state[((column + row) % 4) * 4 + row]];
+            }
+        }
+
+        // MixColumns, skipped by the last round
+        if (round != A_CHAT_AES_ROUNDS) {
+            for (int column = 0; column < 4; column++) {
+                uint8_t* c = shifted + column * 4;
+                uint8_t a0 = c[0], a1 = c[1], a2 = c[2], a3 = c[3];
+                uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+                c[0] = a0 ^ all ^ a_chat_aes_double(a0 ^ a1);
+                c[1] = a1 ^ all ^ a_chat_aes_double(a1 ^ a2);
+                c[2] = a2 ^ all ^ a_chat_aes_double(a2 ^ a3);
+                c[3] = a3 ^ all ^ a_chat_aes_double(a3 ^ a0);
+            }
+        }
+
+        for (int i = 0; i < A_CHAT_AES_BLOCK_SIZE; i++) {
+            state[i] = shifted[i] ^ round_keys[round * A_CHAT_AES_BLOCK_SIZE + i];
+        }
+    }
+
+    memcpy(output, state, A_CHAT_AES_BLOCK_SIZE);
+}
+
+static uint64_t a_chat_aes_gcm_load64(const uint8_t* bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+static void a_chat_aes_gcm_store64(uint8_t* bytes, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = (uint8_t) value;
+        value >>= 8;
+    }
+}
+
+// the 32-bit counter at the end of the counter block is big-endian and wraps on its own
+static void a_chat_aes_gcm_increment(uint8_t counter[A_CHAT_AES_BLOCK_SIZE]) {
+    for (int i = A_CHAT_AES_BLOCK_SIZE - 1; i >= A_CHAT_AES_BLOCK_SIZE - 4; i--) {
+        if (++counter[i] != 0) { break; }
+    }
+}
+
+void a_chat_aes_gcm_ctr_portable(const AChatAesGcm* gcm, const uint8_t counter[A_CHAT_AES_BLOCK_SIZE], const uint8_t* input, uint8_t* output, size_t length) {
+    uint8_t block[A_CHAT_AES_BLOCK_SIZE];
+    memcpy(block, counter, A_CHAT_AES_BLOCK_SIZE);
+
+    while (length > 0) {
+        uint8_t keystream[A_CHAT_AES_BLOCK_SIZE];
+        a_chat_aes_encrypt_block(gcm->round_keys, block, keystream);
+        a_chat_aes_gcm_increment(block);
+
+        size_t chunk = length < A_CHAT_AES_BLOCK_SIZE ? length : A_CHAT_AES_BLOCK_SIZE;
+        for (size_t i = 0; i < chunk; i++) {
+            output[i] = input[i] ^ keystream[i];
+        }
+
+        input += chunk;
+        output += chunk;
+        length -= chunk;
+    }
+}
+
+void a_chat_aes_gcm_ghash_portable(const AChatAesGcm* gcm, uint8_t state[A_CHAT_AES_BLOCK_SIZE], const uint8_t* data, size_t length) {
+    uint64_t h_high = a_chat_aes_gcm_load64(gcm->hash_key);
+    uint64_t h_low = a_chat_aes_gcm_load64(gcm->hash_key + 8);
+    uint64_t x_high = a_chat_aes_gcm_load64(state);
+    uint64_t x_low = a_chat_aes_gcm_load64(state + 8);
+
+    while (length > 0) {
+        uint8_t block[A_CHAT_AES_BLOCK_SIZE] = {0};
+        size_t chunk = length < A_CHAT_AES_BLOCK_SIZE ? length : A_CHAT_AES_BLOCK_SIZE;
+        memcpy(block, data, chunk);
+
+        x_high ^= a_chat_aes_gcm_load64(block);
+        x_low ^= a_chat_aes_gcm_load64(block + 8);
+
+        // multiply by H in GF(2^128) one bit at a time, masks instead of branches keep it constant time
+        uint64_t z_high = 0, z_low = 0;
+        uint64_t v_high = h_high, v_low = h_low;
+        for (int i = 0; i < 128; i++) {
+            uint64_t bit = i < 64 ? (x_high >> (63 - i)) & 1 : (x_low >> (127 - i)) & 1;
+            uint64_t mask = 0 - bit;
+            z_high ^= v_high & mask;
+            z_low ^= v_low & mask;
+
+            uint64_t carry = 0 - (v_low & 1);
+            v_low = (v_low >> 1) | (v_high << 63);
+            v_high = (v_high >> 1) ^ (0xe100000000000000ull & carry);
+        }
+        x_high = z_high;
+        x_low = z_low;
+
+        data += chunk;
+        length -= chunk;
+    }
+
+    a_chat_aes_gcm_store64(state, x_high);
+    a_chat_aes_gcm_store64(state + 8, x_low);
+}
+
+bool a_chat_aes_gcm_is_accelerated(void) {
+#ifdef A_CHAT_AES_GCM_X86
+    // cpuid leaf 1, ecx bit 25 is AES-NI, bit 1 is PCLMULQDQ, and bit 19 is SSE4.1 which the kernels use too
+    static int accelerated = -1;
+    if (accelerated == -1) {
+        unsigned int eax, ebx, ecx, edx;
+        accelerated = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 25)) && (ecx & (1u << 1)) && (ecx & (1u << 19));
+    }
+    return accelerated;
+#else
+    return false;
+#endif
+}
+
+void a_chat_aes_gcm_init(AChatAesGcm* gcm, const uint8_t key[A_CHAT_AES_GCM_KEY_SIZE]) {
+    // AES-NI uses the same round keys, so the key is always expanded here
+    a_chat_aes_expand_key(key, gcm->round_keys);
+
+    uint8_t zero[A_CHAT_AES_BLOCK_SIZE] = {0};
+    a_chat_aes_encrypt_block(gcm->round_keys, zero, gcm->hash_key);
+
+    gcm->accelerated = a_chat_aes_gcm_is_accelerated();
+}
+
+void a_chat_aes_gcm_destroy(AChatAesGcm* gcm) {
+    // volatile so the wipe isn't optimised away
+    volatile uint8_t* bytes = (volatile uint8_t*) gcm;
+    for (size_t i = 0; i < sizeof(AChatAesGcm); i++) {
+        bytes[i] = 0;
+    }
+}
+
+static void a_chat_aes_gcm_ctr(const AChatAesGcm* gcm, const uint8_t counter[A_CHAT_AES_BLOCK_SIZE], const uint8_t* input, uint8_t* output, size_t length) {
+#ifdef A_CHAT_AES_GCM_X86
+    if (gcm->accelerated) {
+        a_chat_aes_gcm_ctr_x86(gcm, counter, input, output, length);
+        return;
+    }
+#endif
+    a_chat_aes_gcm_ctr_portable(gcm, counter, input, output, length);
+}
+
+static void a_chat_aes_gcm_ghash(const AChatAesGcm* gcm, uint8_t state[A_CHAT_AES_BLOCK_SIZE], const uint8_t* data, size_t length) {
+#ifdef A_CHAT_AES_GCM_X86
+    if (gcm->accelerated) {
+        a_chat_aes_gcm_ghash_x86(gcm, state, data, length);
+        return;
+    }
+#endif
+    a_chat_aes_gcm_ghash_portable(gcm, state, data, length);
+}
+
+// computes the tag over the aad and ciphertext, J0 is the nonce followed by a counter of 1
+static void a_chat_aes_gcm_tag(const AChatAesGcm* gcm, const uint8_t j0[A_CHAT_AES_BLOCK_SIZE], const uint8_t* aad, size_t aad_length, const uint8_t* ciphertext, size_t length, uint8_t tag[A_CHAT_AES_GCM_TAG_SIZE]) {
+    uint8_t state[A_CHAT_AES_BLOCK_SIZE] = {0};
+    a_chat_aes_gcm_ghash(gcm, state, aad, aad_length);
+    a_chat_aes_gcm_ghash(gcm, state, ciphertext, length);
+
+    // the lengths are in bits
+    uint8_t lengths[A_CHAT_AES_BLOCK_SIZE];
+    a_chat_aes_gcm_store64(lengths, (uint64_t) aad_length * 8);
+    a_chat_aes_gcm_store64(lengths + 8, (uint64_t) length * 8);
+    a_chat_aes_gcm_ghash(gcm, state, lengths, sizeof(lengths));
+
+    // the tag is the hash masked with the encryption of J0
+    a_chat_aes_gcm_ctr(gcm, j0, state, tag, A_CHAT_AES_GCM_TAG_SIZE);
+}
+
+void a_chat_aes_gcm_encrypt(const AChatAesGcm* gcm, const uint8_t nonce[A_CHAT_AES_GCM_NONCE_SIZE], const uint8_t* aad, size_t aad_length, const uint8_t* plaintext, size_t length, uint8_t* ciphertext, uint8_t tag[A_CHAT_AES_GCM_TAG_SIZE]) {
+    uint8_t j0[A_CHAT_AES_BLOCK_SIZE] = {0};
+    memcpy(j0, nonce, A_CHAT_AES_GCM_NONCE_SIZE);
+    j0[A_CHAT_AES_BLOCK_SIZE - 1] = 1;
+
+    // the message is encrypted starting from the counter after J0
+    uint8_t counter[A_CHAT_AES_BLOCK_SIZE];
+    memcpy(counter, j0, A_CHAT_AES_BLOCK_SIZE);
+    a_chat_aes_gcm_increment(counter);
+    a_chat_aes_gcm_ctr(gcm, counter, plaintext, ciphertext, length);
+
+    a_chat_aes_gcm_tag(gcm, j0, aad, aad_length, ciphertext, length, tag);
+}
+
+bool a_chat_aes_gcm_decrypt(const AChatAesGcm* gcm, const uint8_t nonce[A_CHAT_AES_GCM_NONCE_SIZE], const uint8_t* aad, size_t aad_length, const uint8_t* ciphertext, size_t length, const uint8_t tag[A_CHAT_AES_GCM_TAG_SIZE], uint8_t* plaintext) {
+    uint8_t j0[A_CHAT_AES_BLOCK_SIZE] = {0};
+    memcpy(j0, nonce, A_CHAT_AES_GCM_NONCE_SIZE);
+    j0[A_CHAT_AES_BLOCK_SIZE - 1] = 1;
+
+    // check the tag before decrypting anything, and compare it in constant time
+    uint8_t expected[A_CHAT_AES_GCM_TAG_SIZE];
+    a_chat_aes_gcm_tag(gcm, j0, aad, aad_length, ciphertext, length, expected);
+
+    uint8_t difference = 0;
+    for (int i = 0; i < A_CHAT_AES_GCM_TAG_SIZE; i++) {
+        difference |= expected[i] ^ tag[i];
+    }
+    if (difference != 0) { return false; }
+
+    uint8_t counter[A_CHAT_AES_BLOCK_SIZE];
+    memcpy(counter, j0, A_CHAT_AES_BLOCK_SIZE);
+    a_chat_aes_gcm_increment(counter);
+    a_chat_aes_gcm_ctr(gcm, counter, ciphertext, plaintext, length);
+
+    return true;
+}
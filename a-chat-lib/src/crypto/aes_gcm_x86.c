@@ -0,0 +1,132 @@
+#include "crypto/aes_gcm.h"
+
+#ifdef A_CHAT_AES_GCM_X86
+
+#include <immintrin.h>
+#include <string.h>
+
+// only these functions are built for AES-NI, so the rest of the library still runs on cpus without it
+#define A_CHAT_AES_GCM_TARGET __attribute__((target("aes,pclmul,ssse3,sse4.1")))
+
+// how many counter blocks are kept in flight, aesenc has a latency of several cycles but can issue every cycle
+#define A_CHAT_AES_GCM_X86_INTERLEAVE 4
+
+A_CHAT_AES_GCM_TARGET static __m128i a_chat_aes_gcm_x86_reverse(__m128i value) {
+    return _mm_shuffle_epi8(value, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+A_CHAT_AES_GCM_TARGET void a_chat_aes_gcm_ctr_x86(const AChatAesGcm* gcm, const uint8_t counter[A_CHAT_AES_BLOCK_SIZE], const uint8_t* input, uint8_t* output, size_t length) {
+    __m128i keys[A_CHAT_AES_ROUNDS + 1];
+    for (int i = 0; i <= A_CHAT_AES_ROUNDS; i++) {
+        keys[i] = _mm_load_si128((const __m128i*) (gcm->round_keys + i * A_CHAT_AES_BLOCK_SIZE));
+    }
+
+    // the counter is kept byte reversed, so its big-endian 32-bit tail is the lowest lane and wraps on its own with add_epi32
+    __m128i reversed = a_chat_aes_gcm_x86_reverse(_mm_loadu_si128((const __m128i*) counter));
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+
+    while (length >= A_CHAT_AES_GCM_X86_INTERLEAVE * A_CHAT_AES_BLOCK_SIZE) {
+        __m128i blocks[A_CHAT_AES_GCM_X86_INTERLEAVE];
+        for (int i = 0; i < A_CHAT_AES_GCM_X86_INTERLEAVE; i++) {
+            blocks[i] = _mm_xor_si128(a_chat_aes_gcm_x86_reverse(reversed), keys[0]);
+            reversed = _mm_add_epi32(reversed, one);
+        }
+
+        for (int round = 1; round < A_CHAT_AES_ROUNDS; round++) {
+            for (int i = 0; i < A_CHAT_AES_GCM_X86_INTERLEAVE; i++) {
+                blocks[i] = _mm_aesenc_si128(blocks[i], keys[round]);
+            }
+        }
+
+        for (int i = 0; i < A_CHAT_AES_GCM_X86_INTERLEAVE; i++) {
+            __m128i keystream = _mm_aesenclast_si128(blocks[i], keys[A_CHAT_AES_ROUNDS]);
+            __m128i data = _mm_loadu_si128((const __m128i*) (input + i * A_CHAT_AES_BLOCK_SIZE));
+            _mm_storeu_si128((__m128i*) (output + i * A_CHAT_AES_BLOCK_SIZE), _mm_xor_si128(data, keystream));
+        }
+
+        input += A_CHAT_AES_GCM_X86_INTERLEAVE * A_CHAT_AES_BLOCK_SIZE;
+        output += A_CHAT_AES_GCM_X86_INTERLEAVE * A_CHAT_AES_BLOCK_SIZE;
+        length -= A_CHAT_AES_GCM_X86_INTERLEAVE * A_CHAT_AES_BLOCK_SIZE;
+    }
+
+    // whatever is left, including a partial last block
+    while (length > 0) {
+        __m128i block = _mm_xor_si128(a_chat_aes_gcm_x86_reverse(reversed), keys[0]);
+        reversed = _mm_add_epi32(reversed, one);
+        for (int round = 1; round < A_CHAT_AES_ROUNDS; round++) {
+            block = _mm_aesenc_si128(block, keys[round]);
+        }
+        block = _mm_aesenclast_si128(block, keys[A_CHAT_AES_ROUNDS]);
+
+        uint8_t keystream[A_CHAT_AES_BLOCK_SIZE];
+        _mm_storeu_si128((__m128i*) keystream, block);
+
+        size_t chunk = length < A_CHAT_AES_BLOCK_SIZE ? length : A_CHAT_AES_BLOCK_SIZE;
+        for (size_t i = 0; i < chunk; i++) {
+            output[i] = input[i] ^ keystream[i];
+        }
+
+        input += chunk;
+        output += chunk;
+        length -= chunk;
+    }
+}
+
+// carry-less multiply and reduce in GF(2^128) on byte reversed operands, from Intel's carry-less multiplication white paper
+A_CHAT_AES_GCM_TARGET static __m128i a_chat_aes_gcm_x86_multiply(__m128i a, __m128i b) {
+    __m128i low = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i high = _mm_clmulepi64_si128(a, b, 0x11);
+
+    low = _mm_xor_si128(low, _mm_slli_si128(middle, 8));
+    high = _mm_xor_si128(high, _mm_srli_si128(middle, 8));
+
+    // the operands are bit reflected, so the 256-bit product is shifted left by one
+    __m128i low_carry = _mm_srli_epi32(low, 31);
+    __m128i high_carry = _mm_srli_epi32(high, 31);
+    low = _mm_slli_epi32(low, 1);
+    high = _mm_slli_epi32(high, 1);
+
+    __m128i across = _mm_srli_si128(low_carry, 12);
+    high_carry = _mm_slli_si128(high_carry, 4);
+    low_carry = _mm_slli_si128(low_carry, 4);
+    low = _mm_or_si128(low, low_carry);
+    high = _mm_or_si128(high, high_carry);
+    high = _mm_or_si128(high, across);
+
+    // reduce modulo x^128 + x^7 + x^2 + x + 1
+    __m128i first = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(low, 31), _mm_slli_epi32(low, 30)), _mm_slli_epi32(low, 25));
+    __m128i leftover = _mm_srli_si128(first, 4);
+    low = _mm_xor_si128(low, _mm_slli_si128(first, 12));
+
+    __m128i second = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(low, 1), _mm_srli_epi32(low, 2)), _mm_srli_epi32(low, 7));
+    second = _mm_xor_si128(second, leftover);
+    low = _mm_xor_si128(low, second);
+
+    return _mm_xor_si128(high, low);
+}
+
+A_CHAT_AES_GCM_TARGET void a_chat_aes_gcm_ghash_x86(const AChatAesGcm* gcm, uint8_t state[A_CHAT_AES_BLOCK_SIZE], const uint8_t* data, size_t length) {
+    __m128i hash_key = a_chat_aes_gcm_x86_reverse(_mm_load_si128((const __m128i*) gcm->hash_key));
+    __m128i x = a_chat_aes_gcm_x86_reverse(_mm_loadu_si128((const __m128i*) state));
+
+    while (length >= A_CHAT_AES_BLOCK_SIZE) {
+        __m128i block = a_chat_aes_gcm_x86_reverse(_mm_loadu_si128((const __m128i*) data));
+        x = a_chat_aes_gcm_x86_multiply(_mm_xor_si128(x, block), hash_key);
+
+        data += A_CHAT_AES_BLOCK_SIZE;
+        length -= A_CHAT_AES_BLOCK_SIZE;
+    }
+
+    if (length > 0) {
+        uint8_t padded[A_CHAT_AES_BLOCK_SIZE] = {0};
+        memcpy(padded, data, length);
+
+        __m128i block = a_chat_aes_gcm_x86_reverse(_mm_loadu_si128((const __m128i*) padded));
+        x = a_chat_aes_gcm_x86_multiply(_mm_xor_si128(x, block), hash_key);
+    }
+
+    _mm_storeu_si128((__m128i*) state, a_chat_aes_gcm_x86_reverse(x));
+}
+
+#endif
@@ -0,0 +1,177 @@
+#include "crypto/sha256.h"
+
+#include <string.h>
+
+static const uint32_t a_chat_sha256_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t a_chat_sha256_rotate(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void a_chat_sha256_compress(uint32_t state[8], const uint8_t block[A_CHAT_SHA256_BLOCK_SIZE]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16) | ((uint32_t) block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = a_chat_sha256_rotate(w[i - 15], 7) ^ a_chat_sha256_rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = a_chat_sha256_rotate(w[i - 2], 17) ^ a_chat_sha256_rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = a_chat_sha256_rotate(e, 6) ^ a_chat_sha256_rotate(e, 11) ^ a_chat_sha256_rotate(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t first = h + s1 + choice + a_chat_sha256_constants[i] + w[i];
+        uint32_t s0 = a_chat_sha256_rotate(a, 2) ^ a_chat_sha256_rotate(a, 13) ^ a_chat_sha256_rotate(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t second = s0 + majority;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + first;
+        d = c;
+        c = b;
+        b = a;
+        a = first + second;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void a_chat_sha256_init(AChatSha256* sha256) {
+    static const uint32_t initial_state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(sha256->state, initial_state, sizeof(initial_state));
+    sha256->length = 0;
+    sha256->block_length = 0;
+}
+
+void a_chat_sha256_update(AChatSha256* sha256, const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    sha256->length += length;
+
+    // top up a partly filled block first, then compress whole blocks straight from the input
+    if (sha256->block_length > 0) {
+        size_t chunk = A_CHAT_SHA256_BLOCK_SIZE - sha256->block_length;
+        if (chunk > length) { chunk = length; }
+        memcpy(sha256->block + sha256->block_length, bytes, chunk);
+        sha256->block_length += chunk;
+        bytes += chunk;
+        length -= chunk;
+
+        if (sha256->block_length < A_CHAT_SHA256_BLOCK_SIZE) { return; }
+        a_chat_sha256_compress(sha256->state, sha256->block);
+        sha256->block_length = 0;
+    }
+
+    while (length >= A_CHAT_SHA256_BLOCK_SIZE) {
+        a_chat_sha256_compress(sha256->state, bytes);
+        bytes += A_CHAT_SHA256_BLOCK_SIZE;
+        length -= A_CHAT_SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(sha256->block, bytes, length);
+    sha256->block_length = length;
+}
+
+void a_chat_sha256_final(AChatSha256* sha256, uint8_t digest[A_CHAT_SHA256_SIZE]) {
+    uint64_t bits = sha256->length * 8;
+
+    // pad with a single 1 bit, then zeros until there are 8 bytes left in the block for the length
+    sha256->block[sha256->block_length++] = 0x80;
+    if (sha256->block_length > A_CHAT_SHA256_BLOCK_SIZE - 8) {
+        memset(sha256->block + sha256->block_length, 0, A_CHAT_SHA256_BLOCK_SIZE - sha256->block_length);
+        a_chat_sha256_compress(sha256->state, sha256->block);
+        sha256->block_length = 0;
+    }
+    memset(sha256->block + sha256->block_length, 0, A_CHAT_SHA256_BLOCK_SIZE - 8 - sha256->block_length);
+    for (int i = 0; i < 8; i++) {
+        sha256->block[A_CHAT_SHA256_BLOCK_SIZE - 1 - i] = (uint8_t) (bits >> (i * 8));
+    }
+    a_chat_sha256_compress(sha256->state, sha256->block);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t) (sha256->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t) (sha256->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t) (sha256->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t) sha256->state[i];
+    }
+}
+
+void a_chat_hmac_sha256(const uint8_t* key, size_t key_length, const void* data, size_t length, uint8_t mac[A_CHAT_SHA256_SIZE]) {
+    // keys longer than a block are hashed down first
+    uint8_t block_key[A_CHAT_SHA256_BLOCK_SIZE] = {0};
+    if (key_length > A_CHAT_SHA256_BLOCK_SIZE) {
+        AChatSha256 sha256;
+        a_chat_sha256_init(&sha256);
+        a_chat_sha256_update(&sha256, key, key_length);
+        a_chat_sha256_final(&sha256, block_key);
+    } else if (key_length > 0) {
+        memcpy(block_key, key, key_length);
+    }
+
+    uint8_t pad[A_CHAT_SHA256_BLOCK_SIZE];
+    uint8_t inner[A_CHAT_SHA256_SIZE];
+    AChatSha256 sha256;
+
+    for (int i = 0; i < A_CHAT_SHA256_BLOCK_SIZE; i++) { pad[i] = block_key[i] ^ 0x36; }
+    a_chat_sha256_init(&sha256);
+    a_chat_sha256_update(&sha256, pad, sizeof(pad));
+    a_chat_sha256_update(&sha256, data, length);
+    a_chat_sha256_final(&sha256, inner);
+
+    for (int i = 0; i < A_CHAT_SHA256_BLOCK_SIZE; i++) { pad[i] = block_key[i] ^ 0x5c; }
+    a_chat_sha256_init(&sha256);
+    a_chat_sha256_update(&sha256, pad, sizeof(pad));
+    a_chat_sha256_update(&sha256, inner, sizeof(inner));
+    a_chat_sha256_final(&sha256, mac);
+}
+
+void a_chat_hkdf_sha256(const uint8_t* salt, size_t salt_length, const uint8_t* input, size_t input_length, const uint8_t* info, size_t info_length, uint8_t* output, size_t output_length) {
+    if (info_length > A_CHAT_HKDF_MAXIMUM_INFO) { info_length = A_CHAT_HKDF_MAXIMUM_INFO; }
+
+    uint8_t pseudorandom_key[A_CHAT_SHA256_SIZE];
+    a_chat_hmac_sha256(salt, salt_length, input, input_length, pseudorandom_key);
+
+    // T(i) = HMAC(PRK, T(i - 1) || info || i)
+    uint8_t block[A_CHAT_SHA256_SIZE];
+    size_t block_length = 0;
+    for (uint8_t counter = 1; output_length > 0; counter++) {
+        uint8_t message[A_CHAT_SHA256_SIZE + A_CHAT_HKDF_MAXIMUM_INFO + 1];
+        size_t message_length = 0;
+        memcpy(message, block, block_length);
+        message_length += block_length;
+        if (info_length > 0) {
+            memcpy(message + message_length, info, info_length);
+            message_length += info_length;
+        }
+        message[message_length++] = counter;
+
+        a_chat_hmac_sha256(pseudorandom_key, sizeof(pseudorandom_key), message, message_length, block);
+        block_length = A_CHAT_SHA256_SIZE;
+
+        size_t chunk = output_length < A_CHAT_SHA256_SIZE ? output_length : A_CHAT_SHA256_SIZE;
+        memcpy(output, block, chunk);
+        output += chunk;
+        output_length -= chunk;
+    }
+}
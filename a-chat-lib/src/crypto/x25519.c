@@ -0,0 +1,235 @@
+#include "crypto/x25519.h"
+
+#include <string.h>
+#include <sys/random.h>
+
+#include "log.h"
+
+// field elements mod 2^255 - 19 are five 51-bit limbs, so a limb product fits in an unsigned __int128
+typedef uint64_t AChatFieldElement[5];
+typedef unsigned __int128 AChatUint128;
+
+#define A_CHAT_FIELD_MASK ((UINT64_C(1) << 51) - 1)
+
+static uint64_t a_chat_x25519_load64(const uint8_t* bytes) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+static void a_chat_field_from_bytes(AChatFieldElement out, const uint8_t bytes[A_CHAT_X25519_KEY_SIZE]) {
+    // the top bit is ignored, as RFC 7748 asks
+    out[0] = a_chat_x25519_load64(bytes) & A_CHAT_FIELD_MASK;
+    out[1] = (a_chat_x25519_load64(bytes + 6) >> 3) & A_CHAT_FIELD_MASK;
+    out[2] = (a_chat_x25519_load64(bytes + 12) >> 6) & A_CHAT_FIELD_MASK;
+    out[3] = (a_chat_x25519_load64(bytes + 19) >> 1) & A_CHAT_FIELD_MASK;
+    out[4] = (a_chat_x25519_load64(bytes + 24) >> 12) & A_CHAT_FIELD_MASK;
+}
+
+static void a_chat_field_carry(AChatFieldElement element) {
+    for (int i = 0; i < 4; i++) {
+        element[i + 1] += element[i] >> 51;
+        element[i] &= A_CHAT_FIELD_MASK;
+    }
+    element[0] += (element[4] >> 51) * 19;
+    element[4] &= A_CHAT_FIELD_MASK;
+    element[1] += element[0] >> 51;
+    element[0] &= A_CHAT_FIELD_MASK;
+}
+
+static void a_chat_field_to_bytes(uint8_t bytes[A_CHAT_X25519_KEY_SIZE], const AChatFieldElement element) {
+    AChatFieldElement t;
+    memcpy(t, element, sizeof(t));
+    a_chat_field_carry(t);
+    a_chat_field_carry(t);
+
+    // t is now below 2^255 + 19, so it is at least p exactly when t + 19 carries into bit 255
+    AChatFieldElement u;
+    memcpy(u, t, sizeof(u));
+    u[0] += 19;
+    for (int i = 0; i < 4; i++) {
+        u[i + 1] += u[i] >> 51;
+        u[i] &= A_CHAT_FIELD_MASK;
+    }
+    uint64_t select = 0 - (u[4] >> 51);
+    u[4] &= A_CHAT_FIELD_MASK;
+    for (int i = 0; i < 5; i++) {
+        t[i] = (u[i] & select) | (t[i] & ~select);
+    }
+
+    // pack the limbs back into 255 bits, little-endian
+    uint64_t words[4] = {
+        t[0] | (t[1] << 51),
+        (t[1] >> 13) | (t[2] << 38),
+        (t[2] >> 26) | (t[3] << 25),
+        (t[3] >> 39) | (t[4] << 12),
+    };
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 8; j++) {
+            bytes[i * 8 + j] = (uint8_t) (words[i] >> (j * 8));
+        }
+    }
+}
+
+static void a_chat_field_add(AChatFieldElement out, const AChatFieldElement a, const AChatFieldElement b) {
+    for (int i = 0; i < 5; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+// adds 4p before subtracting so no limb goes negative
+static void a_chat_field_subtract(AChatFieldElement out, const AChatFieldElement a, const AChatFieldElement b) {
+    out[0] = a[0] + UINT64_C(0x1fffffffffffb4) - b[0];
+    for (int i = 1; i < 5; i++) {
+        out[i] = a[i] + UINT64_C(0x1ffffffffffffc) - b[i];
+    }
+    a_chat_field_carry(out);
+}
+
+static void a_chat_field_reduce(AChatFieldElement out, AChatUint128 r[5]) {
+    for (int i = 0; i < 4; i++) {
+        r[i + 1] += (uint64_t) (r[i] >> 51);
+        r[i] = (uint64_t) r[i] & A_CHAT_FIELD_MASK;
+    }
+    r[0] += (r[4] >> 51) * 19;
+    r[4] = (uint64_t) r[4] & A_CHAT_FIELD_MASK;
+    r[1] += (uint64_t) (r[0] >> 51);
+    r[0] = (uint64_t) r[0] & A_CHAT_FIELD_MASK;
+
+    for (int i = 0; i < 5; i++) {
+        out[i] = (uint64_t) r[i];
+    }
+}
+
+static void a_chat_field_multiply(AChatFieldElement out, const AChatFieldElement a, const AChatFieldElement b) {
+    // 2^255 = 19 mod p, so the limbs that wrap around are multiplied by 19
+    uint64_t b1 = b[1] * 19, b2 = b[2] * 19, b3 = b[3] * 19, b4 = b[4] * 19;
+
+    AChatUint128 r[5];
+    r[0] = (AChatUint128) a[0] * b[0] + (AChatUint128) a[1] * b4 + (AChatUint128) a[2] * b3 + (AChatUint128) a[3] * b2 + (AChatUint128) a[4] * b1;
+    r[1] = (AChatUint128) a[0] * b[1] + (AChatUint128) a[1] * b[0] + (AChatUint128) a[2] * b4 + (AChatUint128) a[3] * b3 + (AChatUint128) a[4] * b2;
+    r[2] = (AChatUint128) a[0] * b[2] + (AChatUint128) a[1] * b[1] + (AChatUint128) a[2] * b[0] + (AChatUint128) a[3] * b4 + (AChatUint128) a[4] * b3;
+    r[3] = (AChatUint128) a[0] * b[3] + (AChatUint128) a[1] * b[2] + (AChatUint128) a[2] * b[1] + (AChatUint128) a[3] * b[0] + (AChatUint128) a[4] * b4;
+    r[4] = (AChatUint128) a[0] * b[4] + (AChatUint128) a[1] * b[3] + (AChatUint128) a[2] * b[2] + (AChatUint128) a[3] * b[1] + (AChatUint128) a[4] * b[0];
+
+    a_chat_field_reduce(out, r);
+}
+
+static void a_chat_field_square(AChatFieldElement out, const AChatFieldElement a) {
+    uint64_t a0_2 = a[0] * 2, a1_2 = a[1] * 2, a3_19 = a[3] * 19, a4_19 = a[4] * 19;
+
+    AChatUint128 r[5];
+    r[0] = (AChatUint128) a[0] * a[0] + (AChatUint128) a1_2 * a4_19 + (AChatUint128) (a[2] * 2) * a3_19;
+    r[1] = (AChatUint128) a0_2 * a[1] + (AChatUint128) (a[2] * 2) * a4_19 + (AChatUint128) a[3] * a3_19;
+    r[2] = (AChatUint128) a0_2 * a[2] + (AChatUint128) a[1] * a[1] + (AChatUint128) (a[3] * 2) * a4_19;
+    r[3] = (AChatUint128) a0_2 * a[3] + (AChatUint128) a1_2 * a[2] + (AChatUint128) a[4] * a4_19;
+    r[4] = (AChatUint128) a0_2 * a[4] + (AChatUint128) a1_2 * a[3] + (AChatUint128) a[2] * a[2];
+
+    a_chat_field_reduce(out, r);
+}
+
+static void a_chat_field_multiply_small(AChatFieldElement out, const AChatFieldElement a, uint64_t b) {
+    AChatUint128 r[5];
+    for (int i = 0; i < 5; i++) {
+        r[i] = (AChatUint128) a[i] * b;
+    }
+    a_chat_field_reduce(out, r);
+}
+
+// a^(p - 2), the exponent 2^255 - 21 is all ones apart from bits 2 and 4
+static void a_chat_field_invert(AChatFieldElement out, const AChatFieldElement a) {
+    AChatFieldElement result = {1, 0, 0, 0, 0};
+    for (int bit = 254; bit >= 0; bit--) {
+        a_chat_field_square(result, result);
+        if (bit != 2 && bit != 4) {
+            a_chat_field_multiply(result, result, a);
+        }
+    }
+    memcpy(out, result, sizeof(result));
+}
+
+static void a_chat_field_swap(AChatFieldElement a, AChatFieldElement b, uint64_t swap) {
+    uint64_t mask = 0 - swap;
+    for (int i = 0; i < 5; i++) {
+        uint64_t difference = (a[i] ^ b[i]) & mask;
+        a[i] ^= difference;
+        b[i] ^= difference;
+    }
+}
+
+// the montgomery ladder from RFC 7748, it does the same work for every bit of the scalar
+static void a_chat_x25519_scalar_multiply(uint8_t out[A_CHAT_X25519_KEY_SIZE], const uint8_t scalar[A_CHAT_X25519_KEY_SIZE], const uint8_t point[A_CHAT_X25519_KEY_SIZE]) {
+    uint8_t k[A_CHAT_X25519_KEY_SIZE];
+    memcpy(k, scalar, sizeof(k));
+    k[0] &= 248;
+    k[31] &= 127;
+    k[31] |= 64;
+
+    AChatFieldElement x1, x2 = {1, 0, 0, 0, 0}, z2 = {0}, x3, z3 = {1, 0, 0, 0, 0};
+    a_chat_field_from_bytes(x1, point);
+    memcpy(x3, x1, sizeof(x3));
+
+    uint64_t swap = 0;
+    for (int t = 254; t >= 0; t--) {
+        uint64_t bit = (k[t / 8] >> (t % 8)) & 1;
+        swap ^= bit;
+        a_chat_field_swap(x2, x3, swap);
+        a_chat_field_swap(z2, z3, swap);
+        swap = bit;
+
+        AChatFieldElement a, aa, b, bb, e, c, d, da, cb, temporary;
+        a_chat_field_add(a, x2, z2);
+        a_chat_field_square(aa, a);
+        a_chat_field_subtract(b, x2, z2);
+        a_chat_field_square(bb, b);
+        a_chat_field_subtract(e, aa, bb);
+        a_chat_field_add(c, x3, z3);
+        a_chat_field_subtract(d, x3, z3);
+        a_chat_field_multiply(da, d, a);
+        a_chat_field_multiply(cb, c, b);
+
+        a_chat_field_add(temporary, da, cb);
+        a_chat_field_square(x3, temporary);
+        a_chat_field_subtract(temporary, da, cb);
+        a_chat_field_square(temporary, temporary);
+        a_chat_field_multiply(z3, x1, temporary);
+
+        a_chat_field_multiply(x2, aa, bb);
+        a_chat_field_multiply_small(temporary, e, 121665);
+        a_chat_field_add(temporary, aa, temporary);
+        a_chat_field_multiply(z2, e, temporary);
+    }
+    a_chat_field_swap(x2, x3, swap);
+    a_chat_field_swap(z2, z3, swap);
+
+    a_chat_field_invert(z2, z2);
+    a_chat_field_multiply(x2, x2, z2);
+    a_chat_field_to_bytes(out, x2);
+}
+
+bool a_chat_x25519_generate(uint8_t private_key[A_CHAT_X25519_KEY_SIZE], uint8_t public_key[A_CHAT_X25519_KEY_SIZE]) {
+    if (getrandom(private_key, A_CHAT_X25519_KEY_SIZE, 0) != A_CHAT_X25519_KEY_SIZE) {
+        a_chat_log_error_errno("Failed to generate private key");
+        return false;
+    }
+
+    a_chat_x25519_public_key(public_key, private_key);
+    return true;
+}
+
+void a_chat_x25519_public_key(uint8_t public_key[A_CHAT_X25519_KEY_SIZE], const uint8_t private_key[A_CHAT_X25519_KEY_SIZE]) {
+    static const uint8_t base_point[A_CHAT_X25519_KEY_SIZE] = {9};
+    a_chat_x25519_scalar_multiply(public_key, private_key, base_point);
+}
+
+bool a_chat_x25519(uint8_t shared_secret[A_CHAT_X25519_KEY_SIZE], const uint8_t private_key[A_CHAT_X25519_KEY_SIZE], const uint8_t peer_public_key[A_CHAT_X25519_KEY_SIZE]) {
+    a_chat_x25519_scalar_multiply(shared_secret, private_key, peer_public_key);
+
+    uint8_t any = 0;
+    for (int i = 0; i < A_CHAT_X25519_KEY_SIZE; i++) {
+        any |= shared_secret[i];
+    }
+    return any != 0;
+}
@@ -5,105 +5,426 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-// todo: save log to file!
+// every thread's ring, has to be a power of two
+#define A_CHAT_LOG_RING_SIZE (16 * 1024)
+// the longest a single line can be, anything longer is cut short
+#define A_CHAT_LOG_MAXIMUM_LENGTH 1024
+// the background thread batches lines up to this size before writing them
+#define A_CHAT_LOG_OUTPUT_BUFFER_SIZE (64 * 1024)
 
-void a_chat_log_error(const char* message) {
-    const char* prefix = "ERROR:";
-    const char* suffix = "\n";
+// a record in a ring is this header followed by the formatted line
+typedef struct AChatLogRecord {
+    uint64_t time_ms; // wall clock, for the log file's timestamps
+    uint32_t length;
+    uint32_t level;
+} AChatLogRecord;
+
+// single producer (the thread it belongs to), single consumer (the background thread)
+typedef struct AChatLogRing {
+    _Alignas(64) _Atomic size_t head; // only written by the owning thread
+    _Alignas(64) _Atomic size_t tail; // only written by the background thread
+    _Atomic bool abandoned; // the owning thread has exited, so the ring can be freed once it is empty
+    struct AChatLogRing* next;
+    uint8_t data[A_CHAT_LOG_RING_SIZE];
+} AChatLogRing;
+
+typedef struct AChatLogOutput {
+    char buffer[A_CHAT_LOG_OUTPUT_BUFFER_SIZE];
+    size_t length;
+} AChatLogOutput;
+
+static _Atomic int a_chat_log_level = A_CHAT_LOG_LEVEL_INFO;
+static _Atomic bool a_chat_log_running = false;
+static _Atomic uint64_t a_chat_log_total_dropped = 0;
+
+// rings are pushed onto the front by their threads and only ever unlinked by the background thread
+static _Atomic(AChatLogRing*) a_chat_log_rings = NULL;
+static _Thread_local AChatLogRing* a_chat_log_thread_ring = NULL;
+static pthread_key_t a_chat_log_ring_key;
+static pthread_once_t a_chat_log_ring_key_once = PTHREAD_ONCE_INIT;
+
+// everything below is only touched by a_chat_log_start/stop and the background thread
+static AChatLogConfig a_chat_log_config;
+static pthread_t a_chat_log_thread_id;
+static pthread_mutex_t a_chat_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t a_chat_log_wake = PTHREAD_COND_INITIALIZER;
+static bool a_chat_log_stopping = false;
+static bool a_chat_log_registered_exit = false;
+static int a_chat_log_file = -1;
+static size_t a_chat_log_file_bytes = 0;
+static uint64_t a_chat_log_reported_dropped = 0;
+static AChatLogOutput a_chat_log_stderr_output;
+static AChatLogOutput a_chat_log_file_output;
+
+static void a_chat_log_ring_abandon(void* ring) {
+    atomic_store_explicit(&((AChatLogRing*) ring)->abandoned, true, memory_order_release);
+}
+
+static void a_chat_log_ring_key_create(void) {
+    pthread_key_create(&a_chat_log_ring_key, a_chat_log_ring_abandon);
+}
+
+// the calling thread's ring, made the first time the thread logs anything
+static AChatLogRing* a_chat_log_get_ring(void) {
+    if (a_chat_log_thread_ring) { return a_chat_log_thread_ring; }
+
+    pthread_once(&a_chat_log_ring_key_once, a_chat_log_ring_key_create);
+
+    AChatLogRing* ring = malloc(sizeof(AChatLogRing));
+    if (!ring) { return NULL; }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->abandoned, false);
 
-    int length = strlen(prefix) + 1 + strlen(message) + strlen(suffix) + 1; // first "+ 1" is for the space, second "+ 1" is for the null terminator
-    char* output = malloc(length);
-    if (!output) {
-        perror("ERROR: Failed to allocate memory for error message!\n");
+    // tells the background thread when this thread exits
+    pthread_setspecific(a_chat_log_ring_key, ring);
+
+    ring->next = atomic_load_explicit(&a_chat_log_rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&a_chat_log_rings, &ring->next, ring, memory_order_release, memory_order_relaxed));
+
+    a_chat_log_thread_ring = ring;
+    return ring;
+}
+
+// copies into the ring, wrapping around its end
+static void a_chat_log_ring_write(AChatLogRing* ring, size_t position, const void* data, size_t length) {
+    size_t offset = position & (A_CHAT_LOG_RING_SIZE - 1);
+    size_t first = A_CHAT_LOG_RING_SIZE - offset < length ? A_CHAT_LOG_RING_SIZE - offset : length;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const uint8_t*) data + first, length - first);
+}
+
+static void a_chat_log_ring_read(const AChatLogRing* ring, size_t position, void* data, size_t length) {
+    size_t offset = position & (A_CHAT_LOG_RING_SIZE - 1);
+    size_t first = A_CHAT_LOG_RING_SIZE - offset < length ? A_CHAT_LOG_RING_SIZE - offset : length;
+    memcpy(data, ring->data + offset, first);
+    memcpy((uint8_t*) data + first, ring->data, length - first);
+}
+
+static void a_chat_log_submit(AChatLogLevel level, const char* prefix, const char* message, const char* detail) {
+    if ((int) level < atomic_load_explicit(&a_chat_log_level, memory_order_relaxed)) { return; }
+
+    char line[A_CHAT_LOG_MAXIMUM_LENGTH];
+    int length = detail ? snprintf(line, sizeof(line), "%s %s: %s\n", prefix, message, detail) : snprintf(line, sizeof(line), "%s %s\n", prefix, message);
+    if (length < 0) { return; }
+    // a line that was cut short still ends with a new line
+    if ((size_t) length >= sizeof(line)) {
+        length = sizeof(line) - 1;
+        line[length - 1] = '\n';
+    }
+
+    AChatLogRing* ring = atomic_load_explicit(&a_chat_log_running, memory_order_acquire) ? a_chat_log_get_ring() : NULL;
+    if (!ring) {
+        fputs(line, stderr);
         return;
     }
 
-    snprintf(output, length, "%s %s%s", prefix, message, suffix);
-    fprintf(stderr, "%s", output);
-    free(output);
-}
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    AChatLogRecord record = {
+        .time_ms = (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000,
+        .length = (uint32_t) length,
+        .level = (uint32_t) level,
+    };
 
-void a_chat_log_error_gai_strerror(const char* message, int status) {
-    const char* prefix = "ERROR:";
-    const char* error_message = gai_strerror(status);
-    const char* suffix = "\n";
-
-    // first "+ 1" is for the space, the "+ 2" is for ":" and space, and the second "+ 1" is for the null terminator
-    int length = strlen(prefix) + 1 + strlen(message) + 2 + strlen(error_message) + strlen(suffix) + 1;
-    char* output = malloc(length);
-    if (!output) {
-        a_chat_log_error("Failed to allocate memory for error message!");
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (A_CHAT_LOG_RING_SIZE - (head - tail) < sizeof(record) + (size_t) length) {
+        // the background thread has fallen behind, losing the message is better than waiting for it
+        atomic_fetch_add_explicit(&a_chat_log_total_dropped, 1, memory_order_relaxed);
         return;
     }
 
-    snprintf(output, length, "%s %s: %s%s", prefix, message, error_message, suffix);
-    fprintf(stderr, "%s", output);
-    free(output);
+    a_chat_log_ring_write(ring, head, &record, sizeof(record));
+    a_chat_log_ring_write(ring, head + sizeof(record), line, (size_t) length);
+    atomic_store_explicit(&ring->head, head + sizeof(record) + (size_t) length, memory_order_release);
 }
 
-void a_chat_log_error_errno(const char* message) {
-    const char* prefix = "ERROR:";
+static void a_chat_log_file_rotate(void) {
+    close(a_chat_log_file);
+    a_chat_log_file = -1;
 
-    char error_message[1024];
-    int result = strerror_r(errno, error_message, sizeof(error_message));
-    if (result != 0) {
-        a_chat_log_error("Failed to get error from errno!");
-        return;
+    // "file.1" becomes "file.2" and so on, the oldest is written over
+    char from[4096], to[4096];
+    for (int i = a_chat_log_config.number_of_files - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", a_chat_log_config.file_path, i);
+        snprintf(to, sizeof(to), "%s.%d", a_chat_log_config.file_path, i + 1);
+        rename(from, to);
     }
 
-    const char* suffix = "\n";
+    int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    if (a_chat_log_config.number_of_files > 0) {
+        snprintf(to, sizeof(to), "%s.1", a_chat_log_config.file_path);
+        rename(a_chat_log_config.file_path, to);
+    } else {
+        flags |= O_TRUNC;
+    }
 
-    // first "+ 1" is for the space, the "+ 2" is for ":" and space, and the second "+ 1" is for the null terminator
-    int length = strlen(prefix) + 1 + strlen(message) + 2 + strlen(error_message) + strlen(suffix) + 1;
-    char* output = malloc(length);
-    if (!output) {
-        a_chat_log_error("Failed to allocate memory for error message!");
-        return;
+    a_chat_log_file = open(a_chat_log_config.file_path, flags, 0644);
+    if (a_chat_log_file == -1) {
+        // going through the rings from here would only end up back here
+        fprintf(stderr, "ERROR: Failed to open log file %s: %s\n", a_chat_log_config.file_path, strerror(errno));
     }
+    a_chat_log_file_bytes = 0;
+}
 
-    snprintf(output, length, "%s %s: %s%s", prefix, message, error_message, suffix);
-    fprintf(stderr, "%s", output);
-    free(output);
+static void a_chat_log_write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written == -1) {
+            if (errno == EINTR) { continue; }
+            return;
+        }
+        data += written;
+        length -= (size_t) written;
+    }
 }
 
-void a_chat_log_warning_errno(const char* message) {
-    const char* prefix = "WARNING:";
+static void a_chat_log_flush(void) {
+    if (a_chat_log_stderr_output.length > 0) {
+        a_chat_log_write_all(STDERR_FILENO, a_chat_log_stderr_output.buffer, a_chat_log_stderr_output.length);
+        a_chat_log_stderr_output.length = 0;
+    }
 
-    char error_message[1024];
-    int result = strerror_r(errno, error_message, sizeof(error_message));
-    if (result != 0) {
-        a_chat_log_error("Failed to get error from errno!");
-        return;
+    if (a_chat_log_file_output.length > 0) {
+        if (a_chat_log_config.file_maximum_bytes > 0 && a_chat_log_file_bytes > 0 && a_chat_log_file_bytes + a_chat_log_file_output.length > a_chat_log_config.file_maximum_bytes) {
+            a_chat_log_file_rotate();
+        }
+        if (a_chat_log_file != -1) {
+            a_chat_log_write_all(a_chat_log_file, a_chat_log_file_output.buffer, a_chat_log_file_output.length);
+            a_chat_log_file_bytes += a_chat_log_file_output.length;
+        }
+        a_chat_log_file_output.length = 0;
+    }
+}
+
+// the file gets a timestamp in front of every line, stderr gets the line as it was logged
+static void a_chat_log_output(uint64_t time_ms, const char* line, size_t length) {
+    char timestamp[64];
+    size_t timestamp_length = 0;
+    if (a_chat_log_file != -1) {
+        time_t seconds = (time_t) (time_ms / 1000);
+        struct tm local;
+        localtime_r(&seconds, &local);
+        timestamp_length = strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &local);
+        timestamp_length += (size_t) snprintf(timestamp + timestamp_length, sizeof(timestamp) - timestamp_length, ".%03u ", (unsigned int) (time_ms % 1000));
+    }
+
+    if (a_chat_log_stderr_output.length + length > sizeof(a_chat_log_stderr_output.buffer) || a_chat_log_file_output.length + timestamp_length + length > sizeof(a_chat_log_file_output.buffer)) {
+        a_chat_log_flush();
+    }
+
+    if (a_chat_log_config.to_stderr) {
+        memcpy(a_chat_log_stderr_output.buffer + a_chat_log_stderr_output.length, line, length);
+        a_chat_log_stderr_output.length += length;
+    }
+    if (a_chat_log_file != -1) {
+        memcpy(a_chat_log_file_output.buffer + a_chat_log_file_output.length, timestamp, timestamp_length);
+        memcpy(a_chat_log_file_output.buffer + a_chat_log_file_output.length + timestamp_length, line, length);
+        a_chat_log_file_output.length += timestamp_length + length;
+    }
+}
+
+// returns how many records were drained, lines are only in order within a thread
+static size_t a_chat_log_drain(void) {
+    size_t number_of_records = 0;
+
+    AChatLogRing* previous = NULL;
+    AChatLogRing* ring = atomic_load_explicit(&a_chat_log_rings, memory_order_acquire);
+    while (ring) {
+        // read abandoned first, so nothing the thread wrote before exiting is missed
+        bool abandoned = atomic_load_explicit(&ring->abandoned, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        while (tail != head) {
+            AChatLogRecord record;
+            char line[A_CHAT_LOG_MAXIMUM_LENGTH];
+            a_chat_log_ring_read(ring, tail, &record, sizeof(record));
+            a_chat_log_ring_read(ring, tail + sizeof(record), line, record.length);
+            tail += sizeof(record) + record.length;
+
+            a_chat_log_output(record.time_ms, line, record.length);
+            number_of_records++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        AChatLogRing* next = ring->next;
+        // the front of the list can have new rings pushed in front of it at any time, so it is left for later
+        if (abandoned && previous) {
+            previous->next = next;
+            free(ring);
+        } else {
+            previous = ring;
+        }
+        ring = next;
     }
 
-    const char* suffix = "\n";
+    uint64_t dropped = atomic_load_explicit(&a_chat_log_total_dropped, memory_order_relaxed);
+    if (dropped != a_chat_log_reported_dropped) {
+        char line[128];
+        int length = snprintf(line, sizeof(line), "WARNING: Dropped %llu log messages, the log can't keep up\n", (unsigned long long) (dropped - a_chat_log_reported_dropped));
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        a_chat_log_output((uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000, line, (size_t) length);
+        a_chat_log_reported_dropped = dropped;
+    }
+
+    a_chat_log_flush();
+
+    return number_of_records;
+}
+
+static void* a_chat_log_thread(void* arguments) {
+    (void) arguments;
+
+    pthread_mutex_lock(&a_chat_log_lock);
+    while (!a_chat_log_stopping) {
+        pthread_mutex_unlock(&a_chat_log_lock);
+        size_t number_of_records = a_chat_log_drain();
+        pthread_mutex_lock(&a_chat_log_lock);
+
+        // only sleep once the rings are empty, the loggers never wake this thread up so they never have to take a lock
+        if (number_of_records == 0 && !a_chat_log_stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += a_chat_log_config.flush_interval_ms / 1000;
+            deadline.tv_nsec += (long) (a_chat_log_config.flush_interval_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&a_chat_log_wake, &a_chat_log_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&a_chat_log_lock);
+
+    return NULL;
+}
+
+AChatLogConfig a_chat_log_default_config(void) {
+    return (AChatLogConfig) {
+        .level = A_CHAT_LOG_LEVEL_INFO,
+        .to_stderr = true,
+        .file_path = NULL,
+        .file_maximum_bytes = 16 * 1024 * 1024,
+        .number_of_files = 4,
+        .flush_interval_ms = 20,
+    };
+}
+
+bool a_chat_log_start(const AChatLogConfig* config) {
+    if (atomic_load(&a_chat_log_running)) {
+        a_chat_log_error("Failed to start logging, it has already been started");
+        return false;
+    }
+
+    a_chat_log_config = config ? *config : a_chat_log_default_config();
+    if (a_chat_log_config.flush_interval_ms < 1) {
+        a_chat_log_config.flush_interval_ms = a_chat_log_default_config().flush_interval_ms;
+    }
+    a_chat_log_set_level(a_chat_log_config.level);
+
+    if (a_chat_log_config.file_path) {
+        a_chat_log_file = open(a_chat_log_config.file_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (a_chat_log_file == -1) {
+            a_chat_log_error_errno("Failed to open log file");
+            return false;
+        }
+
+        off_t size = lseek(a_chat_log_file, 0, SEEK_END);
+        a_chat_log_file_bytes = size > 0 ? (size_t) size : 0;
+    }
+
+    a_chat_log_stopping = false;
+    a_chat_log_reported_dropped = atomic_load(&a_chat_log_total_dropped);
+    if (pthread_create(&a_chat_log_thread_id, NULL, a_chat_log_thread, NULL) != 0) {
+        a_chat_log_error("Failed to create logging thread");
+        if (a_chat_log_file != -1) {
+            close(a_chat_log_file);
+            a_chat_log_file = -1;
+        }
+        return false;
+    }
+
+    // whatever is still in the rings when the program exits gets written out
+    if (!a_chat_log_registered_exit) {
+        atexit(a_chat_log_stop);
+        a_chat_log_registered_exit = true;
+    }
+
+    atomic_store_explicit(&a_chat_log_running, true, memory_order_release);
+    return true;
+}
+
+void a_chat_log_stop(void) {
+    if (!atomic_exchange(&a_chat_log_running, false)) { return; }
 
-    // first "+ 1" is for the space, the "+ 2" is for ":" and space, and the second "+ 1" is for the null terminator
-    int length = strlen(prefix) + 1 + strlen(message) + 2 + strlen(error_message) + strlen(suffix) + 1;
-    char* output = malloc(length);
-    if (!output) {
-        a_chat_log_error("Failed to allocate memory for error message!");
+    pthread_mutex_lock(&a_chat_log_lock);
+    a_chat_log_stopping = true;
+    pthread_cond_signal(&a_chat_log_wake);
+    pthread_mutex_unlock(&a_chat_log_lock);
+    pthread_join(a_chat_log_thread_id, NULL);
+
+    // anything logged while the thread was stopping, from here on loggers write to stderr themselves
+    a_chat_log_drain();
+
+    if (a_chat_log_file != -1) {
+        close(a_chat_log_file);
+        a_chat_log_file = -1;
+    }
+}
+
+void a_chat_log_set_level(AChatLogLevel level) {
+    atomic_store_explicit(&a_chat_log_level, (int) level, memory_order_relaxed);
+}
+
+AChatLogLevel a_chat_log_get_level(void) {
+    return (AChatLogLevel) atomic_load_explicit(&a_chat_log_level, memory_order_relaxed);
+}
+
+uint64_t a_chat_log_dropped(void) {
+    return atomic_load_explicit(&a_chat_log_total_dropped, memory_order_relaxed);
+}
+
+void a_chat_log_error(const char* message) {
+    a_chat_log_submit(A_CHAT_LOG_LEVEL_ERROR, "ERROR:", message, NULL);
+}
+
+void a_chat_log_error_gai_strerror(const char* message, int status) {
+    a_chat_log_submit(A_CHAT_LOG_LEVEL_ERROR, "ERROR:", message, gai_strerror(status));
+}
+
+void a_chat_log_error_errno(const char* message) {
+    char error_message[256];
+    if (strerror_r(errno, error_message, sizeof(error_message)) != 0) {
+        a_chat_log_error("Failed to get error from errno!");
         return;
     }
 
-    snprintf(output, length, "%s %s: %s%s", prefix, message, error_message, suffix);
-    fprintf(stderr, "%s", output);
-    free(output);
+    a_chat_log_submit(A_CHAT_LOG_LEVEL_ERROR, "ERROR:", message, error_message);
 }
 
-void a_chat_log_info(const char* message) {
-    const char* prefix = "INFO:";
-    const char* suffix = "\n";
+void a_chat_log_warning(const char* message) {
+    a_chat_log_submit(A_CHAT_LOG_LEVEL_WARNING, "WARNING:", message, NULL);
+}
 
-    int length = strlen(prefix) + 1 + strlen(message) + strlen(suffix) + 1; // first "+ 1" is for the space, second "+ 1" is for the null terminator
-    char* output = malloc(length);
-    if (!output) {
-        a_chat_log_error("Failed to allocate memory for info message!");
+void a_chat_log_warning_errno(const char* message) {
+    char error_message[256];
+    if (strerror_r(errno, error_message, sizeof(error_message)) != 0) {
+        a_chat_log_error("Failed to get error from errno!");
         return;
     }
 
-    snprintf(output, length, "%s %s%s", prefix, message, suffix);
-    fprintf(stderr, "%s", output);
-    free(output);
+    a_chat_log_submit(A_CHAT_LOG_LEVEL_WARNING, "WARNING:", message, error_message);
+}
+
+void a_chat_log_info(const char* message) {
+    a_chat_log_submit(A_CHAT_LOG_LEVEL_INFO, "INFO:", message, NULL);
 }
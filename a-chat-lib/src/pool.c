@@ -0,0 +1,306 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+// the size_class of blocks that came straight from the heap
+#define A_CHAT_POOL_OVERSIZED A_CHAT_POOL_SIZE_CLASSES
+
+// how many batches a slab holds, a class grows a slab at a time
+#define A_CHAT_POOL_SLAB_BATCHES 4
+
+// about this many bytes move between a thread's cache and its class at once
+#define A_CHAT_POOL_BATCH_BYTES (64 * 1024)
+#define A_CHAT_POOL_MINIMUM_BATCH 4
+#define A_CHAT_POOL_MAXIMUM_BATCH 32
+
+// powers of 4, from a short server notice up to the largest messages clients normally send
+static const size_t a_chat_pool_block_sizes[A_CHAT_POOL_SIZE_CLASSES] = { 64, 256, 1024, 4096, 16 * 1024, 64 * 1024 };
+
+// sits in front of every block, 16 bytes so the block after it is aligned like malloc's
+typedef struct AChatPoolBlock {
+    union {
+        struct AChatPoolBlock* next; // while the block is free
+        size_t size; // for oversized blocks, which are never free in the pool
+    };
+    size_t size_class;
+} AChatPoolBlock;
+
+typedef struct AChatPoolSlab {
+    struct AChatPoolSlab* next;
+    size_t padding; // keeps the blocks after it aligned
+} AChatPoolSlab;
+
+typedef struct AChatPoolClass {
+    pthread_mutex_t lock;
+    AChatPoolBlock* free_blocks;
+    uint64_t number_of_free_blocks;
+    uint64_t reserved_blocks;
+    AChatPoolSlab* slabs; // kept so the pool's memory stays reachable
+} AChatPoolClass;
+
+// every thread's free blocks, only touched by the thread that owns it
+// so the counts are atomic only to be read, they are updated with plain loads and stores rather than read-modify-writes
+typedef struct AChatPoolCache {
+    AChatPoolBlock* free_blocks[A_CHAT_POOL_SIZE_CLASSES];
+    _Atomic uint64_t number_of_free_blocks[A_CHAT_POOL_SIZE_CLASSES]; // also read by a_chat_pool_get_stats
+    struct AChatPoolCache* next;
+} AChatPoolCache;
+
+static void a_chat_pool_cache_count(AChatPoolCache* cache, size_t size_class, int64_t change) {
+    uint64_t count = atomic_load_explicit(&cache->number_of_free_blocks[size_class], memory_order_relaxed);
+    atomic_store_explicit(&cache->number_of_free_blocks[size_class], count + change, memory_order_relaxed);
+}
+
+static AChatPoolClass a_chat_pool_classes[A_CHAT_POOL_SIZE_CLASSES];
+static pthread_once_t a_chat_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t a_chat_pool_cache_key;
+
+static pthread_mutex_t a_chat_pool_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static AChatPoolCache* a_chat_pool_caches = NULL;
+static _Thread_local AChatPoolCache* a_chat_pool_thread_cache = NULL;
+
+static _Atomic uint64_t a_chat_pool_oversized_blocks = 0;
+static _Atomic uint64_t a_chat_pool_oversized_bytes = 0;
+
+static size_t a_chat_pool_size_class(size_t size) {
+    for (size_t i = 0; i < A_CHAT_POOL_SIZE_CLASSES; i++) {
+        if (size <= a_chat_pool_block_sizes[i]) { return i; }
+    }
+
+    return A_CHAT_POOL_OVERSIZED;
+}
+
+static size_t a_chat_pool_batch(size_t size_class) {
+    size_t batch = A_CHAT_POOL_BATCH_BYTES / a_chat_pool_block_sizes[size_class];
+    if (batch < A_CHAT_POOL_MINIMUM_BATCH) { return A_CHAT_POOL_MINIMUM_BATCH; }
+    if (batch > A_CHAT_POOL_MAXIMUM_BATCH) { return A_CHAT_POOL_MAXIMUM_BATCH; }
+
+    return batch;
+}
+
+// hands a block back to its class, the class' lock must be held
+static void a_chat_pool_class_push(AChatPoolClass* pool_class, AChatPoolBlock* block) {
+    block->next = pool_class->free_blocks;
+    pool_class->free_blocks = block;
+    pool_class->number_of_free_blocks++;
+}
+
+// carves a new slab into free blocks, the class' lock must be held
+static bool a_chat_pool_class_grow(AChatPoolClass* pool_class, size_t size_class) {
+    size_t number_of_blocks = a_chat_pool_batch(size_class) * A_CHAT_POOL_SLAB_BATCHES;
+    size_t stride = sizeof(AChatPoolBlock) + a_chat_pool_block_sizes[size_class];
+
+    AChatPoolSlab* slab = malloc(sizeof(AChatPoolSlab) + number_of_blocks * stride);
+    if (!slab) { return false; }
+    slab->next = pool_class->slabs;
+    pool_class->slabs = slab;
+
+    uint8_t* blocks = (uint8_t*) (slab + 1);
+    for (size_t i = 0; i < number_of_blocks; i++) {
+        AChatPoolBlock* block = (AChatPoolBlock*) (blocks + i * stride);
+        block->size_class = size_class;
+        a_chat_pool_class_push(pool_class, block);
+    }
+    pool_class->reserved_blocks += number_of_blocks;
+
+    return true;
+}
+
+// moves up to a batch of blocks from the class into the cache, returns how many it moved
+static size_t a_chat_pool_refill(AChatPoolCache* cache, size_t size_class) {
+    AChatPoolClass* pool_class = &a_chat_pool_classes[size_class];
+    size_t batch = a_chat_pool_batch(size_class);
+
+    pthread_mutex_lock(&pool_class->lock);
+    if (!pool_class->free_blocks && !a_chat_pool_class_grow(pool_class, size_class)) {
+        pthread_mutex_unlock(&pool_class->lock);
+        return 0;
+    }
+
+    size_t moved = 0;
+    for (; moved < batch && pool_class->free_blocks; moved++) {
+        AChatPoolBlock* block = pool_class->free_blocks;
+        pool_class->free_blocks = block->next;
+
+        block->next = cache->free_blocks[size_class];
+        cache->free_blocks[size_class] = block;
+    }
+    pool_class->number_of_free_blocks -= moved;
+    pthread_mutex_unlock(&pool_class->lock);
+
+    a_chat_pool_cache_count(cache, size_class, (int64_t) moved);
+    return moved;
+}
+
+// moves number_of_blocks blocks from the cache back to the class
+static void a_chat_pool_drain(AChatPoolCache* cache, size_t size_class, size_t number_of_blocks) {
+    AChatPoolClass* pool_class = &a_chat_pool_classes[size_class];
+
+    pthread_mutex_lock(&pool_class->lock);
+    size_t moved = 0;
+    for (; moved < number_of_blocks && cache->free_blocks[size_class]; moved++) {
+        AChatPoolBlock* block = cache->free_blocks[size_class];
+        cache->free_blocks[size_class] = block->next;
+        a_chat_pool_class_push(pool_class, block);
+    }
+    pthread_mutex_unlock(&pool_class->lock);
+
+    a_chat_pool_cache_count(cache, size_class, -(int64_t) moved);
+}
+
+// runs when a thread exits, its cached blocks go back to their classes for the other threads
+static void a_chat_pool_cache_release(void* pointer) {
+    AChatPoolCache* cache = pointer;
+    for (size_t i = 0; i < A_CHAT_POOL_SIZE_CLASSES; i++) {
+        a_chat_pool_drain(cache, i, atomic_load_explicit(&cache->number_of_free_blocks[i], memory_order_relaxed));
+    }
+
+    pthread_mutex_lock(&a_chat_pool_caches_lock);
+    AChatPoolCache** link = &a_chat_pool_caches;
+    while (*link && *link != cache) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = cache->next;
+    }
+    pthread_mutex_unlock(&a_chat_pool_caches_lock);
+
+    free(cache);
+    a_chat_pool_thread_cache = NULL;
+}
+
+static void a_chat_pool_init(void) {
+    for (size_t i = 0; i < A_CHAT_POOL_SIZE_CLASSES; i++) {
+        pthread_mutex_init(&a_chat_pool_classes[i].lock, NULL);
+    }
+
+    pthread_key_create(&a_chat_pool_cache_key, a_chat_pool_cache_release);
+}
+
+// the calling thread's cache, made the first time the thread uses the pool
+static AChatPoolCache* a_chat_pool_get_cache(void) {
+    if (a_chat_pool_thread_cache) { return a_chat_pool_thread_cache; }
+
+    pthread_once(&a_chat_pool_once, a_chat_pool_init);
+
+    AChatPoolCache* cache = calloc(1, sizeof(AChatPoolCache));
+    if (!cache) {
+        a_chat_log_error("Failed to allocate memory for pool cache");
+        return NULL;
+    }
+
+    // gives the cache back when this thread exits
+    pthread_setspecific(a_chat_pool_cache_key, cache);
+
+    pthread_mutex_lock(&a_chat_pool_caches_lock);
+    cache->next = a_chat_pool_caches;
+    a_chat_pool_caches = cache;
+    pthread_mutex_unlock(&a_chat_pool_caches_lock);
+
+    a_chat_pool_thread_cache = cache;
+    return cache;
+}
+
+void* a_chat_pool_alloc(size_t size) {
+    size_t size_class = a_chat_pool_size_class(size);
+    if (size_class == A_CHAT_POOL_OVERSIZED) {
+        AChatPoolBlock* block = malloc(sizeof(AChatPoolBlock) + size);
+        if (!block) {
+            a_chat_log_error("Failed to allocate memory for oversized pool block");
+            return NULL;
+        }
+        block->size = size;
+        block->size_class = A_CHAT_POOL_OVERSIZED;
+
+        atomic_fetch_add_explicit(&a_chat_pool_oversized_blocks, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&a_chat_pool_oversized_bytes, size, memory_order_relaxed);
+        return block + 1;
+    }
+
+    AChatPoolCache* cache = a_chat_pool_get_cache();
+    if (!cache) { return NULL; }
+
+    if (!cache->free_blocks[size_class] && a_chat_pool_refill(cache, size_class) == 0) {
+        a_chat_log_error("Failed to allocate memory for pool slab");
+        return NULL;
+    }
+
+    AChatPoolBlock* block = cache->free_blocks[size_class];
+    cache->free_blocks[size_class] = block->next;
+    a_chat_pool_cache_count(cache, size_class, -1);
+
+    return block + 1;
+}
+
+void a_chat_pool_free(void* pointer) {
+    if (!pointer) { return; }
+
+    AChatPoolBlock* block = (AChatPoolBlock*) pointer - 1;
+    size_t size_class = block->size_class;
+    if (size_class == A_CHAT_POOL_OVERSIZED) {
+        atomic_fetch_sub_explicit(&a_chat_pool_oversized_blocks, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&a_chat_pool_oversized_bytes, block->size, memory_order_relaxed);
+        free(block);
+        return;
+    }
+
+    // without a cache the block goes straight back to its class
+    AChatPoolCache* cache = a_chat_pool_get_cache();
+    if (!cache) {
+        AChatPoolClass* pool_class = &a_chat_pool_classes[size_class];
+        pthread_mutex_lock(&pool_class->lock);
+        a_chat_pool_class_push(pool_class, block);
+        pthread_mutex_unlock(&pool_class->lock);
+        return;
+    }
+
+    block->next = cache->free_blocks[size_class];
+    cache->free_blocks[size_class] = block;
+    a_chat_pool_cache_count(cache, size_class, 1);
+
+    // a thread that frees more than it allocates, like one draining broadcasts another thread built, hands the surplus back
+    size_t batch = a_chat_pool_batch(size_class);
+    if (atomic_load_explicit(&cache->number_of_free_blocks[size_class], memory_order_relaxed) > 2 * batch) {
+        a_chat_pool_drain(cache, size_class, batch);
+    }
+}
+
+void a_chat_pool_get_stats(AChatPoolStats* stats) {
+    memset(stats, 0, sizeof(AChatPoolStats));
+    pthread_once(&a_chat_pool_once, a_chat_pool_init);
+
+    uint64_t cached[A_CHAT_POOL_SIZE_CLASSES] = {0};
+    pthread_mutex_lock(&a_chat_pool_caches_lock);
+    for (AChatPoolCache* cache = a_chat_pool_caches; cache; cache = cache->next) {
+        for (size_t i = 0; i < A_CHAT_POOL_SIZE_CLASSES; i++) {
+            cached[i] += atomic_load_explicit(&cache->number_of_free_blocks[i], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&a_chat_pool_caches_lock);
+
+    for (size_t i = 0; i < A_CHAT_POOL_SIZE_CLASSES; i++) {
+        AChatPoolClass* pool_class = &a_chat_pool_classes[i];
+        pthread_mutex_lock(&pool_class->lock);
+        uint64_t reserved = pool_class->reserved_blocks;
+        uint64_t free_blocks = pool_class->number_of_free_blocks + cached[i];
+        pthread_mutex_unlock(&pool_class->lock);
+
+        // blocks moving between a cache and its class while this runs can be counted twice
+        AChatPoolClassStats* class_stats = &stats->classes[i];
+        class_stats->block_size = a_chat_pool_block_sizes[i];
+        class_stats->reserved_blocks = reserved;
+        class_stats->in_use_blocks = free_blocks < reserved ? reserved - free_blocks : 0;
+
+        stats->reserved_bytes += reserved * class_stats->block_size;
+        stats->in_use_bytes += class_stats->in_use_blocks * class_stats->block_size;
+    }
+
+    stats->oversized_blocks = atomic_load_explicit(&a_chat_pool_oversized_blocks, memory_order_relaxed);
+    stats->oversized_bytes = atomic_load_explicit(&a_chat_pool_oversized_bytes, memory_order_relaxed);
+}
@@ -0,0 +1,191 @@
+#include "protocol/frame.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "log.h"
+
+#define A_CHAT_FRAME_DECODER_INITIAL_CAPACITY 4096
+
+// the smallest amount of space a read is given, so a single read can pick up many small frames
+#define A_CHAT_FRAME_DECODER_MINIMUM_READ 1024
+
+static uint32_t a_chat_frame_read_length(const uint8_t* header) {
+    return ((uint32_t) header[4] << 24) | ((uint32_t) header[5] << 16) | ((uint32_t) header[6] << 8) | (uint32_t) header[7];
+}
+
+bool a_chat_frame_decoder_init(AChatFrameDecoder* decoder) {
+    decoder->buffer = malloc(A_CHAT_FRAME_DECODER_INITIAL_CAPACITY);
+    if (!decoder->buffer) {
+        a_chat_log_error("Failed to allocate memory for frame decoder");
+        return false;
+    }
+
+    decoder->capacity = A_CHAT_FRAME_DECODER_INITIAL_CAPACITY;
+    decoder->start = 0;
+    decoder->end = 0;
+
+    return true;
+}
+
+void a_chat_frame_decoder_destroy(AChatFrameDecoder* decoder) {
+    free(decoder->buffer);
+    decoder->buffer = NULL;
+    decoder->capacity = 0;
+    decoder->start = 0;
+    decoder->end = 0;
+}
+
+uint8_t* a_chat_frame_decoder_reserve(AChatFrameDecoder* decoder, size_t* available) {
+    size_t pending = decoder->end - decoder->start;
+
+    // once the length of the pending frame is known, make sure the whole frame fits
+    size_t needed = pending + A_CHAT_FRAME_DECODER_MINIMUM_READ;
+    if (pending >= A_CHAT_FRAME_HEADER_SIZE) {
+        uint32_t length = a_chat_frame_read_length(decoder->buffer + decoder->start);
+        if (length <= A_CHAT_FRAME_MAXIMUM_LENGTH && A_CHAT_FRAME_HEADER_SIZE + length > needed) {
+            needed = A_CHAT_FRAME_HEADER_SIZE + length;
+        }
+    }
+
+    // move the pending bytes to the front when the space after them is too small
+    if (decoder->capacity - decoder->start < needed && decoder->start > 0) {
+        memmove(decoder->buffer, decoder->buffer + decoder->start, pending);
+        decoder->start = 0;
+        decoder->end = pending;
+    }
+
+    if (decoder->capacity < needed) {
+        size_t new_capacity = decoder->capacity * 2 > needed ? decoder->capacity * 2 : needed;
+        uint8_t* new_buffer = realloc(decoder->buffer, new_capacity);
+        if (!new_buffer) {
+            a_chat_log_error("Failed to allocate memory for frame decoder");
+
+            *available = 0;
+            return NULL;
+        }
+
+        decoder->buffer = new_buffer;
+        decoder->capacity = new_capacity;
+    }
+
+    *available = decoder->capacity - decoder->end;
+    return decoder->buffer + decoder->end;
+}
+
+void a_chat_frame_decoder_commit(AChatFrameDecoder* decoder, size_t bytes_received) {
+    decoder->end += bytes_received;
+}
+
+AChatFrameResult a_chat_frame_decoder_next(AChatFrameDecoder* decoder, AChatFrame* frame) {
+    size_t pending = decoder->end - decoder->start;
+    if (pending < A_CHAT_FRAME_HEADER_SIZE) {
+        return A_CHAT_FRAME_INCOMPLETE;
+    }
+
+    const uint8_t* header = decoder->buffer + decoder->start;
+    if (header[0] != A_CHAT_FRAME_VERSION) {
+        a_chat_log_error("Received frame with an unsupported version");
+        return A_CHAT_FRAME_ERROR;
+    }
+
+    uint32_t length = a_chat_frame_read_length(header);
+    if (length > A_CHAT_FRAME_MAXIMUM_LENGTH) {
+        a_chat_log_error("Received frame that is too long");
+        return A_CHAT_FRAME_ERROR;
+    }
+
+    if (pending < A_CHAT_FRAME_HEADER_SIZE + length) {
+        return A_CHAT_FRAME_INCOMPLETE;
+    }
+
+    frame->type = header[1];
+    frame->flags = (uint16_t) ((header[2] << 8) | header[3]);
+    frame->length = length;
+    frame->payload = header + A_CHAT_FRAME_HEADER_SIZE;
+
+    decoder->start += A_CHAT_FRAME_HEADER_SIZE + length;
+
+    // everything has been decoded, so the next read can start at the front of the buffer
+    if (decoder->start == decoder->end) {
+        decoder->start = 0;
+        decoder->end = 0;
+    }
+
+    return A_CHAT_FRAME_COMPLETE;
+}
+
+void a_chat_frame_encode_header(uint8_t* header, uint8_t type, uint16_t flags, uint32_t length) {
+    header[0] = A_CHAT_FRAME_VERSION;
+    header[1] = type;
+    header[2] = (uint8_t) (flags >> 8);
+    header[3] = (uint8_t) flags;
+    header[4] = (uint8_t) (length >> 24);
+    header[5] = (uint8_t) (length >> 16);
+    header[6] = (uint8_t) (length >> 8);
+    header[7] = (uint8_t) length;
+}
+
+AChatBuffer* a_chat_frame_create(uint8_t type, uint16_t flags, const void* payload, uint32_t length) {
+    AChatBuffer* frame = a_chat_buffer_create(A_CHAT_FRAME_HEADER_SIZE + length);
+    if (!frame) { return NULL; }
+
+    a_chat_frame_encode_header(frame->data, type, flags, length);
+    if (length > 0) {
+        memcpy(frame->data + A_CHAT_FRAME_HEADER_SIZE, payload, length);
+    }
+
+    return frame;
+}
+
+bool a_chat_frame_send(int socket, uint8_t type, uint16_t flags, const void* payload, uint32_t length) {
+    uint8_t header[A_CHAT_FRAME_HEADER_SIZE];
+    a_chat_frame_encode_header(header, type, flags, length);
+
+    // send the header and the payload together without copying them into one buffer
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = sizeof(header) },
+        { .iov_base = (void*) payload, .iov_len = length },
+    };
+    struct msghdr message = { .msg_iov = iov, .msg_iovlen = length > 0 ? 2 : 1 };
+
+    while (message.msg_iovlen > 0) {
+        ssize_t bytes_sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+
+        // skip over whatever was sent, a blocking socket can still send less than asked for
+        while (message.msg_iovlen > 0 && (size_t) bytes_sent >= message.msg_iov->iov_len) {
+            bytes_sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = (uint8_t*) message.msg_iov->iov_base + bytes_sent;
+            message.msg_iov->iov_len -= bytes_sent;
+        }
+    }
+
+    return true;
+}
+
+bool a_chat_send_all(int socket, const void* data, size_t length) {
+    const uint8_t* position = data;
+    while (length > 0) {
+        ssize_t bytes_sent = send(socket, position, length, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+
+        position += bytes_sent;
+        length -= bytes_sent;
+    }
+
+    return true;
+}
@@ -0,0 +1,247 @@
+#include "protocol/lz4.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define A_CHAT_LZ4_HASH_BITS 12
+#define A_CHAT_LZ4_MINIMUM_MATCH 4
+// lz4 always ends a block with at least this many literals, and never starts a match this close to its end
+#define A_CHAT_LZ4_LAST_LITERALS 5
+#define A_CHAT_LZ4_MATCH_LIMIT 12
+#define A_CHAT_LZ4_MAXIMUM_OFFSET 65535
+// the longer no match turns up, the more bytes are skipped at a time, so incompressible data goes by quickly
+#define A_CHAT_LZ4_SKIP_TRIGGER 6
+
+// text that turns up in a lot of chat messages, most common last, which every client has to have exactly the same
+static const char a_chat_lz4_dictionary[] =
+    "https://www.youtube.com/watch?v=https://github.com/https://docs.google.com/https://twitter.com/"
+    "https://en.wikipedia.org/wiki/ .com/ .org/ .html .png .jpg .gif "
+    "Monday Tuesday Wednesday Thursday Friday Saturday Sunday tomorrow yesterday tonight this morning this afternoon "
+    "this evening next week last week in a minute in a few minutes an hour ago right now at the moment "
+    "meeting schedule calendar deadline release version update issue ticket review merge branch commit "
+    "deploy build test error bug fix feature server client message room channel group chat "
+    "I don't know if I think we should I'm not sure I'm going to I was going to I have to I need to I want to "
+    "do you want to do you have can you could you would you will you are you is it does anyone "
+    "let me know let me check let me see sounds good sounds great looks good to me works for me "
+    "no problem no worries of course for sure I agree makes sense good idea never mind "
+    "what do you think what time where are you how are you how's it going what's up "
+    "thank you so much thanks a lot thanks! thank you! please sorry about that my bad "
+    "good morning good night good luck have a good one see you later talk to you later "
+    "haha lol lmao omg btw imo tbh idk brb afk gg np ty ok okay yeah yes no maybe "
+    "because should would could about there their they're that's what which when where "
+    "with from have this will your just like know time people into some other than then "
+    "also only over after first well even want because these give most us, "
+    "the and for are but not you all any can had her was one our out day get has him his "
+    "how man new now old see two way who boy did its let put say she too use "
+    ". The , and , but . I . It . We . You ? ! ... :) :( :D ;) <3 "
+    " the  a  to  of  in  is  it  I  you  that  and  for  on  be  at  this  with ";
+
+#define A_CHAT_LZ4_DICTIONARY_SIZE (sizeof(a_chat_lz4_dictionary) - 1)
+
+// where every 4 bytes of the dictionary are, plus one so 0 is empty, shared by every compression as a starting point
+static uint32_t a_chat_lz4_dictionary_table[1 << A_CHAT_LZ4_HASH_BITS];
+static pthread_once_t a_chat_lz4_dictionary_once = PTHREAD_ONCE_INIT;
+
+static uint32_t a_chat_lz4_read32(const uint8_t* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint32_t a_chat_lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - A_CHAT_LZ4_HASH_BITS);
+}
+
+static void a_chat_lz4_hash_dictionary(void) {
+    const uint8_t* dictionary = (const uint8_t*) a_chat_lz4_dictionary;
+    for (size_t i = 0; i + A_CHAT_LZ4_MINIMUM_MATCH <= A_CHAT_LZ4_DICTIONARY_SIZE; i++) {
+        a_chat_lz4_dictionary_table[a_chat_lz4_hash(a_chat_lz4_read32(dictionary + i))] = (uint32_t) i + 1;
+    }
+}
+
+// writes what doesn't fit in a token's nibble as 255s and a remainder, returns NULL if it doesn't fit
+static uint8_t* a_chat_lz4_write_length(uint8_t* output, const uint8_t* end, size_t length) {
+    while (length >= 255) {
+        if (output >= end) { return NULL; }
+        *output++ = 255;
+        length -= 255;
+    }
+    if (output >= end) { return NULL; }
+    *output++ = (uint8_t) length;
+
+    return output;
+}
+
+// writes one sequence, its literals then a match (or none for the last sequence), returns NULL if it doesn't fit
+static uint8_t* a_chat_lz4_write_sequence(uint8_t* output, const uint8_t* end, const uint8_t* literals, size_t literal_length, size_t offset, size_t match_length) {
+    if (output >= end) { return NULL; }
+    uint8_t* token = output++;
+    *token = (uint8_t) ((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15 && !(output = a_chat_lz4_write_length(output, end, literal_length - 15))) { return NULL; }
+
+    if ((size_t) (end - output) < literal_length) { return NULL; }
+    memcpy(output, literals, literal_length);
+    output += literal_length;
+
+    if (match_length == 0) { return output; }
+
+    if (end - output < 2) { return NULL; }
+    *output++ = (uint8_t) offset;
+    *output++ = (uint8_t) (offset >> 8);
+
+    match_length -= A_CHAT_LZ4_MINIMUM_MATCH;
+    *token |= (uint8_t) (match_length < 15 ? match_length : 15);
+    if (match_length >= 15 && !(output = a_chat_lz4_write_length(output, end, match_length - 15))) { return NULL; }
+
+    return output;
+}
+
+size_t a_chat_lz4_compress(const uint8_t* input, size_t length, uint8_t* output, size_t capacity) {
+    // only worth it if the result is smaller, and the header has to fit
+    if (capacity > length) {
+        capacity = length;
+    }
+    if (length > UINT32_MAX || capacity <= A_CHAT_LZ4_HEADER_SIZE) { return 0; }
+
+    pthread_once(&a_chat_lz4_dictionary_once, a_chat_lz4_hash_dictionary);
+
+    // the dictionary goes right before the input, so a match can point into either the same way
+    // a_chat_pool_alloc logs the correct error already
+    size_t dictionary_size = A_CHAT_LZ4_DICTIONARY_SIZE;
+    uint8_t* window = a_chat_pool_alloc(dictionary_size + length);
+    if (!window) { return 0; }
+    memcpy(window, a_chat_lz4_dictionary, dictionary_size);
+    memcpy(window + dictionary_size, input, length);
+
+    uint32_t table[1 << A_CHAT_LZ4_HASH_BITS];
+    memcpy(table, a_chat_lz4_dictionary_table, sizeof(table));
+
+    uint8_t* out = output;
+    const uint8_t* out_end = output + capacity;
+    out[0] = (uint8_t) (length >> 24);
+    out[1] = (uint8_t) (length >> 16);
+    out[2] = (uint8_t) (length >> 8);
+    out[3] = (uint8_t) length;
+    out += A_CHAT_LZ4_HEADER_SIZE;
+
+    size_t end = dictionary_size + length;
+    size_t anchor = dictionary_size;
+    size_t position = dictionary_size;
+    if (length >= A_CHAT_LZ4_MATCH_LIMIT + 1) {
+        size_t match_limit = end - A_CHAT_LZ4_MATCH_LIMIT;
+        size_t literals_limit = end - A_CHAT_LZ4_LAST_LITERALS;
+        size_t misses = 1 << A_CHAT_LZ4_SKIP_TRIGGER;
+
+        while (position < match_limit) {
+            uint32_t sequence = a_chat_lz4_read32(window + position);
+            uint32_t hash = a_chat_lz4_hash(sequence);
+            size_t candidate = table[hash];
+            table[hash] = (uint32_t) position + 1;
+
+            if (candidate == 0 || position - (candidate - 1) > A_CHAT_LZ4_MAXIMUM_OFFSET || a_chat_lz4_read32(window + candidate - 1) != sequence) {
+                position += misses++ >> A_CHAT_LZ4_SKIP_TRIGGER;
+                continue;
+            }
+            size_t match = candidate - 1;
+            misses = 1 << A_CHAT_LZ4_SKIP_TRIGGER;
+
+            // the match may have started before the bytes that were hashed
+            while (position > anchor && match > 0 && window[position - 1] == window[match - 1]) {
+                position--;
+                match--;
+            }
+            size_t match_length = A_CHAT_LZ4_MINIMUM_MATCH;
+            while (position + match_length < literals_limit && window[position + match_length] == window[match + match_length]) {
+                match_length++;
+            }
+
+            out = a_chat_lz4_write_sequence(out, out_end, window + anchor, position - anchor, position - match, match_length);
+            if (!out) {
+                a_chat_pool_free(window);
+                return 0;
+            }
+
+            position += match_length;
+            anchor = position;
+        }
+    }
+
+    out = a_chat_lz4_write_sequence(out, out_end, window + anchor, end - anchor, 0, 0);
+    a_chat_pool_free(window);
+    if (!out || out >= out_end) { return 0; }
+
+    return (size_t) (out - output);
+}
+
+bool a_chat_lz4_decompressed_length(const uint8_t* input, size_t length, size_t* decompressed_length) {
+    if (length < A_CHAT_LZ4_HEADER_SIZE) { return false; }
+
+    *decompressed_length = ((size_t) input[0] << 24) | ((size_t) input[1] << 16) | ((size_t) input[2] << 8) | input[3];
+    return true;
+}
+
+// reads the rest of a length that didn't fit in a token's nibble, returns false if the input ends first
+static bool a_chat_lz4_read_length(const uint8_t** input, const uint8_t* end, size_t* length) {
+    uint8_t byte;
+    do {
+        if (*input >= end) { return false; }
+        byte = *(*input)++;
+        *length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+bool a_chat_lz4_decompress(const uint8_t* input, size_t length, uint8_t* output, size_t decompressed_length) {
+    size_t expected_length;
+    if (!a_chat_lz4_decompressed_length(input, length, &expected_length) || expected_length != decompressed_length) { return false; }
+
+    const uint8_t* dictionary = (const uint8_t*) a_chat_lz4_dictionary;
+    const uint8_t* in = input + A_CHAT_LZ4_HEADER_SIZE;
+    const uint8_t* in_end = input + length;
+    size_t position = 0;
+
+    // every bound is checked, the input comes from another client and only the server stood in between
+    while (true) {
+        if (in >= in_end) { return false; }
+        uint8_t token = *in++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !a_chat_lz4_read_length(&in, in_end, &literal_length)) { return false; }
+        if ((size_t) (in_end - in) < literal_length || decompressed_length - position < literal_length) { return false; }
+        memcpy(output + position, in, literal_length);
+        in += literal_length;
+        position += literal_length;
+
+        // the last sequence is only literals
+        if (in == in_end) { break; }
+
+        if (in_end - in < 2) { return false; }
+        size_t offset = (size_t) in[0] | ((size_t) in[1] << 8);
+        in += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !a_chat_lz4_read_length(&in, in_end, &match_length)) { return false; }
+        match_length += A_CHAT_LZ4_MINIMUM_MATCH;
+
+        if (offset == 0 || offset > position + A_CHAT_LZ4_DICTIONARY_SIZE || decompressed_length - position < match_length) { return false; }
+
+        // a match that starts in the dictionary can carry on into the output
+        if (offset > position) {
+            size_t from = A_CHAT_LZ4_DICTIONARY_SIZE - (offset - position);
+            size_t from_dictionary = offset - position < match_length ? offset - position : match_length;
+            memcpy(output + position, dictionary + from, from_dictionary);
+            position += from_dictionary;
+            match_length -= from_dictionary;
+        }
+
+        // matches can overlap what they are copying, so they are copied a byte at a time
+        for (size_t i = 0; i < match_length; i++) {
+            output[position] = output[position - offset];
+            position++;
+        }
+    }
+
+    return position == decompressed_length;
+}
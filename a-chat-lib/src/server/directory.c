@@ -0,0 +1,148 @@
+#include "server/directory.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define A_CHAT_DIRECTORY_INITIAL_BUCKETS 256
+
+// the directory's lock must be held while calling this
+static AChatUser* a_chat_directory_lookup(const AChatDirectory* directory, const char* name, size_t length, uint32_t hash) {
+    for (AChatHashEntry* entry = a_chat_hash_table_bucket(&directory->users, hash); entry; entry = entry->next) {
+        AChatUser* user = (AChatUser*) entry;
+        if (entry->hash == hash && user->name_length == length && memcmp(user->name, name, length) == 0) {
+            return user;
+        }
+    }
+
+    return NULL;
+}
+
+bool a_chat_directory_init(AChatDirectory* directory) {
+    if (!a_chat_hash_table_init(&directory->users, A_CHAT_DIRECTORY_INITIAL_BUCKETS)) {
+        a_chat_log_error("Failed to allocate memory for user directory");
+        return false;
+    }
+
+    if (pthread_rwlock_init(&directory->lock, NULL) != 0) {
+        a_chat_log_error("Failed to create user directory's lock");
+
+        a_chat_hash_table_destroy(&directory->users);
+        return false;
+    }
+
+    directory->number_online = 0;
+    directory->number_away = 0;
+
+    return true;
+}
+
+void a_chat_directory_destroy(AChatDirectory* directory) {
+    for (uint32_t i = 0; i < directory->users.number_of_buckets; i++) {
+        AChatHashEntry* entry = directory->users.buckets[i];
+        while (entry) {
+            AChatUser* user = (AChatUser*) entry;
+            entry = entry->next;
+            free(user);
+        }
+    }
+
+    pthread_rwlock_destroy(&directory->lock);
+    a_chat_hash_table_destroy(&directory->users);
+}
+
+AChatUser* a_chat_directory_claim(AChatDirectory* directory, const char* name, size_t length) {
+    uint32_t hash = a_chat_hash(name, length);
+
+    // made before taking the lock, so the write lock is only held for the link
+    AChatUser* user = malloc(sizeof(AChatUser) + length + 1);
+    if (!user) {
+        a_chat_log_error("Failed to allocate memory for user");
+        return NULL;
+    }
+    user->presence = A_CHAT_PRESENCE_OFFLINE;
+    user->event_loop = -1;
+    user->handle = (AChatRegistryHandle) { A_CHAT_REGISTRY_NONE, 0 };
+    user->has_public_key = false;
+    user->name_length = length;
+    memcpy(user->name, name, length);
+    user->name[length] = '\0';
+
+    pthread_rwlock_wrlock(&directory->lock);
+    if (a_chat_directory_lookup(directory, name, length, hash)) {
+        pthread_rwlock_unlock(&directory->lock);
+
+        free(user);
+        return NULL;
+    }
+    a_chat_hash_table_insert(&directory->users, &user->entry, hash);
+    pthread_rwlock_unlock(&directory->lock);
+
+    return user;
+}
+
+void a_chat_directory_attach(AChatDirectory* directory, AChatUser* user, int event_loop, AChatRegistryHandle handle, const uint8_t* public_key) {
+    pthread_rwlock_wrlock(&directory->lock);
+    if (user->presence == A_CHAT_PRESENCE_AWAY) {
+        directory->number_away--;
+    }
+    if (user->presence != A_CHAT_PRESENCE_ONLINE) {
+        directory->number_online++;
+    }
+    user->presence = A_CHAT_PRESENCE_ONLINE;
+    user->event_loop = event_loop;
+    user->handle = handle;
+    user->has_public_key = public_key != NULL;
+    if (public_key) {
+        memcpy(user->public_key, public_key, A_CHAT_PUBLIC_KEY_SIZE);
+    }
+    pthread_rwlock_unlock(&directory->lock);
+}
+
+void a_chat_directory_detach(AChatDirectory* directory, AChatUser* user) {
+    pthread_rwlock_wrlock(&directory->lock);
+    if (user->presence == A_CHAT_PRESENCE_ONLINE) {
+        directory->number_online--;
+    }
+    if (user->presence != A_CHAT_PRESENCE_AWAY) {
+        directory->number_away++;
+    }
+    user->presence = A_CHAT_PRESENCE_AWAY;
+    user->handle = (AChatRegistryHandle) { A_CHAT_REGISTRY_NONE, 0 };
+    pthread_rwlock_unlock(&directory->lock);
+}
+
+void a_chat_directory_release(AChatDirectory* directory, AChatUser* user) {
+    pthread_rwlock_wrlock(&directory->lock);
+    if (user->presence == A_CHAT_PRESENCE_ONLINE) {
+        directory->number_online--;
+    } else if (user->presence == A_CHAT_PRESENCE_AWAY) {
+        directory->number_away--;
+    }
+
+    a_chat_hash_table_remove(&directory->users, &user->entry);
+    pthread_rwlock_unlock(&directory->lock);
+
+    free(user);
+}
+
+bool a_chat_directory_find(AChatDirectory* directory, const char* name, size_t length, AChatUserStatus* status) {
+    uint32_t hash = a_chat_hash(name, length);
+
+    pthread_rwlock_rdlock(&directory->lock);
+    AChatUser* user = a_chat_directory_lookup(directory, name, length, hash);
+    if (!user) {
+        pthread_rwlock_unlock(&directory->lock);
+        return false;
+    }
+
+    status->presence = user->presence;
+    status->event_loop = user->event_loop;
+    status->handle = user->handle;
+    status->has_public_key = user->has_public_key;
+    memcpy(status->public_key, user->public_key, A_CHAT_PUBLIC_KEY_SIZE);
+    pthread_rwlock_unlock(&directory->lock);
+
+    return true;
+}
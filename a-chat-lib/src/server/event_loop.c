@@ -0,0 +1,1365 @@
+#include "server/event_loop.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "log.h"
+#include "pool.h"
+#include "protocol/frame.h"
+#include "server/session.h"
+
+#define A_CHAT_EVENT_LOOP_MAXIMUM_EVENTS 64
+
+// how long epoll_wait can block before the event loop checks if the server is still running
+#define A_CHAT_EVENT_LOOP_TIMEOUT_MS 500
+
+// how precise handshake deadlines are
+#define A_CHAT_EVENT_LOOP_TICK_MS 100
+
+// how many bytes can be queued to a client during a single pass through the event loop before it is flushed early
+#define A_CHAT_EVENT_LOOP_FLUSH_WATERMARK (64 * 1024)
+
+// io_uring's submission queue, and the provided buffers every receive on the ring shares
+#define A_CHAT_EVENT_LOOP_URING_ENTRIES 1024
+#define A_CHAT_EVENT_LOOP_URING_BUFFERS 256
+#define A_CHAT_EVENT_LOOP_URING_BUFFER_SIZE (16 * 1024)
+
+// how many ticks a stopping io_uring event loop waits for its cancelled requests
+#define A_CHAT_EVENT_LOOP_URING_DRAIN_TICKS 10
+
+// what an io_uring request is for, kept in the low bits of its user data next to the event loop or client handler it belongs to
+typedef enum AChatUringOperation {
+    A_CHAT_URING_ACCEPT = 1,
+    A_CHAT_URING_WAKE,
+    A_CHAT_URING_RECEIVE,
+    A_CHAT_URING_SEND,
+    A_CHAT_URING_CANCEL, // cancels only complete when they fail, which is ignored
+} AChatUringOperation;
+
+#define A_CHAT_URING_OPERATION_MASK 7
+
+// a frame waiting in an event loop's inbox to be sent to every client in its shard, one of its rooms or one client
+// the frame itself is shared by every event loop, only this small node is per event loop
+typedef struct AChatEventLoopMessage {
+    AChatMpscNode node; // must be first so a popped node can be cast back to the message
+    AChatBuffer* frame;
+    uint64_t posted_at_ns; // for the broadcast's latency
+    AChatRegistryHandle handle; // the one client handler the frame is for, its slot is A_CHAT_REGISTRY_NONE otherwise
+    size_t room_length; // 0 when the frame is for the whole shard
+    char room[];
+} AChatEventLoopMessage;
+
+// the event loop running on the current thread, NULL on threads that aren't event loops
+static _Thread_local AChatEventLoop* a_chat_current_event_loop = NULL;
+
+static uint64_t a_chat_event_loop_user_data(void* pointer, AChatUringOperation operation) {
+    return (uint64_t) (uintptr_t) pointer | operation;
+}
+
+static void a_chat_event_loop_schedule_flush(AChatEventLoop* event_loop, AChatClientHandler* client_handler) {
+    if (client_handler->pending_flush_index != -1) { return; }
+
+    if (event_loop->number_of_pending_flushes == event_loop->pending_flushes_capacity) {
+        int new_capacity = event_loop->pending_flushes_capacity ? event_loop->pending_flushes_capacity * 2 : 16;
+        AChatClientHandler** new_pending_flushes = realloc(event_loop->pending_flushes, sizeof(AChatClientHandler*) * new_capacity);
+        if (!new_pending_flushes) {
+            a_chat_log_error("Failed to allocate memory for event loop pending flushes");
+            return;
+        }
+
+        event_loop->pending_flushes = new_pending_flushes;
+        event_loop->pending_flushes_capacity = new_capacity;
+    }
+
+    client_handler->pending_flush_index = event_loop->number_of_pending_flushes;
+    event_loop->pending_flushes[event_loop->number_of_pending_flushes++] = client_handler;
+}
+
+static void a_chat_event_loop_cancel_flush(AChatEventLoop* event_loop, AChatClientHandler* client_handler) {
+    if (client_handler->pending_flush_index == -1) { return; }
+
+    int last = event_loop->number_of_pending_flushes - 1;
+    event_loop->pending_flushes[client_handler->pending_flush_index] = event_loop->pending_flushes[last];
+    event_loop->pending_flushes[client_handler->pending_flush_index]->pending_flush_index = client_handler->pending_flush_index;
+    event_loop->number_of_pending_flushes--;
+    client_handler->pending_flush_index = -1;
+}
+
+// queues the frame to the client handler, this only pushes a pointer
+static void a_chat_event_loop_send_to_client(AChatEventLoop* event_loop, AChatClientHandler* client_handler, AChatBuffer* frame) {
+    if (!client_handler->handshake_complete || client_handler->overflowed) { return; }
+
+    switch (a_chat_outbound_queue_push(&client_handler->outbound, frame)) {
+        case A_CHAT_OUTBOUND_QUEUED:
+            // a burst of frames in one pass shouldn't overflow a client that keeps up, so flush early past the watermark
+            // io_uring's sends all go out together at the end of the pass instead
+            if (!event_loop->uring && client_handler->outbound.queued_bytes >= A_CHAT_EVENT_LOOP_FLUSH_WATERMARK && a_chat_outbound_queue_flush(&client_handler->outbound, client_handler->socket) == A_CHAT_FLUSH_FAILED) {
+                a_chat_log_warning_errno("Failed broadcast message to a client");
+                a_chat_outbound_queue_clear(&client_handler->outbound);
+                break;
+            }
+            a_chat_event_loop_schedule_flush(event_loop, client_handler);
+            break;
+        case A_CHAT_OUTBOUND_DROPPED:
+            break;
+        case A_CHAT_OUTBOUND_OVERFLOW:
+            // the shard may be being iterated, so the slow client is disconnected when the event loop flushes
+            client_handler->overflowed = true;
+            a_chat_event_loop_schedule_flush(event_loop, client_handler);
+            break;
+    }
+}
+
+// queues the frame to every client handler in members
+static void a_chat_event_loop_send_to_members(AChatEventLoop* event_loop, AChatRegistry* members, AChatBuffer* frame) {
+    for (uint32_t i = 0; i < members->count; i++) {
+        a_chat_event_loop_send_to_client(event_loop, members->client_handlers[i], frame);
+    }
+}
+
+// a client handler that has disconnected since the frame was sent its way is just skipped
+static void a_chat_event_loop_send_to_handle(AChatEventLoop* event_loop, AChatRegistryHandle handle, AChatBuffer* frame) {
+    AChatClientHandler* client_handler = a_chat_registry_get(&event_loop->registry, handle);
+    if (client_handler) {
+        a_chat_event_loop_send_to_client(event_loop, client_handler, frame);
+    }
+}
+
+static void a_chat_event_loop_send_to_room(AChatEventLoop* event_loop, const char* room, size_t room_length, AChatBuffer* frame) {
+    // a shard with none of the room's members has nothing to do
+    AChatRoom* found_room = a_chat_room_table_find(&event_loop->rooms, room, room_length);
+    if (found_room) {
+        a_chat_event_loop_send_to_members(event_loop, &found_room->members, frame);
+    }
+}
+
+static void a_chat_event_loop_wake(AChatEventLoop* event_loop) {
+    // only the first producer since the last drain needs to write to the eventfd
+    if (atomic_exchange(&event_loop->wake_pending, true)) { return; }
+
+    uint64_t value = 1;
+    if (write(event_loop->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        a_chat_log_error_errno("Failed to wake event loop");
+    }
+}
+
+// sends everything in the inbox to the shard's clients, without touching the wakeup
+static void a_chat_event_loop_deliver_inbox(AChatEventLoop* event_loop) {
+    AChatMpscNode* node;
+    while ((node = a_chat_mpsc_queue_pop(&event_loop->inbox))) {
+        AChatEventLoopMessage* message = (AChatEventLoopMessage*) node;
+        if (message->handle.slot != A_CHAT_REGISTRY_NONE) {
+            a_chat_event_loop_send_to_handle(event_loop, message->handle, message->frame);
+        } else if (message->room_length > 0) {
+            a_chat_event_loop_send_to_room(event_loop, message->room, message->room_length, message->frame);
+        } else {
+            a_chat_event_loop_send_to_members(event_loop, &event_loop->registry, message->frame);
+        }
+        a_chat_metrics_record(&event_loop->server->metrics, A_CHAT_HISTOGRAM_BROADCAST, a_chat_metrics_now_ns() - message->posted_at_ns);
+        a_chat_buffer_release(message->frame);
+        a_chat_pool_free(message);
+    }
+}
+
+static void a_chat_event_loop_drain_inbox(AChatEventLoop* event_loop) {
+    uint64_t value;
+    if (read(event_loop->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        a_chat_log_error_errno("Failed to read event loop's eventfd");
+    }
+
+    // clear the flag before draining so a push that races with the drain wakes the event loop again
+    atomic_store(&event_loop->wake_pending, false);
+
+    a_chat_event_loop_deliver_inbox(event_loop);
+}
+
+static void a_chat_event_loop_free_client_handler(AChatClientHandler* client_handler) {
+    a_chat_frame_decoder_destroy(&client_handler->decoder);
+    a_chat_outbound_queue_destroy(&client_handler->outbound);
+    free(client_handler->send_iov);
+    free(client_handler);
+}
+
+static void a_chat_event_loop_disconnect(AChatEventLoop* event_loop, AChatClientHandler* client_handler) {
+    a_chat_registry_remove(&event_loop->registry, client_handler->handle);
+    a_chat_timer_wheel_cancel(&event_loop->timers, &client_handler->timer);
+
+    if (event_loop->uring) {
+        // the ring holds on to the socket until its requests end, shutting it down ends them
+        // the receive is cancelled as well in case it is waiting on a provided buffer
+        shutdown(client_handler->socket, SHUT_RDWR);
+
+        struct io_uring_sqe* sqe = a_chat_uring_get_sqe(event_loop->uring);
+        if (sqe) {
+            a_chat_uring_prepare_cancel(sqe, a_chat_event_loop_user_data(client_handler, A_CHAT_URING_RECEIVE), a_chat_event_loop_user_data(NULL, A_CHAT_URING_CANCEL));
+        }
+    }
+
+    // closing the socket also removes it from the epoll instance
+    if (close(client_handler->socket) != 0) {
+        a_chat_log_error("Failed to close client socket while disconnecting client");
+    }
+
+    // a client that can still resume its session hasn't left its rooms as far as anyone else knows
+    // its session takes its username over, so the notice is made first
+    // a resume that failed after its session was found has to give it back the same way
+    bool detached = client_handler->session && (client_handler->handshake_complete || client_handler->resuming);
+    char message[640];
+    if (client_handler->handshake_complete) {
+        snprintf(message, sizeof(message), detached ? "%s has disconnected, keeping their session" : "%s has disconnected", client_handler->user->name);
+    }
+    if (detached) {
+        a_chat_session_table_save_rooms(event_loop->server->sessions, client_handler);
+        a_chat_session_table_detach(event_loop->server->sessions, client_handler);
+    }
+
+    if (client_handler->handshake_complete) {
+        event_loop->server->number_of_clients--;
+        a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_DISCONNECTS, 1);
+        a_chat_log_info(message);
+
+        // let every room the client was in know that they have gone, the room can be freed by the leave so its name is copied
+        while (client_handler->number_of_rooms > 0) {
+            AChatRoom* room = client_handler->rooms[client_handler->number_of_rooms - 1].room;
+            char room_name[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+            size_t room_length = room->name_length;
+            memcpy(room_name, room->name, room_length + 1);
+
+            a_chat_room_leave(&event_loop->rooms, client_handler, room_name, room_length);
+            if (detached || event_loop->draining) { continue; }
+            a_chat_server_broadcast_room(event_loop->server, room_name, room_length, message);
+            if (client_handler->has_public_key) {
+                a_chat_server_announce_member(event_loop->server, room_name, room_length, client_handler->public_key, A_CHAT_MEMBER_LEFT);
+            }
+        }
+    }
+
+    // the broadcasts above can hand the client handler frames for the rooms it hadn't left yet, so it only stops
+    // waiting on a flush once it is in none
+    a_chat_event_loop_cancel_flush(event_loop, client_handler);
+
+    // a client without a session to come back to gives its username up straight away
+    if (client_handler->user) {
+        a_chat_directory_release(&event_loop->server->directory, client_handler->user);
+        client_handler->user = NULL;
+    }
+
+    // a send in flight still reads from the outbound queue, so the client handler is freed once its last request completes
+    if (client_handler->pending_operations > 0) {
+        client_handler->closing = true;
+        a_chat_registry_insert(&event_loop->closing, client_handler, &client_handler->handle);
+        return;
+    }
+
+    a_chat_event_loop_free_client_handler(client_handler);
+}
+
+// frees a disconnected client handler once the ring is done with it
+static void a_chat_event_loop_uring_release(AChatEventLoop* event_loop, AChatClientHandler* client_handler) {
+    if (!client_handler->closing || client_handler->pending_operations > 0) { return; }
+
+    a_chat_registry_remove(&event_loop->closing, client_handler->handle);
+    a_chat_event_loop_free_client_handler(client_handler);
+}
+
+static bool a_chat_event_loop_uring_submit_accept(AChatEventLoop* event_loop) {
+    struct io_uring_sqe* sqe = a_chat_uring_get_sqe(event_loop->uring);
+    if (!sqe) {
+        a_chat_log_error("Failed to queue accepting new clients");
+        return false;
+    }
+
+    a_chat_uring_prepare_accept_multishot(sqe, event_loop->listening_socket, a_chat_event_loop_user_data(event_loop, A_CHAT_URING_ACCEPT));
+    event_loop->uring_operations++;
+
+    return true;
+}
+
+static bool a_chat_event_loop_uring_submit_wake(AChatEventLoop* event_loop) {
+    struct io_uring_sqe* sqe = a_chat_uring_get_sqe(event_loop->uring);
+    if (!sqe) {
+        a_chat_log_error("Failed to queue waiting on event loop's eventfd");
+        return false;
+    }
+
+    a_chat_uring_prepare_poll_multishot(sqe, event_loop->wake_fd, a_chat_event_loop_user_data(event_loop, A_CHAT_URING_WAKE));
+    event_loop->uring_operations++;
+
+    return true;
+}
+
+static bool a_chat_event_loop_uring_submit_receive(AChatEventLoop* event_loop, AChatClientHandler* client_handler) {
+    struct io_uring_sqe* sqe = a_chat_uring_get_sqe(event_loop->uring);
+    if (!sqe) {
+        a_chat_log_error("Failed to queue receiving from client");
+        return false;
+    }
+
+    a_chat_uring_prepare_receive_multishot(sqe, client_handler->socket, a_chat_event_loop_user_data(client_handler, A_CHAT_URING_RECEIVE));
+    client_handler->pending_operations++;
+    event_loop->uring_operations++;
+
+    return true;
+}
+
+static bool a_chat_event_loop_uring_submit_send(AChatEventLoop* event_loop, AChatClientHandler* client_handler) {
+    if (!client_handler->send_iov) {
+        client_handler->send_iov = malloc(sizeof(struct iovec) * A_CHAT_OUTBOUND_QUEUE_MAXIMUM_IOV);
+        if (!client_handler->send_iov) {
+            a_chat_log_error("Failed to allocate memory for client handler's send");
+            return false;
+        }
+    }
+
+    struct io_uring_sqe* sqe = a_chat_uring_get_sqe(event_loop->uring);
+    if (!sqe) {
+        a_chat_log_error("Failed to queue sending to client");
+        return false;
+    }
+
+    // the frames stay pinned in the outbound queue until the send completes
+    size_t number_of_iov = a_chat_outbound_queue_begin_send(&client_handler->outbound, client_handler->send_iov, A_CHAT_OUTBOUND_QUEUE_MAXIMUM_IOV);
+    client_handler->send_message = (struct msghdr) { .msg_iov = client_handler->send_iov, .msg_iovlen = number_of_iov };
+    a_chat_uring_prepare_send_message(sqe, client_handler->socket, &client_handler->send_message, a_chat_event_loop_user_data(client_handler, A_CHAT_URING_SEND));
+    client_handler->sending = true;
+    client_handler->pending_operations++;
+    event_loop->uring_operations++;
+
+    return true;
+}
+
+static void a_chat_event_loop_flush(AChatEventLoop* event_loop) {
+    // disconnecting a slow client broadcasts to the shard, which can schedule more flushes while this runs
+    while (event_loop->number_of_pending_flushes > 0) {
+        AChatClientHandler* client_handler = event_loop->pending_flushes[--event_loop->number_of_pending_flushes];
+        client_handler->pending_flush_index = -1;
+
+        if (client_handler->overflowed) {
+            char message[640];
+            snprintf(message, sizeof(message), "%s can't keep up, disconnecting them", client_handler->user->name);
+            a_chat_log_info(message);
+            a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_SLOW_CONSUMER_DISCONNECTS, 1);
+
+            a_chat_event_loop_disconnect(event_loop, client_handler);
+            continue;
+        }
+
+        // io_uring sends to every pending client handler with one submission, a client handler with a send in flight is flushed again when it completes
+        if (event_loop->uring) {
+            if (!client_handler->sending && client_handler->outbound.count > 0) {
+                a_chat_event_loop_uring_submit_send(event_loop, client_handler);
+            }
+            continue;
+        }
+
+        // a blocked flush carries on when epoll says the socket is writable again
+        if (a_chat_outbound_queue_flush(&client_handler->outbound, client_handler->socket) == A_CHAT_FLUSH_FAILED) {
+            a_chat_log_warning_errno("Failed broadcast message to a client");
+
+            // the connection is broken, recv() will pick that up, so there is no point keeping the rest
+            a_chat_outbound_queue_clear(&client_handler->outbound);
+        }
+    }
+}
+
+// the client stays in the handshake state until its first message arrives
+static void a_chat_event_loop_add_client(AChatEventLoop* event_loop, int new_socket) {
+    a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_CONNECTIONS_ACCEPTED, 1);
+
+    AChatClientHandler* client_handler = calloc(1, sizeof(AChatClientHandler));
+    if (!client_handler) {
+        a_chat_log_error("Failed to allocate memory for client handler");
+
+        close(new_socket);
+        return;
+    }
+    client_handler->socket = new_socket;
+    client_handler->event_loop = event_loop;
+    client_handler->pending_flush_index = -1;
+    client_handler->wake_fd = -1;
+    client_handler->accepted_at_ns = a_chat_metrics_now_ns();
+    client_handler->last_received_ms = a_chat_timer_now_ms();
+    a_chat_token_bucket_init(&client_handler->messages_bucket);
+    a_chat_token_bucket_init(&client_handler->bytes_bucket);
+    client_handler->address_slot = a_chat_rate_limiter_address_slot(new_socket);
+    a_chat_outbound_queue_init(&client_handler->outbound, event_loop->server->config.outbound_queue_maximum_frames, event_loop->server->config.outbound_queue_maximum_bytes, event_loop->server->config.overflow_policy, &event_loop->server->metrics);
+
+    // reads and flushes must never block the event loop
+    // io_uring waits for the socket itself, a non-blocking socket would have its requests fail instead
+    if (!event_loop->uring) {
+        int flags = fcntl(new_socket, F_GETFL, 0);
+        if (flags == -1 || fcntl(new_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+            a_chat_log_error_errno("Failed to make client socket non-blocking");
+
+            close(new_socket);
+            free(client_handler);
+            return;
+        }
+    }
+
+    if (!a_chat_frame_decoder_init(&client_handler->decoder)) {
+        close(new_socket);
+        free(client_handler);
+        return;
+    }
+
+    if (!a_chat_registry_insert(&event_loop->registry, client_handler, &client_handler->handle)) {
+        close(new_socket);
+        a_chat_frame_decoder_destroy(&client_handler->decoder);
+        free(client_handler);
+        return;
+    }
+
+    // a client that never finishes its handshake is disconnected once its deadline passes
+    a_chat_timer_init(&client_handler->timer, client_handler);
+    a_chat_timer_wheel_schedule(&event_loop->timers, &client_handler->timer, a_chat_timer_now_ms(), event_loop->server->config.handshake_timeout_ms);
+
+    if (event_loop->uring) {
+        if (!a_chat_event_loop_uring_submit_receive(event_loop, client_handler)) {
+            a_chat_event_loop_disconnect(event_loop, client_handler);
+        }
+        return;
+    }
+
+    // edge-triggered EPOLLOUT only fires when a full socket becomes writable again, so it can always be registered
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = client_handler;
+    if (epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_ADD, new_socket, &event) == -1) {
+        a_chat_log_error_errno("Failed to register client socket with epoll");
+
+        a_chat_event_loop_disconnect(event_loop, client_handler);
+    }
+}
+
+static void a_chat_event_loop_accept(AChatEventLoop* event_loop) {
+    // the listening socket is edge-triggered, so keep accepting until there is nothing left
+    while (true) {
+        struct sockaddr_storage their_address;
+        socklen_t address_size = sizeof(struct sockaddr_storage);
+
+        int new_socket = accept(event_loop->listening_socket, (struct sockaddr*) &their_address, &address_size);
+        if (new_socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                a_chat_log_error_errno("Failed accept new client");
+            }
+
+            return;
+        }
+
+        a_chat_event_loop_add_client(event_loop, new_socket);
+    }
+}
+
+// pings the client handler if it has gone quiet, or disconnects it if it has been quiet for too long, then sets its timer
+// for the next check, returns false if the client handler was disconnected
+static bool a_chat_event_loop_check_idle(AChatEventLoop* event_loop, AChatClientHandler* client_handler) {
+    uint64_t now = a_chat_timer_now_ms();
+    int delay;
+    AChatIdleResult idle = a_chat_client_handler_check_idle(event_loop->server, client_handler, now, &delay);
+    if (idle == A_CHAT_IDLE_REAP) {
+        char message[640];
+        snprintf(message, sizeof(message), "%s has gone quiet, disconnecting them", client_handler->user->name);
+        a_chat_log_info(message);
+        a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_CONNECTIONS_REAPED, 1);
+
+        a_chat_event_loop_disconnect(event_loop, client_handler);
+        return false;
+    }
+
+    if (idle == A_CHAT_IDLE_PING) {
+        AChatBuffer* ping = a_chat_frame_create(A_CHAT_FRAME_PING, 0, NULL, 0);
+        if (ping) {
+            a_chat_event_loop_send_to_client(event_loop, client_handler, ping);
+            a_chat_buffer_release(ping);
+            a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_PINGS_SENT, 1);
+        }
+    }
+
+    // the timer only goes off when the client might have gone quiet, hearing from it doesn't touch the wheel at all
+    if (delay >= 0) {
+        a_chat_timer_wheel_schedule(&event_loop->timers, &client_handler->timer, now, (uint64_t) delay);
+    } else {
+        a_chat_timer_wheel_cancel(&event_loop->timers, &client_handler->timer);
+    }
+
+    return true;
+}
+
+// joins the room quietly, catching up from the sequence if the client asked to, returns false if it couldn't
+static bool a_chat_event_loop_join_room(AChatEventLoop* event_loop, AChatClientHandler* client_handler, const char* room, size_t room_length, bool catch_up, uint64_t sequence) {
+    // a catch up is queued in the same step as the join, under the room's history lock, so no new message can get ahead of it
+    // one that was numbered before the lock but is still in the inbox arrives twice, and the client skips it
+    AChatHistory* history = catch_up ? a_chat_history_table_find(&event_loop->server->history, room, room_length) : NULL;
+    if (history) {
+        pthread_mutex_lock(&history->lock);
+    }
+
+    bool joined = a_chat_room_join(&event_loop->rooms, client_handler, room, room_length);
+    if (joined && history) {
+        // the catch up goes out with the rest of the pass' sends, gathered into as few syscalls as the socket takes
+        size_t replayed = a_chat_history_replay(history, sequence, &client_handler->outbound);
+        a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_FRAMES_REPLAYED, replayed);
+        if (replayed > 0) {
+            a_chat_event_loop_schedule_flush(event_loop, client_handler);
+        }
+    }
+
+    if (history) {
+        pthread_mutex_unlock(&history->lock);
+    }
+
+    return joined;
+}
+
+static bool a_chat_event_loop_handshake(AChatEventLoop* event_loop, AChatClientHandler* client_handler, const AChatFrame* frame) {
+    if (!a_chat_handshake_validate(event_loop->server, frame, client_handler)) {
+        // the correct error message will be printed inside the a_chat_handshake_validate function
+        a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_HANDSHAKES_FAILED, 1);
+        return false;
+    }
+
+    // check if the maximum number of clients have connected, reserving a place if they haven't
+    if (atomic_fetch_add(&event_loop->server->number_of_clients, 1) >= event_loop->server->config.maximum_clients) {
+        event_loop->server->number_of_clients--;
+        a_chat_log_error("Maximum number of connected clients reached");
+        a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_HANDSHAKES_FAILED, 1);
+
+        return false;
+    }
+
+    client_handler->handshake_complete = true;
+    a_chat_directory_attach(&event_loop->server->directory, client_handler->user, event_loop->index, client_handler->handle, client_handler->has_public_key ? client_handler->public_key : NULL);
+    a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_HANDSHAKES_COMPLETED, 1);
+    a_chat_metrics_record(&event_loop->server->metrics, A_CHAT_HISTOGRAM_HANDSHAKE, a_chat_metrics_now_ns() - client_handler->accepted_at_ns);
+
+    // the handshake deadline becomes the first check for the client going quiet, it was only just heard from
+    a_chat_event_loop_check_idle(event_loop, client_handler);
+
+    // a resumed client goes straight back to its session's rooms, without telling them, as they never heard it had gone
+    if (client_handler->resuming) {
+        const AChatSession* session = client_handler->session;
+        if (a_chat_client_handler_queue_answer(client_handler)) {
+            a_chat_event_loop_schedule_flush(event_loop, client_handler);
+        }
+        for (int i = 0; i < session->number_of_rooms; i++) {
+            a_chat_event_loop_join_room(event_loop, client_handler, session->rooms[i], session->room_lengths[i], true, session->sequences[i]);
+        }
+        client_handler->resuming = false;
+
+        char message[640];
+        snprintf(message, sizeof(message), "%s has resumed their session", client_handler->user->name);
+        a_chat_log_info(message);
+        a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_SESSIONS_RESUMED, 1);
+        return true;
+    }
+
+    // every client starts out in the default room
+    a_chat_room_join(&event_loop->rooms, client_handler, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM));
+
+    if (event_loop->server->sessions) {
+        a_chat_session_table_open(event_loop->server->sessions, client_handler);
+    }
+    if (a_chat_client_handler_queue_answer(client_handler)) {
+        a_chat_event_loop_schedule_flush(event_loop, client_handler);
+    }
+
+    // log and let the default room know that a new client has connected
+    char message[640];
+    snprintf(message, sizeof(message), "%s has connected", client_handler->user->name);
+    a_chat_log_info(message);
+    a_chat_server_broadcast_room(event_loop->server, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM), message);
+    if (client_handler->has_public_key) {
+        a_chat_server_announce_member(event_loop->server, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM), client_handler->public_key, A_CHAT_MEMBER_JOINED);
+    }
+
+    return true;
+}
+
+static void a_chat_event_loop_join(AChatEventLoop* event_loop, AChatClientHandler* client_handler, const AChatFrame* frame) {
+    const char* room;
+    size_t room_length;
+    bool catch_up;
+    uint64_t sequence;
+    if (!a_chat_room_join_parse(frame, &room, &room_length, &catch_up, &sequence)) {
+        a_chat_log_error("Client sent an invalid room name");
+        return;
+    }
+
+    // joining a room the client is already in just announces them to it again, for the key agreement
+    if (a_chat_room_is_member(client_handler, room, room_length)) {
+        if (client_handler->has_public_key) {
+            a_chat_server_announce_member(event_loop->server, room, room_length, client_handler->public_key, A_CHAT_MEMBER_JOINED);
+        }
+        return;
+    }
+
+    if (!a_chat_event_loop_join_room(event_loop, client_handler, room, room_length, catch_up, sequence)) { return; }
+
+    char message[640];
+    snprintf(message, sizeof(message), "%s has joined #%.*s", client_handler->user->name, (int) room_length, room);
+    a_chat_server_broadcast_room(event_loop->server, room, room_length, message);
+    if (client_handler->has_public_key) {
+        a_chat_server_announce_member(event_loop->server, room, room_length, client_handler->public_key, A_CHAT_MEMBER_JOINED);
+    }
+}
+
+static void a_chat_event_loop_leave(AChatEventLoop* event_loop, AChatClientHandler* client_handler, const AChatFrame* frame) {
+    if (!a_chat_room_is_member(client_handler, (const char*) frame->payload, frame->length)) { return; }
+
+    // the client is told they left along with everyone else in the room
+    char message[640];
+    snprintf(message, sizeof(message), "%s has left #%.*s", client_handler->user->name, (int) frame->length, (const char*) frame->payload);
+    a_chat_server_broadcast_room(event_loop->server, (const char*) frame->payload, frame->length, message);
+    if (client_handler->has_public_key) {
+        a_chat_server_announce_member(event_loop->server, (const char*) frame->payload, frame->length, client_handler->public_key, A_CHAT_MEMBER_LEFT);
+    }
+
+    a_chat_room_leave(&event_loop->rooms, client_handler, (const char*) frame->payload, frame->length);
+}
+
+static void a_chat_event_loop_handle_frame(AChatEventLoop* event_loop, AChatClientHandler* client_handler, const AChatFrame* frame) {
+    switch (frame->type) {
+        case A_CHAT_FRAME_MESSAGE: {
+            const char* room;
+            size_t room_length;
+            const uint8_t* message;
+            uint32_t message_length;
+            if (!a_chat_room_message_parse(frame, &room, &room_length, &message, &message_length)) {
+                a_chat_log_error("Received invalid message from client");
+                break;
+            }
+
+            // clients can only talk in rooms they are in
+            if (!a_chat_room_is_member(client_handler, room, room_length)) { break; }
+            if ((frame->flags & A_CHAT_FRAME_FLAG_COMPRESSED) && !client_handler->compression) {
+                a_chat_log_error("Client sent a compressed message without being allowed to");
+                break;
+            }
+
+            a_chat_server_relay_message(event_loop->server, room, room_length, client_handler->user->name, frame->flags, message, message_length);
+            break;
+        }
+        case A_CHAT_FRAME_GROUP_KEY: {
+            const char* room;
+            size_t room_length;
+            const uint8_t* group_key;
+            uint32_t group_key_length;
+            if (!a_chat_room_message_parse(frame, &room, &room_length, &group_key, &group_key_length)) {
+                a_chat_log_error("Received invalid group key from client");
+                break;
+            }
+
+            // the other members need to know who the key is from to unwrap it
+            if (!client_handler->has_public_key || !a_chat_room_is_member(client_handler, room, room_length)) { break; }
+
+            a_chat_server_relay_group_key(event_loop->server, room, room_length, client_handler->public_key, group_key, group_key_length);
+            break;
+        }
+        case A_CHAT_FRAME_PRESENCE: {
+            AChatBuffer* answer = a_chat_server_presence_frame(event_loop->server, frame);
+            if (!answer) { break; }
+
+            a_chat_event_loop_send_to_client(event_loop, client_handler, answer);
+            a_chat_buffer_release(answer);
+            break;
+        }
+        case A_CHAT_FRAME_DIRECT:
+            a_chat_server_relay_direct(event_loop->server, client_handler, frame);
+            break;
+        case A_CHAT_FRAME_PING: {
+            AChatBuffer* pong = a_chat_server_pong_frame(frame);
+            if (!pong) { break; }
+
+            a_chat_event_loop_send_to_client(event_loop, client_handler, pong);
+            a_chat_buffer_release(pong);
+            break;
+        }
+        case A_CHAT_FRAME_PONG:
+            // hearing anything back is all that matters, which receiving it has already counted
+            break;
+        case A_CHAT_FRAME_JOIN:
+            a_chat_event_loop_join(event_loop, client_handler, frame);
+            break;
+        case A_CHAT_FRAME_LEAVE:
+            a_chat_event_loop_leave(event_loop, client_handler, frame);
+            break;
+        case A_CHAT_FRAME_SESSION:
+            // the client is closing for good, so its rooms hear it has gone as soon as it disconnects
+            if (frame->length == 0 && client_handler->session) {
+                a_chat_session_table_end(event_loop->server->sessions, client_handler);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// handles every complete frame in the client handler's decoder, returns false if the client handler was disconnected
+static bool a_chat_event_loop_decode(AChatEventLoop* event_loop, AChatClientHandler* client_handler) {
+    AChatFrame frame;
+    AChatFrameResult result;
+    while ((result = a_chat_frame_decoder_next(&client_handler->decoder, &frame)) == A_CHAT_FRAME_COMPLETE) {
+        a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_FRAMES_RECEIVED, 1);
+
+        // a client is still read from while it is drained, so its hanging up is noticed, but nothing it sends is handled
+        if (event_loop->draining) { continue; }
+
+        // the first frame from a client is its handshake
+        if (!client_handler->handshake_complete) {
+            if (!a_chat_event_loop_handshake(event_loop, client_handler, &frame)) {
+                a_chat_event_loop_disconnect(event_loop, client_handler);
+                return false;
+            }
+            continue;
+        }
+
+        AChatAdmitResult admit = a_chat_client_handler_admit(event_loop->server, client_handler, &frame);
+        if (admit == A_CHAT_ADMIT_DROP) { continue; }
+        if (admit == A_CHAT_ADMIT_DISCONNECT) {
+            a_chat_event_loop_disconnect(event_loop, client_handler);
+            return false;
+        }
+        a_chat_event_loop_handle_frame(event_loop, client_handler, &frame);
+    }
+
+    if (result == A_CHAT_FRAME_ERROR) {
+        a_chat_event_loop_disconnect(event_loop, client_handler);
+        return false;
+    }
+
+    return true;
+}
+
+// returns false if the client handler was disconnected
+static bool a_chat_event_loop_read(AChatEventLoop* event_loop, AChatClientHandler* client_handler) {
+    // the client socket is edge-triggered, so keep reading until there is nothing left
+    while (true) {
+        // receive straight into the frame decoder
+        size_t available;
+        uint8_t* buffer = a_chat_frame_decoder_reserve(&client_handler->decoder, &available);
+        if (!buffer) {
+            a_chat_event_loop_disconnect(event_loop, client_handler);
+            return false;
+        }
+
+        int bytes_received = recv(client_handler->socket, buffer, available, MSG_DONTWAIT);
+        if (bytes_received == 0) { // the client has disconnected
+            a_chat_event_loop_disconnect(event_loop, client_handler);
+            return false;
+        } else if (bytes_received == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return true; }
+
+            char message[640];
+            snprintf(message, sizeof(message), "Connection with client %s has failed", client_handler->user ? client_handler->user->name : "");
+            a_chat_log_error_errno(message);
+            a_chat_event_loop_disconnect(event_loop, client_handler);
+            return false;
+        }
+        a_chat_frame_decoder_commit(&client_handler->decoder, bytes_received);
+        a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_BYTES_RECEIVED, bytes_received);
+        client_handler->last_received_ms = a_chat_timer_now_ms();
+
+        // a single recv() can contain any number of frames, including none
+        if (!a_chat_event_loop_decode(event_loop, client_handler)) { return false; }
+    }
+}
+
+// io_uring received into one of its provided buffers, which is copied into the frame decoder
+// returns false if the client handler was disconnected
+static bool a_chat_event_loop_uring_read(AChatEventLoop* event_loop, AChatClientHandler* client_handler, const uint8_t* data, size_t length) {
+    a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_BYTES_RECEIVED, length);
+    client_handler->last_received_ms = a_chat_timer_now_ms();
+
+    while (length > 0) {
+        size_t available;
+        uint8_t* buffer = a_chat_frame_decoder_reserve(&client_handler->decoder, &available);
+        if (!buffer) {
+            a_chat_event_loop_disconnect(event_loop, client_handler);
+            return false;
+        }
+
+        size_t chunk = length < available ? length : available;
+        memcpy(buffer, data, chunk);
+        a_chat_frame_decoder_commit(&client_handler->decoder, chunk);
+        data += chunk;
+        length -= chunk;
+
+        if (!a_chat_event_loop_decode(event_loop, client_handler)) { return false; }
+    }
+
+    return true;
+}
+
+static void a_chat_event_loop_uring_received(AChatEventLoop* event_loop, AChatClientHandler* client_handler, int result, uint32_t flags) {
+    bool more = flags & IORING_CQE_F_MORE;
+    if (!more) {
+        client_handler->pending_operations--;
+        event_loop->uring_operations--;
+    }
+
+    bool connected = true;
+    if (flags & IORING_CQE_F_BUFFER) {
+        uint16_t id = (uint16_t) (flags >> IORING_CQE_BUFFER_SHIFT);
+
+        // a stopping event loop or a disconnected client only needs the buffer back
+        if (result > 0 && !client_handler->closing && atomic_load(&event_loop->server->running)) {
+            connected = a_chat_event_loop_uring_read(event_loop, client_handler, a_chat_uring_buffer(event_loop->uring, id), (size_t) result);
+        }
+        a_chat_uring_recycle_buffer(event_loop->uring, id);
+    }
+    if (!connected) { return; }
+
+    if (client_handler->closing) {
+        a_chat_event_loop_uring_release(event_loop, client_handler);
+        return;
+    }
+    if (!atomic_load(&event_loop->server->running)) { return; }
+
+    // running out of provided buffers ends the multishot receive without anything being wrong with the client
+    if (result > 0 || result == -ENOBUFS) {
+        if (!more && !a_chat_event_loop_uring_submit_receive(event_loop, client_handler)) {
+            a_chat_event_loop_disconnect(event_loop, client_handler);
+        }
+        return;
+    }
+
+    if (result < 0) {
+        errno = -result;
+
+        char message[640];
+        snprintf(message, sizeof(message), "Connection with client %s has failed", client_handler->user ? client_handler->user->name : "");
+        a_chat_log_error_errno(message);
+    }
+
+    // 0 means the client has disconnected
+    a_chat_event_loop_disconnect(event_loop, client_handler);
+}
+
+static void a_chat_event_loop_uring_sent(AChatEventLoop* event_loop, AChatClientHandler* client_handler, int result) {
+    client_handler->pending_operations--;
+    event_loop->uring_operations--;
+    client_handler->sending = false;
+
+    if (client_handler->closing) {
+        a_chat_event_loop_uring_release(event_loop, client_handler);
+        return;
+    }
+
+    if (result < 0) {
+        errno = -result;
+        a_chat_log_warning_errno("Failed broadcast message to a client");
+
+        // the connection is broken, the receive will pick that up, so there is no point keeping the rest
+        a_chat_outbound_queue_end_send(&client_handler->outbound, 0);
+        a_chat_outbound_queue_clear(&client_handler->outbound);
+        return;
+    }
+
+    // whatever didn't fit, or was queued while the send was in flight, goes out at the end of this pass
+    a_chat_outbound_queue_end_send(&client_handler->outbound, (size_t) result);
+    if (client_handler->outbound.count > 0) {
+        a_chat_event_loop_schedule_flush(event_loop, client_handler);
+    }
+}
+
+static void a_chat_event_loop_uring_complete(AChatEventLoop* event_loop, uint64_t user_data, int result, uint32_t flags) {
+    void* pointer = (void*) (uintptr_t) (user_data & ~(uint64_t) A_CHAT_URING_OPERATION_MASK);
+    bool running = atomic_load(&event_loop->server->running) && !event_loop->uring_stopping;
+    bool accepting = running && !event_loop->draining;
+
+    switch ((AChatUringOperation) (user_data & A_CHAT_URING_OPERATION_MASK)) {
+        case A_CHAT_URING_ACCEPT:
+            if (!(flags & IORING_CQE_F_MORE)) {
+                event_loop->uring_operations--;
+                if (accepting) {
+                    a_chat_event_loop_uring_submit_accept(event_loop);
+                }
+            }
+
+            if (result >= 0) {
+                if (accepting) {
+                    a_chat_event_loop_add_client(event_loop, result);
+                } else {
+                    close(result);
+                }
+            } else if (result != -ECONNABORTED && result != -ECANCELED) {
+                errno = -result;
+                a_chat_log_error_errno("Failed accept new client");
+            }
+            break;
+        case A_CHAT_URING_WAKE:
+            if (!(flags & IORING_CQE_F_MORE)) {
+                event_loop->uring_operations--;
+                if (running) {
+                    a_chat_event_loop_uring_submit_wake(event_loop);
+                }
+            }
+
+            if (running) {
+                a_chat_event_loop_drain_inbox(event_loop);
+            }
+            break;
+        case A_CHAT_URING_RECEIVE:
+            a_chat_event_loop_uring_received(event_loop, pointer, result, flags);
+            break;
+        case A_CHAT_URING_SEND:
+            a_chat_event_loop_uring_sent(event_loop, pointer, result);
+            break;
+        case A_CHAT_URING_CANCEL:
+            break;
+    }
+}
+
+// handles every completion the ring has, returns false if the ring failed
+static bool a_chat_event_loop_uring_wait(AChatEventLoop* event_loop, int timeout) {
+    if (!a_chat_uring_submit_and_wait(event_loop->uring, timeout)) { return false; }
+
+    // the completion is copied out first, handling it can queue more requests
+    struct io_uring_cqe* cqe;
+    while ((cqe = a_chat_uring_peek(event_loop->uring))) {
+        uint64_t user_data = cqe->user_data;
+        int result = cqe->res;
+        uint32_t flags = cqe->flags;
+        a_chat_uring_seen(event_loop->uring);
+
+        a_chat_event_loop_uring_complete(event_loop, user_data, result, flags);
+    }
+
+    return true;
+}
+
+static void a_chat_event_loop_expire(AChatEventLoop* event_loop) {
+    AChatTimer* timer;
+    while ((timer = a_chat_timer_wheel_expire(&event_loop->timers, a_chat_timer_now_ms()))) {
+        AChatClientHandler* client_handler = timer->data;
+        // a client being drained is going anyway, so it isn't pinged
+        if (client_handler->handshake_complete) {
+            if (!event_loop->draining) {
+                a_chat_event_loop_check_idle(event_loop, client_handler);
+            }
+            continue;
+        }
+
+        a_chat_log_error("Handshake from client timed out");
+        a_chat_metrics_add(&event_loop->server->metrics, A_CHAT_COUNTER_HANDSHAKES_TIMED_OUT, 1);
+
+        a_chat_event_loop_disconnect(event_loop, client_handler);
+    }
+}
+
+// closes the event loop's listening socket, so new clients go to the other servers sharing the port, or are refused
+static void a_chat_event_loop_stop_accepting(AChatEventLoop* event_loop) {
+    // the ring holds on to the listening socket until its accept is cancelled
+    if (event_loop->uring) {
+        struct io_uring_sqe* sqe = a_chat_uring_get_sqe(event_loop->uring);
+        if (sqe) {
+            a_chat_uring_prepare_cancel(sqe, a_chat_event_loop_user_data(event_loop, A_CHAT_URING_ACCEPT), a_chat_event_loop_user_data(NULL, A_CHAT_URING_CANCEL));
+        }
+    }
+
+    // closing the socket also removes it from the epoll instance
+    // the first event loop borrows the server's, nothing else uses it once the event loops are running
+    if (event_loop->listening_socket == event_loop->server->listening_socket) {
+        event_loop->server->listening_socket = -1;
+    }
+    close(event_loop->listening_socket);
+    event_loop->listening_socket = -1;
+}
+
+// once the server is draining, disconnects every client that has been sent everything, or every client at all once
+// the drain's deadline has passed, returns true when none are left
+static bool a_chat_event_loop_drain(AChatEventLoop* event_loop) {
+    if (!atomic_load(&event_loop->server->draining)) { return false; }
+
+    if (!event_loop->draining) {
+        event_loop->draining = true;
+        a_chat_event_loop_stop_accepting(event_loop);
+
+        // the shutdown notice was pushed onto the inbox before draining was set, but this pass may have emptied the
+        // inbox before then, so it is picked up now, otherwise clients with nothing queued would go without it
+        a_chat_event_loop_drain_inbox(event_loop);
+        a_chat_event_loop_flush(event_loop);
+    }
+
+    // disconnecting moves the last client handler into the hole, which has been looked at already going backwards
+    bool expired = a_chat_timer_now_ms() >= event_loop->server->drain_deadline_ms;
+    for (uint32_t i = event_loop->registry.count; i > 0; i--) {
+        AChatClientHandler* client_handler = event_loop->registry.client_handlers[i - 1];
+        if (expired || (client_handler->outbound.count == 0 && !client_handler->sending)) {
+            a_chat_event_loop_disconnect(event_loop, client_handler);
+        }
+    }
+
+    return event_loop->registry.count == 0;
+}
+
+// how long the event loop can wait for its next event, which is no later than its next timer or the drain's deadline
+static int a_chat_event_loop_timeout(AChatEventLoop* event_loop) {
+    uint64_t now_ms = a_chat_timer_now_ms();
+    int timeout = a_chat_timer_wheel_timeout(&event_loop->timers, now_ms, A_CHAT_EVENT_LOOP_TIMEOUT_MS);
+    if (event_loop->draining) {
+        uint64_t deadline_ms = event_loop->server->drain_deadline_ms;
+        int remaining = deadline_ms > now_ms ? (int) (deadline_ms - now_ms) : 0;
+        if (remaining < timeout) {
+            timeout = remaining;
+        }
+    }
+
+    return timeout;
+}
+
+static void* a_chat_event_loop_thread(void* arguments) {
+    AChatEventLoop* event_loop = (AChatEventLoop*) arguments;
+    a_chat_current_event_loop = event_loop;
+
+    struct epoll_event events[A_CHAT_EVENT_LOOP_MAXIMUM_EVENTS];
+    while (atomic_load(&event_loop->server->running)) {
+        int timeout = a_chat_event_loop_timeout(event_loop);
+        int number_of_events = epoll_wait(event_loop->epoll_fd, events, A_CHAT_EVENT_LOOP_MAXIMUM_EVENTS, timeout);
+        if (number_of_events == -1) {
+            if (errno == EINTR) { continue; }
+
+            a_chat_log_error_errno("Failed to wait for events");
+            break;
+        }
+
+        for (int i = 0; i < number_of_events; i++) {
+            if (events[i].data.ptr == &event_loop->listening_socket) {
+                if (!event_loop->draining) {
+                    a_chat_event_loop_accept(event_loop);
+                }
+            } else if (events[i].data.ptr == &event_loop->wake_fd) {
+                a_chat_event_loop_drain_inbox(event_loop);
+            } else {
+                AChatClientHandler* client_handler = events[i].data.ptr;
+
+                // errors and hang ups are picked up by recv()
+                if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !a_chat_event_loop_read(event_loop, client_handler)) {
+                    continue;
+                }
+
+                if (events[i].events & EPOLLOUT) {
+                    a_chat_event_loop_schedule_flush(event_loop, client_handler);
+                }
+            }
+        }
+
+        a_chat_event_loop_expire(event_loop);
+
+        // send everything queued while handling this batch of events
+        a_chat_event_loop_flush(event_loop);
+
+        if (a_chat_event_loop_drain(event_loop)) { break; }
+    }
+
+    a_chat_current_event_loop = NULL;
+
+    return NULL;
+}
+
+static void* a_chat_event_loop_uring_thread(void* arguments) {
+    AChatEventLoop* event_loop = (AChatEventLoop*) arguments;
+    a_chat_current_event_loop = event_loop;
+
+    // the ring is single issuer, so it is enabled by the thread that submits to it
+    bool ready = a_chat_uring_enable(event_loop->uring) && a_chat_event_loop_uring_submit_accept(event_loop) && a_chat_event_loop_uring_submit_wake(event_loop);
+
+    while (ready && atomic_load(&event_loop->server->running)) {
+        // every send queued during the last pass is submitted here, along with the wait
+        int timeout = a_chat_event_loop_timeout(event_loop);
+        if (!a_chat_event_loop_uring_wait(event_loop, timeout)) { break; }
+
+        a_chat_event_loop_expire(event_loop);
+
+        // queue a send for everything queued while handling this batch of completions
+        a_chat_event_loop_flush(event_loop);
+
+        if (a_chat_event_loop_drain(event_loop)) { break; }
+    }
+
+    // the ring may still be using client handlers' buffers, so cancel everything and give it a moment to finish
+    // a drained event loop leaves its loop with the server still running
+    event_loop->uring_stopping = true;
+    struct io_uring_sqe* sqe = a_chat_uring_get_sqe(event_loop->uring);
+    if (sqe) {
+        a_chat_uring_prepare_cancel_all(sqe, a_chat_event_loop_user_data(NULL, A_CHAT_URING_CANCEL));
+    }
+    for (int i = 0; i < A_CHAT_EVENT_LOOP_URING_DRAIN_TICKS && event_loop->uring_operations > 0; i++) {
+        if (!a_chat_event_loop_uring_wait(event_loop, A_CHAT_EVENT_LOOP_TICK_MS)) { break; }
+    }
+
+    a_chat_current_event_loop = NULL;
+
+    return NULL;
+}
+
+static void a_chat_event_loop_destroy(AChatEventLoop* event_loop) {
+    // closing the ring ends whatever requests it still has, before the buffers they use are freed
+    if (event_loop->uring) {
+        a_chat_uring_destroy(event_loop->uring);
+        free(event_loop->uring);
+        event_loop->uring = NULL;
+    }
+
+    // the event loop threads are gone, so the shard can be torn down directly
+    for (uint32_t i = 0; i < event_loop->registry.count; i++) {
+        AChatClientHandler* client_handler = event_loop->registry.client_handlers[i];
+        close(client_handler->socket);
+        a_chat_event_loop_free_client_handler(client_handler);
+    }
+    a_chat_registry_destroy(&event_loop->registry);
+
+    // their sockets were closed when they disconnected
+    for (uint32_t i = 0; i < event_loop->closing.count; i++) {
+        a_chat_event_loop_free_client_handler(event_loop->closing.client_handlers[i]);
+    }
+    a_chat_registry_destroy(&event_loop->closing);
+    a_chat_room_table_destroy(&event_loop->rooms);
+
+    free(event_loop->pending_flushes);
+    event_loop->pending_flushes = NULL;
+    event_loop->number_of_pending_flushes = 0;
+
+    AChatMpscNode* node;
+    while ((node = a_chat_mpsc_queue_pop(&event_loop->inbox))) {
+        AChatEventLoopMessage* message = (AChatEventLoopMessage*) node;
+        a_chat_buffer_release(message->frame);
+        a_chat_pool_free(message);
+    }
+
+    if (event_loop->epoll_fd != -1) { close(event_loop->epoll_fd); }
+    if (event_loop->wake_fd != -1) { close(event_loop->wake_fd); }
+
+    // the first event loop borrows the server's listening socket, which the server closes itself
+    if (event_loop->listening_socket != -1 && event_loop->listening_socket != event_loop->server->listening_socket) {
+        close(event_loop->listening_socket);
+    }
+}
+
+static bool a_chat_event_loop_init(AChatEventLoop* event_loop, AChatServer* server, int index, const char* port, bool use_uring) {
+    event_loop->server = server;
+    event_loop->index = index;
+    event_loop->epoll_fd = -1;
+    event_loop->wake_fd = -1;
+    event_loop->listening_socket = -1;
+    atomic_init(&event_loop->wake_pending, false);
+    a_chat_mpsc_queue_init(&event_loop->inbox);
+    a_chat_registry_init(&event_loop->registry);
+    a_chat_registry_init(&event_loop->closing);
+    if (!a_chat_room_table_init(&event_loop->rooms)) { return false; }
+    a_chat_timer_wheel_init(&event_loop->timers, A_CHAT_EVENT_LOOP_TICK_MS, a_chat_timer_now_ms());
+
+    event_loop->listening_socket = index == 0 ? server->listening_socket : a_chat_server_listen(NULL, port, true, server->config.listen_backlog);
+    if (event_loop->listening_socket == -1) {
+        // a_chat_server_listen logs the correct error already
+        return false;
+    }
+
+    event_loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_loop->wake_fd == -1) {
+        a_chat_log_error_errno("Failed to create event loop's eventfd");
+        return false;
+    }
+
+    // the listening socket and eventfd are waited on by multishot requests, which the thread submits once it has enabled the ring
+    if (use_uring) {
+        event_loop->uring = malloc(sizeof(AChatUring));
+        if (!event_loop->uring) {
+            a_chat_log_error("Failed to allocate memory for event loop's io_uring");
+            return false;
+        }
+
+        if (!a_chat_uring_init(event_loop->uring, A_CHAT_EVENT_LOOP_URING_ENTRIES, A_CHAT_EVENT_LOOP_URING_BUFFERS, A_CHAT_EVENT_LOOP_URING_BUFFER_SIZE)) {
+            free(event_loop->uring);
+            event_loop->uring = NULL;
+            return false;
+        }
+
+        return true;
+    }
+
+    // the event loop never blocks on the listening socket, it drains it whenever epoll says it is readable
+    int flags = fcntl(event_loop->listening_socket, F_GETFL, 0);
+    if (flags == -1 || fcntl(event_loop->listening_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+        a_chat_log_error_errno("Failed to make listening socket non-blocking");
+        return false;
+    }
+
+    event_loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_loop->epoll_fd == -1) {
+        a_chat_log_error_errno("Failed to create epoll instance");
+        return false;
+    }
+
+    // the listening socket and the eventfd are told apart from client handlers by the address stored with them
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &event_loop->listening_socket;
+    if (epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_ADD, event_loop->listening_socket, &event) == -1) {
+        a_chat_log_error_errno("Failed to register listening socket with epoll");
+        return false;
+    }
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &event_loop->wake_fd;
+    if (epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_ADD, event_loop->wake_fd, &event) == -1) {
+        a_chat_log_error_errno("Failed to register event loop's eventfd with epoll");
+        return false;
+    }
+
+    return true;
+}
+
+bool a_chat_event_loops_create(AChatServer* server, const char* port) {
+    server->event_loops = calloc(server->config.number_of_threads, sizeof(AChatEventLoop));
+    if (!server->event_loops) {
+        a_chat_log_error("Failed to allocate memory for event loops");
+        return false;
+    }
+
+    // io_uring is opt in, and only used when the kernel has everything the event loops need
+    bool use_uring = server->config.io_uring && a_chat_uring_is_supported();
+    if (server->config.io_uring && !use_uring) {
+        a_chat_log_warning("io_uring isn't available, the event loops are using epoll instead");
+    }
+
+    for (int i = 0; i < server->config.number_of_threads; i++) {
+        if (!a_chat_event_loop_init(&server->event_loops[i], server, i, port, use_uring)) {
+            // a_chat_event_loop_init logs the correct error already
+
+            for (int j = 0; j <= i; j++) {
+                a_chat_event_loop_destroy(&server->event_loops[j]);
+            }
+            free(server->event_loops);
+            server->event_loops = NULL;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void a_chat_event_loops_run(AChatServer* server) {
+    int number_of_threads = 0;
+    for (int i = 0; i < server->config.number_of_threads; i++) {
+        void* (*thread)(void*) = server->event_loops[i].uring ? a_chat_event_loop_uring_thread : a_chat_event_loop_thread;
+        if (pthread_create(&server->event_loops[i].thread_id, NULL, thread, &server->event_loops[i]) != 0) {
+            a_chat_log_error_errno("Failed to create event loop thread");
+            break;
+        }
+        number_of_threads++;
+    }
+
+    // block like the threaded engine's accept loop until the server is stopped
+    struct pollfd poll_fd = { .fd = server->stop_fd, .events = POLLIN };
+    while (number_of_threads > 0 && poll(&poll_fd, 1, -1) == -1) {
+        if (errno != EINTR) {
+            a_chat_log_error_errno("Failed to wait for the server to stop");
+            break;
+        }
+    }
+
+    // the event loops pick the drain up on their next pass, and each one stops once its shard is empty
+    a_chat_server_begin_drain(server);
+    for (int i = 0; i < number_of_threads; i++) {
+        a_chat_event_loop_wake(&server->event_loops[i]);
+    }
+    for (int i = 0; i < number_of_threads; i++) {
+        pthread_join(server->event_loops[i].thread_id, NULL);
+    }
+    atomic_store(&server->running, false);
+}
+
+// hands the frame to every event loop, room_length is 0 when the frame is for every client
+static void a_chat_event_loops_post(AChatServer* server, const char* room, size_t room_length, AChatBuffer* frame) {
+    // every shard records how long the broadcast took to reach it, including the time spent in its inbox
+    uint64_t posted_at = a_chat_metrics_now_ns();
+
+    for (int i = 0; i < server->config.number_of_threads; i++) {
+        AChatEventLoop* event_loop = &server->event_loops[i];
+
+        // the calling event loop's own shard can be queued to straight away, once it has what other shards posted before,
+        // so a room's relayed messages reach every client in the order their history numbered them
+        if (event_loop == a_chat_current_event_loop) {
+            a_chat_event_loop_deliver_inbox(event_loop);
+            if (room_length > 0) {
+                a_chat_event_loop_send_to_room(event_loop, room, room_length, frame);
+            } else {
+                a_chat_event_loop_send_to_members(event_loop, &event_loop->registry, frame);
+            }
+            a_chat_metrics_record(&server->metrics, A_CHAT_HISTOGRAM_BROADCAST, a_chat_metrics_now_ns() - posted_at);
+            continue;
+        }
+
+        // a_chat_pool_alloc logs the correct error already
+        AChatEventLoopMessage* message = a_chat_pool_alloc(sizeof(AChatEventLoopMessage) + room_length);
+        if (!message) { continue; }
+        message->frame = a_chat_buffer_acquire(frame);
+        message->posted_at_ns = posted_at;
+        message->room_length = room_length;
+        if (room_length > 0) {
+            memcpy(message->room, room, room_length);
+        }
+
+        message->handle = (AChatRegistryHandle) { A_CHAT_REGISTRY_NONE, 0 };
+        a_chat_mpsc_queue_push(&event_loop->inbox, &message->node);
+        a_chat_event_loop_wake(event_loop);
+    }
+}
+
+void a_chat_event_loops_broadcast(AChatServer* server, AChatBuffer* frame) {
+    a_chat_event_loops_post(server, NULL, 0, frame);
+}
+
+void a_chat_event_loops_broadcast_room(AChatServer* server, const char* room, size_t room_length, AChatBuffer* frame) {
+    a_chat_event_loops_post(server, room, room_length, frame);
+}
+
+void a_chat_event_loops_send(AChatServer* server, int index, AChatRegistryHandle handle, AChatBuffer* frame) {
+    if (index < 0 || index >= server->config.number_of_threads) { return; }
+    AChatEventLoop* event_loop = &server->event_loops[index];
+    uint64_t posted_at = a_chat_metrics_now_ns();
+
+    // the same as a broadcast, but only the one event loop is involved
+    if (event_loop == a_chat_current_event_loop) {
+        a_chat_event_loop_deliver_inbox(event_loop);
+        a_chat_event_loop_send_to_handle(event_loop, handle, frame);
+        return;
+    }
+
+    // a_chat_pool_alloc logs the correct error already
+    AChatEventLoopMessage* message = a_chat_pool_alloc(sizeof(AChatEventLoopMessage));
+    if (!message) { return; }
+    message->frame = a_chat_buffer_acquire(frame);
+    message->posted_at_ns = posted_at;
+    message->handle = handle;
+    message->room_length = 0;
+
+    a_chat_mpsc_queue_push(&event_loop->inbox, &message->node);
+    a_chat_event_loop_wake(event_loop);
+}
+
+void a_chat_event_loops_destroy(AChatServer* server) {
+    if (!server->event_loops) { return; }
+
+    for (int i = 0; i < server->config.number_of_threads; i++) {
+        a_chat_event_loop_destroy(&server->event_loops[i]);
+    }
+
+    free(server->event_loops);
+    server->event_loops = NULL;
+}
@@ -0,0 +1,273 @@
+#include "server/handshake.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "protocol/frame.h"
+
+#define A_CHAT_HANDSHAKE_STAGE_MAXIMUM_EVENTS 64
+
+// how long epoll_wait can block before the stage checks if the server is still running
+#define A_CHAT_HANDSHAKE_STAGE_TIMEOUT_MS 500
+
+// how precise handshake deadlines are
+#define A_CHAT_HANDSHAKE_STAGE_TICK_MS 100
+
+// a client handler waiting in the stage's inbox
+typedef struct AChatHandshakeStageMessage {
+    AChatMpscNode node; // must be first so a popped node can be cast back to the message
+    AChatClientHandler* client_handler;
+} AChatHandshakeStageMessage;
+
+static void a_chat_handshake_stage_free_client_handler(AChatClientHandler* client_handler) {
+    close(client_handler->socket);
+    a_chat_frame_decoder_destroy(&client_handler->decoder);
+    free(client_handler);
+}
+
+static void a_chat_handshake_stage_drop(AChatHandshakeStage* stage, AChatClientHandler* client_handler) {
+    a_chat_registry_remove(&stage->registry, client_handler->handle);
+    a_chat_timer_wheel_cancel(&stage->timers, &client_handler->timer);
+
+    // closing the socket also removes it from the epoll instance
+    a_chat_handshake_stage_free_client_handler(client_handler);
+}
+
+static void a_chat_handshake_stage_add(AChatHandshakeStage* stage, AChatClientHandler* client_handler) {
+    if (!a_chat_registry_insert(&stage->registry, client_handler, &client_handler->handle)) {
+        a_chat_handshake_stage_free_client_handler(client_handler);
+        return;
+    }
+
+    a_chat_timer_init(&client_handler->timer, client_handler);
+    a_chat_timer_wheel_schedule(&stage->timers, &client_handler->timer, a_chat_timer_now_ms(), stage->server->config.handshake_timeout_ms);
+
+    // the handshake could have arrived before the socket was registered, edge-triggered epoll still reports it
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = client_handler;
+    if (epoll_ctl(stage->epoll_fd, EPOLL_CTL_ADD, client_handler->socket, &event) == -1) {
+        a_chat_log_error_errno("Failed to register client socket with epoll");
+
+        a_chat_handshake_stage_drop(stage, client_handler);
+    }
+}
+
+static void a_chat_handshake_stage_drain_inbox(AChatHandshakeStage* stage) {
+    uint64_t value;
+    if (read(stage->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        a_chat_log_error_errno("Failed to read handshake stage's eventfd");
+    }
+
+    // clear the flag before draining so a push that races with the drain wakes the stage again
+    atomic_store(&stage->wake_pending, false);
+
+    AChatMpscNode* node;
+    while ((node = a_chat_mpsc_queue_pop(&stage->inbox))) {
+        AChatHandshakeStageMessage* message = (AChatHandshakeStageMessage*) node;
+        a_chat_handshake_stage_add(stage, message->client_handler);
+        free(message);
+    }
+}
+
+static void a_chat_handshake_stage_complete(AChatHandshakeStage* stage, AChatClientHandler* client_handler) {
+    a_chat_registry_remove(&stage->registry, client_handler->handle);
+    a_chat_timer_wheel_cancel(&stage->timers, &client_handler->timer);
+
+    if (epoll_ctl(stage->epoll_fd, EPOLL_CTL_DEL, client_handler->socket, NULL) == -1) {
+        a_chat_log_error_errno("Failed to remove client socket from epoll");
+    }
+
+    // anything received after the handshake stays in the decoder for the client handler's thread
+    client_handler->handshake_complete = true;
+    a_chat_client_handler_start(stage->server, client_handler);
+}
+
+static void a_chat_handshake_stage_read(AChatHandshakeStage* stage, AChatClientHandler* client_handler) {
+    // the client socket is edge-triggered, so keep reading until there is nothing left or the handshake has arrived
+    while (true) {
+        size_t available;
+        uint8_t* buffer = a_chat_frame_decoder_reserve(&client_handler->decoder, &available);
+        if (!buffer) {
+            a_chat_handshake_stage_drop(stage, client_handler);
+            return;
+        }
+
+        int bytes_received = recv(client_handler->socket, buffer, available, MSG_DONTWAIT);
+        if (bytes_received == 0) {
+            a_chat_log_error("Client disconnect before handshake message was received");
+            a_chat_metrics_add(&stage->server->metrics, A_CHAT_COUNTER_HANDSHAKES_FAILED, 1);
+
+            a_chat_handshake_stage_drop(stage, client_handler);
+            return;
+        } else if (bytes_received == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+
+            a_chat_log_error_errno("Failed to get handshake from client");
+            a_chat_metrics_add(&stage->server->metrics, A_CHAT_COUNTER_HANDSHAKES_FAILED, 1);
+
+            a_chat_handshake_stage_drop(stage, client_handler);
+            return;
+        }
+        a_chat_frame_decoder_commit(&client_handler->decoder, bytes_received);
+        a_chat_metrics_add(&stage->server->metrics, A_CHAT_COUNTER_BYTES_RECEIVED, bytes_received);
+
+        // the client will send a "handshake" frame which looks like this "a-chat [username]"
+        AChatFrame frame;
+        AChatFrameResult result = a_chat_frame_decoder_next(&client_handler->decoder, &frame);
+        if (result == A_CHAT_FRAME_INCOMPLETE) { continue; }
+
+        if (result == A_CHAT_FRAME_ERROR || !a_chat_handshake_validate(stage->server, &frame, client_handler)) {
+            // the correct error message will be printed inside the frame decoder or a_chat_handshake_validate
+            a_chat_metrics_add(&stage->server->metrics, A_CHAT_COUNTER_HANDSHAKES_FAILED, 1);
+            a_chat_handshake_stage_drop(stage, client_handler);
+            return;
+        }
+        a_chat_metrics_add(&stage->server->metrics, A_CHAT_COUNTER_FRAMES_RECEIVED, 1);
+
+        a_chat_handshake_stage_complete(stage, client_handler);
+        return;
+    }
+}
+
+static void a_chat_handshake_stage_expire(AChatHandshakeStage* stage) {
+    AChatTimer* timer;
+    while ((timer = a_chat_timer_wheel_expire(&stage->timers, a_chat_timer_now_ms()))) {
+        a_chat_log_error("Handshake from client timed out");
+        a_chat_metrics_add(&stage->server->metrics, A_CHAT_COUNTER_HANDSHAKES_TIMED_OUT, 1);
+
+        a_chat_handshake_stage_drop(stage, timer->data);
+    }
+}
+
+static void* a_chat_handshake_stage_thread(void* arguments) {
+    AChatHandshakeStage* stage = (AChatHandshakeStage*) arguments;
+
+    struct epoll_event events[A_CHAT_HANDSHAKE_STAGE_MAXIMUM_EVENTS];
+    while (atomic_load(&stage->server->running)) {
+        int timeout = a_chat_timer_wheel_timeout(&stage->timers, a_chat_timer_now_ms(), A_CHAT_HANDSHAKE_STAGE_TIMEOUT_MS);
+        int number_of_events = epoll_wait(stage->epoll_fd, events, A_CHAT_HANDSHAKE_STAGE_MAXIMUM_EVENTS, timeout);
+        if (number_of_events == -1) {
+            if (errno == EINTR) { continue; }
+
+            a_chat_log_error_errno("Failed to wait for events");
+            break;
+        }
+
+        for (int i = 0; i < number_of_events; i++) {
+            if (events[i].data.ptr == &stage->wake_fd) {
+                a_chat_handshake_stage_drain_inbox(stage);
+            } else {
+                a_chat_handshake_stage_read(stage, events[i].data.ptr);
+            }
+        }
+
+        a_chat_handshake_stage_expire(stage);
+    }
+
+    return NULL;
+}
+
+AChatHandshakeStage* a_chat_handshake_stage_create(AChatServer* server) {
+    AChatHandshakeStage* stage = calloc(1, sizeof(AChatHandshakeStage));
+    if (!stage) {
+        a_chat_log_error("Failed to allocate memory for handshake stage");
+        return NULL;
+    }
+
+    stage->server = server;
+    stage->wake_fd = -1;
+    atomic_init(&stage->wake_pending, false);
+    a_chat_mpsc_queue_init(&stage->inbox);
+    a_chat_registry_init(&stage->registry);
+    a_chat_timer_wheel_init(&stage->timers, A_CHAT_HANDSHAKE_STAGE_TICK_MS, a_chat_timer_now_ms());
+
+    stage->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (stage->epoll_fd == -1) {
+        a_chat_log_error_errno("Failed to create epoll instance");
+
+        a_chat_handshake_stage_destroy(stage);
+        return NULL;
+    }
+
+    stage->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stage->wake_fd == -1) {
+        a_chat_log_error_errno("Failed to create handshake stage's eventfd");
+
+        a_chat_handshake_stage_destroy(stage);
+        return NULL;
+    }
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &stage->wake_fd;
+    if (epoll_ctl(stage->epoll_fd, EPOLL_CTL_ADD, stage->wake_fd, &event) == -1) {
+        a_chat_log_error_errno("Failed to register handshake stage's eventfd with epoll");
+
+        a_chat_handshake_stage_destroy(stage);
+        return NULL;
+    }
+
+    return stage;
+}
+
+bool a_chat_handshake_stage_start(AChatHandshakeStage* stage) {
+    if (pthread_create(&stage->thread_id, NULL, a_chat_handshake_stage_thread, stage) != 0) {
+        a_chat_log_error_errno("Failed to create handshake stage thread");
+        return false;
+    }
+
+    return true;
+}
+
+void a_chat_handshake_stage_submit(AChatHandshakeStage* stage, AChatClientHandler* client_handler) {
+    AChatHandshakeStageMessage* message = malloc(sizeof(AChatHandshakeStageMessage));
+    if (!message) {
+        a_chat_log_error("Failed to allocate memory for handshake stage message");
+
+        a_chat_handshake_stage_free_client_handler(client_handler);
+        return;
+    }
+    message->client_handler = client_handler;
+
+    a_chat_mpsc_queue_push(&stage->inbox, &message->node);
+
+    // only the first submit since the last drain needs to write to the eventfd
+    if (atomic_exchange(&stage->wake_pending, true)) { return; }
+
+    uint64_t value = 1;
+    if (write(stage->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        a_chat_log_error_errno("Failed to wake handshake stage");
+    }
+}
+
+void a_chat_handshake_stage_join(AChatHandshakeStage* stage) {
+    pthread_join(stage->thread_id, NULL);
+}
+
+void a_chat_handshake_stage_destroy(AChatHandshakeStage* stage) {
+    // the stage's thread is gone, so whatever is still waiting on a handshake can be torn down directly
+    for (uint32_t i = 0; i < stage->registry.count; i++) {
+        a_chat_handshake_stage_free_client_handler(stage->registry.client_handlers[i]);
+    }
+    a_chat_registry_destroy(&stage->registry);
+
+    AChatMpscNode* node;
+    while ((node = a_chat_mpsc_queue_pop(&stage->inbox))) {
+        AChatHandshakeStageMessage* message = (AChatHandshakeStageMessage*) node;
+        a_chat_handshake_stage_free_client_handler(message->client_handler);
+        free(message);
+    }
+
+    if (stage->epoll_fd != -1) { close(stage->epoll_fd); }
+    if (stage->wake_fd != -1) { close(stage->wake_fd); }
+
+    free(stage);
+}
@@ -0,0 +1,82 @@
+#include "server/hash_table.h"
+
+#include <stdlib.h>
+
+#include "log.h"
+
+uint32_t a_chat_hash(const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void a_chat_hash_table_grow(AChatHashTable* table) {
+    uint32_t new_number_of_buckets = table->number_of_buckets * 2;
+    AChatHashEntry** new_buckets = calloc(new_number_of_buckets, sizeof(AChatHashEntry*));
+    if (!new_buckets) {
+        a_chat_log_error("Failed to allocate memory to grow hash table");
+        return;
+    }
+
+    for (uint32_t i = 0; i < table->number_of_buckets; i++) {
+        AChatHashEntry* entry = table->buckets[i];
+        while (entry) {
+            AChatHashEntry* next = entry->next;
+            AChatHashEntry** bucket = &new_buckets[entry->hash & (new_number_of_buckets - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = new_buckets;
+    table->number_of_buckets = new_number_of_buckets;
+}
+
+bool a_chat_hash_table_init(AChatHashTable* table, uint32_t number_of_buckets) {
+    table->buckets = calloc(number_of_buckets, sizeof(AChatHashEntry*));
+    if (!table->buckets) { return false; }
+
+    table->number_of_buckets = number_of_buckets;
+    table->number_of_entries = 0;
+
+    return true;
+}
+
+void a_chat_hash_table_destroy(AChatHashTable* table) {
+    free(table->buckets);
+    table->buckets = NULL;
+    table->number_of_buckets = 0;
+    table->number_of_entries = 0;
+}
+
+AChatHashEntry* a_chat_hash_table_bucket(const AChatHashTable* table, uint32_t hash) {
+    return table->buckets[hash & (table->number_of_buckets - 1)];
+}
+
+void a_chat_hash_table_insert(AChatHashTable* table, AChatHashEntry* entry, uint32_t hash) {
+    if ((table->number_of_entries + 1) * 4 > table->number_of_buckets * 3) {
+        a_chat_hash_table_grow(table);
+    }
+
+    AChatHashEntry** bucket = &table->buckets[hash & (table->number_of_buckets - 1)];
+    entry->hash = hash;
+    entry->next = *bucket;
+    *bucket = entry;
+    table->number_of_entries++;
+}
+
+void a_chat_hash_table_remove(AChatHashTable* table, AChatHashEntry* entry) {
+    AChatHashEntry** link = &table->buckets[entry->hash & (table->number_of_buckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    table->number_of_entries--;
+}
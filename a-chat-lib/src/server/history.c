@@ -0,0 +1,170 @@
+#include "server/history.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "server/message_store.h"
+
+#define A_CHAT_HISTORY_TABLE_INITIAL_BUCKETS 64
+
+static void a_chat_history_destroy(AChatHistory* history) {
+    for (size_t i = 0; i < history->count; i++) {
+        a_chat_buffer_release(history->frames[(history->head + i) % history->capacity]);
+    }
+
+    pthread_mutex_destroy(&history->lock);
+    free(history->frames);
+    free(history);
+}
+
+// the table's lock must be held while calling this
+static AChatHistory* a_chat_history_table_lookup(const AChatHistoryTable* table, const char* name, size_t length, uint32_t hash) {
+    for (AChatHashEntry* entry = a_chat_hash_table_bucket(&table->histories, hash); entry; entry = entry->next) {
+        AChatHistory* history = (AChatHistory*) entry;
+        if (entry->hash == hash && history->name_length == length && memcmp(history->name, name, length) == 0) {
+            return history;
+        }
+    }
+
+    return NULL;
+}
+
+bool a_chat_history_table_init(AChatHistoryTable* table, size_t maximum_frames, size_t maximum_bytes) {
+    if (!a_chat_hash_table_init(&table->histories, A_CHAT_HISTORY_TABLE_INITIAL_BUCKETS)) {
+        a_chat_log_error("Failed to allocate memory for history table");
+        return false;
+    }
+
+    if (pthread_rwlock_init(&table->lock, NULL) != 0) {
+        a_chat_log_error("Failed to create history table's lock");
+
+        a_chat_hash_table_destroy(&table->histories);
+        return false;
+    }
+
+    table->maximum_frames = maximum_frames;
+    table->maximum_bytes = maximum_bytes;
+
+    return true;
+}
+
+void a_chat_history_table_destroy(AChatHistoryTable* table) {
+    for (uint32_t i = 0; i < table->histories.number_of_buckets; i++) {
+        AChatHashEntry* entry = table->histories.buckets[i];
+        while (entry) {
+            AChatHistory* history = (AChatHistory*) entry;
+            entry = entry->next;
+            a_chat_history_destroy(history);
+        }
+    }
+
+    pthread_rwlock_destroy(&table->lock);
+    a_chat_hash_table_destroy(&table->histories);
+}
+
+AChatHistory* a_chat_history_table_find(AChatHistoryTable* table, const char* name, size_t length) {
+    uint32_t hash = a_chat_hash(name, length);
+
+    pthread_rwlock_rdlock(&table->lock);
+    AChatHistory* history = a_chat_history_table_lookup(table, name, length, hash);
+    pthread_rwlock_unlock(&table->lock);
+
+    return history;
+}
+
+AChatHistory* a_chat_history_table_get(AChatHistoryTable* table, const char* name, size_t length) {
+    if (table->maximum_frames == 0) { return NULL; }
+
+    // nearly every message is to a room that already has a history, so only making one takes the write lock
+    AChatHistory* history = a_chat_history_table_find(table, name, length);
+    if (history) { return history; }
+
+    uint32_t hash = a_chat_hash(name, length);
+    pthread_rwlock_wrlock(&table->lock);
+
+    // another thread may have made it between the two locks
+    history = a_chat_history_table_lookup(table, name, length, hash);
+    if (history) {
+        pthread_rwlock_unlock(&table->lock);
+        return history;
+    }
+
+    history = malloc(sizeof(AChatHistory));
+    AChatBuffer** frames = malloc(sizeof(AChatBuffer*) * table->maximum_frames);
+    if (!history || !frames) {
+        a_chat_log_error("Failed to allocate memory for room history");
+
+        pthread_rwlock_unlock(&table->lock);
+        free(history);
+        free(frames);
+        return NULL;
+    }
+    if (pthread_mutex_init(&history->lock, NULL) != 0) {
+        a_chat_log_error("Failed to create room history's mutex");
+
+        pthread_rwlock_unlock(&table->lock);
+        free(history);
+        free(frames);
+        return NULL;
+    }
+
+    memcpy(history->name, name, length);
+    history->name[length] = '\0';
+    history->name_length = length;
+    history->frames = frames;
+    history->capacity = table->maximum_frames;
+    history->head = 0;
+    history->count = 0;
+    history->bytes = 0;
+    history->next_sequence = 1;
+    history->stored = NULL;
+    a_chat_hash_table_insert(&table->histories, &history->entry, hash);
+
+    pthread_rwlock_unlock(&table->lock);
+
+    return history;
+}
+
+uint64_t a_chat_history_append(AChatHistoryTable* table, AChatHistory* history, AChatBuffer* frame) {
+    // make room for the frame, always keeping at least the newest one
+    while (history->count > 0 && (history->count == history->capacity || history->bytes + frame->length > table->maximum_bytes)) {
+        AChatBuffer* oldest = history->frames[history->head];
+        history->bytes -= oldest->length;
+        a_chat_buffer_release(oldest);
+        history->head = (history->head + 1) % history->capacity;
+        history->count--;
+    }
+
+    history->frames[(history->head + history->count) % history->capacity] = a_chat_buffer_acquire(frame);
+    history->count++;
+    history->bytes += frame->length;
+
+    return history->next_sequence++;
+}
+
+size_t a_chat_history_replay(AChatHistory* history, uint64_t sequence, AChatOutboundQueue* queue) {
+    uint64_t oldest = history->next_sequence - history->count;
+    size_t replayed = 0;
+
+    // the message store goes further back than the ring, and the ring carries on from wherever it stopped
+    if (sequence < oldest && history->stored) {
+        if (!a_chat_message_store_replay(history->stored, &sequence, queue, &replayed)) { return replayed; }
+    }
+
+    // sequences older than the ring get whatever is still kept
+    if (sequence < oldest) {
+        sequence = oldest;
+    }
+
+    for (uint64_t i = sequence - oldest; i < history->count; i++) {
+        AChatBuffer* frame = history->frames[(history->head + i) % history->capacity];
+
+        // a catch up shouldn't drop or overflow what the client already has queued, so it stops at the queue's limits
+        if (queue->count >= queue->maximum_frames || queue->queued_bytes + frame->length > queue->maximum_bytes) { break; }
+        if (a_chat_outbound_queue_push(queue, frame) != A_CHAT_OUTBOUND_QUEUED) { break; }
+        replayed++;
+    }
+
+    return replayed;
+}
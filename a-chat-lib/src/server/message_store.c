@@ -0,0 +1,767 @@
+#include "server/message_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "pool.h"
+#include "server/room.h"
+
+#define A_CHAT_MESSAGE_STORE_MAGIC "ACHATSEG"
+
+// the start of every segment
+typedef struct AChatSegmentHeader {
+    char magic[8];
+    uint64_t first_sequence;
+    uint64_t committed; // the end of the committed frames, counted from the start of the segment
+} AChatSegmentHeader;
+
+// a relayed frame waiting for the background thread
+typedef struct AChatMessageStoreEntry {
+    AChatMpscNode node;
+    AChatStoredRoom* room;
+    AChatBuffer* frame;
+    uint64_t sequence;
+} AChatMessageStoreEntry;
+
+static size_t a_chat_segment_frame_length(const uint8_t* frame) {
+    return A_CHAT_FRAME_HEADER_SIZE + (((size_t) frame[4] << 24) | ((size_t) frame[5] << 16) | ((size_t) frame[6] << 8) | frame[7]);
+}
+
+// every stored frame is a relayed message, whose payload starts with its sequence
+static uint64_t a_chat_segment_frame_sequence(const uint8_t* frame) {
+    uint64_t sequence = 0;
+    for (int i = 0; i < 8; i++) {
+        sequence = (sequence << 8) | frame[A_CHAT_FRAME_HEADER_SIZE + i];
+    }
+
+    return sequence;
+}
+
+// a frame that was only partly written before a crash, or never written at all, fails this
+static bool a_chat_segment_frame_valid(const AChatSegment* segment, size_t offset, size_t end) {
+    if (end - offset < A_CHAT_FRAME_HEADER_SIZE + 8) { return false; }
+
+    const uint8_t* frame = segment->map + offset;
+    uint16_t flags = ((uint16_t) frame[2] << 8) | frame[3];
+    size_t length = a_chat_segment_frame_length(frame);
+
+    return frame[0] == A_CHAT_FRAME_VERSION && frame[1] == A_CHAT_FRAME_MESSAGE && (flags & A_CHAT_FRAME_FLAG_SEQUENCE) &&
+           length >= A_CHAT_FRAME_HEADER_SIZE + 8 && length <= end - offset;
+}
+
+static void a_chat_segment_file_name(char* name, size_t size, uint64_t first_sequence, const char* extension) {
+    snprintf(name, size, "%020" PRIu64 ".%s", first_sequence, extension);
+}
+
+static void a_chat_segment_release(void* owner) {
+    AChatSegment* segment = owner;
+    if (atomic_fetch_sub_explicit(&segment->references, 1, memory_order_acq_rel) != 1) { return; }
+
+    munmap(segment->map, segment->size);
+    close(segment->fd);
+    close(segment->index_fd);
+    free(segment->index);
+    free(segment);
+}
+
+static bool a_chat_segment_add_index(AChatSegment* segment, uint64_t sequence, size_t offset) {
+    if (segment->index_count == segment->index_capacity) {
+        size_t new_capacity = segment->index_capacity ? segment->index_capacity * 2 : 16;
+        AChatSegmentIndexEntry* new_index = realloc(segment->index, sizeof(AChatSegmentIndexEntry) * new_capacity);
+        if (!new_index) {
+            a_chat_log_error("Failed to allocate memory for segment index");
+            return false;
+        }
+
+        segment->index = new_index;
+        segment->index_capacity = new_capacity;
+    }
+
+    segment->index[segment->index_count++] = (AChatSegmentIndexEntry) { .sequence = sequence, .offset = offset };
+    return true;
+}
+
+// the offset of the first frame from sequence on, and that frame's sequence
+// the room's lock must be held while calling this
+static size_t a_chat_segment_find(const AChatSegment* segment, uint64_t* sequence) {
+    size_t offset = A_CHAT_MESSAGE_STORE_HEADER_SIZE;
+
+    // the last index entry at or before the sequence, then walk the frames from there
+    size_t low = 0;
+    size_t high = segment->index_count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (segment->index[middle].sequence <= *sequence) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low > 0) {
+        offset = segment->index[low - 1].offset;
+    }
+
+    while (offset < segment->written && a_chat_segment_frame_sequence(segment->map + offset) < *sequence) {
+        offset += a_chat_segment_frame_length(segment->map + offset);
+    }
+    *sequence = offset < segment->written ? a_chat_segment_frame_sequence(segment->map + offset) : segment->next_sequence;
+
+    return offset;
+}
+
+// the last frame boundary at or before limit, and the sequence of the frame that starts there
+// the room's lock must be held while calling this
+static size_t a_chat_segment_cut(const AChatSegment* segment, size_t start, size_t limit, uint64_t* sequence) {
+    size_t offset = start;
+    for (size_t i = segment->index_count; i > 0; i--) {
+        if (segment->index[i - 1].offset <= limit) {
+            if (segment->index[i - 1].offset > start) {
+                offset = segment->index[i - 1].offset;
+            }
+            break;
+        }
+    }
+
+    while (offset < segment->written && offset + a_chat_segment_frame_length(segment->map + offset) <= limit) {
+        offset += a_chat_segment_frame_length(segment->map + offset);
+    }
+    *sequence = offset < segment->written ? a_chat_segment_frame_sequence(segment->map + offset) : segment->next_sequence;
+
+    return offset;
+}
+
+static AChatSegment* a_chat_segment_map(int fd, int index_fd, size_t size) {
+    AChatSegment* segment = calloc(1, sizeof(AChatSegment));
+    if (!segment) {
+        a_chat_log_error("Failed to allocate memory for segment");
+        return NULL;
+    }
+
+    segment->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment->map == MAP_FAILED) {
+        a_chat_log_error_errno("Failed to map segment");
+        free(segment);
+        return NULL;
+    }
+
+    atomic_init(&segment->references, 1);
+    segment->fd = fd;
+    segment->index_fd = index_fd;
+    segment->size = size;
+
+    return segment;
+}
+
+static AChatSegment* a_chat_segment_create(AChatMessageStore* store, AChatStoredRoom* room, uint64_t first_sequence) {
+    char name[64];
+    a_chat_segment_file_name(name, sizeof(name), first_sequence, "segment");
+    int fd = openat(room->directory_fd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        a_chat_log_error_errno("Failed to create segment");
+        return NULL;
+    }
+
+    // the whole segment is allocated up front, so a full disk fails here rather than faulting on a write to the mapping
+    int error = posix_fallocate(fd, 0, (off_t) store->segment_bytes);
+    if (error != 0) {
+        errno = error;
+        a_chat_log_error_errno("Failed to allocate segment");
+
+        close(fd);
+        unlinkat(room->directory_fd, name, 0);
+        return NULL;
+    }
+
+    a_chat_segment_file_name(name, sizeof(name), first_sequence, "index");
+    int index_fd = openat(room->directory_fd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (index_fd == -1) {
+        a_chat_log_error_errno("Failed to create segment index");
+
+        close(fd);
+        return NULL;
+    }
+
+    AChatSegment* segment = a_chat_segment_map(fd, index_fd, store->segment_bytes);
+    if (!segment) {
+        close(fd);
+        close(index_fd);
+        return NULL;
+    }
+
+    AChatSegmentHeader* header = (AChatSegmentHeader*) segment->map;
+    memcpy(header->magic, A_CHAT_MESSAGE_STORE_MAGIC, sizeof(header->magic));
+    header->first_sequence = first_sequence;
+    header->committed = A_CHAT_MESSAGE_STORE_HEADER_SIZE;
+
+    segment->first_sequence = first_sequence;
+    segment->next_sequence = first_sequence;
+    segment->written = A_CHAT_MESSAGE_STORE_HEADER_SIZE;
+    segment->committed = A_CHAT_MESSAGE_STORE_HEADER_SIZE;
+
+    // the new files have to survive a crash along with what gets committed to them
+    if (fsync(room->directory_fd) == -1) {
+        a_chat_log_warning_errno("Failed to sync room's directory");
+    }
+
+    return segment;
+}
+
+// syncs the frames written since the last commit, then the header that says they are there, then their index entries
+static bool a_chat_segment_commit(AChatSegment* segment) {
+    if (segment->committed == segment->written) { return false; }
+
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = segment->committed & ~(page_size - 1);
+    if (msync(segment->map + start, segment->written - start, MS_SYNC) == -1) {
+        a_chat_log_error_errno("Failed to sync segment");
+        return false;
+    }
+
+    ((AChatSegmentHeader*) segment->map)->committed = segment->written;
+    if (msync(segment->map, page_size, MS_SYNC) == -1) {
+        a_chat_log_error_errno("Failed to sync segment's header");
+        return false;
+    }
+    segment->committed = segment->written;
+
+    // the index is only a shortcut, opening the store checks it against the header, so it isn't synced itself
+    if (segment->index_committed < segment->index_count) {
+        size_t count = segment->index_count - segment->index_committed;
+        ssize_t bytes_written = pwrite(segment->index_fd, &segment->index[segment->index_committed], count * sizeof(AChatSegmentIndexEntry), (off_t) (segment->index_committed * sizeof(AChatSegmentIndexEntry)));
+        if (bytes_written == (ssize_t) (count * sizeof(AChatSegmentIndexEntry))) {
+            segment->index_committed = segment->index_count;
+        } else {
+            a_chat_log_warning_errno("Failed to write segment index");
+        }
+    }
+
+    return true;
+}
+
+// starts a new segment for the room, deleting the oldest ones past the store's limit
+static AChatSegment* a_chat_message_store_roll(AChatMessageStore* store, AChatStoredRoom* room, uint64_t first_sequence) {
+    // the segment being left is committed now, so every commit after this only has to look at the newest one
+    if (room->number_of_segments > 0) {
+        a_chat_segment_commit(room->segments[room->number_of_segments - 1]);
+    }
+
+    AChatSegment* segment = a_chat_segment_create(store, room, first_sequence);
+    if (!segment) { return NULL; }
+
+    pthread_mutex_lock(&room->lock);
+    if (room->number_of_segments == room->segments_capacity) {
+        size_t new_capacity = room->segments_capacity ? room->segments_capacity * 2 : 4;
+        AChatSegment** new_segments = realloc(room->segments, sizeof(AChatSegment*) * new_capacity);
+        if (!new_segments) {
+            pthread_mutex_unlock(&room->lock);
+            a_chat_log_error("Failed to allocate memory for room's segments");
+            a_chat_segment_release(segment);
+            return NULL;
+        }
+
+        room->segments = new_segments;
+        room->segments_capacity = new_capacity;
+    }
+    room->segments[room->number_of_segments++] = segment;
+    pthread_mutex_unlock(&room->lock);
+
+    // usually just the oldest one, but more if the limit was lowered since the store was last open
+    // a catch up still queued from a deleted segment keeps it mapped until it has been sent
+    for (;;) {
+        pthread_mutex_lock(&room->lock);
+        AChatSegment* deleted = NULL;
+        if (room->number_of_segments > (size_t) store->segments_per_room) {
+            deleted = room->segments[0];
+            memmove(room->segments, room->segments + 1, sizeof(AChatSegment*) * (room->number_of_segments - 1));
+            room->number_of_segments--;
+        }
+        pthread_mutex_unlock(&room->lock);
+        if (!deleted) { break; }
+
+        char name[64];
+        a_chat_segment_file_name(name, sizeof(name), deleted->first_sequence, "segment");
+        unlinkat(room->directory_fd, name, 0);
+        a_chat_segment_file_name(name, sizeof(name), deleted->first_sequence, "index");
+        unlinkat(room->directory_fd, name, 0);
+        a_chat_segment_release(deleted);
+    }
+
+    return segment;
+}
+
+static void a_chat_message_store_write(AChatMessageStore* store, AChatMessageStoreEntry* entry) {
+    AChatStoredRoom* room = entry->room;
+    AChatBuffer* frame = entry->frame;
+    if (frame->length > store->segment_bytes - A_CHAT_MESSAGE_STORE_HEADER_SIZE) {
+        a_chat_log_error("Message is too big to store");
+        return;
+    }
+
+    // only this thread changes the room's segments, so the newest one can be read without the lock
+    AChatSegment* segment = room->number_of_segments > 0 ? room->segments[room->number_of_segments - 1] : NULL;
+    if (!segment || segment->written + frame->length > segment->size) {
+        if (!(segment = a_chat_message_store_roll(store, room, entry->sequence))) { return; }
+    }
+
+    // catch ups only read up to the written end, so the copy doesn't need the lock
+    memcpy(segment->map + segment->written, frame->data, frame->length);
+
+    pthread_mutex_lock(&room->lock);
+    if (segment->index_count == 0 || segment->written - segment->index[segment->index_count - 1].offset >= A_CHAT_MESSAGE_STORE_INDEX_INTERVAL) {
+        a_chat_segment_add_index(segment, entry->sequence, segment->written);
+    }
+    segment->written += frame->length;
+    segment->next_sequence = entry->sequence + 1;
+    pthread_mutex_unlock(&room->lock);
+
+    room->dirty = true;
+    a_chat_metrics_add(store->metrics, A_CHAT_COUNTER_MESSAGES_STORED, 1);
+}
+
+// writes everything queued, then commits every room it touched at once
+static void a_chat_message_store_drain(AChatMessageStore* store) {
+    AChatMpscNode* node;
+    bool wrote = false;
+    while ((node = a_chat_mpsc_queue_pop(&store->queue))) {
+        AChatMessageStoreEntry* entry = (AChatMessageStoreEntry*) node;
+        a_chat_message_store_write(store, entry);
+        a_chat_buffer_release(entry->frame);
+        a_chat_pool_free(entry);
+        wrote = true;
+    }
+    if (!wrote) { return; }
+
+    // rooms are only ever added to the front of the list, so it can be walked without holding its lock
+    pthread_mutex_lock(&store->rooms_lock);
+    AChatStoredRoom* room = store->rooms;
+    pthread_mutex_unlock(&store->rooms_lock);
+
+    bool committed = false;
+    for (; room; room = room->next) {
+        if (!room->dirty) { continue; }
+
+        room->dirty = false;
+        committed |= a_chat_segment_commit(room->segments[room->number_of_segments - 1]);
+    }
+    if (committed) {
+        a_chat_metrics_add(store->metrics, A_CHAT_COUNTER_MESSAGE_STORE_COMMITS, 1);
+    }
+}
+
+static void* a_chat_message_store_thread(void* arguments) {
+    AChatMessageStore* store = arguments;
+
+    pthread_mutex_lock(&store->lock);
+    while (!store->stopping) {
+        pthread_mutex_unlock(&store->lock);
+        a_chat_message_store_drain(store);
+        pthread_mutex_lock(&store->lock);
+
+        // relaying never wakes this thread, whatever arrives during the wait is committed together
+        if (!store->stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += store->commit_interval_ms / 1000;
+            deadline.tv_nsec += (long) (store->commit_interval_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&store->wake, &store->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    // anything relayed before the server stopped is still committed
+    a_chat_message_store_drain(store);
+
+    return NULL;
+}
+
+// room names can hold any printable character, so their directories are named in hex
+static void a_chat_message_store_directory_name(char* directory_name, const char* name, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < length; i++) {
+        directory_name[i * 2] = digits[(uint8_t) name[i] >> 4];
+        directory_name[i * 2 + 1] = digits[(uint8_t) name[i] & 0x0f];
+    }
+    directory_name[length * 2] = '\0';
+}
+
+static bool a_chat_message_store_decode_name(const char* directory_name, char* name, size_t* length) {
+    size_t directory_length = strlen(directory_name);
+    if (directory_length == 0 || directory_length % 2 != 0 || directory_length / 2 > A_CHAT_ROOM_NAME_MAXIMUM_LENGTH) { return false; }
+
+    for (size_t i = 0; i < directory_length / 2; i++) {
+        unsigned value;
+        if (sscanf(directory_name + i * 2, "%2x", &value) != 1) { return false; }
+        name[i] = (char) value;
+    }
+    *length = directory_length / 2;
+    name[*length] = '\0';
+
+    return a_chat_room_name_validate((const uint8_t*) name, *length);
+}
+
+// the rooms lock must not be held while calling this
+static AChatStoredRoom* a_chat_message_store_add_room(AChatMessageStore* store, const char* name, size_t length, bool create) {
+    char directory_name[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH * 2 + 1];
+    a_chat_message_store_directory_name(directory_name, name, length);
+    if (create && mkdirat(store->directory_fd, directory_name, 0700) == -1 && errno != EEXIST) {
+        a_chat_log_error_errno("Failed to create room's directory");
+        return NULL;
+    }
+
+    AChatStoredRoom* room = calloc(1, sizeof(AChatStoredRoom));
+    if (!room) {
+        a_chat_log_error("Failed to allocate memory for stored room");
+        return NULL;
+    }
+
+    room->directory_fd = openat(store->directory_fd, directory_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (room->directory_fd == -1) {
+        a_chat_log_error_errno("Failed to open room's directory");
+        free(room);
+        return NULL;
+    }
+    if (pthread_mutex_init(&room->lock, NULL) != 0) {
+        a_chat_log_error("Failed to create stored room's mutex");
+        close(room->directory_fd);
+        free(room);
+        return NULL;
+    }
+
+    memcpy(room->name, name, length);
+    room->name[length] = '\0';
+    room->name_length = length;
+
+    pthread_mutex_lock(&store->rooms_lock);
+    room->next = store->rooms;
+    store->rooms = room;
+    pthread_mutex_unlock(&store->rooms_lock);
+
+    return room;
+}
+
+// maps a segment left by an earlier run, trusting its header for how much was committed and its index for where the frames are
+static AChatSegment* a_chat_segment_open(AChatStoredRoom* room, uint64_t first_sequence) {
+    char name[64];
+    a_chat_segment_file_name(name, sizeof(name), first_sequence, "segment");
+    int fd = openat(room->directory_fd, name, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        a_chat_log_error_errno("Failed to open segment");
+        return NULL;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) == -1 || (size_t) status.st_size < A_CHAT_MESSAGE_STORE_HEADER_SIZE) {
+        a_chat_log_error("Failed to open segment, it is too small");
+        close(fd);
+        return NULL;
+    }
+
+    a_chat_segment_file_name(name, sizeof(name), first_sequence, "index");
+    int index_fd = openat(room->directory_fd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (index_fd == -1) {
+        a_chat_log_error_errno("Failed to open segment index");
+        close(fd);
+        return NULL;
+    }
+
+    AChatSegment* segment = a_chat_segment_map(fd, index_fd, (size_t) status.st_size);
+    if (!segment) {
+        close(fd);
+        close(index_fd);
+        return NULL;
+    }
+
+    const AChatSegmentHeader* header = (const AChatSegmentHeader*) segment->map;
+    if (memcmp(header->magic, A_CHAT_MESSAGE_STORE_MAGIC, sizeof(header->magic)) != 0 || header->first_sequence != first_sequence) {
+        a_chat_log_error("Failed to open segment, its header is invalid");
+        a_chat_segment_release(segment);
+        return NULL;
+    }
+
+    segment->first_sequence = first_sequence;
+    segment->next_sequence = first_sequence;
+    segment->committed = header->committed;
+    if (segment->committed < A_CHAT_MESSAGE_STORE_HEADER_SIZE || segment->committed > segment->size) {
+        segment->committed = A_CHAT_MESSAGE_STORE_HEADER_SIZE;
+    }
+    segment->written = segment->committed;
+
+    // index entries past the committed end, or out of order, are from a commit that didn't finish
+    struct stat index_status;
+    size_t number_of_entries = fstat(index_fd, &index_status) == 0 ? (size_t) index_status.st_size / sizeof(AChatSegmentIndexEntry) : 0;
+    if (number_of_entries > 0) {
+        segment->index = malloc(sizeof(AChatSegmentIndexEntry) * number_of_entries);
+        if (segment->index && pread(index_fd, segment->index, sizeof(AChatSegmentIndexEntry) * number_of_entries, 0) == (ssize_t) (sizeof(AChatSegmentIndexEntry) * number_of_entries)) {
+            segment->index_capacity = number_of_entries;
+            while (segment->index_count < number_of_entries) {
+                const AChatSegmentIndexEntry* entry = &segment->index[segment->index_count];
+                const AChatSegmentIndexEntry* previous = segment->index_count > 0 ? entry - 1 : NULL;
+                if (entry->offset < A_CHAT_MESSAGE_STORE_HEADER_SIZE || entry->offset >= segment->committed || entry->sequence < first_sequence ||
+                    (previous && (entry->offset <= previous->offset || entry->sequence <= previous->sequence))) {
+                    break;
+                }
+                segment->index_count++;
+            }
+        }
+    }
+    segment->index_committed = segment->index_count;
+    if (ftruncate(index_fd, (off_t) (segment->index_count * sizeof(AChatSegmentIndexEntry))) == -1) {
+        a_chat_log_warning_errno("Failed to trim segment index");
+    }
+
+    return segment;
+}
+
+static int a_chat_message_store_compare_sequences(const void* a, const void* b) {
+    uint64_t first = *(const uint64_t*) a;
+    uint64_t second = *(const uint64_t*) b;
+    return (first > second) - (first < second);
+}
+
+static void a_chat_message_store_recover_room(AChatMessageStore* store, const char* directory_name, AChatHistoryTable* history) {
+    char name[A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+    size_t length;
+    if (!a_chat_message_store_decode_name(directory_name, name, &length)) { return; }
+
+    AChatStoredRoom* room = a_chat_message_store_add_room(store, name, length, false);
+    if (!room) { return; }
+
+    // the segments are found by name, the directory's own order means nothing
+    int directory_fd = dup(room->directory_fd);
+    DIR* directory = directory_fd == -1 ? NULL : fdopendir(directory_fd);
+    if (!directory) {
+        a_chat_log_error_errno("Failed to read room's directory");
+        if (directory_fd != -1) {
+            close(directory_fd);
+        }
+        return;
+    }
+
+    uint64_t* sequences = NULL;
+    size_t number_of_sequences = 0;
+    size_t sequences_capacity = 0;
+    struct dirent* directory_entry;
+    while ((directory_entry = readdir(directory))) {
+        char* end;
+        uint64_t sequence = strtoull(directory_entry->d_name, &end, 10);
+        if (end == directory_entry->d_name || strcmp(end, ".segment") != 0) { continue; }
+
+        if (number_of_sequences == sequences_capacity) {
+            sequences_capacity = sequences_capacity ? sequences_capacity * 2 : 8;
+            uint64_t* new_sequences = realloc(sequences, sizeof(uint64_t) * sequences_capacity);
+            if (!new_sequences) {
+                a_chat_log_error("Failed to allocate memory while opening message store");
+                break;
+            }
+            sequences = new_sequences;
+        }
+        sequences[number_of_sequences++] = sequence;
+    }
+    closedir(directory);
+    qsort(sequences, number_of_sequences, sizeof(uint64_t), a_chat_message_store_compare_sequences);
+
+    room->segments = malloc(sizeof(AChatSegment*) * (number_of_sequences ? number_of_sequences : 1));
+    room->segments_capacity = room->segments ? (number_of_sequences ? number_of_sequences : 1) : 0;
+    for (size_t i = 0; i < number_of_sequences && room->segments; i++) {
+        AChatSegment* segment = a_chat_segment_open(room, sequences[i]);
+        if (segment) {
+            room->segments[room->number_of_segments++] = segment;
+        }
+    }
+    free(sequences);
+
+    // every segment but the last was committed in full before the next was started, so it ends where the next begins
+    for (size_t i = 0; i + 1 < room->number_of_segments; i++) {
+        room->segments[i]->next_sequence = room->segments[i + 1]->first_sequence;
+    }
+
+    // only the last segment's tail past its last index entry is read, to find its last sequence
+    uint64_t next_sequence = 1;
+    if (room->number_of_segments > 0) {
+        AChatSegment* segment = room->segments[room->number_of_segments - 1];
+        size_t offset = segment->index_count > 0 ? segment->index[segment->index_count - 1].offset : A_CHAT_MESSAGE_STORE_HEADER_SIZE;
+        segment->next_sequence = segment->index_count > 0 ? segment->index[segment->index_count - 1].sequence : segment->first_sequence;
+        while (offset < segment->committed && a_chat_segment_frame_valid(segment, offset, segment->committed)) {
+            segment->next_sequence = a_chat_segment_frame_sequence(segment->map + offset) + 1;
+            offset += a_chat_segment_frame_length(segment->map + offset);
+        }
+        segment->written = offset;
+        segment->committed = offset;
+        next_sequence = segment->next_sequence;
+    }
+
+    // the room's history carries on numbering from the last stored message, catch ups older than it come from the store
+    AChatHistory* room_history = a_chat_history_table_get(history, name, length);
+    if (room_history) {
+        room_history->next_sequence = next_sequence;
+        room_history->stored = room;
+    }
+}
+
+AChatMessageStore* a_chat_message_store_open(const char* path, size_t segment_bytes, int segments_per_room, int commit_interval_ms, AChatHistoryTable* history, AChatMetrics* metrics) {
+    AChatMessageStore* store = calloc(1, sizeof(AChatMessageStore));
+    if (!store) {
+        a_chat_log_error("Failed to allocate memory for message store");
+        return NULL;
+    }
+
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        a_chat_log_error_errno("Failed to create message store's directory");
+        free(store);
+        return NULL;
+    }
+    store->directory_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store->directory_fd == -1) {
+        a_chat_log_error_errno("Failed to open message store's directory");
+        free(store);
+        return NULL;
+    }
+
+    store->segment_bytes = segment_bytes;
+    store->segments_per_room = segments_per_room;
+    store->commit_interval_ms = commit_interval_ms;
+    store->metrics = metrics;
+    a_chat_mpsc_queue_init(&store->queue);
+    pthread_mutex_init(&store->rooms_lock, NULL);
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->wake, NULL);
+
+    int directory_fd = dup(store->directory_fd);
+    DIR* directory = directory_fd == -1 ? NULL : fdopendir(directory_fd);
+    if (!directory) {
+        a_chat_log_error_errno("Failed to read message store's directory");
+        if (directory_fd != -1) {
+            close(directory_fd);
+        }
+        a_chat_message_store_close(store);
+        return NULL;
+    }
+    struct dirent* directory_entry;
+    while ((directory_entry = readdir(directory))) {
+        if (directory_entry->d_name[0] == '.') { continue; }
+        a_chat_message_store_recover_room(store, directory_entry->d_name, history);
+    }
+    closedir(directory);
+
+    if (pthread_create(&store->thread_id, NULL, a_chat_message_store_thread, store) != 0) {
+        a_chat_log_error("Failed to create message store's thread");
+        a_chat_message_store_close(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+void a_chat_message_store_close(AChatMessageStore* store) {
+    if (!store) { return; }
+
+    if (store->thread_id) {
+        pthread_mutex_lock(&store->lock);
+        store->stopping = true;
+        pthread_cond_signal(&store->wake);
+        pthread_mutex_unlock(&store->lock);
+        pthread_join(store->thread_id, NULL);
+    }
+
+    AChatStoredRoom* room = store->rooms;
+    while (room) {
+        AChatStoredRoom* next = room->next;
+        for (size_t i = 0; i < room->number_of_segments; i++) {
+            a_chat_segment_release(room->segments[i]);
+        }
+        free(room->segments);
+        pthread_mutex_destroy(&room->lock);
+        close(room->directory_fd);
+        free(room);
+        room = next;
+    }
+
+    pthread_cond_destroy(&store->wake);
+    pthread_mutex_destroy(&store->lock);
+    pthread_mutex_destroy(&store->rooms_lock);
+    close(store->directory_fd);
+    free(store);
+}
+
+AChatStoredRoom* a_chat_message_store_room(AChatMessageStore* store, const char* name, size_t length) {
+    pthread_mutex_lock(&store->rooms_lock);
+    AChatStoredRoom* room = store->rooms;
+    while (room && !(room->name_length == length && memcmp(room->name, name, length) == 0)) {
+        room = room->next;
+    }
+    pthread_mutex_unlock(&store->rooms_lock);
+
+    return room ? room : a_chat_message_store_add_room(store, name, length, true);
+}
+
+void a_chat_message_store_append(AChatMessageStore* store, AChatStoredRoom* room, AChatBuffer* frame, uint64_t sequence) {
+    // a_chat_pool_alloc logs the correct error already
+    AChatMessageStoreEntry* entry = a_chat_pool_alloc(sizeof(AChatMessageStoreEntry));
+    if (!entry) { return; }
+
+    entry->room = room;
+    entry->frame = a_chat_buffer_acquire(frame);
+    entry->sequence = sequence;
+    a_chat_mpsc_queue_push(&store->queue, &entry->node);
+}
+
+bool a_chat_message_store_replay(AChatStoredRoom* room, uint64_t* sequence, AChatOutboundQueue* queue, size_t* replayed) {
+    bool complete = true;
+
+    pthread_mutex_lock(&room->lock);
+    for (size_t i = 0; i < room->number_of_segments && complete; i++) {
+        AChatSegment* segment = room->segments[i];
+        if (segment->next_sequence <= *sequence) { continue; }
+
+        size_t start = a_chat_segment_find(segment, sequence);
+        size_t end = segment->written;
+        uint64_t end_sequence = segment->next_sequence;
+        if (start >= end) { continue; }
+
+        // the rest of the segment goes out as a single buffer, cut at a frame if it doesn't all fit in the queue
+        size_t budget = queue->maximum_bytes > queue->queued_bytes ? queue->maximum_bytes - queue->queued_bytes : 0;
+        if (end - start > budget) {
+            end = a_chat_segment_cut(segment, start, start + budget, &end_sequence);
+            complete = false;
+        }
+        if (end == start || queue->count >= queue->maximum_frames) {
+            complete = false;
+            break;
+        }
+
+        atomic_fetch_add_explicit(&segment->references, 1, memory_order_relaxed);
+        AChatBuffer* buffer = a_chat_buffer_wrap(segment->map + start, end - start, a_chat_segment_release, segment);
+        if (!buffer) {
+            a_chat_segment_release(segment);
+            complete = false;
+            break;
+        }
+
+        AChatOutboundQueueResult result = a_chat_outbound_queue_push(queue, buffer);
+        a_chat_buffer_release(buffer);
+        if (result != A_CHAT_OUTBOUND_QUEUED) {
+            complete = false;
+            break;
+        }
+
+        *replayed += end_sequence - *sequence;
+        *sequence = end_sequence;
+    }
+    pthread_mutex_unlock(&room->lock);
+
+    return complete;
+}
@@ -0,0 +1,254 @@
+#include "server/metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+typedef struct AChatMetricDescription {
+    const char* name;
+    const char* help;
+} AChatMetricDescription;
+
+static const AChatMetricDescription a_chat_counter_descriptions[A_CHAT_NUMBER_OF_COUNTERS] = {
+    [A_CHAT_COUNTER_CONNECTIONS_ACCEPTED] = { "a_chat_connections_accepted_total", "Connections accepted" },
+    [A_CHAT_COUNTER_HANDSHAKES_COMPLETED] = { "a_chat_handshakes_completed_total", "Handshakes that completed" },
+    [A_CHAT_COUNTER_HANDSHAKES_FAILED] = { "a_chat_handshakes_failed_total", "Handshakes that were invalid or found the server full" },
+    [A_CHAT_COUNTER_HANDSHAKES_TIMED_OUT] = { "a_chat_handshakes_timed_out_total", "Handshakes that missed their deadline" },
+    [A_CHAT_COUNTER_DISCONNECTS] = { "a_chat_disconnects_total", "Clients that disconnected after their handshake" },
+    [A_CHAT_COUNTER_SLOW_CONSUMER_DISCONNECTS] = { "a_chat_slow_consumer_disconnects_total", "Clients disconnected for not keeping up" },
+    [A_CHAT_COUNTER_FRAMES_RECEIVED] = { "a_chat_frames_received_total", "Frames received from clients" },
+    [A_CHAT_COUNTER_BYTES_RECEIVED] = { "a_chat_bytes_received_total", "Bytes received from clients" },
+    [A_CHAT_COUNTER_MESSAGES_RELAYED] = { "a_chat_messages_relayed_total", "Messages relayed to a room" },
+    [A_CHAT_COUNTER_BROADCASTS] = { "a_chat_broadcasts_total", "Frames broadcast to a room or every client" },
+    [A_CHAT_COUNTER_FRAMES_QUEUED] = { "a_chat_frames_queued_total", "Frames queued to clients" },
+    [A_CHAT_COUNTER_FRAMES_SENT] = { "a_chat_frames_sent_total", "Frames completely sent to clients" },
+    [A_CHAT_COUNTER_BYTES_SENT] = { "a_chat_bytes_sent_total", "Bytes sent to clients" },
+    [A_CHAT_COUNTER_FRAMES_DROPPED] = { "a_chat_frames_dropped_total", "Frames dropped by a full outbound queue" },
+    [A_CHAT_COUNTER_BYTES_DROPPED] = { "a_chat_bytes_dropped_total", "Bytes dropped by a full outbound queue" },
+    [A_CHAT_COUNTER_FRAMES_COALESCED] = { "a_chat_frames_coalesced_total", "Frames merged into another by a full outbound queue" },
+    [A_CHAT_COUNTER_FRAMES_REPLAYED] = { "a_chat_frames_replayed_total", "Frames replayed from a room's history" },
+    [A_CHAT_COUNTER_MESSAGES_STORED] = { "a_chat_messages_stored_total", "Messages written to the message store" },
+    [A_CHAT_COUNTER_MESSAGE_STORE_COMMITS] = { "a_chat_message_store_commits_total", "Group commits of the message store to disk" },
+    [A_CHAT_COUNTER_SESSIONS_RESUMED] = { "a_chat_sessions_resumed_total", "Sessions resumed by a reconnecting client" },
+    [A_CHAT_COUNTER_SESSIONS_EXPIRED] = { "a_chat_sessions_expired_total", "Sessions that expired before their client came back" },
+    [A_CHAT_COUNTER_DIRECT_MESSAGES_RELAYED] = { "a_chat_direct_messages_relayed_total", "Direct messages sent on to their recipient" },
+    [A_CHAT_COUNTER_DIRECT_MESSAGES_UNDELIVERED] = { "a_chat_direct_messages_undelivered_total", "Direct messages whose recipient wasn't online" },
+    [A_CHAT_COUNTER_PINGS_SENT] = { "a_chat_pings_sent_total", "Pings sent to clients that had gone quiet" },
+    [A_CHAT_COUNTER_CONNECTIONS_REAPED] = { "a_chat_connections_reaped_total", "Connections disconnected for being idle past the idle timeout" },
+    [A_CHAT_COUNTER_FRAMES_RATE_LIMITED] = { "a_chat_frames_rate_limited_total", "Frames dropped for being over their client's rate limits" },
+    [A_CHAT_COUNTER_FRAMES_ADDRESS_RATE_LIMITED] = { "a_chat_frames_address_rate_limited_total", "Frames dropped for being over their address' rate limits" },
+    [A_CHAT_COUNTER_BYTES_RATE_LIMITED] = { "a_chat_bytes_rate_limited_total", "Bytes in frames dropped by rate limits" },
+};
+
+static const AChatMetricDescription a_chat_gauge_descriptions[A_CHAT_NUMBER_OF_GAUGES] = {
+    [A_CHAT_GAUGE_QUEUED_FRAMES] = { "a_chat_queued_frames", "Frames waiting in outbound queues" },
+    [A_CHAT_GAUGE_QUEUED_BYTES] = { "a_chat_queued_bytes", "Bytes waiting in outbound queues" },
+};
+
+static const AChatMetricDescription a_chat_histogram_descriptions[A_CHAT_NUMBER_OF_HISTOGRAMS] = {
+    [A_CHAT_HISTOGRAM_BROADCAST] = { "a_chat_broadcast_latency_seconds", "Time from a broadcast starting to a shard having queued it to its members" },
+    [A_CHAT_HISTOGRAM_HANDSHAKE] = { "a_chat_handshake_duration_seconds", "Time from a connection being accepted to its handshake completing" },
+};
+
+// the shard the current thread records into
+static _Thread_local int a_chat_metrics_shard_index = -1;
+static atomic_int a_chat_metrics_next_shard_index = 0;
+
+static AChatMetricsShard* a_chat_metrics_shard(AChatMetrics* metrics) {
+    if (a_chat_metrics_shard_index == -1) {
+        a_chat_metrics_shard_index = atomic_fetch_add_explicit(&a_chat_metrics_next_shard_index, 1, memory_order_relaxed) % A_CHAT_METRICS_SHARDS;
+    }
+    return &metrics->shards[a_chat_metrics_shard_index];
+}
+
+static size_t a_chat_histogram_bucket(uint64_t value) {
+    // small values get a bucket each
+    if (value < A_CHAT_HISTOGRAM_SUB_BUCKETS) { return (size_t) value; }
+
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > A_CHAT_HISTOGRAM_MAXIMUM_EXPONENT) { return A_CHAT_HISTOGRAM_BUCKETS - 1; }
+
+    // the 4 bits after the leading one pick the sub-bucket
+    size_t sub_bucket = (size_t) (value >> (exponent - 4)) - A_CHAT_HISTOGRAM_SUB_BUCKETS;
+    return (size_t) (exponent - 3) * A_CHAT_HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+// the biggest value that lands in the bucket
+static uint64_t a_chat_histogram_bucket_value(size_t bucket) {
+    if (bucket < A_CHAT_HISTOGRAM_SUB_BUCKETS) { return bucket; }
+
+    int exponent = (int) (bucket / A_CHAT_HISTOGRAM_SUB_BUCKETS) + 3;
+    uint64_t sub_bucket = bucket % A_CHAT_HISTOGRAM_SUB_BUCKETS;
+    return ((A_CHAT_HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << (exponent - 4)) - 1;
+}
+
+bool a_chat_metrics_init(AChatMetrics* metrics) {
+    metrics->shards = aligned_alloc(64, sizeof(AChatMetricsShard) * A_CHAT_METRICS_SHARDS);
+    if (!metrics->shards) {
+        a_chat_log_error("Failed to allocate memory for metrics");
+        return false;
+    }
+
+    // every field is an atomic integer, which is all zero bits when it is zero
+    memset(metrics->shards, 0, sizeof(AChatMetricsShard) * A_CHAT_METRICS_SHARDS);
+
+    return true;
+}
+
+void a_chat_metrics_destroy(AChatMetrics* metrics) {
+    free(metrics->shards);
+    metrics->shards = NULL;
+}
+
+uint64_t a_chat_metrics_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+void a_chat_metrics_add(AChatMetrics* metrics, AChatCounter counter, uint64_t value) {
+    if (!metrics) { return; }
+
+    atomic_fetch_add_explicit(&a_chat_metrics_shard(metrics)->counters[counter], value, memory_order_relaxed);
+}
+
+void a_chat_metrics_gauge_add(AChatMetrics* metrics, AChatGauge gauge, int64_t value) {
+    if (!metrics) { return; }
+
+    atomic_fetch_add_explicit(&a_chat_metrics_shard(metrics)->gauges[gauge], value, memory_order_relaxed);
+}
+
+void a_chat_metrics_record(AChatMetrics* metrics, AChatHistogramType histogram, uint64_t value_ns) {
+    if (!metrics) { return; }
+
+    a_chat_histogram_record(&a_chat_metrics_shard(metrics)->histograms[histogram], value_ns);
+}
+
+void a_chat_histogram_record(AChatHistogram* histogram, uint64_t value_ns) {
+    atomic_fetch_add_explicit(&histogram->buckets[a_chat_histogram_bucket(value_ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value_ns, memory_order_relaxed);
+
+    uint64_t maximum = atomic_load_explicit(&histogram->maximum, memory_order_relaxed);
+    while (value_ns > maximum && !atomic_compare_exchange_weak_explicit(&histogram->maximum, &maximum, value_ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+// the smallest value that at least the given fraction of the recorded values are at or below
+static uint64_t a_chat_histogram_percentile(const uint64_t* buckets, uint64_t count, uint64_t maximum, double fraction) {
+    if (count == 0) { return 0; }
+
+    uint64_t rank = (uint64_t) (fraction * (double) count + 0.5);
+    if (rank == 0) { rank = 1; }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < A_CHAT_HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            uint64_t value = a_chat_histogram_bucket_value(i);
+            return value < maximum ? value : maximum;
+        }
+    }
+    return maximum;
+}
+
+void a_chat_histogram_summarize(AChatHistogram* const* histograms, size_t number_of_histograms, AChatLatencyStats* latency) {
+    memset(latency, 0, sizeof(AChatLatencyStats));
+
+    uint64_t buckets[A_CHAT_HISTOGRAM_BUCKETS] = {0};
+    for (size_t i = 0; i < number_of_histograms; i++) {
+        const AChatHistogram* histogram = histograms[i];
+        for (size_t j = 0; j < A_CHAT_HISTOGRAM_BUCKETS; j++) {
+            buckets[j] += atomic_load_explicit(&histogram->buckets[j], memory_order_relaxed);
+        }
+        latency->sum_ns += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+        uint64_t maximum = atomic_load_explicit(&histogram->maximum, memory_order_relaxed);
+        if (maximum > latency->maximum_ns) {
+            latency->maximum_ns = maximum;
+        }
+    }
+
+    // counted from the buckets so the percentiles always agree with the count
+    for (size_t i = 0; i < A_CHAT_HISTOGRAM_BUCKETS; i++) {
+        latency->count += buckets[i];
+    }
+
+    latency->p50_ns = a_chat_histogram_percentile(buckets, latency->count, latency->maximum_ns, 0.5);
+    latency->p90_ns = a_chat_histogram_percentile(buckets, latency->count, latency->maximum_ns, 0.9);
+    latency->p99_ns = a_chat_histogram_percentile(buckets, latency->count, latency->maximum_ns, 0.99);
+    latency->p999_ns = a_chat_histogram_percentile(buckets, latency->count, latency->maximum_ns, 0.999);
+}
+
+void a_chat_metrics_snapshot(const AChatMetrics* metrics, AChatServerStats* stats) {
+    memset(stats, 0, sizeof(AChatServerStats));
+
+    for (int i = 0; i < A_CHAT_METRICS_SHARDS; i++) {
+        AChatMetricsShard* shard = &metrics->shards[i];
+        for (int j = 0; j < A_CHAT_NUMBER_OF_COUNTERS; j++) {
+            stats->counters[j] += atomic_load_explicit(&shard->counters[j], memory_order_relaxed);
+        }
+        for (int j = 0; j < A_CHAT_NUMBER_OF_GAUGES; j++) {
+            stats->gauges[j] += atomic_load_explicit(&shard->gauges[j], memory_order_relaxed);
+        }
+    }
+
+    // every shard's histogram of a type is added together
+    for (int i = 0; i < A_CHAT_NUMBER_OF_HISTOGRAMS; i++) {
+        AChatHistogram* histograms[A_CHAT_METRICS_SHARDS];
+        for (int j = 0; j < A_CHAT_METRICS_SHARDS; j++) {
+            histograms[j] = &metrics->shards[j].histograms[i];
+        }
+
+        a_chat_histogram_summarize(histograms, A_CHAT_METRICS_SHARDS, &stats->latencies[i]);
+    }
+}
+
+size_t a_chat_metrics_format_prometheus(const AChatServerStats* stats, char* output, size_t size) {
+    size_t length = 0;
+#define A_CHAT_METRICS_APPEND(...) length += (size_t) snprintf(output + (length < size ? length : size), length < size ? size - length : 0, __VA_ARGS__)
+
+    A_CHAT_METRICS_APPEND("# HELP a_chat_connected_clients Clients that have completed their handshake\n# TYPE a_chat_connected_clients gauge\na_chat_connected_clients %d\n", stats->connected_clients);
+    A_CHAT_METRICS_APPEND("# HELP a_chat_away_clients Clients that disconnected but can still resume their session\n# TYPE a_chat_away_clients gauge\na_chat_away_clients %d\n", stats->away_clients);
+
+    for (int i = 0; i < A_CHAT_NUMBER_OF_COUNTERS; i++) {
+        const AChatMetricDescription* description = &a_chat_counter_descriptions[i];
+        A_CHAT_METRICS_APPEND("# HELP %s %s\n# TYPE %s counter\n%s %llu\n", description->name, description->help, description->name, description->name, (unsigned long long) stats->counters[i]);
+    }
+
+    for (int i = 0; i < A_CHAT_NUMBER_OF_GAUGES; i++) {
+        const AChatMetricDescription* description = &a_chat_gauge_descriptions[i];
+        A_CHAT_METRICS_APPEND("# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", description->name, description->help, description->name, description->name, (long long) stats->gauges[i]);
+    }
+
+    // the histograms are given as summaries, prometheus can't merge their quantiles across servers but they are exact to 1/16th
+    for (int i = 0; i < A_CHAT_NUMBER_OF_HISTOGRAMS; i++) {
+        const AChatMetricDescription* description = &a_chat_histogram_descriptions[i];
+        const AChatLatencyStats* latency = &stats->latencies[i];
+        A_CHAT_METRICS_APPEND("# HELP %s %s\n# TYPE %s summary\n", description->name, description->help, description->name);
+        A_CHAT_METRICS_APPEND("%s{quantile=\"0.5\"} %.9f\n", description->name, latency->p50_ns / 1e9);
+        A_CHAT_METRICS_APPEND("%s{quantile=\"0.9\"} %.9f\n", description->name, latency->p90_ns / 1e9);
+        A_CHAT_METRICS_APPEND("%s{quantile=\"0.99\"} %.9f\n", description->name, latency->p99_ns / 1e9);
+        A_CHAT_METRICS_APPEND("%s{quantile=\"0.999\"} %.9f\n", description->name, latency->p999_ns / 1e9);
+        A_CHAT_METRICS_APPEND("%s{quantile=\"1\"} %.9f\n", description->name, latency->maximum_ns / 1e9);
+        A_CHAT_METRICS_APPEND("%s_sum %.9f\n%s_count %llu\n", description->name, latency->sum_ns / 1e9, description->name, (unsigned long long) latency->count);
+    }
+
+    // the buffer pool is shared by everything in the process, not just this server
+    const AChatPoolStats* pool = &stats->pool;
+    A_CHAT_METRICS_APPEND("# HELP a_chat_pool_reserved_blocks Blocks the buffer pool has carved out of the heap\n# TYPE a_chat_pool_reserved_blocks gauge\n");
+    for (int i = 0; i < A_CHAT_POOL_SIZE_CLASSES; i++) {
+        A_CHAT_METRICS_APPEND("a_chat_pool_reserved_blocks{size=\"%zu\"} %llu\n", pool->classes[i].block_size, (unsigned long long) pool->classes[i].reserved_blocks);
+    }
+    A_CHAT_METRICS_APPEND("# HELP a_chat_pool_in_use_blocks Buffer pool blocks handed out right now\n# TYPE a_chat_pool_in_use_blocks gauge\n");
+    for (int i = 0; i < A_CHAT_POOL_SIZE_CLASSES; i++) {
+        A_CHAT_METRICS_APPEND("a_chat_pool_in_use_blocks{size=\"%zu\"} %llu\n", pool->classes[i].block_size, (unsigned long long) pool->classes[i].in_use_blocks);
+    }
+    A_CHAT_METRICS_APPEND("# HELP a_chat_pool_reserved_bytes Bytes the buffer pool has carved out of the heap\n# TYPE a_chat_pool_reserved_bytes gauge\na_chat_pool_reserved_bytes %llu\n", (unsigned long long) pool->reserved_bytes);
+    A_CHAT_METRICS_APPEND("# HELP a_chat_pool_in_use_bytes Bytes of buffer pool blocks handed out right now\n# TYPE a_chat_pool_in_use_bytes gauge\na_chat_pool_in_use_bytes %llu\n", (unsigned long long) pool->in_use_bytes);
+    A_CHAT_METRICS_APPEND("# HELP a_chat_pool_oversized_bytes Bytes in use by blocks too big for the buffer pool's size classes\n# TYPE a_chat_pool_oversized_bytes gauge\na_chat_pool_oversized_bytes %llu\n", (unsigned long long) pool->oversized_bytes);
+
+#undef A_CHAT_METRICS_APPEND
+    return length;
+}
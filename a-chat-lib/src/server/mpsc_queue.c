@@ -0,0 +1,53 @@
+#include "server/mpsc_queue.h"
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+void a_chat_mpsc_queue_init(AChatMpscQueue* queue) {
+    atomic_store_explicit(&queue->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, &queue->stub, memory_order_relaxed);
+    queue->tail = &queue->stub;
+}
+
+void a_chat_mpsc_queue_push(AChatMpscQueue* queue, AChatMpscNode* node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+
+    // claim the head, then link the previous head to the new node
+    AChatMpscNode* previous = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&previous->next, node, memory_order_release);
+}
+
+AChatMpscNode* a_chat_mpsc_queue_pop(AChatMpscQueue* queue) {
+    AChatMpscNode* tail = queue->tail;
+    AChatMpscNode* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    // skip over the stub node
+    if (tail == &queue->stub) {
+        if (!next) { return NULL; }
+
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    // the tail isn't the last node, so a producer hasn't finished linking it yet
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire)) {
+        return NULL;
+    }
+
+    // the tail is the only node, put the stub back behind it so it can be popped
+    a_chat_mpsc_queue_push(queue, &queue->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
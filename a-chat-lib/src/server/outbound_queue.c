@@ -0,0 +1,257 @@
+#include "server/outbound_queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "log.h"
+
+#define A_CHAT_OUTBOUND_QUEUE_INITIAL_CAPACITY 16
+
+// coalescing needs the partly sent head plus at least two frames to merge
+#define A_CHAT_OUTBOUND_QUEUE_MINIMUM_FRAMES 4
+
+static AChatBuffer** a_chat_outbound_queue_at(AChatOutboundQueue* queue, size_t index) {
+    return &queue->buffers[(queue->head + index) % queue->capacity];
+}
+
+// the head can't be dropped or merged once part of it has been sent, that would corrupt the stream
+// neither can frames an asynchronous send is still reading from
+static size_t a_chat_outbound_queue_first_unsent(AChatOutboundQueue* queue) {
+    if (queue->in_flight_frames > 0) { return queue->in_flight_frames; }
+
+    return queue->head_offset > 0 ? 1 : 0;
+}
+
+static bool a_chat_outbound_queue_grow(AChatOutboundQueue* queue) {
+    if (queue->capacity >= queue->maximum_frames) { return false; }
+
+    size_t new_capacity = queue->capacity ? queue->capacity * 2 : A_CHAT_OUTBOUND_QUEUE_INITIAL_CAPACITY;
+    if (new_capacity > queue->maximum_frames) {
+        new_capacity = queue->maximum_frames;
+    }
+
+    AChatBuffer** new_buffers = malloc(sizeof(AChatBuffer*) * new_capacity);
+    if (!new_buffers) {
+        a_chat_log_error("Failed to allocate memory for outbound queue");
+        return false;
+    }
+
+    // unwrap the ring into the new array
+    for (size_t i = 0; i < queue->count; i++) {
+        new_buffers[i] = *a_chat_outbound_queue_at(queue, i);
+    }
+
+    free(queue->buffers);
+    queue->buffers = new_buffers;
+    queue->capacity = new_capacity;
+    queue->head = 0;
+
+    return true;
+}
+
+static bool a_chat_outbound_queue_drop_oldest(AChatOutboundQueue* queue) {
+    size_t index = a_chat_outbound_queue_first_unsent(queue);
+    if (index >= queue->count) { return false; }
+
+    AChatBuffer* buffer = *a_chat_outbound_queue_at(queue, index);
+    queue->dropped_frames++;
+    queue->dropped_bytes += buffer->length;
+    queue->queued_bytes -= buffer->length;
+    a_chat_metrics_add(queue->metrics, A_CHAT_COUNTER_FRAMES_DROPPED, 1);
+    a_chat_metrics_add(queue->metrics, A_CHAT_COUNTER_BYTES_DROPPED, buffer->length);
+    a_chat_metrics_gauge_add(queue->metrics, A_CHAT_GAUGE_QUEUED_FRAMES, -1);
+    a_chat_metrics_gauge_add(queue->metrics, A_CHAT_GAUGE_QUEUED_BYTES, -(int64_t) buffer->length);
+    a_chat_buffer_release(buffer);
+
+    // the frames that are kept are moved up into the dropped frame's slot
+    for (size_t i = index; i > 0; i--) {
+        *a_chat_outbound_queue_at(queue, i) = *a_chat_outbound_queue_at(queue, i - 1);
+    }
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+
+    return true;
+}
+
+static bool a_chat_outbound_queue_coalesce(AChatOutboundQueue* queue) {
+    size_t start = a_chat_outbound_queue_first_unsent(queue);
+    if (queue->count - start < 2) { return false; }
+
+    size_t length = 0;
+    for (size_t i = start; i < queue->count; i++) {
+        length += (*a_chat_outbound_queue_at(queue, i))->length;
+    }
+
+    AChatBuffer* merged = a_chat_buffer_create(length);
+    if (!merged) { return false; }
+
+    // frames are already encoded back to back, so they can be joined as they are
+    size_t offset = 0;
+    for (size_t i = start; i < queue->count; i++) {
+        AChatBuffer* buffer = *a_chat_outbound_queue_at(queue, i);
+        memcpy(merged->data + offset, buffer->data, buffer->length);
+        offset += buffer->length;
+        a_chat_buffer_release(buffer);
+    }
+
+    queue->coalesced_frames += queue->count - start - 1;
+    a_chat_metrics_add(queue->metrics, A_CHAT_COUNTER_FRAMES_COALESCED, queue->count - start - 1);
+    a_chat_metrics_gauge_add(queue->metrics, A_CHAT_GAUGE_QUEUED_FRAMES, -(int64_t) (queue->count - start - 1));
+    *a_chat_outbound_queue_at(queue, start) = merged;
+    queue->count = start + 1;
+
+    return true;
+}
+
+void a_chat_outbound_queue_init(AChatOutboundQueue* queue, size_t maximum_frames, size_t maximum_bytes, AChatOverflowPolicy policy, AChatMetrics* metrics) {
+    queue->buffers = NULL;
+    queue->capacity = 0;
+    queue->head = 0;
+    queue->count = 0;
+    queue->head_offset = 0;
+    queue->in_flight_frames = 0;
+
+    queue->maximum_frames = maximum_frames < A_CHAT_OUTBOUND_QUEUE_MINIMUM_FRAMES ? A_CHAT_OUTBOUND_QUEUE_MINIMUM_FRAMES : maximum_frames;
+    queue->maximum_bytes = maximum_bytes;
+    queue->policy = policy;
+
+    queue->queued_bytes = 0;
+    queue->dropped_frames = 0;
+    queue->dropped_bytes = 0;
+    queue->coalesced_frames = 0;
+
+    queue->metrics = metrics;
+}
+
+void a_chat_outbound_queue_clear(AChatOutboundQueue* queue) {
+    a_chat_metrics_gauge_add(queue->metrics, A_CHAT_GAUGE_QUEUED_FRAMES, -(int64_t) queue->count);
+    a_chat_metrics_gauge_add(queue->metrics, A_CHAT_GAUGE_QUEUED_BYTES, -(int64_t) queue->queued_bytes);
+
+    for (size_t i = 0; i < queue->count; i++) {
+        a_chat_buffer_release(*a_chat_outbound_queue_at(queue, i));
+    }
+
+    queue->head = 0;
+    queue->count = 0;
+    queue->head_offset = 0;
+    queue->in_flight_frames = 0;
+    queue->queued_bytes = 0;
+}
+
+void a_chat_outbound_queue_destroy(AChatOutboundQueue* queue) {
+    a_chat_outbound_queue_clear(queue);
+
+    free(queue->buffers);
+    queue->buffers = NULL;
+    queue->capacity = 0;
+}
+
+AChatOutboundQueueResult a_chat_outbound_queue_push(AChatOutboundQueue* queue, AChatBuffer* buffer) {
+    bool over_bytes = queue->queued_bytes + buffer->length > queue->maximum_bytes;
+    bool over_frames = queue->count == queue->capacity && !a_chat_outbound_queue_grow(queue);
+
+    if (over_bytes || over_frames) {
+        if (queue->policy == A_CHAT_OVERFLOW_DISCONNECT) {
+            return A_CHAT_OUTBOUND_OVERFLOW;
+        }
+
+        if (over_frames && queue->policy == A_CHAT_OVERFLOW_COALESCE) {
+            a_chat_outbound_queue_coalesce(queue);
+        }
+
+        // make room by dropping the oldest frames, if that isn't enough the new frame is dropped instead
+        while (queue->queued_bytes + buffer->length > queue->maximum_bytes || queue->count == queue->capacity) {
+            if (buffer->length > queue->maximum_bytes || !a_chat_outbound_queue_drop_oldest(queue)) {
+                queue->dropped_frames++;
+                queue->dropped_bytes += buffer->length;
+                a_chat_metrics_add(queue->metrics, A_CHAT_COUNTER_FRAMES_DROPPED, 1);
+                a_chat_metrics_add(queue->metrics, A_CHAT_COUNTER_BYTES_DROPPED, buffer->length);
+                return A_CHAT_OUTBOUND_DROPPED;
+            }
+        }
+    }
+
+    *a_chat_outbound_queue_at(queue, queue->count) = a_chat_buffer_acquire(buffer);
+    queue->count++;
+    queue->queued_bytes += buffer->length;
+    a_chat_metrics_add(queue->metrics, A_CHAT_COUNTER_FRAMES_QUEUED, 1);
+    a_chat_metrics_gauge_add(queue->metrics, A_CHAT_GAUGE_QUEUED_FRAMES, 1);
+    a_chat_metrics_gauge_add(queue->metrics, A_CHAT_GAUGE_QUEUED_BYTES, (int64_t) buffer->length);
+
+    return A_CHAT_OUTBOUND_QUEUED;
+}
+
+// fills iov with as many queued frames as fit, starting part way into the head if it was partly sent
+static size_t a_chat_outbound_queue_gather(AChatOutboundQueue* queue, struct iovec* iov, size_t maximum) {
+    size_t number_of_iov = 0;
+    for (; number_of_iov < queue->count && number_of_iov < maximum; number_of_iov++) {
+        AChatBuffer* buffer = *a_chat_outbound_queue_at(queue, number_of_iov);
+        size_t offset = number_of_iov == 0 ? queue->head_offset : 0;
+
+        iov[number_of_iov].iov_base = buffer->data + offset;
+        iov[number_of_iov].iov_len = buffer->length - offset;
+    }
+
+    return number_of_iov;
+}
+
+// releases every frame that was completely sent, and remembers how far into the next one we got
+static void a_chat_outbound_queue_consume(AChatOutboundQueue* queue, size_t bytes_sent) {
+    queue->queued_bytes -= bytes_sent;
+
+    size_t remaining = bytes_sent;
+    size_t frames_sent = 0;
+    while (queue->count > 0) {
+        AChatBuffer* buffer = queue->buffers[queue->head];
+        size_t left = buffer->length - queue->head_offset;
+        if (remaining < left) {
+            queue->head_offset += remaining;
+            break;
+        }
+
+        remaining -= left;
+        a_chat_buffer_release(buffer);
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        queue->head_offset = 0;
+        frames_sent++;
+    }
+
+    a_chat_metrics_add(queue->metrics, A_CHAT_COUNTER_FRAMES_SENT, frames_sent);
+    a_chat_metrics_add(queue->metrics, A_CHAT_COUNTER_BYTES_SENT, (uint64_t) bytes_sent);
+    a_chat_metrics_gauge_add(queue->metrics, A_CHAT_GAUGE_QUEUED_FRAMES, -(int64_t) frames_sent);
+    a_chat_metrics_gauge_add(queue->metrics, A_CHAT_GAUGE_QUEUED_BYTES, -(int64_t) bytes_sent);
+}
+
+AChatFlushResult a_chat_outbound_queue_flush(AChatOutboundQueue* queue, int socket) {
+    while (queue->count > 0) {
+        // gather as many queued frames as possible into one sendmsg()
+        struct iovec iov[A_CHAT_OUTBOUND_QUEUE_MAXIMUM_IOV];
+        size_t number_of_iov = a_chat_outbound_queue_gather(queue, iov, A_CHAT_OUTBOUND_QUEUE_MAXIMUM_IOV);
+
+        // never block, a slow client must not hold up whoever is flushing it
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = number_of_iov };
+        ssize_t bytes_sent = sendmsg(socket, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytes_sent == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return A_CHAT_FLUSH_BLOCKED; }
+            return A_CHAT_FLUSH_FAILED;
+        }
+
+        a_chat_outbound_queue_consume(queue, (size_t) bytes_sent);
+    }
+
+    return A_CHAT_FLUSH_COMPLETE;
+}
+
+size_t a_chat_outbound_queue_begin_send(AChatOutboundQueue* queue, struct iovec* iov, size_t maximum) {
+    queue->in_flight_frames = a_chat_outbound_queue_gather(queue, iov, maximum);
+    return queue->in_flight_frames;
+}
+
+void a_chat_outbound_queue_end_send(AChatOutboundQueue* queue, size_t bytes_sent) {
+    queue->in_flight_frames = 0;
+    a_chat_outbound_queue_consume(queue, bytes_sent);
+}
@@ -0,0 +1,93 @@
+#include "server/rate_limit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "server/hash_table.h"
+
+AChatRate a_chat_rate(int per_second, int burst_ms) {
+    if (per_second <= 0) {
+        return (AChatRate) { 0, 0 };
+    }
+
+    return (AChatRate) {
+        .interval_ns = 1000000000ull / (uint64_t) per_second,
+        .burst_ns = (uint64_t) burst_ms * 1000000ull,
+    };
+}
+
+void a_chat_token_bucket_init(AChatTokenBucket* bucket) {
+    atomic_init(&bucket->full_at_ns, 0);
+}
+
+bool a_chat_token_bucket_take(AChatTokenBucket* bucket, const AChatRate* rate, uint64_t tokens, uint64_t now_ns) {
+    if (rate->interval_ns == 0) { return true; }
+
+    uint64_t full_at = atomic_load_explicit(&bucket->full_at_ns, memory_order_relaxed);
+    uint64_t new_full_at;
+    do {
+        // a bucket that has been full for a while is no fuller than one that just filled up
+        uint64_t start = full_at > now_ns ? full_at : now_ns;
+        new_full_at = start + tokens * rate->interval_ns;
+        if (start > now_ns && new_full_at - now_ns > rate->burst_ns) { return false; }
+    } while (!atomic_compare_exchange_weak_explicit(&bucket->full_at_ns, &full_at, new_full_at, memory_order_relaxed, memory_order_relaxed));
+
+    return true;
+}
+
+void a_chat_token_bucket_give_back(AChatTokenBucket* bucket, const AChatRate* rate, uint64_t tokens) {
+    if (rate->interval_ns == 0) { return; }
+
+    // taking them moved the bucket at least this far ahead, so this can't wrap, and anything before now is just full
+    atomic_fetch_sub_explicit(&bucket->full_at_ns, tokens * rate->interval_ns, memory_order_relaxed);
+}
+
+bool a_chat_rate_limiter_init(AChatRateLimiter* limiter, AChatRate client_messages, AChatRate client_bytes, AChatRate address_messages, AChatRate address_bytes) {
+    limiter->client_messages = client_messages;
+    limiter->client_bytes = client_bytes;
+    limiter->address_messages = address_messages;
+    limiter->address_bytes = address_bytes;
+    limiter->addresses = NULL;
+
+    if (address_messages.interval_ns == 0 && address_bytes.interval_ns == 0) { return true; }
+
+    limiter->addresses = malloc(sizeof(AChatAddressBuckets) * A_CHAT_RATE_LIMIT_ADDRESS_SLOTS);
+    if (!limiter->addresses) {
+        a_chat_log_error("Failed to allocate memory for address rate limits");
+        return false;
+    }
+    for (size_t i = 0; i < A_CHAT_RATE_LIMIT_ADDRESS_SLOTS; i++) {
+        a_chat_token_bucket_init(&limiter->addresses[i].messages);
+        a_chat_token_bucket_init(&limiter->addresses[i].bytes);
+    }
+
+    return true;
+}
+
+void a_chat_rate_limiter_destroy(AChatRateLimiter* limiter) {
+    free(limiter->addresses);
+    limiter->addresses = NULL;
+}
+
+uint32_t a_chat_rate_limiter_address_slot(int socket) {
+    struct sockaddr_storage address;
+    socklen_t address_size = sizeof(address);
+    if (getpeername(socket, (struct sockaddr*) &address, &address_size) == -1) { return 0; }
+
+    // an ipv6 user usually has a whole /64 to pick addresses from, so that is what is limited, ipv4 in ipv6 is still ipv4
+    const uint8_t* bytes = NULL;
+    size_t length = 0;
+    if (address.ss_family == AF_INET) {
+        bytes = (const uint8_t*) &((const struct sockaddr_in*) &address)->sin_addr;
+        length = 4;
+    } else if (address.ss_family == AF_INET6) {
+        const struct in6_addr* address6 = &((const struct sockaddr_in6*) &address)->sin6_addr;
+        bytes = IN6_IS_ADDR_V4MAPPED(address6) ? address6->s6_addr + 12 : address6->s6_addr;
+        length = IN6_IS_ADDR_V4MAPPED(address6) ? 4 : 8;
+    }
+
+    return a_chat_hash(bytes, length) & (A_CHAT_RATE_LIMIT_ADDRESS_SLOTS - 1);
+}
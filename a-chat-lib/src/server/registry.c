@@ -0,0 +1,112 @@
+#include "server/registry.h"
+
+#include <stdlib.h>
+
+#include "log.h"
+
+#define A_CHAT_REGISTRY_INITIAL_CAPACITY 16
+
+static bool a_chat_registry_grow(AChatRegistry* registry) {
+    uint32_t new_capacity = registry->capacity ? registry->capacity * 2 : A_CHAT_REGISTRY_INITIAL_CAPACITY;
+
+    AChatRegistrySlot* new_slots = realloc(registry->slots, sizeof(AChatRegistrySlot) * new_capacity);
+    if (!new_slots) {
+        a_chat_log_error("Failed to allocate memory for registry slots");
+        return false;
+    }
+    registry->slots = new_slots;
+
+    struct AChatClientHandler** new_client_handlers = realloc(registry->client_handlers, sizeof(struct AChatClientHandler*) * new_capacity);
+    if (!new_client_handlers) {
+        a_chat_log_error("Failed to allocate memory for registry client handlers");
+        return false;
+    }
+    registry->client_handlers = new_client_handlers;
+
+    uint32_t* new_dense_slots = realloc(registry->dense_slots, sizeof(uint32_t) * new_capacity);
+    if (!new_dense_slots) {
+        a_chat_log_error("Failed to allocate memory for registry slots");
+        return false;
+    }
+    registry->dense_slots = new_dense_slots;
+
+    registry->capacity = new_capacity;
+
+    return true;
+}
+
+void a_chat_registry_init(AChatRegistry* registry) {
+    registry->slots = NULL;
+    registry->number_of_slots = 0;
+    registry->free_list = A_CHAT_REGISTRY_NONE;
+    registry->client_handlers = NULL;
+    registry->dense_slots = NULL;
+    registry->count = 0;
+    registry->capacity = 0;
+}
+
+void a_chat_registry_destroy(AChatRegistry* registry) {
+    free(registry->slots);
+    free(registry->client_handlers);
+    free(registry->dense_slots);
+    a_chat_registry_init(registry);
+}
+
+bool a_chat_registry_insert(AChatRegistry* registry, struct AChatClientHandler* client_handler, AChatRegistryHandle* handle) {
+    // reuse a free slot if there is one, otherwise take a new one from the end
+    uint32_t slot_index = registry->free_list;
+    if (slot_index != A_CHAT_REGISTRY_NONE) {
+        registry->free_list = registry->slots[slot_index].next_free;
+    } else {
+        if (registry->number_of_slots == registry->capacity && !a_chat_registry_grow(registry)) {
+            return false;
+        }
+
+        slot_index = registry->number_of_slots++;
+        registry->slots[slot_index].generation = 0;
+    }
+
+    AChatRegistrySlot* slot = &registry->slots[slot_index];
+    slot->client_handler = client_handler;
+    slot->dense_index = registry->count;
+    slot->next_free = A_CHAT_REGISTRY_NONE;
+
+    registry->client_handlers[registry->count] = client_handler;
+    registry->dense_slots[registry->count] = slot_index;
+    registry->count++;
+
+    handle->slot = slot_index;
+    handle->generation = slot->generation;
+
+    return true;
+}
+
+bool a_chat_registry_remove(AChatRegistry* registry, AChatRegistryHandle handle) {
+    if (!a_chat_registry_get(registry, handle)) { return false; }
+
+    AChatRegistrySlot* slot = &registry->slots[handle.slot];
+
+    // the order of the dense array doesn't matter, so move the last client handler into the hole
+    uint32_t last = registry->count - 1;
+    registry->client_handlers[slot->dense_index] = registry->client_handlers[last];
+    registry->dense_slots[slot->dense_index] = registry->dense_slots[last];
+    registry->slots[registry->dense_slots[slot->dense_index]].dense_index = slot->dense_index;
+    registry->count--;
+
+    // bumping the generation makes every handle to this slot stale
+    slot->generation++;
+    slot->client_handler = NULL;
+    slot->next_free = registry->free_list;
+    registry->free_list = handle.slot;
+
+    return true;
+}
+
+struct AChatClientHandler* a_chat_registry_get(const AChatRegistry* registry, AChatRegistryHandle handle) {
+    if (handle.slot >= registry->number_of_slots) { return NULL; }
+
+    const AChatRegistrySlot* slot = &registry->slots[handle.slot];
+    if (slot->generation != handle.generation) { return NULL; }
+
+    return slot->client_handler;
+}
@@ -0,0 +1,180 @@
+#include "server/room.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "server/server.h"
+
+#define A_CHAT_ROOM_TABLE_INITIAL_BUCKETS 64
+
+static AChatRoom* a_chat_room_table_create_room(AChatRoomTable* table, const char* name, size_t length) {
+    AChatRoom* room = malloc(sizeof(AChatRoom));
+    if (!room) {
+        a_chat_log_error("Failed to allocate memory for room");
+        return NULL;
+    }
+
+    memcpy(room->name, name, length);
+    room->name[length] = '\0';
+    room->name_length = length;
+    a_chat_registry_init(&room->members);
+    a_chat_hash_table_insert(&table->rooms, &room->entry, a_chat_hash(name, length));
+
+    return room;
+}
+
+static void a_chat_room_table_remove_room(AChatRoomTable* table, AChatRoom* room) {
+    a_chat_hash_table_remove(&table->rooms, &room->entry);
+    a_chat_registry_destroy(&room->members);
+    free(room);
+}
+
+bool a_chat_room_name_validate(const uint8_t* name, size_t length) {
+    if (length == 0 || length > A_CHAT_ROOM_NAME_MAXIMUM_LENGTH) { return false; }
+
+    // room names are printed in notices, so they can't contain spaces or control characters
+    for (size_t i = 0; i < length; i++) {
+        if (name[i] <= ' ' || name[i] == 0x7f) { return false; }
+    }
+
+    return true;
+}
+
+bool a_chat_room_message_parse(const AChatFrame* frame, const char** room, size_t* room_length, const uint8_t** message, uint32_t* message_length) {
+    // the payload is the room's name length (2 bytes, big-endian), the room's name, then the message
+    if (frame->length < 2) { return false; }
+
+    size_t length = ((size_t) frame->payload[0] << 8) | frame->payload[1];
+    if (frame->length < 2 + length || !a_chat_room_name_validate(frame->payload + 2, length)) { return false; }
+
+    *room = (const char*) frame->payload + 2;
+    *room_length = length;
+    *message = frame->payload + 2 + length;
+    *message_length = frame->length - 2 - length;
+
+    return true;
+}
+
+bool a_chat_room_join_parse(const AChatFrame* frame, const char** room, size_t* room_length, bool* catch_up, uint64_t* sequence) {
+    const uint8_t* payload = frame->payload;
+    size_t length = frame->length;
+
+    *catch_up = (frame->flags & A_CHAT_FRAME_FLAG_SEQUENCE) != 0;
+    *sequence = 0;
+    if (*catch_up) {
+        if (length < 8) { return false; }
+        for (int i = 0; i < 8; i++) {
+            *sequence = (*sequence << 8) | payload[i];
+        }
+        payload += 8;
+        length -= 8;
+    }
+
+    if (!a_chat_room_name_validate(payload, length)) { return false; }
+
+    *room = (const char*) payload;
+    *room_length = length;
+
+    return true;
+}
+
+bool a_chat_room_table_init(AChatRoomTable* table) {
+    if (!a_chat_hash_table_init(&table->rooms, A_CHAT_ROOM_TABLE_INITIAL_BUCKETS)) {
+        a_chat_log_error("Failed to allocate memory for room table");
+        return false;
+    }
+
+    return true;
+}
+
+void a_chat_room_table_destroy(AChatRoomTable* table) {
+    for (uint32_t i = 0; i < table->rooms.number_of_buckets; i++) {
+        AChatHashEntry* entry = table->rooms.buckets[i];
+        while (entry) {
+            AChatRoom* room = (AChatRoom*) entry;
+            entry = entry->next;
+            a_chat_registry_destroy(&room->members);
+            free(room);
+        }
+    }
+
+    a_chat_hash_table_destroy(&table->rooms);
+}
+
+AChatRoom* a_chat_room_table_find(const AChatRoomTable* table, const char* name, size_t length) {
+    if (!table->rooms.buckets) { return NULL; }
+
+    uint32_t hash = a_chat_hash(name, length);
+    for (AChatHashEntry* entry = a_chat_hash_table_bucket(&table->rooms, hash); entry; entry = entry->next) {
+        AChatRoom* room = (AChatRoom*) entry;
+        if (entry->hash == hash && room->name_length == length && memcmp(room->name, name, length) == 0) {
+            return room;
+        }
+    }
+
+    return NULL;
+}
+
+static bool a_chat_room_has_member(const AChatRoom* room, const AChatClientHandler* client_handler) {
+    for (int i = 0; i < client_handler->number_of_rooms; i++) {
+        if (client_handler->rooms[i].room == room) { return true; }
+    }
+
+    return false;
+}
+
+bool a_chat_room_is_member(const AChatClientHandler* client_handler, const char* name, size_t length) {
+    // a room can't be freed while the client handler is one of its members, so its name is safe to read
+    for (int i = 0; i < client_handler->number_of_rooms; i++) {
+        const AChatRoom* room = client_handler->rooms[i].room;
+        if (room->name_length == length && memcmp(room->name, name, length) == 0) { return true; }
+    }
+
+    return false;
+}
+
+bool a_chat_room_join(AChatRoomTable* table, AChatClientHandler* client_handler, const char* name, size_t length) {
+    AChatRoom* room = a_chat_room_table_find(table, name, length);
+    if (room && a_chat_room_has_member(room, client_handler)) { return false; }
+
+    if (client_handler->number_of_rooms == A_CHAT_ROOM_MAXIMUM_PER_CLIENT) {
+        a_chat_log_error("Client is already in the maximum number of rooms");
+        return false;
+    }
+
+    if (!room && !(room = a_chat_room_table_create_room(table, name, length))) { return false; }
+
+    AChatRoomMembership* membership = &client_handler->rooms[client_handler->number_of_rooms];
+    if (!a_chat_registry_insert(&room->members, client_handler, &membership->handle)) {
+        if (room->members.count == 0) {
+            a_chat_room_table_remove_room(table, room);
+        }
+        return false;
+    }
+    membership->room = room;
+    client_handler->number_of_rooms++;
+
+    return true;
+}
+
+bool a_chat_room_leave(AChatRoomTable* table, AChatClientHandler* client_handler, const char* name, size_t length) {
+    AChatRoom* room = a_chat_room_table_find(table, name, length);
+    if (!room) { return false; }
+
+    for (int i = 0; i < client_handler->number_of_rooms; i++) {
+        if (client_handler->rooms[i].room != room) { continue; }
+
+        a_chat_registry_remove(&room->members, client_handler->rooms[i].handle);
+        client_handler->rooms[i] = client_handler->rooms[--client_handler->number_of_rooms];
+
+        // nobody is left to talk in the room, so it goes away until someone joins it again
+        if (room->members.count == 0) {
+            a_chat_room_table_remove_room(table, room);
+        }
+
+        return true;
+    }
+
+    return false;
+}
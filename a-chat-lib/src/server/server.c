@@ -9,17 +9,54 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 
 #include "log.h"
+#include "protocol/frame.h"
+#include "server/event_loop.h"
+#include "server/handshake.h"
+#include "server/message_store.h"
+#include "server/session.h"
+#include "server/stats_endpoint.h"
+
+AChatServerConfig a_chat_server_default_config(void) {
+    // one event loop per online cpu
+    long number_of_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (AChatServerConfig) {
+        .engine = A_CHAT_SERVER_ENGINE_EPOLL,
+        .number_of_threads = number_of_cpus > 0 ? (int) number_of_cpus : 1,
+        .io_uring = false,
+        .maximum_clients = 10000,
+        .listen_backlog = SOMAXCONN,
+        .handshake_timeout_ms = 5000,
+        .ping_interval_ms = 30000,
+        .idle_timeout_ms = 90000,
+        .client_messages_per_second = 50,
+        .client_bytes_per_second = 256 * 1024,
+        .address_messages_per_second = 500,
+        .address_bytes_per_second = 2 * 1024 * 1024,
+        .rate_limit_burst_ms = 2000,
+        .drain_timeout_ms = 5000,
+        .outbound_queue_maximum_frames = 1024,
+        .outbound_queue_maximum_bytes = 4 * 1024 * 1024,
+        .overflow_policy = A_CHAT_OVERFLOW_DISCONNECT,
+        .history_maximum_frames = 256,
+        .history_maximum_bytes = 1024 * 1024,
+        .message_store_path = NULL,
+        .message_store_segment_bytes = 16 * 1024 * 1024,
+        .message_store_segments_per_room = 8,
+        .message_store_commit_interval_ms = 5,
+        .session_timeout_ms = 30000,
+        .compression = true,
+        .stats_port = NULL,
+    };
+}
 
-AChatServer* a_chat_server_create(const char* port) {
-    // create the server on the heap to avoid thread race conditions
-    AChatServer* server = malloc(sizeof(AChatServer));
-    if (!server) {
-        a_chat_log_error("Failed to allocate memory for server");
-        return NULL;
-    }
-
+int a_chat_server_listen(const char* address, const char* port, bool reuse_port, int backlog) {
     // get all the ip address related infomation for us
     struct addrinfo hints = {0};
     hints.ai_family = AF_UNSPEC; // allows for either IPv4 or IPv6, it doesnt matter to us
@@ -28,41 +65,205 @@ AChatServer* a_chat_server_create(const char* port) {
 
     struct addrinfo* address_info;
     int status; // used for error checking
-    if ((status = getaddrinfo(NULL, port, &hints, &address_info)) != 0) {
+    if ((status = getaddrinfo(address, port, &hints, &address_info)) != 0) {
         a_chat_log_error_gai_strerror("Failed to get address infomation", status);
-
-        free(server);
-        return NULL;
+        return -1;
     }
 
     // create the listening socket with the correct ip infomation
-    server->listening_socket = socket(address_info->ai_family, address_info->ai_socktype, address_info->ai_protocol);
-    if (server->listening_socket == -1) {
+    int listening_socket = socket(address_info->ai_family, address_info->ai_socktype, address_info->ai_protocol);
+    if (listening_socket == -1) {
         a_chat_log_error_errno("Failed to create listening socket");
 
-        free(server);
-        return NULL;
+        freeaddrinfo(address_info);
+        return -1;
+    }
+
+    // a drained server closes its clients' connections itself, which leaves them in TIME_WAIT, so a restart has to be
+    // able to bind the port again straight away
+    int enabled = 1;
+    if (setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) == -1) {
+        a_chat_log_error_errno("Failed to enable SO_REUSEADDR on listening socket");
+
+        close(listening_socket);
+        freeaddrinfo(address_info);
+        return -1;
+    }
+
+    // every socket bound to the port needs SO_REUSEPORT, the kernel then spreads new connections between them
+    if (reuse_port && setsockopt(listening_socket, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) == -1) {
+        a_chat_log_error_errno("Failed to enable SO_REUSEPORT on listening socket");
+
+        close(listening_socket);
+        freeaddrinfo(address_info);
+        return -1;
     }
 
     // bind the socket to the port
-    int bind_result = bind(server->listening_socket, address_info->ai_addr, address_info->ai_addrlen);
+    int bind_result = bind(listening_socket, address_info->ai_addr, address_info->ai_addrlen);
     if (bind_result == -1) {
         a_chat_log_error_errno("Failed to bind port");
 
-        close(server->listening_socket);
-        free(server);
-        return NULL;
+        close(listening_socket);
+        freeaddrinfo(address_info);
+        return -1;
     }
 
     // free the address infomation as it is no longer needed
     freeaddrinfo(address_info);
 
-    // begin listening
-    int listen_result = listen(server->listening_socket, 10);
+    // begin listening, a big backlog lets a storm of connections queue up in the kernel instead of being refused
+    int listen_result = listen(listening_socket, backlog);
     if (listen_result == -1) {
         a_chat_log_error_errno("Failed to begin listening");
 
-        close(server->listening_socket);
+        close(listening_socket);
+        return -1;
+    }
+
+    return listening_socket;
+}
+
+AChatServer* a_chat_server_create(const char* port) {
+    return a_chat_server_create_with_config(port, NULL);
+}
+
+AChatServer* a_chat_server_create_with_config(const char* port, const AChatServerConfig* config) {
+    // create the server on the heap to avoid thread race conditions
+    AChatServer* server = malloc(sizeof(AChatServer));
+    if (!server) {
+        a_chat_log_error("Failed to allocate memory for server");
+        return NULL;
+    }
+
+    server->config = config ? *config : a_chat_server_default_config();
+    if (server->config.number_of_threads < 1) {
+        server->config.number_of_threads = a_chat_server_default_config().number_of_threads;
+    }
+    if (server->config.maximum_clients < 1) {
+        server->config.maximum_clients = a_chat_server_default_config().maximum_clients;
+    }
+    if (server->config.listen_backlog < 1) {
+        server->config.listen_backlog = a_chat_server_default_config().listen_backlog;
+    }
+    if (server->config.handshake_timeout_ms < 1) {
+        server->config.handshake_timeout_ms = a_chat_server_default_config().handshake_timeout_ms;
+    }
+    if (server->config.ping_interval_ms < 0) {
+        server->config.ping_interval_ms = a_chat_server_default_config().ping_interval_ms;
+    }
+    if (server->config.idle_timeout_ms < 0) {
+        server->config.idle_timeout_ms = a_chat_server_default_config().idle_timeout_ms;
+    }
+    if (server->config.client_messages_per_second < 0) {
+        server->config.client_messages_per_second = a_chat_server_default_config().client_messages_per_second;
+    }
+    if (server->config.client_bytes_per_second < 0) {
+        server->config.client_bytes_per_second = a_chat_server_default_config().client_bytes_per_second;
+    }
+    if (server->config.address_messages_per_second < 0) {
+        server->config.address_messages_per_second = a_chat_server_default_config().address_messages_per_second;
+    }
+    if (server->config.address_bytes_per_second < 0) {
+        server->config.address_bytes_per_second = a_chat_server_default_config().address_bytes_per_second;
+    }
+    if (server->config.rate_limit_burst_ms < 1) {
+        server->config.rate_limit_burst_ms = a_chat_server_default_config().rate_limit_burst_ms;
+    }
+    if (server->config.drain_timeout_ms < 0) {
+        server->config.drain_timeout_ms = a_chat_server_default_config().drain_timeout_ms;
+    }
+    if (server->config.outbound_queue_maximum_frames < 1) {
+        server->config.outbound_queue_maximum_frames = a_chat_server_default_config().outbound_queue_maximum_frames;
+    }
+    if (server->config.outbound_queue_maximum_bytes < 1) {
+        server->config.outbound_queue_maximum_bytes = a_chat_server_default_config().outbound_queue_maximum_bytes;
+    }
+    if (server->config.history_maximum_frames < 0) {
+        server->config.history_maximum_frames = a_chat_server_default_config().history_maximum_frames;
+    }
+    if (server->config.history_maximum_bytes < 1) {
+        server->config.history_maximum_bytes = a_chat_server_default_config().history_maximum_bytes;
+    }
+    // a segment has to fit the biggest frame there is
+    if (server->config.message_store_segment_bytes < A_CHAT_MESSAGE_STORE_HEADER_SIZE + A_CHAT_FRAME_HEADER_SIZE + A_CHAT_FRAME_MAXIMUM_LENGTH) {
+        server->config.message_store_segment_bytes = a_chat_server_default_config().message_store_segment_bytes;
+    }
+    if (server->config.message_store_segments_per_room < 1) {
+        server->config.message_store_segments_per_room = a_chat_server_default_config().message_store_segments_per_room;
+    }
+    if (server->config.message_store_commit_interval_ms < 1) {
+        server->config.message_store_commit_interval_ms = a_chat_server_default_config().message_store_commit_interval_ms;
+    }
+    if (server->config.session_timeout_ms < 0) {
+        server->config.session_timeout_ms = a_chat_server_default_config().session_timeout_ms;
+    }
+    server->number_of_clients = 0;
+    server->event_loops = NULL;
+    server->handshake_stage = NULL;
+    server->stats_endpoint = NULL;
+    server->message_store = NULL;
+    server->sessions = NULL;
+    a_chat_registry_init(&server->registry);
+    if (!a_chat_metrics_init(&server->metrics)) {
+        free(server);
+        return NULL;
+    }
+    if (!a_chat_room_table_init(&server->rooms)) {
+        a_chat_metrics_destroy(&server->metrics);
+        free(server);
+        return NULL;
+    }
+    if (!a_chat_history_table_init(&server->history, server->config.history_maximum_frames, server->config.history_maximum_bytes)) {
+        a_chat_room_table_destroy(&server->rooms);
+        a_chat_metrics_destroy(&server->metrics);
+        free(server);
+        return NULL;
+    }
+    if (!a_chat_directory_init(&server->directory)) {
+        a_chat_history_table_destroy(&server->history);
+        a_chat_room_table_destroy(&server->rooms);
+        a_chat_metrics_destroy(&server->metrics);
+        free(server);
+        return NULL;
+    }
+    AChatRate client_messages = a_chat_rate(server->config.client_messages_per_second, server->config.rate_limit_burst_ms);
+    AChatRate client_bytes = a_chat_rate(server->config.client_bytes_per_second, server->config.rate_limit_burst_ms);
+    AChatRate address_messages = a_chat_rate(server->config.address_messages_per_second, server->config.rate_limit_burst_ms);
+    AChatRate address_bytes = a_chat_rate(server->config.address_bytes_per_second, server->config.rate_limit_burst_ms);
+    if (!a_chat_rate_limiter_init(&server->rate_limiter, client_messages, client_bytes, address_messages, address_bytes)) {
+        a_chat_directory_destroy(&server->directory);
+        a_chat_history_table_destroy(&server->history);
+        a_chat_room_table_destroy(&server->rooms);
+        a_chat_metrics_destroy(&server->metrics);
+        free(server);
+        return NULL;
+    }
+    // without a history there are no sequences to store the messages under
+    if (server->config.message_store_path && server->config.history_maximum_frames > 0 &&
+        !(server->message_store = a_chat_message_store_open(server->config.message_store_path, (size_t) server->config.message_store_segment_bytes, server->config.message_store_segments_per_room, server->config.message_store_commit_interval_ms, &server->history, &server->metrics))) {
+        // a_chat_message_store_open logs the correct error already
+
+        a_chat_history_table_destroy(&server->history);
+        a_chat_directory_destroy(&server->directory);
+        a_chat_rate_limiter_destroy(&server->rate_limiter);
+        a_chat_room_table_destroy(&server->rooms);
+        a_chat_metrics_destroy(&server->metrics);
+        free(server);
+        return NULL;
+    }
+
+    // the epoll engine gives every event loop its own listening socket, the first one is the server's
+    server->listening_socket = a_chat_server_listen(NULL, port, server->config.engine == A_CHAT_SERVER_ENGINE_EPOLL, server->config.listen_backlog);
+    if (server->listening_socket == -1) {
+        // a_chat_server_listen logs the correct error already
+
+        a_chat_room_table_destroy(&server->rooms);
+        a_chat_message_store_close(server->message_store);
+        a_chat_history_table_destroy(&server->history);
+        a_chat_directory_destroy(&server->directory);
+        a_chat_rate_limiter_destroy(&server->rate_limiter);
+        a_chat_metrics_destroy(&server->metrics);
         free(server);
         return NULL;
     }
@@ -72,6 +273,66 @@ AChatServer* a_chat_server_create(const char* port) {
         a_chat_log_error("Failed to create thread mutex");
 
         close(server->listening_socket);
+        a_chat_room_table_destroy(&server->rooms);
+        a_chat_message_store_close(server->message_store);
+        a_chat_history_table_destroy(&server->history);
+        a_chat_directory_destroy(&server->directory);
+        a_chat_rate_limiter_destroy(&server->rate_limiter);
+        a_chat_metrics_destroy(&server->metrics);
+        free(server);
+        return NULL;
+    }
+    pthread_cond_init(&server->drained, NULL);
+    atomic_init(&server->draining, false);
+    server->drain_deadline_ms = 0;
+
+    server->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->stop_fd == -1) {
+        a_chat_log_error_errno("Failed to create server's eventfd");
+
+        pthread_cond_destroy(&server->drained);
+        pthread_mutex_destroy(&server->lock);
+        close(server->listening_socket);
+        a_chat_room_table_destroy(&server->rooms);
+        a_chat_message_store_close(server->message_store);
+        a_chat_history_table_destroy(&server->history);
+        a_chat_directory_destroy(&server->directory);
+        a_chat_rate_limiter_destroy(&server->rate_limiter);
+        a_chat_metrics_destroy(&server->metrics);
+        free(server);
+        return NULL;
+    }
+
+    if (server->config.engine == A_CHAT_SERVER_ENGINE_EPOLL && !a_chat_event_loops_create(server, port)) {
+        // a_chat_event_loops_create logs the correct error already
+
+        close(server->stop_fd);
+        pthread_cond_destroy(&server->drained);
+        pthread_mutex_destroy(&server->lock);
+        close(server->listening_socket);
+        a_chat_room_table_destroy(&server->rooms);
+        a_chat_message_store_close(server->message_store);
+        a_chat_history_table_destroy(&server->history);
+        a_chat_directory_destroy(&server->directory);
+        a_chat_rate_limiter_destroy(&server->rate_limiter);
+        a_chat_metrics_destroy(&server->metrics);
+        free(server);
+        return NULL;
+    }
+
+    if (server->config.engine == A_CHAT_SERVER_ENGINE_THREADED && !(server->handshake_stage = a_chat_handshake_stage_create(server))) {
+        // a_chat_handshake_stage_create logs the correct error already
+
+        close(server->stop_fd);
+        pthread_cond_destroy(&server->drained);
+        pthread_mutex_destroy(&server->lock);
+        close(server->listening_socket);
+        a_chat_room_table_destroy(&server->rooms);
+        a_chat_message_store_close(server->message_store);
+        a_chat_history_table_destroy(&server->history);
+        a_chat_directory_destroy(&server->directory);
+        a_chat_rate_limiter_destroy(&server->rate_limiter);
+        a_chat_metrics_destroy(&server->metrics);
         free(server);
         return NULL;
     }
@@ -83,39 +344,455 @@ AChatServer* a_chat_server_create(const char* port) {
     snprintf(message, sizeof(message), "Created server at port: %s", port);
     a_chat_log_info(message);
 
+    // nor without sessions, clients just do a whole handshake again when they reconnect
+    if (server->config.session_timeout_ms > 0) {
+        server->sessions = a_chat_session_table_create(server);
+    }
+
+    // the server works without its stats, so failing to serve them isn't fatal
+    if (server->config.stats_port) {
+        server->stats_endpoint = a_chat_stats_endpoint_create(server, server->config.stats_port);
+    }
+
     return server;
 }
 
+// closes and frees everything a threaded client handler owns, giving back the session and username it still has
+// once the client handler is in the server's registry, the server's mutex must be held while calling this
+static void a_chat_client_handler_release(AChatServer* server, AChatClientHandler* client_handler) {
+    // a client handler that never got going, a resumed session waits for its client again and a new one just ends
+    if (client_handler->session && client_handler->resuming) {
+        a_chat_session_table_detach(server->sessions, client_handler);
+    } else if (client_handler->session) {
+        a_chat_session_table_end(server->sessions, client_handler);
+    }
+    if (client_handler->user) {
+        a_chat_directory_release(&server->directory, client_handler->user);
+    }
+
+    close(client_handler->socket);
+    if (client_handler->wake_fd != -1) {
+        close(client_handler->wake_fd);
+    }
+    a_chat_outbound_queue_destroy(&client_handler->outbound);
+    a_chat_frame_decoder_destroy(&client_handler->decoder);
+    free(client_handler);
+}
+
+// sends as much of the client handler's outbound queue as its socket takes, its thread finishes the rest
+// the server's mutex must be held while calling this
+static void a_chat_client_handler_flush(AChatClientHandler* client_handler) {
+    AChatFlushResult flush_result = a_chat_outbound_queue_flush(&client_handler->outbound, client_handler->socket);
+    if (flush_result == A_CHAT_FLUSH_BLOCKED) {
+        // the client handler's thread finishes the flush once the socket is writable
+        uint64_t value = 1;
+        if (write(client_handler->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+            a_chat_log_error_errno("Failed to wake client handler");
+        }
+    } else if (flush_result == A_CHAT_FLUSH_FAILED) {
+        a_chat_log_warning_errno("Failed broadcast message to a client");
+        a_chat_outbound_queue_clear(&client_handler->outbound);
+    }
+}
+
+// queues the frame to the client handler, then sends as much as its socket takes without blocking
+// the server's mutex must be held while calling this
+static void a_chat_server_send_to_client(AChatServer* server, AChatClientHandler* client_handler, AChatBuffer* frame) {
+    if (client_handler->overflowed) { return; }
+
+    AChatOutboundQueueResult result = a_chat_outbound_queue_push(&client_handler->outbound, frame);
+    if (result == A_CHAT_OUTBOUND_OVERFLOW) {
+        char message[640];
+        snprintf(message, sizeof(message), "%s can't keep up, disconnecting them", client_handler->user->name);
+        a_chat_log_info(message);
+        a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_SLOW_CONSUMER_DISCONNECTS, 1);
+
+        // the client handler's thread sees the shutdown as a disconnect and destroys itself
+        client_handler->overflowed = true;
+        shutdown(client_handler->socket, SHUT_RDWR);
+        return;
+    } else if (result == A_CHAT_OUTBOUND_DROPPED) {
+        return;
+    }
+
+    a_chat_client_handler_flush(client_handler);
+}
+
+// queues the same frame to every client handler in members, the server's mutex must be held while calling this
+static void a_chat_server_send_to_members(AChatServer* server, AChatRegistry* members, AChatBuffer* frame) {
+    for (uint32_t i = 0; i < members->count; i++) {
+        a_chat_server_send_to_client(server, members->client_handlers[i], frame);
+    }
+}
+
+// sends the frame to one client wherever it is, event_loop is the index of the event loop that owns it with the epoll engine
+// nothing is sent if the client handler has gone since the handle was looked up
+static void a_chat_server_send_to(AChatServer* server, int event_loop, AChatRegistryHandle handle, AChatBuffer* frame) {
+    if (server->config.engine == A_CHAT_SERVER_ENGINE_EPOLL) {
+        a_chat_event_loops_send(server, event_loop, handle, frame);
+        return;
+    }
+
+    if (pthread_mutex_lock(&server->lock) != 0) {
+        a_chat_log_error("Failed to lock server's mutex while sending message");
+        return;
+    }
+
+    AChatClientHandler* client_handler = a_chat_registry_get(&server->registry, handle);
+    if (client_handler) {
+        a_chat_server_send_to_client(server, client_handler, frame);
+    }
+
+    if (pthread_mutex_unlock(&server->lock) != 0) {
+        a_chat_log_error("Failed to unlock server's mutex while sending message");
+    }
+}
+
 static void a_chat_client_handler_destroy(AChatClientHandlerThreadArguments* thread_arguments) {
-    // close the client handler's socket
-    if (close(thread_arguments->server->clientHandlers[thread_arguments->client_handler_index].socket) != 0) {
-        a_chat_log_error("Failed to close client handler socket while destroying client handler");
+    AChatServer* server = thread_arguments->server;
+    AChatClientHandler* client_handler = thread_arguments->client_handler;
+
+    // the client handler is freed under the mutex, so keep what the disconnect notices need
+    char message[640];
+    snprintf(message, sizeof(message), "%s has disconnected", client_handler->user->name);
+
+    // a client that can still resume its session hasn't left its rooms as far as anyone else knows
+    // only its own thread changes its rooms, so they can be read without the mutex, which comes after the history locks
+    bool detached = client_handler->session != NULL;
+    if (detached) {
+        a_chat_session_table_save_rooms(server->sessions, client_handler);
     }
+    char rooms[A_CHAT_ROOM_MAXIMUM_PER_CLIENT][A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1];
+    size_t room_lengths[A_CHAT_ROOM_MAXIMUM_PER_CLIENT];
+    int number_of_rooms = 0;
+    uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE];
+    bool has_public_key = client_handler->has_public_key;
+    memcpy(public_key, client_handler->public_key, sizeof(public_key));
 
     // lock the server for thread safety
-    if (pthread_mutex_lock(&thread_arguments->server->lock) != 0) {
+    if (pthread_mutex_lock(&server->lock) != 0) {
         a_chat_log_error("Failed to lock thread mutex while destroying client handler");
         return;
     }
 
-    // shift all the client handlers down starting at the client handler being destroyed
-    for (int i = thread_arguments->server->clientHandlers[thread_arguments->client_handler_index].index; i < thread_arguments->server->number_of_clients - 1; i++) {
-        thread_arguments->server->clientHandlers[i] = thread_arguments->server->clientHandlers[i + 1];
-        thread_arguments->server->clientHandlers[i].index = i;
+    while (client_handler->number_of_rooms > 0) {
+        AChatRoom* room = client_handler->rooms[client_handler->number_of_rooms - 1].room;
+        memcpy(rooms[number_of_rooms], room->name, room->name_length + 1);
+        room_lengths[number_of_rooms] = room->name_length;
+        a_chat_room_leave(&server->rooms, client_handler, rooms[number_of_rooms], room_lengths[number_of_rooms]);
+        number_of_rooms++;
+    }
+
+    // broadcasts use the client handler under the mutex, so it is removed and torn down under it too
+    // the session only takes the username over then, as it can expire and free it straight away
+    a_chat_registry_remove(&server->registry, client_handler->handle);
+    if (detached) {
+        a_chat_session_table_detach(server->sessions, client_handler);
+    }
+    a_chat_client_handler_release(server, client_handler);
+    server->number_of_clients--;
+    a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_DISCONNECTS, 1);
+    if (server->number_of_clients == 0) {
+        pthread_cond_broadcast(&server->drained);
+    }
+
+    // a drain doesn't tell anyone who is left, everyone is going, and the server can be gone as soon as this unlocks
+    if (atomic_load(&server->draining)) {
+        number_of_rooms = 0;
     }
-    thread_arguments->server->number_of_clients--;
 
     // unlock as the server struct is no longer being modified
-    if (pthread_mutex_unlock(&thread_arguments->server->lock) != 0) {
+    if (pthread_mutex_unlock(&server->lock) != 0) {
         a_chat_log_error("Failed to unlock thread mutex while destroying client handler");
         return;
     }
 
+    // let every room the client was in know that they have gone
+    if (detached) {
+        number_of_rooms = 0;
+    }
+    if (number_of_rooms > 0) {
+        a_chat_log_info(message);
+    }
+    for (int i = 0; i < number_of_rooms; i++) {
+        a_chat_server_broadcast_room(server, rooms[i], room_lengths[i], message);
+        if (has_public_key) {
+            a_chat_server_announce_member(server, rooms[i], room_lengths[i], public_key, A_CHAT_MEMBER_LEFT);
+        }
+    }
+
     // finally free the thread arguments pointer and set it to NULL
     free(thread_arguments);
     thread_arguments = NULL;
 }
 
+// waits for the client handler's socket to be readable, flushing its outbound queue whenever it is writable
+// a client that goes quiet is pinged while waiting, and reaped if it stays quiet for the idle timeout
+// returns false if the client handler should be destroyed
+static bool a_chat_client_handler_wait(AChatClientHandlerThreadArguments* thread_arguments) {
+    AChatServer* server = thread_arguments->server;
+
+    while (true) {
+        // only the client handler's own thread looks at when it last heard from its client
+        int timeout = -1;
+        bool draining = atomic_load(&server->draining);
+        AChatIdleResult idle = draining ? A_CHAT_IDLE_WAIT : a_chat_client_handler_check_idle(server, thread_arguments->client_handler, a_chat_timer_now_ms(), &timeout);
+        if (idle == A_CHAT_IDLE_REAP) {
+            char message[640];
+            snprintf(message, sizeof(message), "%s has gone quiet, disconnecting them", thread_arguments->client_handler->user->name);
+            a_chat_log_info(message);
+            a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_CONNECTIONS_REAPED, 1);
+            return false;
+        }
+        AChatBuffer* ping = idle == A_CHAT_IDLE_PING ? a_chat_frame_create(A_CHAT_FRAME_PING, 0, NULL, 0) : NULL;
+
+        if (pthread_mutex_lock(&server->lock) != 0) {
+            a_chat_log_error("Failed to lock server's mutex while waiting for client");
+            if (ping) {
+                a_chat_buffer_release(ping);
+            }
+            return false;
+        }
+        AChatClientHandler* client_handler = thread_arguments->client_handler;
+        if (ping) {
+            a_chat_server_send_to_client(server, client_handler, ping);
+            a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_PINGS_SENT, 1);
+        }
+
+        // a draining client is only waited on to be sent what it still has queued, until the drain's deadline
+        if (draining) {
+            uint64_t now_ms = a_chat_timer_now_ms();
+            if (client_handler->outbound.count == 0 || now_ms >= server->drain_deadline_ms) {
+                if (pthread_mutex_unlock(&server->lock) != 0) {
+                    a_chat_log_error("Failed to unlock server's mutex while waiting for client");
+                }
+                return false;
+            }
+            timeout = (int) (server->drain_deadline_ms - now_ms);
+        }
+        struct pollfd poll_fds[2] = {
+            { .fd = client_handler->socket, .events = (draining ? 0 : POLLIN) | (client_handler->outbound.count > 0 ? POLLOUT : 0) },
+            { .fd = client_handler->wake_fd, .events = POLLIN },
+        };
+        if (pthread_mutex_unlock(&server->lock) != 0) {
+            a_chat_log_error("Failed to unlock server's mutex while waiting for client");
+            if (ping) {
+                a_chat_buffer_release(ping);
+            }
+            return false;
+        }
+        if (ping) {
+            a_chat_buffer_release(ping);
+        }
+
+        if (poll(poll_fds, 2, timeout) == -1) {
+            if (errno == EINTR) { continue; }
+
+            a_chat_log_error_errno("Failed to wait for client");
+            return false;
+        }
+
+        // a broadcast left part of the outbound queue behind, loop around to wait for the socket to be writable
+        if (poll_fds[1].revents & POLLIN) {
+            uint64_t value;
+            if (read(poll_fds[1].fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+                a_chat_log_error_errno("Failed to read client handler's eventfd");
+            }
+        }
+
+        if (poll_fds[0].revents & POLLOUT) {
+            if (pthread_mutex_lock(&server->lock) != 0) {
+                a_chat_log_error("Failed to lock server's mutex while flushing client");
+                return false;
+            }
+            if (a_chat_outbound_queue_flush(&client_handler->outbound, client_handler->socket) == A_CHAT_FLUSH_FAILED) {
+                a_chat_log_warning_errno("Failed broadcast message to a client");
+                a_chat_outbound_queue_clear(&client_handler->outbound);
+            }
+            if (pthread_mutex_unlock(&server->lock) != 0) {
+                a_chat_log_error("Failed to unlock server's mutex while flushing client");
+                return false;
+            }
+        }
+
+        if (draining && (poll_fds[0].revents & (POLLHUP | POLLERR))) {
+            return false;
+        }
+        if (poll_fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            return true;
+        }
+    }
+}
+
+// joins the room quietly, catching up from the sequence if the client asked to, returns false if it couldn't
+static bool a_chat_client_handler_join_room(AChatServer* server, AChatClientHandler* client_handler, const char* room, size_t room_length, bool catch_up, uint64_t sequence) {
+    // a catch up is queued in the same step as the join, under the room's history lock, so no new message can get ahead of it
+    AChatHistory* history = catch_up ? a_chat_history_table_find(&server->history, room, room_length) : NULL;
+    if (history) {
+        pthread_mutex_lock(&history->lock);
+    }
+
+    if (pthread_mutex_lock(&server->lock) != 0) {
+        a_chat_log_error("Failed to lock server's mutex while joining room");
+        if (history) {
+            pthread_mutex_unlock(&history->lock);
+        }
+        return false;
+    }
+    bool joined = a_chat_room_join(&server->rooms, client_handler, room, room_length);
+    if (joined && history) {
+        size_t replayed = a_chat_history_replay(history, sequence, &client_handler->outbound);
+        a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_FRAMES_REPLAYED, replayed);
+        if (replayed > 0) {
+            a_chat_client_handler_flush(client_handler);
+        }
+    }
+    if (pthread_mutex_unlock(&server->lock) != 0) {
+        a_chat_log_error("Failed to unlock server's mutex while joining room");
+    }
+
+    if (history) {
+        pthread_mutex_unlock(&history->lock);
+    }
+
+    return joined;
+}
+
+static void a_chat_client_handler_join(AChatServer* server, AChatClientHandler* client_handler, const AChatFrame* frame) {
+    const char* room;
+    size_t room_length;
+    bool catch_up;
+    uint64_t sequence;
+    if (!a_chat_room_join_parse(frame, &room, &room_length, &catch_up, &sequence)) {
+        a_chat_log_error("Client sent an invalid room name");
+        return;
+    }
+
+    // joining a room the client is already in just announces them to it again, for the key agreement
+    if (a_chat_room_is_member(client_handler, room, room_length)) {
+        if (client_handler->has_public_key) {
+            a_chat_server_announce_member(server, room, room_length, client_handler->public_key, A_CHAT_MEMBER_JOINED);
+        }
+        return;
+    }
+
+    if (!a_chat_client_handler_join_room(server, client_handler, room, room_length, catch_up, sequence)) { return; }
+
+    char message[640];
+    snprintf(message, sizeof(message), "%s has joined #%.*s", client_handler->user->name, (int) room_length, room);
+    a_chat_server_broadcast_room(server, room, room_length, message);
+    if (client_handler->has_public_key) {
+        a_chat_server_announce_member(server, room, room_length, client_handler->public_key, A_CHAT_MEMBER_JOINED);
+    }
+}
+
+static void a_chat_client_handler_leave(AChatServer* server, AChatClientHandler* client_handler, const AChatFrame* frame) {
+    if (!a_chat_room_is_member(client_handler, (const char*) frame->payload, frame->length)) { return; }
+
+    // the client is told they left along with everyone else in the room
+    char message[640];
+    snprintf(message, sizeof(message), "%s has left #%.*s", client_handler->user->name, (int) frame->length, (const char*) frame->payload);
+    a_chat_server_broadcast_room(server, (const char*) frame->payload, frame->length, message);
+    if (client_handler->has_public_key) {
+        a_chat_server_announce_member(server, (const char*) frame->payload, frame->length, client_handler->public_key, A_CHAT_MEMBER_LEFT);
+    }
+
+    if (pthread_mutex_lock(&server->lock) != 0) {
+        a_chat_log_error("Failed to lock server's mutex while leaving room");
+        return;
+    }
+    a_chat_room_leave(&server->rooms, client_handler, (const char*) frame->payload, frame->length);
+    if (pthread_mutex_unlock(&server->lock) != 0) {
+        a_chat_log_error("Failed to unlock server's mutex while leaving room");
+    }
+}
+
+// puts a resumed client back in its session's rooms, without telling them, as they never heard it had gone
+static void a_chat_client_handler_resume(AChatServer* server, AChatClientHandler* client_handler) {
+    const AChatSession* session = client_handler->session;
+    for (int i = 0; i < session->number_of_rooms; i++) {
+        a_chat_client_handler_join_room(server, client_handler, session->rooms[i], session->room_lengths[i], true, session->sequences[i]);
+    }
+    client_handler->resuming = false;
+}
+
+static void a_chat_client_handler_handle_frame(AChatServer* server, AChatClientHandler* client_handler, const AChatFrame* frame) {
+    switch (frame->type) {
+        case A_CHAT_FRAME_MESSAGE: {
+            const char* room;
+            size_t room_length;
+            const uint8_t* message;
+            uint32_t message_length;
+            if (!a_chat_room_message_parse(frame, &room, &room_length, &message, &message_length)) {
+                a_chat_log_error("Received invalid message from client");
+                break;
+            }
+
+            // clients can only talk in rooms they are in, which only their own thread changes
+            if (!a_chat_room_is_member(client_handler, room, room_length)) { break; }
+            if ((frame->flags & A_CHAT_FRAME_FLAG_COMPRESSED) && !client_handler->compression) {
+                a_chat_log_error("Client sent a compressed message without being allowed to");
+                break;
+            }
+
+            a_chat_server_relay_message(server, room, room_length, client_handler->user->name, frame->flags, message, message_length);
+            break;
+        }
+        case A_CHAT_FRAME_GROUP_KEY: {
+            const char* room;
+            size_t room_length;
+            const uint8_t* group_key;
+            uint32_t group_key_length;
+            if (!a_chat_room_message_parse(frame, &room, &room_length, &group_key, &group_key_length)) {
+                a_chat_log_error("Received invalid group key from client");
+                break;
+            }
+
+            // the other members need to know who the key is from to unwrap it
+            if (!client_handler->has_public_key || !a_chat_room_is_member(client_handler, room, room_length)) { break; }
+
+            a_chat_server_relay_group_key(server, room, room_length, client_handler->public_key, group_key, group_key_length);
+            break;
+        }
+        case A_CHAT_FRAME_PRESENCE: {
+            AChatBuffer* answer = a_chat_server_presence_frame(server, frame);
+            if (!answer) { break; }
+
+            a_chat_server_send_to(server, -1, client_handler->handle, answer);
+            a_chat_buffer_release(answer);
+            break;
+        }
+        case A_CHAT_FRAME_DIRECT:
+            a_chat_server_relay_direct(server, client_handler, frame);
+            break;
+        case A_CHAT_FRAME_PING: {
+            AChatBuffer* pong = a_chat_server_pong_frame(frame);
+            if (!pong) { break; }
+
+            a_chat_server_send_to(server, -1, client_handler->handle, pong);
+            a_chat_buffer_release(pong);
+            break;
+        }
+        case A_CHAT_FRAME_PONG:
+            // hearing anything back is all that matters, which receiving it has already counted
+            break;
+        case A_CHAT_FRAME_JOIN:
+            a_chat_client_handler_join(server, client_handler, frame);
+            break;
+        case A_CHAT_FRAME_LEAVE:
+            a_chat_client_handler_leave(server, client_handler, frame);
+            break;
+        case A_CHAT_FRAME_SESSION:
+            // the client is closing for good, so its rooms hear it has gone as soon as it disconnects
+            if (frame->length == 0 && client_handler->session) {
+                a_chat_session_table_end(server->sessions, client_handler);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
 static void* a_chat_client_handler_thread(void* arguments) {
     // check if the arguments are valid
     if (!arguments) {
@@ -126,6 +803,11 @@ static void* a_chat_client_handler_thread(void* arguments) {
     // create a pointer of type "AChatClientHandlerThreadArguments" so it is easier to use the arguments passed through
     AChatClientHandlerThreadArguments* thread_arguments = (AChatClientHandlerThreadArguments*) arguments;
 
+    // a resumed client's rooms are rejoined on its own thread, the only one that changes them
+    if (thread_arguments->client_handler->resuming) {
+        a_chat_client_handler_resume(thread_arguments->server, thread_arguments->client_handler);
+    }
+
     while (true) {
         // check if the server is still running
         if (pthread_mutex_lock(&thread_arguments->server->lock) != 0) {
@@ -139,33 +821,45 @@ static void* a_chat_client_handler_thread(void* arguments) {
         }
         if (!running) { break; }
 
-        // wait till the client sends something, then receive the infomation and put it into the buffer
-        char buffer[1024];
-        int bytes_received = recv(thread_arguments->server->clientHandlers[thread_arguments->client_handler_index].socket, &buffer, sizeof(buffer), 0);
-        if (bytes_received == 0) { // if recv() returns 0, the client associated with the client handler has disconnected
-            char message[640];
-            snprintf(message, sizeof(message), "%s has disconnected", thread_arguments->server->clientHandlers[thread_arguments->client_handler_index].username);
-            a_chat_log_info(message);
-            char broadcast_buffer[640];
-            snprintf(broadcast_buffer, sizeof(broadcast_buffer), "[SERVER] %s", message);
-            a_chat_server_broadcast(thread_arguments->server, broadcast_buffer);
+        // handle every complete frame first, the handshake or a single recv() can leave any number of them behind
+        AChatFrame frame;
+        AChatFrameResult result;
+        while ((result = a_chat_frame_decoder_next(&thread_arguments->client_handler->decoder, &frame)) == A_CHAT_FRAME_COMPLETE) {
+            a_chat_metrics_add(&thread_arguments->server->metrics, A_CHAT_COUNTER_FRAMES_RECEIVED, 1);
+            // the same as the event loops, a client is still read from while it is drained but nothing it sends is handled
+            if (atomic_load(&thread_arguments->server->draining)) { continue; }
+            AChatAdmitResult admit = a_chat_client_handler_admit(thread_arguments->server, thread_arguments->client_handler, &frame);
+            if (admit == A_CHAT_ADMIT_DROP) { continue; }
+            // ends the connection the same as a frame that couldn't be decoded
+            if (admit == A_CHAT_ADMIT_DISCONNECT) {
+                result = A_CHAT_FRAME_ERROR;
+                break;
+            }
+            a_chat_client_handler_handle_frame(thread_arguments->server, thread_arguments->client_handler, &frame);
+        }
+        if (result == A_CHAT_FRAME_ERROR) { break; }
+
+        // wait till the client sends something, or its outbound queue has to wait for the socket to be writable
+        if (!a_chat_client_handler_wait(thread_arguments)) { break; }
 
+        // receive the infomation straight into the frame decoder
+        size_t available;
+        uint8_t* buffer = a_chat_frame_decoder_reserve(&thread_arguments->client_handler->decoder, &available);
+        if (!buffer) { break; }
+
+        int bytes_received = recv(thread_arguments->client_handler->socket, buffer, available, 0);
+        if (bytes_received == 0) { // if recv() returns 0, the client associated with the client handler has disconnected
             break;
         } else if (bytes_received == -1) { // revc() return -1 if any errors occur and sets errno with the error message
             char message[640];
-            snprintf(message, sizeof(message), "Connection with client %s has failed", thread_arguments->server->clientHandlers[thread_arguments->client_handler_index].username);
+            snprintf(message, sizeof(message), "Connection with client %s has failed", thread_arguments->client_handler->user->name);
             a_chat_log_error_errno(message);
 
             break;
         }
-
-        // this is just temporary
-        buffer[bytes_received - 1] = '\0'; // - 1 because of new line
-
-        char broadcast_buffer[640];
-        snprintf(broadcast_buffer, sizeof(broadcast_buffer), "[%s] %s", thread_arguments->server->clientHandlers[thread_arguments->client_handler_index].username, buffer);
-        a_chat_server_broadcast(thread_arguments->server, broadcast_buffer);
-        printf("%s\n", buffer);
+        a_chat_frame_decoder_commit(&thread_arguments->client_handler->decoder, bytes_received);
+        a_chat_metrics_add(&thread_arguments->server->metrics, A_CHAT_COUNTER_BYTES_RECEIVED, bytes_received);
+        thread_arguments->client_handler->last_received_ms = a_chat_timer_now_ms();
     }
 
     // destory client handler onces the client disconnects or an error occurs
@@ -174,35 +868,30 @@ static void* a_chat_client_handler_thread(void* arguments) {
     return NULL;
 }
 
-static bool a_chat_handshake(AChatServer* server) {
-    // set a timeout time of 5 seconds
-    struct timeval timeout = { .tv_sec = 5, .tv_usec = 0 };
-    setsockopt(server->clientHandlers[server->number_of_clients].socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    // the client will send a "handshake" message which looks like this "a-chat [username]"
-    char buffer[1024];
-    int bytes_received = recv(server->clientHandlers[server->number_of_clients].socket, &buffer, sizeof(buffer), 0);
-    if (bytes_received == 0) {
-        a_chat_log_error_errno("Client disconnect before handshake message was received");
-
-        return false;
-    } else if (bytes_received == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            a_chat_log_error_errno("Handshake from client timed out");
-
+bool a_chat_handshake_validate(AChatServer* server, const AChatFrame* frame, AChatClientHandler* client_handler) {
+    // a resume stands in for the whole handshake, the session already has everything it would have said
+    if (frame->type == A_CHAT_FRAME_RESUME) {
+        if (!server->sessions || !a_chat_session_table_resume(server->sessions, frame, client_handler)) {
+            // a_chat_session_table_resume logs the correct error already
+            // the client does a whole handshake instead once it hears the session is gone, the socket is empty so this doesn't block
+            if (!a_chat_frame_send(client_handler->socket, A_CHAT_FRAME_SESSION, 0, NULL, 0)) {
+                a_chat_log_warning_errno("Failed to refuse client's resume");
+            }
             return false;
         }
-        a_chat_log_error_errno("Failed to get handshake from client");
 
-        return false;
+        client_handler->resuming = true;
+        return true;
     }
 
-    // reset the socket's timeout
-    timeout = (struct timeval) { .tv_sec = 0, .tv_usec = 0 };
-    setsockopt(server->clientHandlers[server->number_of_clients].socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (frame->type != A_CHAT_FRAME_HANDSHAKE) {
+        a_chat_log_error("Client's first frame wasn't a handshake");
+
+        return false;
+    }
 
     // make sure the handshake is at least long enough to contain "a-chat "
-    if (strlen(buffer) < 7) {
+    if (frame->length < 7) {
         a_chat_log_error("Handshake with client was too short");
 
         return false;
@@ -210,28 +899,178 @@ static bool a_chat_handshake(AChatServer* server) {
 
     // make sure the identifier matches with the expected result
     // the identifier is just the first "token" of the handshake, which is just "a-chat"
-    if (strncmp(buffer, "a-chat", 6) != 0) {
+    if (memcmp(frame->payload, "a-chat ", 7) != 0) {
         a_chat_log_error("Handshake with client had invalid identifier");
 
         return false;
     }
 
+    // the public key, if there is one, comes after the username
+    size_t username_length = frame->length - 7;
+    client_handler->has_public_key = (frame->flags & A_CHAT_FRAME_FLAG_PUBLIC_KEY) != 0;
+    if (client_handler->has_public_key) {
+        if (username_length < A_CHAT_PUBLIC_KEY_SIZE) {
+            a_chat_log_error("Handshake with client was too short");
+
+            return false;
+        }
+
+        username_length -= A_CHAT_PUBLIC_KEY_SIZE;
+        memcpy(client_handler->public_key, frame->payload + 7 + username_length, A_CHAT_PUBLIC_KEY_SIZE);
+    }
+
+    // the server can't read messages either way, it only lets the client compress if it is allowed to
+    client_handler->compression = (frame->flags & A_CHAT_FRAME_FLAG_COMPRESSED) && server->config.compression;
+
     // make sure the client's username is in the length
-    const char* username_start = buffer + 7;
-    int username_length = strlen(username_start);
-    if (username_length == 0 || username_length >= 512) {
+    const char* username_start = (const char*) frame->payload + 7;
+    if (username_length == 0 || username_length >= 512 || memchr(username_start, '\0', username_length)) {
         a_chat_log_error("Client's username is invalid");
 
         return false;
     }
 
-    // set the associated client handler's username to the client's username
-    strncpy(server->clientHandlers[server->number_of_clients].username, username_start, 511);
-    server->clientHandlers[server->number_of_clients].username[511] = '\0';
+    // usernames are unique, so anyone can be found by theirs
+    client_handler->user = a_chat_directory_claim(&server->directory, username_start, username_length);
+    if (!client_handler->user) {
+        a_chat_log_error("Client's username is already taken");
+
+        // the socket is empty so this doesn't block, the client finds out why before it is disconnected, and that
+        // reconnecting won't help
+        const char reason[] = "That username is already taken";
+        if (!a_chat_frame_send(client_handler->socket, A_CHAT_FRAME_HANDSHAKE, 0, reason, sizeof(reason) - 1)) {
+            a_chat_log_warning_errno("Failed to tell client its username is taken");
+        }
+        return false;
+    }
 
     return true;
 }
 
+bool a_chat_client_handler_queue_answer(AChatClientHandler* client_handler) {
+    bool queued = false;
+
+    if (client_handler->compression) {
+        AChatBuffer* frame = a_chat_frame_create(A_CHAT_FRAME_HANDSHAKE, A_CHAT_FRAME_FLAG_COMPRESSED, NULL, 0);
+        if (frame) {
+            a_chat_outbound_queue_push(&client_handler->outbound, frame);
+            a_chat_buffer_release(frame);
+            queued = true;
+        }
+    }
+
+    // the client keeps its session's token for when it has to reconnect
+    if (client_handler->session) {
+        AChatBuffer* frame = a_chat_session_frame(client_handler);
+        if (frame) {
+            a_chat_outbound_queue_push(&client_handler->outbound, frame);
+            a_chat_buffer_release(frame);
+            queued = true;
+        }
+    }
+
+    return queued;
+}
+
+AChatIdleResult a_chat_client_handler_check_idle(const AChatServer* server, AChatClientHandler* client_handler, uint64_t now_ms, int* delay_ms) {
+    uint64_t ping_interval = (uint64_t) server->config.ping_interval_ms;
+    uint64_t idle_timeout = (uint64_t) server->config.idle_timeout_ms;
+    uint64_t quiet = now_ms - client_handler->last_received_ms;
+    if (idle_timeout > 0 && quiet >= idle_timeout) { return A_CHAT_IDLE_REAP; }
+
+    // a client that stays quiet is pinged again every interval, anything it sends puts the next one off
+    AChatIdleResult result = A_CHAT_IDLE_WAIT;
+    uint64_t delay = UINT64_MAX;
+    if (ping_interval > 0) {
+        uint64_t since = client_handler->last_ping_ms > client_handler->last_received_ms ? client_handler->last_ping_ms : client_handler->last_received_ms;
+        if (now_ms - since >= ping_interval) {
+            result = A_CHAT_IDLE_PING;
+            client_handler->last_ping_ms = now_ms;
+            since = now_ms;
+        }
+        delay = since + ping_interval - now_ms;
+    }
+    if (idle_timeout > 0 && idle_timeout - quiet < delay) {
+        delay = idle_timeout - quiet;
+    }
+
+    *delay_ms = delay == UINT64_MAX ? -1 : (int) delay;
+    return result;
+}
+
+AChatBuffer* a_chat_server_pong_frame(const AChatFrame* frame) {
+    if (frame->length > A_CHAT_PING_MAXIMUM_LENGTH) {
+        a_chat_log_error("Client sent a ping that is too long");
+        return NULL;
+    }
+
+    return a_chat_frame_create(A_CHAT_FRAME_PONG, 0, frame->payload, frame->length);
+}
+
+AChatAdmitResult a_chat_client_handler_admit(AChatServer* server, AChatClientHandler* client_handler, const AChatFrame* frame) {
+    // a PONG only answers the server, dropping it would get a client that is busy talking reaped
+    if (frame->type == A_CHAT_FRAME_PONG) { return A_CHAT_ADMIT_HANDLE; }
+
+    AChatRateLimiter* limiter = &server->rate_limiter;
+    uint64_t bytes = A_CHAT_FRAME_HEADER_SIZE + (uint64_t) frame->length;
+    uint64_t now_ns = a_chat_metrics_now_ns();
+
+    // the client's own buckets come first, so a client over its limits doesn't use up what its address has left
+    AChatTokenBucket* buckets[4] = { &client_handler->messages_bucket, &client_handler->bytes_bucket };
+    const AChatRate* rates[4] = { &limiter->client_messages, &limiter->client_bytes };
+    uint64_t tokens[4] = { 1, bytes };
+    int number_of_buckets = 2;
+    if (limiter->addresses) {
+        AChatAddressBuckets* address = &limiter->addresses[client_handler->address_slot];
+        buckets[2] = &address->messages;
+        rates[2] = &limiter->address_messages;
+        tokens[2] = 1;
+        buckets[3] = &address->bytes;
+        rates[3] = &limiter->address_bytes;
+        tokens[3] = bytes;
+        number_of_buckets = 4;
+    }
+
+    int taken = 0;
+    while (taken < number_of_buckets && a_chat_token_bucket_take(buckets[taken], rates[taken], tokens[taken], now_ns)) {
+        taken++;
+    }
+    if (taken == number_of_buckets) {
+        client_handler->rate_limited = false;
+        return A_CHAT_ADMIT_HANDLE;
+    }
+
+    // a frame that isn't handled doesn't cost anything, another thread can take from the address' buckets at the same
+    // time, so they can't all be checked before any are taken from, what was taken is given back instead
+    for (int i = 0; i < taken; i++) {
+        a_chat_token_bucket_give_back(buckets[i], rates[i], tokens[i]);
+    }
+
+    a_chat_metrics_add(&server->metrics, taken < 2 ? A_CHAT_COUNTER_FRAMES_RATE_LIMITED : A_CHAT_COUNTER_FRAMES_ADDRESS_RATE_LIMITED, 1);
+    a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_BYTES_RATE_LIMITED, bytes);
+
+    if (frame->type != A_CHAT_FRAME_MESSAGE && frame->type != A_CHAT_FRAME_DIRECT && frame->type != A_CHAT_FRAME_PRESENCE) {
+        char message[640];
+        snprintf(message, sizeof(message), "%s sent control frames too fast, disconnecting them", client_handler->user->name);
+        a_chat_log_info(message);
+        return A_CHAT_ADMIT_DISCONNECT;
+    }
+
+    // only told once for a run of dropped frames, telling it every time would only add to the flood
+    if (!client_handler->rate_limited) {
+        client_handler->rate_limited = true;
+
+        const char* notice = "You're sending too fast, some of your messages were dropped";
+        AChatBuffer* notice_frame = a_chat_frame_create(A_CHAT_FRAME_SERVER, 0, notice, strlen(notice));
+        if (notice_frame) {
+            a_chat_server_send_to(server, client_handler->user->event_loop, client_handler->handle, notice_frame);
+            a_chat_buffer_release(notice_frame);
+        }
+    }
+
+    return A_CHAT_ADMIT_DROP;
+}
+
 static void a_chat_client_handler_create(AChatServer* server) {
     struct sockaddr_storage their_address;
     socklen_t address_size = sizeof(struct sockaddr_storage);
@@ -239,66 +1078,154 @@ static void a_chat_client_handler_create(AChatServer* server) {
     // wait for a client connect and then accept the new connect
     int new_socket = accept(server->listening_socket, (struct sockaddr*) &their_address, &address_size);
     if (new_socket == -1) {
-        a_chat_log_error_errno("Failed accept new client");
+        if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK) {
+            a_chat_log_error_errno("Failed accept new client");
+        }
+
+        return;
+    }
+    a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_CONNECTIONS_ACCEPTED, 1);
+
+    // the handshake stage waits on many clients at once, so it can't block on any of them
+    int flags = fcntl(new_socket, F_GETFL, 0);
+    if (flags == -1 || fcntl(new_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+        a_chat_log_error_errno("Failed to make client socket non-blocking");
+
+        close(new_socket);
+        return;
+    }
+
+    // client handlers live on the heap so they never move while their thread is using them
+    AChatClientHandler* client_handler = calloc(1, sizeof(AChatClientHandler));
+    if (!client_handler) {
+        a_chat_log_error("Failed to allocate memory for client handler");
 
+        close(new_socket);
+        return;
+    }
+    client_handler->socket = new_socket;
+    client_handler->wake_fd = -1;
+    client_handler->accepted_at_ns = a_chat_metrics_now_ns();
+    a_chat_token_bucket_init(&client_handler->messages_bucket);
+    a_chat_token_bucket_init(&client_handler->bytes_bucket);
+    client_handler->address_slot = a_chat_rate_limiter_address_slot(new_socket);
+
+    if (!a_chat_frame_decoder_init(&client_handler->decoder)) {
+        close(new_socket);
+        free(client_handler);
+        return;
+    }
+
+    // hand the client over to the handshake stage and go straight back to accepting
+    a_chat_handshake_stage_submit(server->handshake_stage, client_handler);
+}
+
+void a_chat_client_handler_start(AChatServer* server, AChatClientHandler* client_handler) {
+    // the client handler's thread blocks in poll() and recv(), so the socket can go back to blocking
+    int flags = fcntl(client_handler->socket, F_GETFL, 0);
+    if (flags == -1 || fcntl(client_handler->socket, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        a_chat_log_error_errno("Failed to make client socket blocking");
+
+        a_chat_client_handler_release(server, client_handler);
         return;
     }
 
     if (pthread_mutex_lock(&server->lock) != 0) {
         a_chat_log_error_errno("Failed to lock server's mutex while creating new client handler");
 
-        close(new_socket);
+        a_chat_client_handler_release(server, client_handler);
+        return;
+    }
+
+    // a client that finished its handshake as the server started draining is turned away like the rest are
+    if (atomic_load(&server->draining)) {
+        a_chat_client_handler_release(server, client_handler);
+        if (pthread_mutex_unlock(&server->lock) != 0) {
+            a_chat_log_error_errno("Failed to unlock server's mutex while creating new client handler");
+        }
         return;
     }
 
     // check if the maximum number of clients have connected
-    if (server->number_of_clients >= MAXIMUM_CLIENTS) {
+    if (server->number_of_clients >= server->config.maximum_clients) {
         a_chat_log_error("Maximum number of connected clients reached");
+        a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_HANDSHAKES_FAILED, 1);
 
-        close(new_socket);
+        a_chat_client_handler_release(server, client_handler);
         if (pthread_mutex_unlock(&server->lock) != 0) {
             a_chat_log_error_errno("Failed to unlock server's mutex while creating new client handler");
         }
         return;
     }
 
-    // set the next client handler to the new socket and assign the correct index
-    server->clientHandlers[server->number_of_clients].socket = new_socket;
-    server->clientHandlers[server->number_of_clients].index = server->number_of_clients;
+    a_chat_outbound_queue_init(&client_handler->outbound, server->config.outbound_queue_maximum_frames, server->config.outbound_queue_maximum_bytes, server->config.overflow_policy, &server->metrics);
+    // the handshake was just received, so the client starts out heard from
+    client_handler->last_received_ms = a_chat_timer_now_ms();
+    client_handler->last_ping_ms = 0;
+
+    client_handler->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (client_handler->wake_fd == -1) {
+        a_chat_log_error_errno("Failed to create eventfd for new client handler");
+
+        a_chat_client_handler_release(server, client_handler);
+        if (pthread_mutex_unlock(&server->lock) != 0) {
+            a_chat_log_error_errno("Failed to unlock server's mutex while creating new client handler");
+        }
+        return;
+    }
 
     // create the arguments for the new client handler's thread
     AChatClientHandlerThreadArguments* arguments = malloc(sizeof(AChatClientHandlerThreadArguments));
     if (!arguments) {
         a_chat_log_error("Failed to allocate memory for client handler thread arguments");
 
-        close(server->clientHandlers[server->number_of_clients].socket);
+        a_chat_client_handler_release(server, client_handler);
         if (pthread_mutex_unlock(&server->lock) != 0) {
             a_chat_log_error_errno("Failed to unlock server's mutex while creating new client handler");
         }
         return;
     }
 
-    arguments->client_handler_index = server->clientHandlers[server->number_of_clients].index;
+    arguments->client_handler = client_handler;
     arguments->server = server;
 
-    // get the handshake from the client
-    if (!a_chat_handshake(server)) {
-        // the correct error message will be printed inside the a_chat_handshake function
-
-        close(server->clientHandlers[server->number_of_clients].socket);
+    if (!a_chat_registry_insert(&server->registry, client_handler, &client_handler->handle)) {
+        a_chat_client_handler_release(server, client_handler);
         free(arguments);
         if (pthread_mutex_unlock(&server->lock) != 0) {
-            a_chat_log_error_errno("Failed to unlock server's mutex while retrieving handshake from new client");
+            a_chat_log_error_errno("Failed to unlock server's mutex while creating new client handler");
         }
-
         return;
     }
+    a_chat_directory_attach(&server->directory, client_handler->user, -1, client_handler->handle, client_handler->has_public_key ? client_handler->public_key : NULL);
+
+    // every client starts out in the default room, a resumed one goes back to its session's rooms once its thread starts
+    if (!client_handler->resuming) {
+        a_chat_room_join(&server->rooms, client_handler, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM));
+        if (server->sessions) {
+            a_chat_session_table_open(server->sessions, client_handler);
+        }
+    }
+
+    if (a_chat_client_handler_queue_answer(client_handler)) {
+        a_chat_client_handler_flush(client_handler);
+    }
+
+    // used for logging and announcing that a new client has connected, copied before its thread can destroy it
+    char message[640];
+    snprintf(message, sizeof(message), client_handler->resuming ? "%s has resumed their session" : "%s has connected", client_handler->user->name);
+    uint8_t public_key[A_CHAT_PUBLIC_KEY_SIZE];
+    memcpy(public_key, client_handler->public_key, sizeof(public_key));
+    bool has_public_key = client_handler->has_public_key;
+    bool resuming = client_handler->resuming;
 
     // create the client handler thread with the arguments created
-    if (pthread_create(&server->clientHandlers[server->number_of_clients].thread_id, NULL, a_chat_client_handler_thread, arguments) != 0) {
+    if (pthread_create(&client_handler->thread_id, NULL, a_chat_client_handler_thread, arguments) != 0) {
         a_chat_log_error_errno("Failed to create thread for new client handler");
 
-        close(server->clientHandlers[server->number_of_clients].socket);
+        a_chat_room_leave(&server->rooms, client_handler, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM));
+        a_chat_registry_remove(&server->registry, client_handler->handle);
+        a_chat_client_handler_release(server, client_handler);
         free(arguments);
         if (pthread_mutex_unlock(&server->lock) != 0) {
             a_chat_log_error_errno("Failed to unlock server's mutex while creating thread for client handler");
@@ -306,78 +1233,498 @@ static void a_chat_client_handler_create(AChatServer* server) {
         return;
     }
 
-    // used for logging and broadcasting that a new client has connected
-    char message[640];
-    snprintf(message, sizeof(message), "%s has connected", server->clientHandlers[server->number_of_clients].username);
+    // nothing joins the thread, it destroys its client handler itself and a drain waits on the number of clients instead
+    pthread_detach(client_handler->thread_id);
+
     a_chat_log_info(message);
+    if (resuming) {
+        a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_SESSIONS_RESUMED, 1);
+    }
 
     server->number_of_clients++;
+    a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_HANDSHAKES_COMPLETED, 1);
+    a_chat_metrics_record(&server->metrics, A_CHAT_HISTOGRAM_HANDSHAKE, a_chat_metrics_now_ns() - client_handler->accepted_at_ns);
 
     if (pthread_mutex_unlock(&server->lock) != 0) {
         a_chat_log_error_errno("Failed to unlock server's mutex while creating new client handler");
         return;
     }
 
-    // log and broadcast that a new client has connected to the server
-    char broadcast_buffer[640];
-    snprintf(broadcast_buffer, sizeof(broadcast_buffer), "[SERVER] %s", message);
-    a_chat_server_broadcast(server, broadcast_buffer); // this is at the end of the function because a_chat_server_broadcast uses the mutex
+    // let the default room know that a new client has connected
+    if (resuming) { return; }
+    a_chat_server_broadcast_room(server, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM), message); // this is at the end of the function because a_chat_server_broadcast_room uses the mutex
+    if (has_public_key) {
+        a_chat_server_announce_member(server, A_CHAT_DEFAULT_ROOM, strlen(A_CHAT_DEFAULT_ROOM), public_key, A_CHAT_MEMBER_JOINED);
+    }
+}
+
+// wakes every client handler's thread to drain its client, then waits for them all to go
+// each thread disconnects its own client once its outbound queue is empty or the deadline has passed
+static void a_chat_client_handlers_drain(AChatServer* server) {
+    if (pthread_mutex_lock(&server->lock) != 0) {
+        a_chat_log_error("Failed to lock server's mutex while draining");
+        return;
+    }
+
+    for (uint32_t i = 0; i < server->registry.count; i++) {
+        uint64_t value = 1;
+        if (write(server->registry.client_handlers[i]->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+            a_chat_log_error_errno("Failed to wake client handler");
+        }
+    }
+
+    // the threads time out on the deadline themselves, shutting the stragglers' sockets down only makes sure of it
+    // so it waits a little past it, otherwise it would race every thread that was about to give up anyway
+    int timeout_ms = server->config.drain_timeout_ms + 250;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    bool timed_out = false;
+    while (server->number_of_clients > 0) {
+        if (!timed_out && pthread_cond_timedwait(&server->drained, &server->lock, &deadline) == ETIMEDOUT) {
+            timed_out = true;
+
+            char message[128];
+            snprintf(message, sizeof(message), "%d clients weren't drained in time, disconnecting them", atomic_load(&server->number_of_clients));
+            a_chat_log_warning(message);
+            for (uint32_t i = 0; i < server->registry.count; i++) {
+                shutdown(server->registry.client_handlers[i]->socket, SHUT_RDWR);
+            }
+        } else if (timed_out) {
+            pthread_cond_wait(&server->drained, &server->lock);
+        }
+    }
+
+    if (pthread_mutex_unlock(&server->lock) != 0) {
+        a_chat_log_error("Failed to unlock server's mutex while draining");
+    }
 }
 
 void a_chat_server_accept(AChatServer* server) {
+    // the epoll engine accepts new clients on its own event loop threads
+    if (server->config.engine == A_CHAT_SERVER_ENGINE_EPOLL) {
+        a_chat_event_loops_run(server);
+        return;
+    }
+
+    if (!a_chat_handshake_stage_start(server->handshake_stage)) {
+        // a_chat_handshake_stage_start logs the correct error already
+        return;
+    }
+
+    // accept is only called once poll says someone is waiting, but they can give up before then, so it mustn't block
+    int flags = fcntl(server->listening_socket, F_GETFL, 0);
+    if (flags == -1 || fcntl(server->listening_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+        a_chat_log_error_errno("Failed to make listening socket non-blocking");
+    }
+
+    // wait on the eventfd along with the listening socket, so a stop doesn't have to wait for someone to connect
+    struct pollfd poll_fds[2] = {
+        { .fd = server->listening_socket, .events = POLLIN },
+        { .fd = server->stop_fd, .events = POLLIN },
+    };
     while (true) {
-        // check if the server is still running
-        if (pthread_mutex_lock(&server->lock) != 0) {
-            a_chat_log_error("Failed to lock server's mutex while accepting new clients");
+        if (poll(poll_fds, 2, -1) == -1) {
+            if (errno == EINTR) { continue; }
+
+            a_chat_log_error_errno("Failed to wait for new clients");
             break;
         }
-        bool running = server->running;
-        if (pthread_mutex_unlock(&server->lock) != 0) {
-            a_chat_log_error("Failed to unlock server's mutex while accepting new clients");
-            break;
+        if (poll_fds[1].revents & POLLIN) { break; }
+
+        if (poll_fds[0].revents & POLLIN) {
+            a_chat_client_handler_create(server);
         }
+    }
 
-        if (!running) { break; }
+    // nobody new gets in, their connections are refused straight away instead of waiting in a backlog nobody accepts
+    close(server->listening_socket);
+    server->listening_socket = -1;
 
-        a_chat_client_handler_create(server);
+    a_chat_server_begin_drain(server);
+    a_chat_client_handlers_drain(server);
+    atomic_store(&server->running, false);
+
+    a_chat_handshake_stage_join(server->handshake_stage);
+}
+
+void a_chat_server_stop(AChatServer* server) {
+    // nothing else is safe in a signal handler, not even logging
+    uint64_t value = 1;
+    ssize_t written = write(server->stop_fd, &value, sizeof(value));
+    (void) written;
+}
+
+void a_chat_server_begin_drain(AChatServer* server) {
+    char message[128];
+    snprintf(message, sizeof(message), "Server is stopping, draining %d clients", atomic_load(&server->number_of_clients));
+    a_chat_log_info(message);
+
+    // the notice is queued before draining is set, the threaded engine queues it onto every client's outbound queue
+    // straight away, and an event loop that sees draining picks up its inbox before it disconnects anyone
+    a_chat_server_broadcast(server, "The server is shutting down");
+
+    if (pthread_mutex_lock(&server->lock) != 0) {
+        a_chat_log_error("Failed to lock server's mutex while draining");
+    }
+    server->drain_deadline_ms = a_chat_timer_now_ms() + (uint64_t) server->config.drain_timeout_ms;
+    atomic_store(&server->draining, true);
+    if (pthread_mutex_unlock(&server->lock) != 0) {
+        a_chat_log_error("Failed to unlock server's mutex while draining");
     }
 }
 
-void a_chat_server_broadcast(AChatServer* server, const char* message) {
+void a_chat_server_broadcast_buffer(AChatServer* server, AChatBuffer* frame) {
+    a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_BROADCASTS, 1);
+
+    // the epoll engine hands the frame to every event loop's queue instead of taking the server's mutex
+    if (server->config.engine == A_CHAT_SERVER_ENGINE_EPOLL) {
+        a_chat_event_loops_broadcast(server, frame);
+        return;
+    }
+
+    // waiting on the mutex counts towards the broadcast's latency
+    uint64_t started_at = a_chat_metrics_now_ns();
     if (pthread_mutex_lock(&server->lock) != 0) {
         a_chat_log_error("Failed to lock server's mutex while broadcasting message");
         return;
     }
 
-    // send the message to every client
-    for (int i = 0; i < server->number_of_clients; i++) {
-        if (send(server->clientHandlers[i].socket, message, strlen(message), MSG_NOSIGNAL) == -1) {
-            a_chat_log_warning_errno("Failed broadcast message to a client");
-        }
-    }
+    a_chat_server_send_to_members(server, &server->registry, frame);
+    a_chat_metrics_record(&server->metrics, A_CHAT_HISTOGRAM_BROADCAST, a_chat_metrics_now_ns() - started_at);
 
     if (pthread_mutex_unlock(&server->lock) != 0) {
         a_chat_log_error("Failed to unlock server's mutex while broadcasting message");
     }
 }
 
-void a_chat_server_close(AChatServer* server) {
+void a_chat_server_broadcast_room_buffer(AChatServer* server, const char* room, size_t room_length, AChatBuffer* frame) {
+    a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_BROADCASTS, 1);
+
+    // the epoll engine's event loops each look the room up in their own room table
+    if (server->config.engine == A_CHAT_SERVER_ENGINE_EPOLL) {
+        a_chat_event_loops_broadcast_room(server, room, room_length, frame);
+        return;
+    }
+
+    uint64_t started_at = a_chat_metrics_now_ns();
     if (pthread_mutex_lock(&server->lock) != 0) {
-        a_chat_log_error("Failed to lock server's mutex while closing server");
+        a_chat_log_error("Failed to lock server's mutex while broadcasting message");
+        return;
     }
-    server->running = false;
 
-    // join all the threads so the server and all it's threads close gracefully
-    for (int i = 0; i < server->number_of_clients; i++) {
-        pthread_join(server->clientHandlers[i].thread_id, NULL);
+    // only the room's members are touched, however many clients the server has
+    AChatRoom* found_room = a_chat_room_table_find(&server->rooms, room, room_length);
+    if (found_room) {
+        a_chat_server_send_to_members(server, &found_room->members, frame);
     }
+    a_chat_metrics_record(&server->metrics, A_CHAT_HISTOGRAM_BROADCAST, a_chat_metrics_now_ns() - started_at);
+
     if (pthread_mutex_unlock(&server->lock) != 0) {
-        a_chat_log_error("Failed to unlock server's mutex while closing server");
+        a_chat_log_error("Failed to unlock server's mutex while broadcasting message");
+    }
+}
+
+void a_chat_server_broadcast_frame(AChatServer* server, uint8_t type, const void* payload, uint32_t length) {
+    // encode the frame once, every client is sent the same buffer
+    AChatBuffer* frame = a_chat_frame_create(type, 0, payload, length);
+    if (!frame) { return; }
+
+    a_chat_server_broadcast_buffer(server, frame);
+    a_chat_buffer_release(frame);
+}
+
+void a_chat_server_broadcast(AChatServer* server, const char* message) {
+    a_chat_server_broadcast_frame(server, A_CHAT_FRAME_SERVER, message, strlen(message));
+}
+
+void a_chat_server_broadcast_room(AChatServer* server, const char* room, size_t room_length, const char* message) {
+    AChatBuffer* frame = a_chat_frame_create(A_CHAT_FRAME_SERVER, 0, message, strlen(message));
+    if (!frame) { return; }
+
+    a_chat_server_broadcast_room_buffer(server, room, room_length, frame);
+    a_chat_buffer_release(frame);
+}
+
+void a_chat_server_relay_message(AChatServer* server, const char* room, size_t room_length, const char* username, uint16_t flags, const uint8_t* message, uint32_t length) {
+    // the sequence flag is the server's to set, so only the encrypted and compressed flags are passed on
+    flags &= A_CHAT_FRAME_FLAG_ENCRYPTED | A_CHAT_FRAME_FLAG_COMPRESSED;
+    AChatHistory* history = a_chat_history_table_get(&server->history, room, room_length);
+    if (history) {
+        flags |= A_CHAT_FRAME_FLAG_SEQUENCE;
+    }
+
+    // the relayed message carries its room and its sender, so the clients can tell where it's from
+    size_t username_length = strlen(username);
+    size_t sequence_length = history ? 8 : 0;
+    size_t payload_length = sequence_length + 2 + room_length + 2 + username_length + length;
+    if (payload_length > A_CHAT_FRAME_MAXIMUM_LENGTH) {
+        a_chat_log_error("Message from client is too long to relay");
+        return;
+    }
+
+    // build the frame straight into the buffer that is broadcast
+    AChatBuffer* frame = a_chat_buffer_create(A_CHAT_FRAME_HEADER_SIZE + payload_length);
+    if (!frame) { return; }
+    a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_MESSAGES_RELAYED, 1);
+
+    uint8_t* payload = frame->data + A_CHAT_FRAME_HEADER_SIZE;
+    a_chat_frame_encode_header(frame->data, A_CHAT_FRAME_MESSAGE, flags, payload_length);
+    payload += sequence_length; // filled in once the history hands out the sequence
+    payload[0] = (uint8_t) (room_length >> 8);
+    payload[1] = (uint8_t) room_length;
+    memcpy(payload + 2, room, room_length);
+    payload += 2 + room_length;
+    payload[0] = (uint8_t) (username_length >> 8);
+    payload[1] = (uint8_t) username_length;
+    memcpy(payload + 2, username, username_length);
+    memcpy(payload + 2 + username_length, message, length);
+
+    if (history) {
+        // the lock is held through the broadcast, so no shard can be handed a later sequence before an earlier one
+        pthread_mutex_lock(&history->lock);
+        uint64_t sequence = a_chat_history_append(&server->history, history, frame);
+        for (int i = 0; i < 8; i++) {
+            frame->data[A_CHAT_FRAME_HEADER_SIZE + i] = (uint8_t) (sequence >> (56 - i * 8));
+        }
+        if (server->message_store) {
+            if (!history->stored) {
+                history->stored = a_chat_message_store_room(server->message_store, room, room_length);
+            }
+            if (history->stored) {
+                a_chat_message_store_append(server->message_store, history->stored, frame, sequence);
+            }
+        }
+
+        a_chat_server_broadcast_room_buffer(server, room, room_length, frame);
+        pthread_mutex_unlock(&history->lock);
+    } else {
+        a_chat_server_broadcast_room_buffer(server, room, room_length, frame);
+    }
+    a_chat_buffer_release(frame);
+
+    // encrypted messages mean nothing to the server, so only plaintext ones are printed
+    if (!(flags & A_CHAT_FRAME_FLAG_ENCRYPTED)) {
+        printf("%.*s\n", (int) length, (const char*) message);
+    }
+}
+
+void a_chat_server_announce_member(AChatServer* server, const char* room, size_t room_length, const uint8_t* public_key, uint8_t event) {
+    uint8_t payload[2 + A_CHAT_ROOM_NAME_MAXIMUM_LENGTH + 1 + A_CHAT_PUBLIC_KEY_SIZE];
+    payload[0] = (uint8_t) (room_length >> 8);
+    payload[1] = (uint8_t) room_length;
+    memcpy(payload + 2, room, room_length);
+    payload[2 + room_length] = event;
+    memcpy(payload + 2 + room_length + 1, public_key, A_CHAT_PUBLIC_KEY_SIZE);
+
+    AChatBuffer* frame = a_chat_frame_create(A_CHAT_FRAME_MEMBER, 0, payload, 2 + room_length + 1 + A_CHAT_PUBLIC_KEY_SIZE);
+    if (!frame) { return; }
+
+    a_chat_server_broadcast_room_buffer(server, room, room_length, frame);
+    a_chat_buffer_release(frame);
+}
+
+void a_chat_server_relay_group_key(AChatServer* server, const char* room, size_t room_length, const uint8_t* public_key, const uint8_t* group_key, uint32_t length) {
+    // a single frame carries the key wrapped for every member, so a rekey is one broadcast no matter how big the room is
+    size_t payload_length = 2 + room_length + A_CHAT_PUBLIC_KEY_SIZE + length;
+    if (payload_length > A_CHAT_FRAME_MAXIMUM_LENGTH) {
+        a_chat_log_error("Group key from client is too long to relay");
+        return;
+    }
+
+    AChatBuffer* frame = a_chat_buffer_create(A_CHAT_FRAME_HEADER_SIZE + payload_length);
+    if (!frame) { return; }
+
+    uint8_t* payload = frame->data + A_CHAT_FRAME_HEADER_SIZE;
+    a_chat_frame_encode_header(frame->data, A_CHAT_FRAME_GROUP_KEY, 0, payload_length);
+    payload[0] = (uint8_t) (room_length >> 8);
+    payload[1] = (uint8_t) room_length;
+    memcpy(payload + 2, room, room_length);
+    memcpy(payload + 2 + room_length, public_key, A_CHAT_PUBLIC_KEY_SIZE);
+    memcpy(payload + 2 + room_length + A_CHAT_PUBLIC_KEY_SIZE, group_key, length);
+
+    a_chat_server_broadcast_room_buffer(server, room, room_length, frame);
+    a_chat_buffer_release(frame);
+}
+
+AChatBuffer* a_chat_server_presence_frame(AChatServer* server, const AChatFrame* frame) {
+    // the query is checked and the answer's length worked out before anything is looked up
+    size_t payload_length = 4;
+    int number_of_users = 0;
+    const uint8_t* entry = frame->payload;
+    const uint8_t* end = frame->payload + frame->length;
+    while (entry < end) {
+        size_t username_length = end - entry >= 2 ? ((size_t) entry[0] << 8) | entry[1] : 0;
+        if (username_length == 0 || username_length >= 512 || (size_t) (end - entry - 2) < username_length || ++number_of_users > A_CHAT_PRESENCE_MAXIMUM_USERS) {
+            a_chat_log_error("Client sent an invalid presence query");
+            return NULL;
+        }
+
+        payload_length += 1 + 2 + username_length + A_CHAT_PUBLIC_KEY_SIZE;
+        entry += 2 + username_length;
+    }
+
+    AChatBuffer* answer = a_chat_buffer_create(A_CHAT_FRAME_HEADER_SIZE + payload_length);
+    if (!answer) { return NULL; }
+    a_chat_frame_encode_header(answer->data, A_CHAT_FRAME_PRESENCE, 0, payload_length);
+
+    // the count is kept as users come and go, so it costs the same however many there are
+    uint8_t* payload = answer->data + A_CHAT_FRAME_HEADER_SIZE;
+    uint32_t number_online = (uint32_t) atomic_load(&server->directory.number_online);
+    payload[0] = (uint8_t) (number_online >> 24);
+    payload[1] = (uint8_t) (number_online >> 16);
+    payload[2] = (uint8_t) (number_online >> 8);
+    payload[3] = (uint8_t) number_online;
+    payload += 4;
+
+    for (entry = frame->payload; entry < end;) {
+        size_t username_length = ((size_t) entry[0] << 8) | entry[1];
+        AChatUserStatus status;
+        bool found = a_chat_directory_find(&server->directory, (const char*) entry + 2, username_length, &status);
+
+        payload[0] = found ? status.presence : A_CHAT_PRESENCE_OFFLINE;
+        memcpy(payload + 1, entry, 2 + username_length);
+        payload += 1 + 2 + username_length;
+        if (found && status.has_public_key) {
+            memcpy(payload, status.public_key, A_CHAT_PUBLIC_KEY_SIZE);
+        } else {
+            memset(payload, 0, A_CHAT_PUBLIC_KEY_SIZE);
+        }
+        payload += A_CHAT_PUBLIC_KEY_SIZE;
+        entry += 2 + username_length;
+    }
+
+    return answer;
+}
+
+void a_chat_server_relay_direct(AChatServer* server, const AChatClientHandler* client_handler, const AChatFrame* frame) {
+    // the routing header is all that is read, it is checked before anyone is sent anything
+    int number_of_recipients = frame->length >= 1 ? frame->payload[0] : 0;
+    const uint8_t* recipient = frame->payload + 1;
+    const uint8_t* end = frame->payload + frame->length;
+    bool valid = number_of_recipients >= 1 && number_of_recipients <= A_CHAT_DIRECT_MAXIMUM_RECIPIENTS;
+    for (int i = 0; i < number_of_recipients && valid; i++) {
+        size_t recipient_length = end - recipient >= 2 ? ((size_t) recipient[0] << 8) | recipient[1] : 0;
+        valid = recipient_length != 0 && recipient_length < 512 && (size_t) (end - recipient - 2) >= recipient_length;
+        recipient += 2 + recipient_length;
+    }
+    if (!valid) {
+        a_chat_log_error("Received invalid direct message from client");
+        return;
+    }
+
+    if ((frame->flags & A_CHAT_FRAME_FLAG_COMPRESSED) && !client_handler->compression) {
+        a_chat_log_error("Client sent a compressed message without being allowed to");
+        return;
+    }
+
+    // the recipients are told who it's from, and their public key to decrypt it with, the rest is passed on as it is,
+    // so every recipient is sent the same frame
+    const AChatUser* sender = client_handler->user;
+    size_t payload_length = 2 + sender->name_length + A_CHAT_PUBLIC_KEY_SIZE + frame->length;
+    if (payload_length > A_CHAT_FRAME_MAXIMUM_LENGTH) {
+        a_chat_log_error("Direct message from client is too long to relay");
+        return;
+    }
+    AChatBuffer* direct_frame = NULL;
+
+    // the directory says where each recipient's connection is, so nobody else's is touched
+    recipient = frame->payload + 1;
+    for (int i = 0; i < number_of_recipients; i++) {
+        size_t recipient_length = ((size_t) recipient[0] << 8) | recipient[1];
+        const char* username = (const char*) recipient + 2;
+        recipient += 2 + recipient_length;
+
+        AChatUserStatus status;
+        if (!a_chat_directory_find(&server->directory, username, recipient_length, &status) || status.presence != A_CHAT_PRESENCE_ONLINE) {
+            a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_DIRECT_MESSAGES_UNDELIVERED, 1);
+
+            char notice[640];
+            snprintf(notice, sizeof(notice), "%.*s isn't online", (int) recipient_length, username);
+            AChatBuffer* notice_frame = a_chat_frame_create(A_CHAT_FRAME_SERVER, 0, notice, strlen(notice));
+            if (!notice_frame) { continue; }
+
+            a_chat_server_send_to(server, sender->event_loop, client_handler->handle, notice_frame);
+            a_chat_buffer_release(notice_frame);
+            continue;
+        }
+
+        // only made once someone is there to be sent it
+        if (!direct_frame) {
+            direct_frame = a_chat_buffer_create(A_CHAT_FRAME_HEADER_SIZE + payload_length);
+            if (!direct_frame) { return; }
+
+            uint8_t* payload = direct_frame->data + A_CHAT_FRAME_HEADER_SIZE;
+            a_chat_frame_encode_header(direct_frame->data, A_CHAT_FRAME_DIRECT, frame->flags & (A_CHAT_FRAME_FLAG_ENCRYPTED | A_CHAT_FRAME_FLAG_COMPRESSED), payload_length);
+            payload[0] = (uint8_t) (sender->name_length >> 8);
+            payload[1] = (uint8_t) sender->name_length;
+            memcpy(payload + 2, sender->name, sender->name_length);
+            payload += 2 + sender->name_length;
+            if (client_handler->has_public_key) {
+                memcpy(payload, client_handler->public_key, A_CHAT_PUBLIC_KEY_SIZE);
+            } else {
+                memset(payload, 0, A_CHAT_PUBLIC_KEY_SIZE);
+            }
+            memcpy(payload + A_CHAT_PUBLIC_KEY_SIZE, frame->payload, frame->length);
+        }
+
+        a_chat_server_send_to(server, status.event_loop, status.handle, direct_frame);
+        a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_DIRECT_MESSAGES_RELAYED, 1);
+    }
+
+    if (direct_frame) {
+        a_chat_buffer_release(direct_frame);
+    }
+}
+
+void a_chat_server_close(AChatServer* server) {
+    // a_chat_server_accept drained every client before it returned, so no client handler is left to wait on
+    // (the threaded engine's threads are detached, the epoll engine's event loop threads were joined by a_chat_event_loops_run)
+    atomic_store(&server->running, false);
+
+    // every client handler that could detach a session is gone, and expiring one still needs the engines to announce it
+    if (server->sessions) {
+        a_chat_session_table_destroy(server->sessions);
+    }
+
+    if (server->config.engine == A_CHAT_SERVER_ENGINE_EPOLL) {
+        a_chat_event_loops_destroy(server);
+    } else {
+        a_chat_handshake_stage_destroy(server->handshake_stage);
+    }
+    if (server->stats_endpoint) {
+        a_chat_stats_endpoint_destroy(server->stats_endpoint);
     }
 
     // shutdown the server's listening socket, the "SHUT_RDWR" is to stop allowing sending and receiving new messages
-    shutdown(server->listening_socket, SHUT_RDWR);
-    close(server->listening_socket);
+    // a drain has closed it already
+    if (server->listening_socket != -1) {
+        shutdown(server->listening_socket, SHUT_RDWR);
+        close(server->listening_socket);
+    }
+    close(server->stop_fd);
+    a_chat_registry_destroy(&server->registry);
+    a_chat_room_table_destroy(&server->rooms);
+    // after the event loops, so everything they relayed is committed
+    a_chat_message_store_close(server->message_store);
+    a_chat_history_table_destroy(&server->history);
+    // after the sessions and the engines, whose client handlers still point into it
+    a_chat_directory_destroy(&server->directory);
+    a_chat_rate_limiter_destroy(&server->rate_limiter);
+    a_chat_metrics_destroy(&server->metrics);
+    pthread_cond_destroy(&server->drained);
     pthread_mutex_destroy(&server->lock);
     free(server);
 }
+
+void a_chat_server_get_stats(AChatServer* server, AChatServerStats* stats) {
+    a_chat_metrics_snapshot(&server->metrics, stats);
+    stats->connected_clients = atomic_load(&server->number_of_clients);
+    stats->away_clients = atomic_load(&server->directory.number_away);
+    a_chat_pool_get_stats(&stats->pool);
+}
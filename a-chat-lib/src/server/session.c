@@ -0,0 +1,290 @@
+#include "server/session.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+
+#include "log.h"
+#include "server/timer_wheel.h"
+
+#define A_CHAT_SESSION_TABLE_INITIAL_BUCKETS 64
+
+// how often detached sessions are checked for expiry, at most
+#define A_CHAT_SESSION_TABLE_INTERVAL_MS 1000
+
+// the table's lock must be held while calling this
+static AChatSession* a_chat_session_table_find(const AChatSessionTable* table, const uint8_t token[A_CHAT_SESSION_TOKEN_SIZE]) {
+    uint32_t hash = a_chat_hash(token, A_CHAT_SESSION_TOKEN_SIZE);
+    for (AChatHashEntry* entry = a_chat_hash_table_bucket(&table->sessions, hash); entry; entry = entry->next) {
+        AChatSession* session = (AChatSession*) entry;
+        if (entry->hash == hash && memcmp(session->token, token, A_CHAT_SESSION_TOKEN_SIZE) == 0) {
+            return session;
+        }
+    }
+
+    return NULL;
+}
+
+// unlinks every detached session past its expiry and returns them as a list
+static AChatSession* a_chat_session_table_expire(AChatSessionTable* table, uint64_t now) {
+    AChatSession* expired = NULL;
+
+    pthread_mutex_lock(&table->lock);
+    for (uint32_t i = 0; i < table->sessions.number_of_buckets; i++) {
+        AChatHashEntry* entry = table->sessions.buckets[i];
+        while (entry) {
+            AChatSession* session = (AChatSession*) entry;
+            entry = entry->next;
+            if (!session->detached || session->expires_at_ms > now) { continue; }
+
+            // once it is out of the table its entry's next is free to link the expired sessions together
+            a_chat_hash_table_remove(&table->sessions, &session->entry);
+            session->entry.next = expired ? &expired->entry : NULL;
+            expired = session;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return expired;
+}
+
+static void* a_chat_session_table_thread(void* arguments) {
+    AChatSessionTable* table = arguments;
+    AChatServer* server = table->server;
+    int interval_ms = server->config.session_timeout_ms < A_CHAT_SESSION_TABLE_INTERVAL_MS ? server->config.session_timeout_ms : A_CHAT_SESSION_TABLE_INTERVAL_MS;
+
+    pthread_mutex_lock(&table->lock);
+    while (!table->stopping) {
+        pthread_mutex_unlock(&table->lock);
+
+        // the rooms are only told the client has gone now, just like it had disconnected without a session
+        AChatSession* session = a_chat_session_table_expire(table, a_chat_timer_now_ms());
+        while (session) {
+            AChatSession* next = (AChatSession*) session->entry.next;
+
+            char message[640];
+            snprintf(message, sizeof(message), "%s has disconnected", session->user->name);
+            a_chat_log_info(message);
+            for (int i = 0; i < session->number_of_rooms; i++) {
+                a_chat_server_broadcast_room(server, session->rooms[i], session->room_lengths[i], message);
+                if (session->has_public_key) {
+                    a_chat_server_announce_member(server, session->rooms[i], session->room_lengths[i], session->public_key, A_CHAT_MEMBER_LEFT);
+                }
+            }
+            a_chat_metrics_add(&server->metrics, A_CHAT_COUNTER_SESSIONS_EXPIRED, 1);
+
+            // only now can someone else have the username
+            a_chat_directory_release(&server->directory, session->user);
+            free(session);
+            session = next;
+        }
+
+        pthread_mutex_lock(&table->lock);
+        if (!table->stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += interval_ms / 1000;
+            deadline.tv_nsec += (long) (interval_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&table->wake, &table->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return NULL;
+}
+
+AChatSessionTable* a_chat_session_table_create(AChatServer* server) {
+    AChatSessionTable* table = calloc(1, sizeof(AChatSessionTable));
+    if (!table) {
+        a_chat_log_error("Failed to allocate memory for session table");
+        return NULL;
+    }
+
+    if (!a_chat_hash_table_init(&table->sessions, A_CHAT_SESSION_TABLE_INITIAL_BUCKETS)) {
+        a_chat_log_error("Failed to allocate memory for session table");
+
+        free(table);
+        return NULL;
+    }
+    table->server = server;
+    pthread_mutex_init(&table->lock, NULL);
+    pthread_cond_init(&table->wake, NULL);
+
+    if (pthread_create(&table->thread_id, NULL, a_chat_session_table_thread, table) != 0) {
+        a_chat_log_error("Failed to create session table's thread");
+
+        pthread_cond_destroy(&table->wake);
+        pthread_mutex_destroy(&table->lock);
+        a_chat_hash_table_destroy(&table->sessions);
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+void a_chat_session_table_destroy(AChatSessionTable* table) {
+    pthread_mutex_lock(&table->lock);
+    table->stopping = true;
+    pthread_cond_signal(&table->wake);
+    pthread_mutex_unlock(&table->lock);
+    pthread_join(table->thread_id, NULL);
+
+    // the server is closing, so nobody is left to tell about the sessions that are still detached
+    // their usernames go with the directory
+    for (uint32_t i = 0; i < table->sessions.number_of_buckets; i++) {
+        AChatHashEntry* entry = table->sessions.buckets[i];
+        while (entry) {
+            AChatSession* session = (AChatSession*) entry;
+            entry = entry->next;
+            free(session);
+        }
+    }
+
+    pthread_cond_destroy(&table->wake);
+    pthread_mutex_destroy(&table->lock);
+    a_chat_hash_table_destroy(&table->sessions);
+    free(table);
+}
+
+bool a_chat_session_table_open(AChatSessionTable* table, AChatClientHandler* client_handler) {
+    AChatSession* session = calloc(1, sizeof(AChatSession));
+    if (!session) {
+        a_chat_log_error("Failed to allocate memory for session");
+        return false;
+    }
+
+    // the token is all a client needs to take over the session, so it has to be unguessable
+    if (getrandom(session->token, sizeof(session->token), 0) != sizeof(session->token)) {
+        a_chat_log_error_errno("Failed to generate session token");
+
+        free(session);
+        return false;
+    }
+    session->user = client_handler->user;
+    memcpy(session->public_key, client_handler->public_key, sizeof(session->public_key));
+    session->has_public_key = client_handler->has_public_key;
+    session->compression = client_handler->compression;
+
+    pthread_mutex_lock(&table->lock);
+    if (a_chat_session_table_find(table, session->token)) {
+        pthread_mutex_unlock(&table->lock);
+        a_chat_log_error("Failed to open session, its token is already in use");
+
+        free(session);
+        return false;
+    }
+    a_chat_hash_table_insert(&table->sessions, &session->entry, a_chat_hash(session->token, A_CHAT_SESSION_TOKEN_SIZE));
+    pthread_mutex_unlock(&table->lock);
+
+    client_handler->session = session;
+
+    return true;
+}
+
+bool a_chat_session_table_resume(AChatSessionTable* table, const AChatFrame* frame, AChatClientHandler* client_handler) {
+    if (frame->type != A_CHAT_FRAME_RESUME || frame->length < A_CHAT_SESSION_TOKEN_SIZE) {
+        a_chat_log_error("Client's resume was invalid");
+        return false;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    AChatSession* session = a_chat_session_table_find(table, frame->payload);
+
+    // a session that is still attached belongs to a connection the server hasn't noticed is gone yet
+    if (!session || !session->detached) {
+        pthread_mutex_unlock(&table->lock);
+        a_chat_log_error("Client's session couldn't be resumed");
+        return false;
+    }
+    session->detached = false;
+    pthread_mutex_unlock(&table->lock);
+
+    // the rest of the resume is the last sequence the client saw in each of its rooms, which it knows better than the
+    // server does, anything that was still queued when it disconnected never got to it
+    const uint8_t* entry = frame->payload + A_CHAT_SESSION_TOKEN_SIZE;
+    const uint8_t* end = frame->payload + frame->length;
+    while (end - entry >= 8 + 2) {
+        uint64_t last_sequence = 0;
+        for (int i = 0; i < 8; i++) {
+            last_sequence = (last_sequence << 8) | entry[i];
+        }
+        size_t room_length = ((size_t) entry[8] << 8) | entry[9];
+        if ((size_t) (end - entry - 10) < room_length) { break; }
+
+        for (int i = 0; i < session->number_of_rooms; i++) {
+            if (session->room_lengths[i] == room_length && memcmp(session->rooms[i], entry + 10, room_length) == 0 && last_sequence < session->sequences[i]) {
+                session->sequences[i] = last_sequence + 1;
+            }
+        }
+        entry += 10 + room_length;
+    }
+
+    client_handler->user = session->user;
+    memcpy(client_handler->public_key, session->public_key, sizeof(client_handler->public_key));
+    client_handler->has_public_key = session->has_public_key;
+    client_handler->compression = session->compression;
+    client_handler->session = session;
+
+    return true;
+}
+
+void a_chat_session_table_save_rooms(AChatSessionTable* table, AChatClientHandler* client_handler) {
+    AChatSession* session = client_handler->session;
+
+    // without a last sequence from the client, it catches up on whatever was relayed to each room after it had gone
+    // a client that resumed but never got back into its rooms still has the ones it had then
+    if (!client_handler->resuming) {
+        session->number_of_rooms = 0;
+    }
+    for (int i = 0; i < client_handler->number_of_rooms && !client_handler->resuming; i++) {
+        const AChatRoom* room = client_handler->rooms[i].room;
+        memcpy(session->rooms[i], room->name, room->name_length + 1);
+        session->room_lengths[i] = room->name_length;
+
+        AChatHistory* history = a_chat_history_table_find(&table->server->history, room->name, room->name_length);
+        session->sequences[i] = 1;
+        if (history) {
+            pthread_mutex_lock(&history->lock);
+            session->sequences[i] = history->next_sequence;
+            pthread_mutex_unlock(&history->lock);
+        }
+        session->number_of_rooms++;
+    }
+}
+
+void a_chat_session_table_detach(AChatSessionTable* table, AChatClientHandler* client_handler) {
+    AChatSession* session = client_handler->session;
+
+    // the username is the session's from here on, it can expire as soon as the lock is let go
+    a_chat_directory_detach(&table->server->directory, session->user);
+    client_handler->user = NULL;
+
+    pthread_mutex_lock(&table->lock);
+    session->expires_at_ms = a_chat_timer_now_ms() + (uint64_t) table->server->config.session_timeout_ms;
+    session->detached = true;
+    pthread_mutex_unlock(&table->lock);
+
+    client_handler->session = NULL;
+}
+
+void a_chat_session_table_end(AChatSessionTable* table, AChatClientHandler* client_handler) {
+    AChatSession* session = client_handler->session;
+
+    pthread_mutex_lock(&table->lock);
+    a_chat_hash_table_remove(&table->sessions, &session->entry);
+    pthread_mutex_unlock(&table->lock);
+
+    free(session);
+    client_handler->session = NULL;
+}
+
+AChatBuffer* a_chat_session_frame(const AChatClientHandler* client_handler) {
+    return a_chat_frame_create(A_CHAT_FRAME_SESSION, 0, client_handler->session->token, A_CHAT_SESSION_TOKEN_SIZE);
+}
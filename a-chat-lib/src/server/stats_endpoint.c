@@ -0,0 +1,127 @@
+#include "server/stats_endpoint.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "server/metrics.h"
+
+// how long accepting can block before the endpoint checks if the server is still running
+#define A_CHAT_STATS_ENDPOINT_TIMEOUT_MS 500
+
+// a scraper that stalls only holds the endpoint up this long
+#define A_CHAT_STATS_ENDPOINT_IO_TIMEOUT_MS 1000
+
+#define A_CHAT_STATS_ENDPOINT_BACKLOG 16
+
+static void a_chat_stats_endpoint_respond(AChatStatsEndpoint* endpoint, int socket) {
+    struct timeval timeout = { .tv_sec = A_CHAT_STATS_ENDPOINT_IO_TIMEOUT_MS / 1000, .tv_usec = (A_CHAT_STATS_ENDPOINT_IO_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // whatever was asked for, the answer is the stats, so only the request line matters
+    char request[1024];
+    ssize_t bytes_received = recv(socket, request, sizeof(request) - 1, 0);
+    if (bytes_received <= 0) { return; }
+    request[bytes_received] = '\0';
+
+    if (strncmp(request, "GET ", 4) != 0) {
+        const char* response = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send(socket, response, strlen(response), MSG_NOSIGNAL);
+        return;
+    }
+
+    AChatServerStats stats;
+    a_chat_server_get_stats(endpoint->server, &stats);
+
+    size_t body_length = a_chat_metrics_format_prometheus(&stats, NULL, 0);
+    char* body = malloc(body_length + 1);
+    if (!body) {
+        a_chat_log_error("Failed to allocate memory for stats");
+        return;
+    }
+    a_chat_metrics_format_prometheus(&stats, body, body_length + 1);
+
+    char header[256];
+    int header_length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body_length);
+
+    if (send(socket, header, header_length, MSG_NOSIGNAL) == -1 || send(socket, body, body_length, MSG_NOSIGNAL) == -1) {
+        a_chat_log_warning_errno("Failed to send stats");
+    }
+
+    free(body);
+}
+
+static void* a_chat_stats_endpoint_thread(void* arguments) {
+    AChatStatsEndpoint* endpoint = (AChatStatsEndpoint*) arguments;
+
+    while (atomic_load(&endpoint->server->running)) {
+        struct pollfd poll_fd = { .fd = endpoint->listening_socket, .events = POLLIN };
+        int ready = poll(&poll_fd, 1, A_CHAT_STATS_ENDPOINT_TIMEOUT_MS);
+        if (ready == -1) {
+            if (errno == EINTR) { continue; }
+
+            a_chat_log_error_errno("Failed to wait for stats requests");
+            break;
+        }
+        if (ready == 0) { continue; }
+
+        int socket = accept(endpoint->listening_socket, NULL, NULL);
+        if (socket == -1) {
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                a_chat_log_error_errno("Failed to accept stats request");
+            }
+            continue;
+        }
+
+        a_chat_stats_endpoint_respond(endpoint, socket);
+        close(socket);
+    }
+
+    return NULL;
+}
+
+AChatStatsEndpoint* a_chat_stats_endpoint_create(AChatServer* server, const char* port) {
+    AChatStatsEndpoint* endpoint = malloc(sizeof(AChatStatsEndpoint));
+    if (!endpoint) {
+        a_chat_log_error("Failed to allocate memory for stats endpoint");
+        return NULL;
+    }
+    endpoint->server = server;
+
+    // the stats are only for whoever runs the server, so they are never served beyond the machine
+    endpoint->listening_socket = a_chat_server_listen("127.0.0.1", port, false, A_CHAT_STATS_ENDPOINT_BACKLOG);
+    if (endpoint->listening_socket == -1) {
+        // a_chat_server_listen logs the correct error already
+
+        free(endpoint);
+        return NULL;
+    }
+
+    if (pthread_create(&endpoint->thread_id, NULL, a_chat_stats_endpoint_thread, endpoint) != 0) {
+        a_chat_log_error_errno("Failed to create stats endpoint thread");
+
+        close(endpoint->listening_socket);
+        free(endpoint);
+        return NULL;
+    }
+
+    char message[128];
+    snprintf(message, sizeof(message), "Serving stats at http://127.0.0.1:%s/metrics", port);
+    a_chat_log_info(message);
+
+    return endpoint;
+}
+
+void a_chat_stats_endpoint_destroy(AChatStatsEndpoint* endpoint) {
+    pthread_join(endpoint->thread_id, NULL);
+
+    close(endpoint->listening_socket);
+    free(endpoint);
+}
@@ -0,0 +1,152 @@
+#include "server/timer_wheel.h"
+
+#include <time.h>
+
+static void a_chat_timer_list_init(AChatTimer* head) {
+    head->next = head;
+    head->previous = head;
+}
+
+static void a_chat_timer_list_append(AChatTimer* head, AChatTimer* timer) {
+    timer->previous = head->previous;
+    timer->next = head;
+    head->previous->next = timer;
+    head->previous = timer;
+}
+
+static void a_chat_timer_list_remove(AChatTimer* timer) {
+    timer->previous->next = timer->next;
+    timer->next->previous = timer->previous;
+    timer->next = NULL;
+    timer->previous = NULL;
+}
+
+uint64_t a_chat_timer_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+void a_chat_timer_init(AChatTimer* timer, void* data) {
+    timer->next = NULL;
+    timer->previous = NULL;
+    timer->expires = 0;
+    timer->data = data;
+}
+
+bool a_chat_timer_is_scheduled(const AChatTimer* timer) {
+    return timer->previous != NULL;
+}
+
+void a_chat_timer_wheel_init(AChatTimerWheel* wheel, uint64_t tick_ms, uint64_t now_ms) {
+    for (size_t level = 0; level < A_CHAT_TIMER_WHEEL_LEVELS; level++) {
+        for (size_t i = 0; i < A_CHAT_TIMER_WHEEL_SLOTS; i++) {
+            a_chat_timer_list_init(&wheel->slots[level][i]);
+        }
+    }
+    a_chat_timer_list_init(&wheel->expired);
+
+    wheel->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    wheel->current_tick = now_ms / wheel->tick_ms;
+    wheel->number_of_timers = 0;
+}
+
+// puts the timer in the lowest level that reaches the tick it expires on, from the tick being expired next
+static void a_chat_timer_wheel_place(AChatTimerWheel* wheel, AChatTimer* timer) {
+    uint64_t expires = timer->expires;
+    uint64_t delay = expires - wheel->current_tick;
+
+    size_t level = 0;
+    while (level < A_CHAT_TIMER_WHEEL_LEVELS - 1 && delay >= (uint64_t) 1 << ((level + 1) * A_CHAT_TIMER_WHEEL_SLOT_BITS)) {
+        level++;
+    }
+
+    // past the top level it waits as far away as the top level reaches, and is placed again once it gets there
+    uint64_t reach = ((uint64_t) 1 << (A_CHAT_TIMER_WHEEL_LEVELS * A_CHAT_TIMER_WHEEL_SLOT_BITS)) - 1;
+    if (delay > reach) {
+        expires = wheel->current_tick + reach;
+    }
+
+    size_t slot = (expires >> (level * A_CHAT_TIMER_WHEEL_SLOT_BITS)) & (A_CHAT_TIMER_WHEEL_SLOTS - 1);
+    a_chat_timer_list_append(&wheel->slots[level][slot], timer);
+}
+
+void a_chat_timer_wheel_schedule(AChatTimerWheel* wheel, AChatTimer* timer, uint64_t now_ms, uint64_t delay_ms) {
+    a_chat_timer_wheel_cancel(wheel, timer);
+
+    // round up so a timer never expires early, and never put it behind the tick being expired next
+    timer->expires = (now_ms + delay_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    if (timer->expires < wheel->current_tick) {
+        timer->expires = wheel->current_tick;
+    }
+
+    a_chat_timer_wheel_place(wheel, timer);
+    wheel->number_of_timers++;
+}
+
+void a_chat_timer_wheel_cancel(AChatTimerWheel* wheel, AChatTimer* timer) {
+    if (!a_chat_timer_is_scheduled(timer)) { return; }
+
+    a_chat_timer_list_remove(timer);
+    wheel->number_of_timers--;
+}
+
+// moves every timer in one of the level's slots down to where it belongs now
+static void a_chat_timer_wheel_cascade(AChatTimerWheel* wheel, size_t level, size_t slot) {
+    AChatTimer* head = &wheel->slots[level][slot];
+    while (head->next != head) {
+        AChatTimer* timer = head->next;
+        a_chat_timer_list_remove(timer);
+        a_chat_timer_wheel_place(wheel, timer);
+    }
+}
+
+AChatTimer* a_chat_timer_wheel_expire(AChatTimerWheel* wheel, uint64_t now_ms) {
+    uint64_t now_tick = now_ms / wheel->tick_ms;
+
+    while (wheel->expired.next == &wheel->expired && wheel->current_tick <= now_tick) {
+        if (wheel->number_of_timers == 0) {
+            wheel->current_tick = now_tick + 1;
+            break;
+        }
+
+        // every time a level finishes a turn, the slot of the level above that covers its next turn is moved down into it
+        // the highest level first, so what it moves down can be moved down again straight away
+        size_t levels = 1;
+        while (levels < A_CHAT_TIMER_WHEEL_LEVELS && (wheel->current_tick & (((uint64_t) 1 << (levels * A_CHAT_TIMER_WHEEL_SLOT_BITS)) - 1)) == 0) {
+            levels++;
+        }
+        for (size_t level = levels - 1; level > 0; level--) {
+            a_chat_timer_wheel_cascade(wheel, level, (wheel->current_tick >> (level * A_CHAT_TIMER_WHEEL_SLOT_BITS)) & (A_CHAT_TIMER_WHEEL_SLOTS - 1));
+        }
+
+        // the lowest level's slot only has timers for this very tick
+        AChatTimer* head = &wheel->slots[0][wheel->current_tick & (A_CHAT_TIMER_WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            AChatTimer* timer = head->next;
+            a_chat_timer_list_remove(timer);
+            a_chat_timer_list_append(&wheel->expired, timer);
+        }
+
+        wheel->current_tick++;
+    }
+
+    if (wheel->expired.next == &wheel->expired) { return NULL; }
+
+    AChatTimer* timer = wheel->expired.next;
+    a_chat_timer_list_remove(timer);
+    wheel->number_of_timers--;
+
+    return timer;
+}
+
+int a_chat_timer_wheel_timeout(const AChatTimerWheel* wheel, uint64_t now_ms, int maximum_ms) {
+    if (wheel->number_of_timers == 0) { return maximum_ms; }
+
+    uint64_t next_tick_ms = wheel->current_tick * wheel->tick_ms;
+    if (next_tick_ms <= now_ms) { return 0; }
+
+    uint64_t timeout = next_tick_ms - now_ms;
+    return timeout < (uint64_t) maximum_ms ? (int) timeout : maximum_ms;
+}
@@ -0,0 +1,351 @@
+#include "server/uring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/time_types.h>
+
+#include "log.h"
+
+// completions can outnumber submissions, a multishot request keeps posting them
+#define A_CHAT_URING_COMPLETIONS_PER_SUBMISSION 8
+
+// every kernel that has these flags (6.1 and up) also has multishot accept, multishot recv and provided buffer rings
+#define A_CHAT_URING_SETUP_FLAGS (IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED)
+#define A_CHAT_URING_FEATURES (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_CQE_SKIP)
+
+static int a_chat_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int a_chat_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void* argument, size_t argument_size) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, argument, argument_size);
+}
+
+static int a_chat_uring_register(int fd, unsigned opcode, void* argument, unsigned number_of_arguments) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, argument, number_of_arguments);
+}
+
+static bool a_chat_uring_probe(AChatUring* uring) {
+    static const uint8_t needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probe_size);
+    if (!probe) {
+        a_chat_log_error("Failed to allocate memory for io_uring probe");
+        return false;
+    }
+
+    bool supported = a_chat_uring_register(uring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; supported && i < sizeof(needed); i++) {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return supported;
+}
+
+static bool a_chat_uring_init_buffers(AChatUring* uring, unsigned number_of_buffers, size_t buffer_size) {
+    uring->buffer_ring_size = number_of_buffers * sizeof(struct io_uring_buf);
+    uring->buffer_ring = mmap(NULL, uring->buffer_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (uring->buffer_ring == MAP_FAILED) {
+        uring->buffer_ring = NULL;
+        a_chat_log_error_errno("Failed to allocate io_uring buffer ring");
+        return false;
+    }
+
+    uring->buffers = malloc(number_of_buffers * buffer_size);
+    if (!uring->buffers) {
+        a_chat_log_error("Failed to allocate memory for io_uring buffers");
+        return false;
+    }
+    uring->number_of_buffers = number_of_buffers;
+    uring->buffer_size = buffer_size;
+
+    struct io_uring_buf_reg registration = {0};
+    registration.ring_addr = (uint64_t) (uintptr_t) uring->buffer_ring;
+    registration.ring_entries = number_of_buffers;
+    registration.bgid = 0;
+    if (a_chat_uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+        a_chat_log_error_errno("Failed to register io_uring buffer ring");
+        return false;
+    }
+
+    for (unsigned i = 0; i < number_of_buffers; i++) {
+        a_chat_uring_recycle_buffer(uring, (uint16_t) i);
+    }
+
+    return true;
+}
+
+bool a_chat_uring_init(AChatUring* uring, unsigned entries, unsigned number_of_buffers, size_t buffer_size) {
+    memset(uring, 0, sizeof(AChatUring));
+
+    struct io_uring_params params = {0};
+    params.flags = A_CHAT_URING_SETUP_FLAGS;
+    params.cq_entries = entries * A_CHAT_URING_COMPLETIONS_PER_SUBMISSION;
+    uring->fd = a_chat_uring_setup(entries, &params);
+    if (uring->fd == -1) {
+        a_chat_log_error_errno("Failed to set up io_uring");
+        return false;
+    }
+
+    if ((params.features & A_CHAT_URING_FEATURES) != A_CHAT_URING_FEATURES || !a_chat_uring_probe(uring)) {
+        a_chat_log_error("The kernel's io_uring is missing features the server needs");
+
+        a_chat_uring_destroy(uring);
+        return false;
+    }
+
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // newer kernels share one mapping between both rings
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_ring_size > uring->sq_ring_size) {
+            uring->sq_ring_size = uring->cq_ring_size;
+        }
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED) {
+        uring->sq_ring = NULL;
+        a_chat_log_error_errno("Failed to map io_uring submission queue");
+
+        a_chat_uring_destroy(uring);
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ring = uring->sq_ring;
+    } else {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+        if (uring->cq_ring == MAP_FAILED) {
+            uring->cq_ring = NULL;
+            a_chat_log_error_errno("Failed to map io_uring completion queue");
+
+            a_chat_uring_destroy(uring);
+            return false;
+        }
+    }
+
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        a_chat_log_error_errno("Failed to map io_uring submission queue entries");
+
+        a_chat_uring_destroy(uring);
+        return false;
+    }
+
+    uint8_t* sq_ring = uring->sq_ring;
+    uring->sq_head = (unsigned*) (sq_ring + params.sq_off.head);
+    uring->sq_tail = (unsigned*) (sq_ring + params.sq_off.tail);
+    uring->sq_mask = *(unsigned*) (sq_ring + params.sq_off.ring_mask);
+    uring->sq_entries = *(unsigned*) (sq_ring + params.sq_off.ring_entries);
+    uring->sq_local_tail = *uring->sq_tail;
+
+    // sqes are always used in ring order, so the indirection array never changes
+    unsigned* sq_array = (unsigned*) (sq_ring + params.sq_off.array);
+    for (unsigned i = 0; i < uring->sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    uint8_t* cq_ring = uring->cq_ring;
+    uring->cq_head = (unsigned*) (cq_ring + params.cq_off.head);
+    uring->cq_tail = (unsigned*) (cq_ring + params.cq_off.tail);
+    uring->cq_mask = *(unsigned*) (cq_ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+
+    if (!a_chat_uring_init_buffers(uring, number_of_buffers, buffer_size)) {
+        a_chat_uring_destroy(uring);
+        return false;
+    }
+
+    return true;
+}
+
+bool a_chat_uring_is_supported(void) {
+    // -1 until the first check
+    static int supported = -1;
+    if (supported != -1) { return supported; }
+
+    AChatUring uring;
+    supported = a_chat_uring_init(&uring, 8, 8, 64);
+    if (supported) {
+        a_chat_uring_destroy(&uring);
+    }
+
+    return supported;
+}
+
+bool a_chat_uring_enable(AChatUring* uring) {
+    // a single issuer ring belongs to whichever thread enables it
+    if (a_chat_uring_register(uring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) != 0) {
+        a_chat_log_error_errno("Failed to enable io_uring");
+        return false;
+    }
+
+    return true;
+}
+
+void a_chat_uring_destroy(AChatUring* uring) {
+    // closing the ring cancels whatever it still has in flight
+    if (uring->fd != -1) { close(uring->fd); }
+    uring->fd = -1;
+
+    if (uring->sqes) { munmap(uring->sqes, uring->sqes_size); }
+    if (uring->cq_ring && uring->cq_ring != uring->sq_ring) { munmap(uring->cq_ring, uring->cq_ring_size); }
+    if (uring->sq_ring) { munmap(uring->sq_ring, uring->sq_ring_size); }
+    if (uring->buffer_ring) { munmap(uring->buffer_ring, uring->buffer_ring_size); }
+    free(uring->buffers);
+
+    uring->sqes = NULL;
+    uring->sq_ring = NULL;
+    uring->cq_ring = NULL;
+    uring->buffer_ring = NULL;
+    uring->buffers = NULL;
+}
+
+// the number of sqes the kernel hasn't consumed yet
+static unsigned a_chat_uring_flush_submissions(AChatUring* uring) {
+    __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+    return uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static bool a_chat_uring_submit(AChatUring* uring) {
+    unsigned to_submit = a_chat_uring_flush_submissions(uring);
+    while (a_chat_uring_enter(uring->fd, to_submit, 0, 0, NULL, 0) == -1) {
+        if (errno == EINTR) { continue; }
+
+        a_chat_log_error_errno("Failed to submit to io_uring");
+        return false;
+    }
+
+    return true;
+}
+
+struct io_uring_sqe* a_chat_uring_get_sqe(AChatUring* uring) {
+    if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+        if (!a_chat_uring_submit(uring)) { return NULL; }
+        if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) { return NULL; }
+    }
+
+    struct io_uring_sqe* sqe = &uring->sqes[uring->sq_local_tail & uring->sq_mask];
+    uring->sq_local_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    return sqe;
+}
+
+bool a_chat_uring_submit_and_wait(AChatUring* uring, int timeout_ms) {
+    unsigned to_submit = a_chat_uring_flush_submissions(uring);
+
+    struct __kernel_timespec timeout = { .tv_sec = timeout_ms / 1000, .tv_nsec = (long long) (timeout_ms % 1000) * 1000000 };
+    struct io_uring_getevents_arg argument = {0};
+    argument.sigmask_sz = _NSIG / 8;
+    argument.ts = (uint64_t) (uintptr_t) &timeout;
+
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    const void* enter_argument = NULL;
+    size_t enter_argument_size = 0;
+    if (timeout_ms >= 0) {
+        flags |= IORING_ENTER_EXT_ARG;
+        enter_argument = &argument;
+        enter_argument_size = sizeof(argument);
+    }
+
+    if (a_chat_uring_enter(uring->fd, to_submit, 1, flags, enter_argument, enter_argument_size) == -1) {
+        // running out of time or being interrupted just means there is nothing to do yet
+        if (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY) { return true; }
+
+        a_chat_log_error_errno("Failed to wait for io_uring completions");
+        return false;
+    }
+
+    return true;
+}
+
+struct io_uring_cqe* a_chat_uring_peek(AChatUring* uring) {
+    unsigned head = *uring->cq_head;
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) { return NULL; }
+
+    return &uring->cqes[head & uring->cq_mask];
+}
+
+void a_chat_uring_seen(AChatUring* uring) {
+    __atomic_store_n(uring->cq_head, *uring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+uint8_t* a_chat_uring_buffer(AChatUring* uring, uint16_t id) {
+    return uring->buffers + (size_t) id * uring->buffer_size;
+}
+
+void a_chat_uring_recycle_buffer(AChatUring* uring, uint16_t id) {
+    struct io_uring_buf* buffer = &uring->buffer_ring->bufs[uring->buffer_ring_tail & (uring->number_of_buffers - 1)];
+    buffer->addr = (uint64_t) (uintptr_t) a_chat_uring_buffer(uring, id);
+    buffer->len = (uint32_t) uring->buffer_size;
+    buffer->bid = id;
+
+    // the kernel only sees the buffer once the tail moves past it
+    uring->buffer_ring_tail++;
+    __atomic_store_n(&uring->buffer_ring->tail, uring->buffer_ring_tail, __ATOMIC_RELEASE);
+}
+
+void a_chat_uring_prepare_accept_multishot(struct io_uring_sqe* sqe, int socket, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void a_chat_uring_prepare_receive_multishot(struct io_uring_sqe* sqe, int socket, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = user_data;
+}
+
+void a_chat_uring_prepare_send_message(struct io_uring_sqe* sqe, int socket, const struct msghdr* message, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = socket;
+    sqe->addr = (uint64_t) (uintptr_t) message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void a_chat_uring_prepare_poll_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+void a_chat_uring_prepare_cancel(struct io_uring_sqe* sqe, uint64_t target_user_data, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target_user_data;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = user_data;
+}
+
+void a_chat_uring_prepare_cancel_all(struct io_uring_sqe* sqe, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = user_data;
+}